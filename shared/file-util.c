@@ -38,11 +38,11 @@ static int
 current_time_str(char *str, size_t len, const char *fmt)
 {
 	time_t t;
-	struct tm *t_local;
+	struct tm tm, *t_local;
 	int ret;
 
 	t = time(NULL);
-	t_local = localtime(&t);
+	t_local = localtime_r(&t, &tm);
 	if (!t_local) {
 		errno = ETIME;
 		return -1;
@@ -31,6 +31,13 @@
 #include <stdlib.h>
 #include <math.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MATRIX_NEON 1
+#endif
+
 #ifdef IN_WESTON
 #include <wayland-server.h>
 #else
@@ -46,8 +53,23 @@
  *  1  5  9 13
  *  2  6 10 14
  *  3  7 11 15
+ *
+ * The type bits tell which operations built the matrix. Type 0 is the
+ * identity, and a matrix with only TRANSLATE and SCALE bits has zeros
+ * everywhere but the diagonal and the translation column, with
+ * d[15] == 1. The fast paths below rely on this, so code that writes
+ * d[] directly must set the type to match.
  */
 
+#define AXIS_ALIGNED \
+	(WESTON_MATRIX_TRANSFORM_TRANSLATE | WESTON_MATRIX_TRANSFORM_SCALE)
+
+static inline int
+is_axis_aligned(unsigned int type)
+{
+	return (type & ~AXIS_ALIGNED) == 0;
+}
+
 WL_EXPORT void
 weston_matrix_init(struct weston_matrix *matrix)
 {
@@ -59,23 +81,75 @@ weston_matrix_init(struct weston_matrix *matrix)
 	memcpy(matrix, &identity, sizeof identity);
 }
 
+/* out <- n * m, out must not alias m or n. Each column of the result
+ * is a combination of the columns of n, summed in the same order as
+ * the plain C version so that all versions round identically.
+ */
+static void
+multiply_general(float *out, const float *m, const float *n)
+{
+	int c;
+#if defined(__SSE2__)
+	__m128 n0 = _mm_loadu_ps(n + 0), n1 = _mm_loadu_ps(n + 4);
+	__m128 n2 = _mm_loadu_ps(n + 8), n3 = _mm_loadu_ps(n + 12);
+	__m128 r;
+
+	for (c = 0; c < 16; c += 4) {
+		r = _mm_mul_ps(n0, _mm_set1_ps(m[c + 0]));
+		r = _mm_add_ps(r, _mm_mul_ps(n1, _mm_set1_ps(m[c + 1])));
+		r = _mm_add_ps(r, _mm_mul_ps(n2, _mm_set1_ps(m[c + 2])));
+		r = _mm_add_ps(r, _mm_mul_ps(n3, _mm_set1_ps(m[c + 3])));
+		_mm_storeu_ps(out + c, r);
+	}
+#elif defined(MATRIX_NEON)
+	float32x4_t n0 = vld1q_f32(n + 0), n1 = vld1q_f32(n + 4);
+	float32x4_t n2 = vld1q_f32(n + 8), n3 = vld1q_f32(n + 12);
+	float32x4_t r;
+
+	/* No vmla, it is fused on some cores. */
+	for (c = 0; c < 16; c += 4) {
+		r = vmulq_n_f32(n0, m[c + 0]);
+		r = vaddq_f32(r, vmulq_n_f32(n1, m[c + 1]));
+		r = vaddq_f32(r, vmulq_n_f32(n2, m[c + 2]));
+		r = vaddq_f32(r, vmulq_n_f32(n3, m[c + 3]));
+		vst1q_f32(out + c, r);
+	}
+#else
+	int i;
+
+	for (c = 0; c < 16; c += 4)
+		for (i = 0; i < 4; i++)
+			out[c + i] = m[c + 0] * n[i + 0] + m[c + 1] * n[i + 4] +
+				     m[c + 2] * n[i + 8] + m[c + 3] * n[i + 12];
+#endif
+}
+
 /* m <- n * m, that is, m is multiplied on the LEFT. */
 WL_EXPORT void
 weston_matrix_multiply(struct weston_matrix *m, const struct weston_matrix *n)
 {
 	struct weston_matrix tmp;
-	const float *row, *column;
-	div_t d;
-	int i, j;
-
-	for (i = 0; i < 16; i++) {
-		tmp.d[i] = 0;
-		d = div(i, 4);
-		row = m->d + d.quot * 4;
-		column = n->d + d.rem;
-		for (j = 0; j < 4; j++)
-			tmp.d[i] += row[j] * column[j * 4];
+
+	if (n->type == 0)
+		return;
+
+	if (m->type == 0) {
+		memcpy(m, n, sizeof *m);
+		return;
+	}
+
+	if (is_axis_aligned(m->type | n->type)) {
+		m->d[12] = m->d[12] * n->d[0] + n->d[12];
+		m->d[13] = m->d[13] * n->d[5] + n->d[13];
+		m->d[14] = m->d[14] * n->d[10] + n->d[14];
+		m->d[0] *= n->d[0];
+		m->d[5] *= n->d[5];
+		m->d[10] *= n->d[10];
+		m->type |= n->type;
+		return;
 	}
+
+	multiply_general(tmp.d, m->d, n->d);
 	tmp.type = m->type | n->type;
 	memcpy(m, &tmp, sizeof tmp);
 }
@@ -117,16 +191,135 @@ weston_matrix_rotate_xy(struct weston_matrix *matrix, float cos, float sin)
 WL_EXPORT void
 weston_matrix_transform(struct weston_matrix *matrix, struct weston_vector *v)
 {
-	int i, j;
-	struct weston_vector t;
+	const float *d = matrix->d;
+	float x = v->f[0], y = v->f[1], z = v->f[2], w = v->f[3];
+#if defined(__SSE2__)
+	__m128 r;
+#elif defined(MATRIX_NEON)
+	float32x4_t r;
+#endif
+
+	if (matrix->type == 0)
+		return;
+
+	if (is_axis_aligned(matrix->type)) {
+		v->f[0] = x * d[0] + w * d[12];
+		v->f[1] = y * d[5] + w * d[13];
+		v->f[2] = z * d[10] + w * d[14];
+		return;
+	}
+
+#if defined(__SSE2__)
+	r = _mm_mul_ps(_mm_loadu_ps(d + 0), _mm_set1_ps(x));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(d + 4), _mm_set1_ps(y)));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(d + 8), _mm_set1_ps(z)));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(d + 12), _mm_set1_ps(w)));
+	_mm_storeu_ps(v->f, r);
+#elif defined(MATRIX_NEON)
+	r = vmulq_n_f32(vld1q_f32(d + 0), x);
+	r = vaddq_f32(r, vmulq_n_f32(vld1q_f32(d + 4), y));
+	r = vaddq_f32(r, vmulq_n_f32(vld1q_f32(d + 8), z));
+	r = vaddq_f32(r, vmulq_n_f32(vld1q_f32(d + 12), w));
+	vst1q_f32(v->f, r);
+#else
+	v->f[0] = x * d[0] + y * d[4] + z * d[8] + w * d[12];
+	v->f[1] = x * d[1] + y * d[5] + z * d[9] + w * d[13];
+	v->f[2] = x * d[2] + y * d[6] + z * d[10] + w * d[14];
+	v->f[3] = x * d[3] + y * d[7] + z * d[11] + w * d[15];
+#endif
+}
+
+/* Points whose divisor is smaller than this are mapped to (0, 0). */
+#define MATRIX_MIN_DIVISOR 1e-6f
+
+/** Transform points in the z = 0 plane, with perspective division
+ *
+ * \param matrix The transformation.
+ * \param x Input x coordinates.
+ * \param y Input y coordinates.
+ * \param out_x Output x coordinates, may be the same array as x.
+ * \param out_y Output y coordinates, may be the same array as y.
+ * \param count Number of points.
+ * \return The number of points that could not be divided, which have
+ * been set to (0, 0).
+ *
+ * Gives the same results as weston_matrix_transform() on each vector
+ * (x, y, 0, 1) followed by division by w.
+ */
+WL_EXPORT int
+weston_matrix_transform_xy(const struct weston_matrix *matrix,
+			   const float *x, const float *y,
+			   float *out_x, float *out_y, int count)
+{
+	const float *d = matrix->d;
+	float tx, ty, tw;
+	int unstable = 0;
+	int i = 0;
+
+	if (matrix->type == 0) {
+		if (out_x != x)
+			memmove(out_x, x, count * sizeof *x);
+		if (out_y != y)
+			memmove(out_y, y, count * sizeof *y);
+		return 0;
+	}
+
+	if (is_axis_aligned(matrix->type)) {
+		for (i = 0; i < count; i++) {
+			out_x[i] = x[i] * d[0] + d[12];
+			out_y[i] = y[i] * d[5] + d[13];
+		}
+		return 0;
+	}
+
+#if defined(__SSE2__)
+	{
+		const __m128 min_w = _mm_set1_ps(MATRIX_MIN_DIVISOR);
+		const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		__m128 vx, vy, rx, ry, rw, ok;
+
+		for (; i + 4 <= count; i += 4) {
+			vx = _mm_loadu_ps(x + i);
+			vy = _mm_loadu_ps(y + i);
+
+			rx = _mm_add_ps(_mm_mul_ps(vx, _mm_set1_ps(d[0])),
+					_mm_mul_ps(vy, _mm_set1_ps(d[4])));
+			rx = _mm_add_ps(rx, _mm_set1_ps(d[12]));
+			ry = _mm_add_ps(_mm_mul_ps(vx, _mm_set1_ps(d[1])),
+					_mm_mul_ps(vy, _mm_set1_ps(d[5])));
+			ry = _mm_add_ps(ry, _mm_set1_ps(d[13]));
+			rw = _mm_add_ps(_mm_mul_ps(vx, _mm_set1_ps(d[3])),
+					_mm_mul_ps(vy, _mm_set1_ps(d[7])));
+			rw = _mm_add_ps(rw, _mm_set1_ps(d[15]));
+
+			ok = _mm_cmpge_ps(_mm_and_ps(rw, abs_mask), min_w);
+			unstable += 4 - __builtin_popcount(_mm_movemask_ps(ok));
+
+			rx = _mm_and_ps(_mm_div_ps(rx, rw), ok);
+			ry = _mm_and_ps(_mm_div_ps(ry, rw), ok);
+			_mm_storeu_ps(out_x + i, rx);
+			_mm_storeu_ps(out_y + i, ry);
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		tx = x[i] * d[0] + y[i] * d[4] + d[12];
+		ty = x[i] * d[1] + y[i] * d[5] + d[13];
+		tw = x[i] * d[3] + y[i] * d[7] + d[15];
 
-	for (i = 0; i < 4; i++) {
-		t.f[i] = 0;
-		for (j = 0; j < 4; j++)
-			t.f[i] += v->f[j] * matrix->d[i + j * 4];
+		if (fabsf(tw) < MATRIX_MIN_DIVISOR) {
+			out_x[i] = 0;
+			out_y[i] = 0;
+			unstable++;
+			continue;
+		}
+
+		out_x[i] = tx / tw;
+		out_y[i] = ty / tw;
 	}
 
-	*v = t;
+	return unstable;
 }
 
 static inline void
@@ -256,21 +449,66 @@ inverse_transform(const double *LU, const unsigned *p, float *v)
 		v[j] = b[j];
 }
 
+/* Closed form for matrices with only scale and translation. The results
+ * are the same as from the LU decomposition, which does not need to
+ * pivot or eliminate anything for them.
+ */
+static int
+invert_axis_aligned(struct weston_matrix *inverse,
+		    const struct weston_matrix *matrix)
+{
+	double sx = matrix->d[0], sy = matrix->d[5], sz = matrix->d[10];
+	float tx = matrix->d[12], ty = matrix->d[13], tz = matrix->d[14];
+	unsigned int type = matrix->type;
+
+	if (!(type & WESTON_MATRIX_TRANSFORM_SCALE)) {
+		weston_matrix_init(inverse);
+		inverse->d[12] = -tx;
+		inverse->d[13] = -ty;
+		inverse->d[14] = -tz;
+		inverse->type = type;
+		return 0;
+	}
+
+	if (fabs(sx) < 1e-9 || fabs(sy) < 1e-9 || fabs(sz) < 1e-9)
+		return -1; /* zero pivot, not invertible */
+
+	weston_matrix_init(inverse);
+	inverse->d[0] = 1.0 / sx;
+	inverse->d[5] = 1.0 / sy;
+	inverse->d[10] = 1.0 / sz;
+	inverse->d[12] = -tx / sx;
+	inverse->d[13] = -ty / sy;
+	inverse->d[14] = -tz / sz;
+	inverse->type = type;
+
+	return 0;
+}
+
 WL_EXPORT int
 weston_matrix_invert(struct weston_matrix *inverse,
 		     const struct weston_matrix *matrix)
 {
 	double LU[16];		/* column-major */
 	unsigned perm[4];	/* permutation */
+	unsigned int type = matrix->type; /* inverse may be matrix */
 	unsigned c;
 
+	if (type == 0) {
+		weston_matrix_init(inverse);
+		return 0;
+	}
+
+	if (is_axis_aligned(type))
+		return invert_axis_aligned(inverse, matrix);
+
 	if (matrix_invert(LU, perm, matrix) < 0)
 		return -1;
 
 	weston_matrix_init(inverse);
 	for (c = 0; c < 4; ++c)
 		inverse_transform(LU, perm, &inverse->d[c * 4]);
-	inverse->type = matrix->type;
+	inverse->type = type;
 
 	return 0;
 }
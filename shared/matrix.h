@@ -60,6 +60,10 @@ void
 weston_matrix_rotate_xy(struct weston_matrix *matrix, float cos, float sin);
 void
 weston_matrix_transform(struct weston_matrix *matrix, struct weston_vector *v);
+int
+weston_matrix_transform_xy(const struct weston_matrix *matrix,
+			   const float *x, const float *y,
+			   float *out_x, float *out_y, int count);
 
 int
 weston_matrix_invert(struct weston_matrix *inverse,
@@ -123,6 +123,7 @@ struct drm_backend {
 	int cursors_are_broken;
 
 	int use_pixman;
+	int use_pixman_shadow;
 
 	uint32_t prev_state;
 
@@ -189,7 +190,6 @@ struct drm_output {
 	struct drm_fb *dumb[2];
 	pixman_image_t *image[2];
 	int current_image;
-	pixman_region32_t previous_damage;
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
@@ -548,26 +548,15 @@ static void
 drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *ec = output->base.compositor;
-	pixman_region32_t total_damage, previous_damage;
-
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&previous_damage);
-
-	pixman_region32_copy(&previous_damage, damage);
-
-	pixman_region32_union(&total_damage, damage, &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage, &previous_damage);
 
 	output->current_image ^= 1;
 
+	/* The renderer tracks what the other dumb buffer is missing */
 	output->next = output->dumb[output->current_image];
 	pixman_renderer_output_set_buffer(&output->base,
 					  output->image[output->current_image]);
 
-	ec->renderer->repaint_output(&output->base, &total_damage);
-
-	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&previous_damage);
+	ec->renderer->repaint_output(&output->base, damage);
 }
 
 static void
@@ -1904,12 +1893,11 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 			goto err;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base,
+			b->use_pixman_shadow ?
+			PIXMAN_RENDERER_OUTPUT_USE_SHADOW : 0) < 0)
 		goto err;
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
-
 	return 0;
 
 err:
@@ -1932,7 +1920,6 @@ drm_output_fini_pixman(struct drm_output *output)
 	unsigned int i;
 
 	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
 
 	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
 		drm_fb_destroy_dumb(output->dumb[i]);
@@ -3104,6 +3091,10 @@ drm_backend_create(struct weston_compositor *compositor,
 
 	b->use_pixman = param->use_pixman;
 
+	/* Dumb buffers are usually uncached, blending in them is slow */
+	weston_config_section_get_bool(section, "pixman-shadow",
+				       &b->use_pixman_shadow, 1);
+
 	/* Check if we run drm-backend using weston-launch */
 	compositor->launcher = weston_launcher_connect(compositor, param->tty,
 						       param->seat_id, true);
@@ -58,6 +58,7 @@ struct fbdev_backend {
 	struct udev *udev;
 	struct udev_input input;
 	int use_pixman;
+	int use_pixman_shadow;
 	struct wl_listener session_listener;
 };
 
@@ -522,7 +523,9 @@ fbdev_output_create(struct fbdev_backend *backend,
 			   1);
 
 	if (backend->use_pixman) {
-		if (pixman_renderer_output_create(&output->base) < 0)
+		if (pixman_renderer_output_create(&output->base,
+				backend->use_pixman_shadow ?
+				PIXMAN_RENDERER_OUTPUT_USE_SHADOW : 0) < 0)
 			goto out_hw_surface;
 	} else {
 		setenv("HYBRIS_EGLPLATFORM", "wayland", 1);
@@ -747,6 +750,7 @@ fbdev_backend_create(struct weston_compositor *compositor, int *argc, char *argv
                      struct fbdev_parameters *param)
 {
 	struct fbdev_backend *backend;
+	struct weston_config_section *section;
 	const char *seat_id = default_seat;
 
 	weston_log("initializing fbdev backend\n");
@@ -784,6 +788,12 @@ fbdev_backend_create(struct weston_compositor *compositor, int *argc, char *argv
 	backend->prev_state = WESTON_COMPOSITOR_ACTIVE;
 	backend->use_pixman = !param->use_gl;
 
+	/* The frame buffer is on screen while it is painted, and often
+	 * slow to read back */
+	section = weston_config_get_section(config, "core", NULL, NULL);
+	weston_config_section_get_bool(section, "pixman-shadow",
+				       &backend->use_pixman_shadow, 1);
+
 	weston_setup_vt_switch_bindings(compositor);
 
 	if (backend->use_pixman) {
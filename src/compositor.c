@@ -52,6 +52,7 @@
 #include <errno.h>
 
 #include "timeline.h"
+#include "pick-grid.h"
 
 #include "compositor.h"
 #include "scaler-server-protocol.h"
@@ -63,6 +64,13 @@
 #include "version.h"
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
+#define DEFAULT_REPAINT_MISS_PERCENT 2
+#define DEFAULT_FRAME_THROTTLE_MSEC 1000
+
+/* Adaptive repaint window tuning, in microseconds */
+#define REPAINT_TIMING_MIN_SAMPLES 8
+#define REPAINT_MARGIN_USEC 1000
+#define REPAINT_SLACK_STEP_USEC 500
 
 static void
 weston_output_transform_scale_init(struct weston_output *output,
@@ -71,6 +79,13 @@ weston_output_transform_scale_init(struct weston_output *output,
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor);
 
+static void
+weston_compositor_output_view_lists_dirty(struct weston_compositor *compositor)
+{
+	if (++compositor->view_output_serial == 0)
+		++compositor->view_output_serial;
+}
+
 static void weston_mode_switch_finish(struct weston_output *output,
 				      int mode_changed,
 				      int scale_changed)
@@ -389,15 +404,26 @@ region_init_infinite(pixman_region32_t *region)
 static struct weston_subsurface *
 weston_surface_to_subsurface(struct weston_surface *surface);
 
+/* A view and its entry in the pick grid, which compositor.h only knows
+ * by pointer. */
+struct view_with_pick_entry {
+	struct weston_view view;
+	struct pick_grid_entry pick_entry;
+};
+
 WL_EXPORT struct weston_view *
 weston_view_create(struct weston_surface *surface)
 {
+	struct view_with_pick_entry *vp;
 	struct weston_view *view;
 
-	view = zalloc(sizeof *view);
-	if (view == NULL)
+	vp = zalloc(sizeof *vp);
+	if (vp == NULL)
 		return NULL;
 
+	view = &vp->view;
+	view->pick_entry = &vp->pick_entry;
+
 	view->surface = surface;
 
 	/* Assign to surface */
@@ -406,6 +432,7 @@ weston_view_create(struct weston_surface *surface)
 	wl_signal_init(&view->destroy_signal);
 	wl_list_init(&view->link);
 	wl_list_init(&view->layer_link.link);
+	pick_grid_entry_init(view->pick_entry);
 
 	pixman_region32_init(&view->clip);
 
@@ -419,6 +446,7 @@ weston_view_create(struct weston_surface *surface)
 	wl_list_init(&view->geometry.child_list);
 	pixman_region32_init(&view->geometry.scissor);
 	pixman_region32_init(&view->transform.boundingbox);
+	wl_list_init(&view->transform.dirty_link);
 	view->transform.dirty = 1;
 
 	return view;
@@ -1126,6 +1154,10 @@ weston_surface_assign_output(struct weston_surface *es)
 	}
 	pixman_region32_fini(&region);
 
+	/* Sub-surfaces enter and leave the view list with their mappedness */
+	if (!es->output != !new_output)
+		weston_compositor_view_list_dirty(es->compositor);
+
 	es->output = new_output;
 	weston_surface_update_output_mask(es, mask);
 }
@@ -1175,6 +1207,9 @@ weston_view_assign_output(struct weston_view *ev)
 	}
 	pixman_region32_fini(&region);
 
+	if (ev->output != new_output || ev->output_mask != mask)
+		weston_compositor_output_view_lists_dirty(ec);
+
 	ev->output = new_output;
 	ev->output_mask = mask;
 
@@ -1215,12 +1250,8 @@ view_compute_bbox(struct weston_view *view, const pixman_box32_t *inbox,
 {
 	float min_x = HUGE_VALF,  min_y = HUGE_VALF;
 	float max_x = -HUGE_VALF, max_y = -HUGE_VALF;
-	int32_t s[4][2] = {
-		{ inbox->x1, inbox->y1 },
-		{ inbox->x1, inbox->y2 },
-		{ inbox->x2, inbox->y1 },
-		{ inbox->x2, inbox->y2 },
-	};
+	float x[4] = { inbox->x1, inbox->x1, inbox->x2, inbox->x2 };
+	float y[4] = { inbox->y1, inbox->y2, inbox->y1, inbox->y2 };
 	float int_x, int_y;
 	int i;
 
@@ -1230,17 +1261,17 @@ view_compute_bbox(struct weston_view *view, const pixman_box32_t *inbox,
 		return;
 	}
 
+	weston_view_to_global_points(view, x, y, x, y, 4);
+
 	for (i = 0; i < 4; ++i) {
-		float x, y;
-		weston_view_to_global_float(view, s[i][0], s[i][1], &x, &y);
-		if (x < min_x)
-			min_x = x;
-		if (x > max_x)
-			max_x = x;
-		if (y < min_y)
-			min_y = y;
-		if (y > max_y)
-			max_y = y;
+		if (x[i] < min_x)
+			min_x = x[i];
+		if (x[i] > max_x)
+			max_x = x[i];
+		if (y[i] < min_y)
+			min_y = y[i];
+		if (y[i] > max_y)
+			max_y = y[i];
 	}
 
 	int_x = floorf(min_x);
@@ -1342,20 +1373,20 @@ get_view_layer(struct weston_view *view)
 	return view->layer_link.layer;
 }
 
-WL_EXPORT void
-weston_view_update_transform(struct weston_view *view)
+/* Recompute the transformation, bounding box and opaque region. The
+ * parent, if any, must be up to date already.
+ */
+static void
+view_update_transform_geometry(struct weston_view *view,
+			       struct weston_layer *layer)
 {
 	struct weston_view *parent = view->geometry.parent;
-	struct weston_layer *layer;
 	pixman_region32_t mask;
 
-	if (!view->transform.dirty)
-		return;
-
-	if (parent)
-		weston_view_update_transform(parent);
-
 	view->transform.dirty = 0;
+	view->transform.serial++;
+	wl_list_remove(&view->transform.dirty_link);
+	wl_list_init(&view->transform.dirty_link);
 
 	weston_view_damage_below(view);
 
@@ -1375,7 +1406,6 @@ weston_view_update_transform(struct weston_view *view)
 			weston_view_update_transform_disable(view);
 	}
 
-	layer = get_view_layer(view);
 	if (layer) {
 		pixman_region32_init_with_extents(&mask, &layer->mask);
 		pixman_region32_intersect(&view->transform.boundingbox,
@@ -1393,35 +1423,177 @@ weston_view_update_transform(struct weston_view *view)
 			view->geometry.scissor_enabled = false;
 		}
 	}
+}
 
+/* Propagate a recomputed transformation to damage, picking and output
+ * assignment, and notify listeners.
+ */
+static void
+view_update_transform_finish(struct weston_view *view)
+{
 	weston_view_damage_below(view);
 
+	pick_grid_update(view->surface->compositor->pick_grid,
+			 view->pick_entry,
+			 pixman_region32_extents(&view->transform.boundingbox));
+
 	weston_view_assign_output(view);
 
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
 
+/* A view updated on its own leaves its subtree dirty, but no longer
+ * queued through it. Queue the dirty children in its place.
+ */
+static void
+view_queue_dirty_children(struct weston_view *view)
+{
+	struct weston_compositor *compositor = view->surface->compositor;
+	struct weston_view *child;
+
+	wl_list_for_each(child, &view->geometry.child_list,
+			 geometry.parent_link)
+		if (child->transform.dirty &&
+		    wl_list_empty(&child->transform.dirty_link))
+			wl_list_insert(compositor->transform_dirty_list.prev,
+				       &child->transform.dirty_link);
+}
+
 WL_EXPORT void
-weston_view_geometry_dirty(struct weston_view *view)
+weston_view_update_transform(struct weston_view *view)
+{
+	struct weston_view *parent = view->geometry.parent;
+
+	if (!view->transform.dirty)
+		return;
+
+	if (parent)
+		weston_view_update_transform(parent);
+
+	view_update_transform_geometry(view, get_view_layer(view));
+	view_queue_dirty_children(view);
+	view_update_transform_finish(view);
+}
+
+/* One entry per view of a batched update, parents before children. */
+struct view_transform_record {
+	struct weston_view *view;
+	struct weston_layer *layer;
+};
+
+static void
+view_collect_dirty_subtree(struct weston_compositor *compositor,
+			   struct weston_view *view, int parent_index)
+{
+	struct view_transform_record *rec, *records;
+	struct weston_view *child;
+	int index;
+
+	rec = wl_array_add(&compositor->transform_records, sizeof *rec);
+	if (!rec) {
+		weston_view_update_transform(view);
+		index = -1;
+	} else {
+		records = compositor->transform_records.data;
+		index = rec - records;
+
+		/* Sub-surface views share the layer of their parent view,
+		 * saving the walk up to the root for each of them. */
+		rec->view = view;
+		if (parent_index >= 0 &&
+		    view->parent_view == records[parent_index].view)
+			rec->layer = records[parent_index].layer;
+		else
+			rec->layer = get_view_layer(view);
+
+		/* Collected, even though computed only later. */
+		view->transform.dirty = 0;
+		wl_list_remove(&view->transform.dirty_link);
+		wl_list_init(&view->transform.dirty_link);
+	}
+
+	wl_list_for_each(child, &view->geometry.child_list,
+			 geometry.parent_link)
+		if (child->transform.dirty)
+			view_collect_dirty_subtree(compositor, child, index);
+}
+
+/* Update every dirty subtree in one batch. The work is proportional to
+ * the number of views whose transformation changed, not to the number
+ * of views. Roots queued while collecting, by updating a parent on its
+ * own, join the batch; subtrees dirtied by the transform signal
+ * listeners are left for the next repaint.
+ */
+static void
+weston_compositor_update_transforms(struct weston_compositor *compositor)
+{
+	struct wl_list *roots = &compositor->transform_dirty_list;
+	struct view_transform_record *rec;
+	struct weston_view *view;
+
+	compositor->transform_records.size = 0;
+
+	while (!wl_list_empty(roots)) {
+		view = container_of(roots->next, struct weston_view,
+				    transform.dirty_link);
+		wl_list_remove(&view->transform.dirty_link);
+		wl_list_init(&view->transform.dirty_link);
+
+		/* Already collected as part of an enclosing subtree. */
+		if (!view->transform.dirty)
+			continue;
+
+		if (view->geometry.parent)
+			weston_view_update_transform(view->geometry.parent);
+
+		view_collect_dirty_subtree(compositor, view, -1);
+	}
+
+	wl_array_for_each(rec, &compositor->transform_records)
+		view_update_transform_geometry(rec->view, rec->layer);
+
+	wl_array_for_each(rec, &compositor->transform_records)
+		view_update_transform_finish(rec->view);
+
+	compositor->transform_updates = compositor->transform_records.size /
+					sizeof *rec;
+}
+
+static void
+view_mark_transform_dirty(struct weston_view *view)
 {
 	struct weston_view *child;
 
+	if (view->transform.dirty)
+		return;
+
+	view->transform.dirty = 1;
+
+	wl_list_for_each(child, &view->geometry.child_list,
+			 geometry.parent_link)
+		view_mark_transform_dirty(child);
+}
+
+WL_EXPORT void
+weston_view_geometry_dirty(struct weston_view *view)
+{
 	/*
 	 * The invariant: if view->geometry.dirty, then all views
 	 * in view->geometry.child_list have geometry.dirty too.
 	 * Corollary: if not parent->geometry.dirty, then all ancestors
 	 * are not dirty.
+	 *
+	 * Only the root of the newly dirty subtree is queued for the
+	 * next repaint.
 	 */
 
 	if (view->transform.dirty)
 		return;
 
-	view->transform.dirty = 1;
-
-	wl_list_for_each(child, &view->geometry.child_list,
-			 geometry.parent_link)
-		weston_view_geometry_dirty(child);
+	view_mark_transform_dirty(view);
+	wl_list_insert(view->surface->compositor->transform_dirty_list.prev,
+		       &view->transform.dirty_link);
 }
 
 WL_EXPORT void
@@ -1465,6 +1637,58 @@ weston_view_from_global_float(struct weston_view *view,
 	}
 }
 
+/** Transform points from view to global coordinates
+ *
+ * Same as weston_view_to_global_float() for each point, but done in one
+ * pass over the arrays. The output arrays may be the input arrays.
+ */
+WL_EXPORT void
+weston_view_to_global_points(struct weston_view *view,
+			     const float *sx, const float *sy,
+			     float *x, float *y, int count)
+{
+	int i;
+
+	if (!view->transform.enabled) {
+		for (i = 0; i < count; i++) {
+			x[i] = sx[i] + view->geometry.x;
+			y[i] = sy[i] + view->geometry.y;
+		}
+		return;
+	}
+
+	if (weston_matrix_transform_xy(&view->transform.matrix,
+				       sx, sy, x, y, count) > 0)
+		weston_log("warning: numerical instability in %s()\n",
+			   __func__);
+}
+
+/** Transform points from global to view coordinates
+ *
+ * Same as weston_view_from_global_float() for each point, but done in
+ * one pass over the arrays. The output arrays may be the input arrays.
+ */
+WL_EXPORT void
+weston_view_from_global_points(struct weston_view *view,
+			       const float *x, const float *y,
+			       float *vx, float *vy, int count)
+{
+	int i;
+
+	if (!view->transform.enabled) {
+		for (i = 0; i < count; i++) {
+			vx[i] = x[i] - view->geometry.x;
+			vy[i] = y[i] - view->geometry.y;
+		}
+		return;
+	}
+
+	if (weston_matrix_transform_xy(&view->transform.inverse,
+				       x, y, vx, vy, count) > 0)
+		weston_log("warning: numerical instability in %s()\n",
+			   __func__);
+}
+
 WL_EXPORT void
 weston_view_from_global_fixed(struct weston_view *view,
 			      wl_fixed_t x, wl_fixed_t y,
@@ -1790,38 +2014,96 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+static bool
+view_accepts_input_at(struct weston_view *view, wl_fixed_t x, wl_fixed_t y,
+		      wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	int view_ix, view_iy;
+
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    wl_fixed_to_int(x),
+					    wl_fixed_to_int(y), NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, vx, vy);
+	view_ix = wl_fixed_to_int(*vx);
+	view_iy = wl_fixed_to_int(*vy);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	return true;
+}
+
+struct pick_context {
+	struct weston_compositor *compositor;
+	wl_fixed_t x, y;
+	struct weston_view *view;
+	wl_fixed_t vx, vy;
+};
+
+/* Called in view list order, topmost first. */
+static int
+pick_grid_visit_view(struct pick_grid_entry *entry, void *data)
+{
+	struct pick_context *pick = data;
+	struct weston_view *view =
+		&container_of(entry, struct view_with_pick_entry,
+			      pick_entry)->view;
+
+	/* Views not in the current view list are not pickable. */
+	if (view->view_list_serial == 0 ||
+	    view->view_list_serial != pick->compositor->view_list_serial)
+		return 0;
+
+	if (!view_accepts_input_at(view, pick->x, pick->y,
+				   &pick->vx, &pick->vy))
+		return 0;
+
+	pick->view = view;
+
+	return 1;
+}
+
 WL_EXPORT struct weston_view *
 weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
 	struct weston_view *view;
+	struct pick_context pick;
 	wl_fixed_t view_x, view_y;
-	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
-
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
-
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
-
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (!compositor->pick_grid->incomplete) {
+		pick.compositor = compositor;
+		pick.x = x;
+		pick.y = y;
+		pick.view = NULL;
+		pick_grid_for_each_at(compositor->pick_grid,
+				      wl_fixed_to_int(x), wl_fixed_to_int(y),
+				      pick_grid_visit_view, &pick);
+
+		if (pick.view) {
+			*vx = pick.vx;
+			*vy = pick.vy;
+			return pick.view;
+		}
+	} else {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (!view_accepts_input_at(view, x, y,
+						   &view_x, &view_y))
+				continue;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+			*vx = view_x;
+			*vy = view_y;
+			return view;
+		}
 	}
 
 	*vx = wl_fixed_from_int(-1000000);
@@ -1852,9 +2134,13 @@ weston_view_unmap(struct weston_view *view)
 	weston_view_damage_below(view);
 	view->output = NULL;
 	view->plane = NULL;
+	view->view_list_serial = 0;
+	pick_grid_remove(view->surface->compositor->pick_grid,
+			 view->pick_entry);
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	weston_compositor_view_list_dirty(view->surface->compositor);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1908,8 +2194,12 @@ weston_view_destroy(struct weston_view *view)
 		weston_compositor_build_view_list(view->surface->compositor);
 	}
 
+	if (!wl_list_empty(&view->link))
+		weston_compositor_view_list_dirty(view->surface->compositor);
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	pick_grid_remove(view->surface->compositor->pick_grid,
+			 view->pick_entry);
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -1917,6 +2207,7 @@ weston_view_destroy(struct weston_view *view)
 	pixman_region32_fini(&view->transform.opaque);
 
 	weston_view_set_transform_parent(view, NULL);
+	wl_list_remove(&view->transform.dirty_link);
 
 	wl_list_remove(&view->surface_link);
 
@@ -2044,6 +2335,76 @@ weston_buffer_reference(struct weston_buffer_reference *ref,
 	ref->destroy_listener.notify = weston_buffer_reference_handle_destroy;
 }
 
+/* Whether 'size' bytes from 'data' lie in the one mapping holding 'data'.
+ * That mapping is the shm pool of a buffer, page aligned, so this is what
+ * the pool covers. */
+static bool
+mapping_covers(const void *data, size_t size)
+{
+	uintptr_t addr = (uintptr_t) data;
+	unsigned long start, end;
+	bool covers = false;
+	char *line = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/maps", "re");
+	if (!fp)
+		return false;
+
+	while (getline(&line, &len, fp) >= 0) {
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+			continue;
+
+		if (addr >= start && addr < end) {
+			covers = size <= end - addr;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	return covers;
+}
+
+/** Check that the planes of a YUV shm buffer lie in its pool
+ *
+ * \param buffer An shm buffer, with shm_buffer set by the renderer.
+ * \return Whether the renderer can read all planes of the buffer.
+ *
+ * wl_shm only checks the first plane against the pool, see the layout
+ * notes in compositor.h. Pools only ever grow, so a buffer is looked up
+ * once in its lifetime.
+ */
+WL_EXPORT bool
+weston_buffer_shm_planes_mapped(struct weston_buffer *buffer)
+{
+	struct wl_shm_buffer *shm_buffer = buffer->shm_buffer;
+	size_t stride = wl_shm_buffer_get_stride(shm_buffer);
+	size_t height = wl_shm_buffer_get_height(shm_buffer);
+	size_t size;
+
+	if (buffer->shm_planes_mapped)
+		return true;
+
+	switch (wl_shm_buffer_get_format(shm_buffer)) {
+	case WL_SHM_FORMAT_YUV420:
+		size = stride * height + 2 * (stride / 2) * ((height + 1) / 2);
+		break;
+	case WL_SHM_FORMAT_NV12:
+		size = stride * height + stride * ((height + 1) / 2);
+		break;
+	default:
+		return true;
+	}
+
+	buffer->shm_planes_mapped =
+		mapping_covers(wl_shm_buffer_get_data(shm_buffer), size);
+
+	return buffer->shm_planes_mapped;
+}
+
 static void
 weston_surface_attach(struct weston_surface *surface,
 		      struct weston_buffer *buffer)
@@ -2081,6 +2442,47 @@ weston_output_damage(struct weston_output *output)
 	weston_output_schedule_repaint(output);
 }
 
+/** Reads back a rectangle of what was last drawn to an output
+ *
+ * \param output The output, from its frame_signal
+ * \param format The pixel format to read in
+ * \param pixels Where the pixels go, which must stay valid until done
+ * \param x Left edge of the rectangle, in output buffer pixels
+ * \param y Bottom edge of the rectangle, in the renderer's orientation,
+ *          see WESTON_CAP_CAPTURE_YFLIP
+ * \param width Width of the rectangle
+ * \param height Height of the rectangle
+ * \param done Called once the pixels are in place
+ * \param data User data for done
+ * \return 0 if the read was started, -1 otherwise
+ *
+ * Renderers that copy from the GPU finish the read while the compositor
+ * goes on, others read right away and call done before this returns.
+ * The done callback is not called when this fails.
+ */
+WL_EXPORT int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format, void *pixels,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_func_t done, void *data)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+
+	if (renderer->read_pixels_async)
+		return renderer->read_pixels_async(output, format, pixels,
+						   x, y, width, height,
+						   done, data);
+
+	if (renderer->read_pixels(output, format, pixels,
+				  x, y, width, height) < 0)
+		return -1;
+
+	done(output, 0, data);
+
+	return 0;
+}
+
 static void
 surface_flush_damage(struct weston_surface *surface)
 {
@@ -2096,65 +2498,260 @@ surface_flush_damage(struct weston_surface *surface)
 	pixman_region32_clear(&surface->damage);
 }
 
+struct weston_region_slot {
+	pixman_region32_t region;
+	/* rectangle storage when the slot was last emptied */
+	pixman_region32_data_t *data;
+	long size;
+};
+
+/* An empty region may keep its rectangle storage, pixman only needs
+ * the extents to be empty as well.
+ */
 static void
-view_accumulate_damage(struct weston_view *view,
-		       pixman_region32_t *opaque)
+region_clear_keep_storage(pixman_region32_t *region)
 {
-	pixman_region32_t damage;
+	if (region->data && region->data->size) {
+		region->data->numRects = 0;
+		region->extents.x1 = region->extents.x2 = 0;
+		region->extents.y1 = region->extents.y2 = 0;
+	} else {
+		pixman_region32_clear(region);
+	}
+}
 
-	pixman_region32_init(&damage);
-	if (view->transform.enabled) {
-		pixman_box32_t *extents;
+WL_EXPORT void
+weston_region_pool_init(struct weston_region_pool *pool)
+{
+	memset(pool, 0, sizeof *pool);
+	wl_array_init(&pool->slots);
+}
 
-		extents = pixman_region32_extents(&view->surface->damage);
-		view_compute_bbox(view, extents, &damage);
-	} else {
-		pixman_region32_copy(&damage, &view->surface->damage);
-		pixman_region32_translate(&damage,
-					  view->geometry.x, view->geometry.y);
+WL_EXPORT void
+weston_region_pool_release(struct weston_region_pool *pool)
+{
+	struct weston_region_slot **slotp;
+
+	wl_array_for_each(slotp, &pool->slots) {
+		pixman_region32_fini(&(*slotp)->region);
+		free(*slotp);
+	}
+	wl_array_release(&pool->slots);
+}
+
+/** End a frame of a scratch region pool
+ *
+ * \param pool The pool.
+ *
+ * Empties all regions handed out since the last reset. A slot whose
+ * storage differs from the one it had at the previous reset counts as
+ * a slot allocation. Regions outside the pool are not counted.
+ */
+WL_EXPORT void
+weston_region_pool_reset(struct weston_region_pool *pool)
+{
+	struct weston_region_slot **slots = pool->slots.data;
+	struct weston_region_slot *slot;
+	pixman_region32_data_t *data;
+	unsigned int i;
+
+	for (i = 0; i < pool->used; i++) {
+		slot = slots[i];
+		data = slot->region.data;
+		if (data && data->size &&
+		    (data != slot->data || data->size != slot->size))
+			pool->frame_slot_allocs++;
+
+		slot->data = data;
+		slot->size = data ? data->size : 0;
+		region_clear_keep_storage(&slot->region);
+	}
+
+	pool->used = 0;
+
+	pool->slot_allocs += pool->frame_slot_allocs;
+	pool->last_frame_slot_allocs = pool->frame_slot_allocs;
+	pool->frame_slot_allocs = 0;
+}
+
+/** Get an empty scratch region from a pool
+ *
+ * \param pool The pool.
+ * \return A region owned by the pool, which must not be initialized
+ * or finalized by the caller, or NULL if the pool cannot grow.
+ *
+ * Regions are handed out in order and all of them are emptied by
+ * weston_region_pool_reset(), keeping their rectangle storage. As long
+ * as the work done between resets does not change, each caller then
+ * gets a region that already has room for its result. To benefit from
+ * this, avoid operations whose destination is also a source on complex
+ * regions: pixman allocates new storage for those.
+ */
+WL_EXPORT pixman_region32_t *
+weston_region_pool_get(struct weston_region_pool *pool)
+{
+	struct weston_region_slot **slotp, *slot;
+
+	if (pool->used < pool->slots.size / sizeof *slotp) {
+		slotp = pool->slots.data;
+		return &slotp[pool->used++]->region;
+	}
+
+	slot = zalloc(sizeof *slot);
+	if (!slot)
+		return NULL;
+
+	slotp = wl_array_add(&pool->slots, sizeof *slotp);
+	if (!slotp) {
+		free(slot);
+		return NULL;
+	}
+
+	pixman_region32_init(&slot->region);
+	*slotp = slot;
+	pool->used++;
+	pool->frame_slot_allocs++;
+
+	return &slot->region;
+}
+
+/** Get an empty scratch region for the current repaint
+ *
+ * \param output The output being repainted.
+ * \return A region from the output's pool, or NULL if out of memory,
+ * see weston_region_pool_get().
+ *
+ * The pool is reset when the repaint of the output ends.
+ */
+WL_EXPORT pixman_region32_t *
+weston_output_get_scratch_region(struct weston_output *output)
+{
+	return weston_region_pool_get(&output->region_pool);
+}
+
+/* Returns the opaque region covering the views below this one, which is
+ * either opaque or spare.
+ */
+static pixman_region32_t *
+view_accumulate_damage(struct weston_output *output,
+		       struct weston_view *view,
+		       pixman_region32_t *opaque,
+		       pixman_region32_t *spare)
+{
+	pixman_region32_t *damage, *tmp;
+
+	if (pixman_region32_not_empty(&view->surface->damage)) {
+		damage = weston_output_get_scratch_region(output);
+		tmp = weston_output_get_scratch_region(output);
+
+		if (!damage || !tmp) {
+			/* Out of memory, damage all of the view */
+			pixman_region32_union(&view->plane->damage,
+					      &view->plane->damage,
+					      &view->transform.boundingbox);
+		} else if (view->transform.enabled) {
+			pixman_box32_t *extents;
+			pixman_region32_t bbox;
+
+			extents = pixman_region32_extents(&view->surface->damage);
+			view_compute_bbox(view, extents, &bbox);
+			pixman_region32_intersect(tmp, &bbox,
+						  &view->transform.boundingbox);
+			pixman_region32_fini(&bbox);
+		} else {
+			pixman_region32_copy(damage, &view->surface->damage);
+			pixman_region32_translate(damage, view->geometry.x,
+						  view->geometry.y);
+			pixman_region32_intersect(tmp, damage,
+						  &view->transform.boundingbox);
+		}
+
+		pixman_region32_subtract(damage, tmp, opaque);
+		if (pixman_region32_not_empty(damage)) {
+			pixman_region32_union(tmp, &view->plane->damage,
+					      damage);
+			pixman_region32_copy(&view->plane->damage, tmp);
+		}
 	}
 
-	pixman_region32_intersect(&damage, &damage,
-				  &view->transform.boundingbox);
-	pixman_region32_subtract(&damage, &damage, opaque);
-	pixman_region32_union(&view->plane->damage,
-			      &view->plane->damage, &damage);
-	pixman_region32_fini(&damage);
 	pixman_region32_copy(&view->clip, opaque);
-	pixman_region32_union(opaque, opaque, &view->transform.opaque);
+
+	if (!pixman_region32_not_empty(&view->transform.opaque))
+		return opaque;
+
+	pixman_region32_union(spare, opaque, &view->transform.opaque);
+
+	return spare;
 }
 
+/* Only views on this output are considered. Plane damage is in global
+ * coordinates and stays until each output has repainted its part, so
+ * views elsewhere are accumulated when their own output repaints.
+ */
 static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+output_accumulate_damage(struct weston_output *output)
 {
+	struct weston_compositor *ec = output->compositor;
 	struct weston_plane *plane;
-	struct weston_view *ev;
-	pixman_region32_t opaque, clip;
+	struct weston_view *ev, **evp;
+	pixman_region32_t *opaque, *clip, *spare, *next;
+	pixman_region32_t empty, fallback[2];
 
-	pixman_region32_init(&clip);
+	/* Used when the pool is out of memory. If the clip cannot grow,
+	 * lower planes are not clipped by the ones above, which only
+	 * costs drawing more than needed. */
+	pixman_region32_init(&empty);
+	pixman_region32_init(&fallback[0]);
+	pixman_region32_init(&fallback[1]);
 
-	wl_list_for_each(plane, &ec->plane_list, link) {
-		pixman_region32_copy(&plane->clip, &clip);
+	clip = weston_output_get_scratch_region(output);
+	if (!clip)
+		clip = &empty;
 
-		pixman_region32_init(&opaque);
+	wl_list_for_each(plane, &ec->plane_list, link) {
+		pixman_region32_copy(&plane->clip, clip);
+
+		opaque = weston_output_get_scratch_region(output);
+		spare = weston_output_get_scratch_region(output);
+		if (!opaque || !spare) {
+			pixman_region32_clear(&fallback[0]);
+			pixman_region32_clear(&fallback[1]);
+			opaque = &fallback[0];
+			spare = &fallback[1];
+		}
 
-		wl_list_for_each(ev, &ec->view_list, link) {
+		wl_array_for_each(evp, &output->view_list) {
+			ev = *evp;
 			if (ev->plane != plane)
 				continue;
 
-			view_accumulate_damage(ev, &opaque);
+			next = view_accumulate_damage(output, ev,
+						      opaque, spare);
+			if (next == spare) {
+				spare = opaque;
+				opaque = next;
+			}
 		}
 
-		pixman_region32_union(&clip, &clip, &opaque);
-		pixman_region32_fini(&opaque);
+		if (!pixman_region32_not_empty(opaque))
+			continue;
+
+		next = weston_output_get_scratch_region(output);
+		if (next) {
+			pixman_region32_union(next, clip, opaque);
+			clip = next;
+		}
 	}
 
-	pixman_region32_fini(&clip);
+	pixman_region32_fini(&fallback[1]);
+	pixman_region32_fini(&fallback[0]);
+	pixman_region32_fini(&empty);
 
-	wl_list_for_each(ev, &ec->view_list, link)
-		ev->surface->touched = false;
+	wl_array_for_each(evp, &output->view_list)
+		(*evp)->surface->touched = false;
 
-	wl_list_for_each(ev, &ec->view_list, link) {
+	wl_array_for_each(evp, &output->view_list) {
+		ev = *evp;
 		if (ev->surface->touched)
 			continue;
 		ev->surface->touched = true;
@@ -2276,11 +2873,52 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* Shells are free to re-link layers on compositor->layer_list without
+ * telling us, so remember the layer order the view list was built from.
+ */
+static void
+view_list_save_layers(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **l;
+
+	compositor->view_list_layers.size = 0;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		l = wl_array_add(&compositor->view_list_layers, sizeof *l);
+		if (!l) {
+			compositor->view_list_needs_rebuild = true;
+			return;
+		}
+		*l = layer;
+	}
+}
+
+static bool
+view_list_layers_changed(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **l;
+	size_t i = 0, count;
+
+	l = compositor->view_list_layers.data;
+	count = compositor->view_list_layers.size / sizeof *l;
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		if (i >= count || l[i] != layer)
+			return true;
+		i++;
+	}
+
+	return i != count;
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
 	struct weston_view *view;
 	struct weston_layer *layer;
+	uint32_t i;
+
+	/* Anything dirtied while rebuilding gets picked up next time. */
+	compositor->view_list_needs_rebuild = false;
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
@@ -2296,6 +2934,248 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Stamp the stacking order for picking. */
+	if (++compositor->view_list_serial == 0)
+		++compositor->view_list_serial;
+	i = 0;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		view->view_list_serial = compositor->view_list_serial;
+		view->view_list_index = i++;
+		view->pick_entry->order = view->view_list_index;
+	}
+	pick_grid_reorder(compositor->pick_grid);
+
+	view_list_save_layers(compositor);
+	weston_compositor_output_view_lists_dirty(compositor);
+	compositor->view_list_rebuilds++;
+}
+
+/** Mark the compositor view list as needing a rebuild
+ *
+ * \param compositor The compositor.
+ *
+ * The view list is only rebuilt on repaint when the stacking may have
+ * changed. Layer entry insertion and removal, view unmapping and
+ * sub-surface mapping and restacking call this automatically. Code that
+ * changes the stacking by other means must call this itself.
+ */
+WL_EXPORT void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_needs_rebuild = true;
+}
+
+/* Bring compositor->view_list up to date and update view transforms. */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	if (compositor->view_list_needs_rebuild ||
+	    view_list_layers_changed(compositor))
+		weston_compositor_build_view_list(compositor);
+	else
+		compositor->view_list_rebuilds_skipped++;
+
+	weston_compositor_update_transforms(compositor);
+}
+
+/* Collect the views shown on or vsynced to the output. Views vsynced to
+ * an output they do not overlap are included so that they still get
+ * their damage flushed and frame callbacks sent.
+ */
+static void
+weston_output_update_view_list(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view *view, **v;
+	uint32_t output_bit = 1u << output->id;
+
+	if (output->view_list_serial == ec->view_output_serial)
+		return;
+
+	output->view_list.size = 0;
+	output->view_list_serial = ec->view_output_serial;
+
+	wl_list_for_each(view, &ec->view_list, link) {
+		if (!(view->output_mask & output_bit) &&
+		    view->output != output)
+			continue;
+
+		v = wl_array_add(&output->view_list, sizeof *v);
+		if (!v) {
+			weston_log("out of memory building view list "
+				   "for output %s\n", output->name);
+			output->view_list_serial = 0;
+			break;
+		}
+		*v = view;
+	}
+}
+
+/* Throttling exemptions are decided when a client connects, from the
+ * executable the kernel reports for it, and kept for the life of the
+ * client by the presence of this destroy listener.
+ */
+static void
+frame_throttle_exempt_client_destroy(struct wl_listener *listener,
+				     void *data)
+{
+	free(listener);
+}
+
+static bool
+client_executable_is_exempt(struct wl_client *client, const char *exempt)
+{
+	char path[64], exe[PATH_MAX], *list, *name, *saveptr;
+	bool found = false;
+	ssize_t len;
+	pid_t pid;
+	uid_t uid;
+	gid_t gid;
+
+	wl_client_get_credentials(client, &pid, &uid, &gid);
+	snprintf(path, sizeof path, "/proc/%d/exe", (int)pid);
+	len = readlink(path, exe, sizeof exe - 1);
+	if (len <= 0)
+		return false;
+	exe[len] = '\0';
+
+	list = strdup(exempt);
+	if (!list)
+		return false;
+
+	for (name = strtok_r(list, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		if (strcmp(name, exe) == 0) {
+			found = true;
+			break;
+		}
+	}
+	free(list);
+
+	return found;
+}
+
+static void
+compositor_client_created(struct wl_listener *listener, void *data)
+{
+	struct weston_compositor *compositor =
+		container_of(listener, struct weston_compositor,
+			     client_created_listener);
+	struct wl_client *client = data;
+	struct wl_listener *exempt;
+
+	if (!compositor->frame_throttle_exempt ||
+	    !client_executable_is_exempt(client,
+					 compositor->frame_throttle_exempt))
+		return;
+
+	exempt = zalloc(sizeof *exempt);
+	if (!exempt)
+		return;
+
+	exempt->notify = frame_throttle_exempt_client_destroy;
+	wl_client_add_destroy_listener(client, exempt);
+}
+
+/* Decided once per surface, from its client */
+static bool
+surface_frame_throttle_exempt(struct weston_surface *surface)
+{
+	struct wl_client *client;
+
+	if (surface->frame_throttle_checked)
+		return surface->frame_throttle_exempt;
+
+	surface->frame_throttle_checked = true;
+
+	if (!surface->resource)
+		return surface->frame_throttle_exempt;
+
+	client = wl_resource_get_client(surface->resource);
+	if (wl_client_get_destroy_listener(client,
+			frame_throttle_exempt_client_destroy))
+		surface->frame_throttle_exempt = true;
+
+	return surface->frame_throttle_exempt;
+}
+
+/* Must be called after damage accumulation, which sets view->clip to the
+ * opaque region above each view. Views also shown on other outputs are
+ * taken as visible.
+ */
+static bool
+surface_is_hidden_on_output(struct weston_surface *surface,
+			    struct weston_output *output)
+{
+	struct weston_view *view;
+	pixman_region32_t *visible, *tmp;
+	uint32_t output_bit = 1u << output->id;
+	bool hidden = true;
+
+	visible = weston_output_get_scratch_region(output);
+	tmp = weston_output_get_scratch_region(output);
+	if (!visible || !tmp)
+		return false;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (!weston_view_is_mapped(view))
+			continue;
+
+		if (view->output_mask & ~output_bit) {
+			hidden = false;
+			break;
+		}
+
+		pixman_region32_intersect(tmp, &view->transform.boundingbox,
+					  &output->region);
+		pixman_region32_subtract(visible, tmp, &view->clip);
+		if (pixman_region32_not_empty(visible)) {
+			hidden = false;
+			break;
+		}
+	}
+
+	return hidden;
+}
+
+/* Whether to keep the frame callbacks and presentation feedback of a
+ * surface for a later repaint.
+ */
+static bool
+surface_frame_throttled(struct weston_surface *surface,
+			struct weston_output *output, uint32_t now)
+{
+	struct weston_compositor *compositor = output->compositor;
+
+	if (!compositor->frame_throttle)
+		return false;
+
+	if (wl_list_empty(&surface->frame_callback_list) &&
+	    wl_list_empty(&surface->feedback_list))
+		return false;
+
+	if (!surface_is_hidden_on_output(surface, output) ||
+	    surface_frame_throttle_exempt(surface) ||
+	    (compositor->frame_throttle_msec > 0 &&
+	     now - surface->frame_throttle_time >=
+	     (uint32_t)compositor->frame_throttle_msec)) {
+		surface->frame_throttle_time = now;
+		return false;
+	}
+
+	return true;
+}
+
+static int
+output_frame_throttle_handler(void *data)
+{
+	struct weston_output *output = data;
+
+	/* Held frame callbacks are due, release them on a repaint. */
+	weston_output_schedule_repaint(output);
+
+	return 0;
 }
 
 static void
@@ -2323,15 +3203,42 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+/* The sample covers everything from the start of the repaint until the
+ * backend has submitted the frame, as all of it must fit in the window.
+ */
+static void
+repaint_timing_add_sample(struct weston_repaint_timing *rt,
+			  const struct timespec *begin,
+			  const struct timespec *end)
+{
+	struct timespec d;
+	int64_t usec;
+
+	timespec_sub(&d, end, begin);
+	usec = timespec_to_nsec(&d) / 1000;
+	if (usec < 0)
+		usec = 0;
+	else if (usec > INT32_MAX)
+		usec = INT32_MAX;
+
+	rt->samples[rt->next_sample] = usec;
+	rt->next_sample = (rt->next_sample + 1) % WESTON_REPAINT_TIMING_SAMPLES;
+	if (rt->sample_count < WESTON_REPAINT_TIMING_SAMPLES)
+		rt->sample_count++;
+}
+
 static int
 weston_output_repaint(struct weston_output *output)
 {
 	struct weston_compositor *ec = output->compositor;
-	struct weston_view *ev;
+	struct weston_view *ev, **evp;
 	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
-	pixman_region32_t output_damage;
+	pixman_region32_t *output_damage, *tmp;
+	struct timespec begin, end;
+	uint32_t now;
+	bool throttled = false;
 	int r;
 
 	if (output->destroying)
@@ -2339,46 +3246,73 @@ weston_output_repaint(struct weston_output *output)
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	weston_compositor_read_presentation_clock(ec, &begin);
+
+	/* Rebuild the surface list if needed and update surface transforms
+	 * up front. */
+	weston_compositor_update_view_list(ec);
+	weston_output_update_view_list(output);
 
 	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output);
 	} else {
-		wl_list_for_each(ev, &ec->view_list, link) {
-			weston_view_move_to_plane(ev, &ec->primary_plane);
-			ev->psf_flags = 0;
+		wl_array_for_each(evp, &output->view_list) {
+			weston_view_move_to_plane(*evp, &ec->primary_plane);
+			(*evp)->psf_flags = 0;
 		}
 	}
 
+	output_accumulate_damage(output);
+
+	now = begin.tv_sec * 1000 + begin.tv_nsec / 1000000;
 	wl_list_init(&frame_callback_list);
-	wl_list_for_each(ev, &ec->view_list, link) {
+	wl_array_for_each(evp, &output->view_list) {
+		ev = *evp;
 		/* Note: This operation is safe to do multiple times on the
 		 * same surface.
 		 */
-		if (ev->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &ev->surface->frame_callback_list);
-			wl_list_init(&ev->surface->frame_callback_list);
+		if (ev->surface->output != output)
+			continue;
 
-			weston_output_take_feedback_list(output, ev->surface);
+		if (surface_frame_throttled(ev->surface, output, now)) {
+			throttled = true;
+			continue;
 		}
+
+		wl_list_insert_list(&frame_callback_list,
+				    &ev->surface->frame_callback_list);
+		wl_list_init(&ev->surface->frame_callback_list);
+
+		weston_output_take_feedback_list(output, ev->surface);
 	}
 
-	compositor_accumulate_damage(ec);
+	if (throttled && ec->frame_throttle_msec > 0)
+		wl_event_source_timer_update(output->frame_throttle_timer,
+					     ec->frame_throttle_msec + 1);
 
-	pixman_region32_init(&output_damage);
-	pixman_region32_intersect(&output_damage,
-				  &ec->primary_plane.damage, &output->region);
-	pixman_region32_subtract(&output_damage,
-				 &output_damage, &ec->primary_plane.clip);
+	output_damage = weston_output_get_scratch_region(output);
+	tmp = weston_output_get_scratch_region(output);
+	if (output_damage && tmp) {
+		pixman_region32_intersect(tmp, &ec->primary_plane.damage,
+					  &output->region);
+		pixman_region32_subtract(output_damage,
+					 tmp, &ec->primary_plane.clip);
+	} else {
+		/* Out of memory, repaint everything */
+		output_damage = &output->region;
+	}
 
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
-	r = output->repaint(output, &output_damage);
+	r = output->repaint(output, output_damage);
+
+	weston_compositor_read_presentation_clock(ec, &end);
+	repaint_timing_add_sample(&output->repaint_timing, &begin, &end);
+	if (r == 0)
+		output->repaint_timing.target_pending = true;
 
-	pixman_region32_fini(&output_damage);
+	weston_region_pool_reset(&output->region_pool);
 
 	output->repaint_needed = 0;
 
@@ -2447,12 +3381,111 @@ output_repaint_timer_handler(void *data)
 	return 0;
 }
 
+/* Did the last repaint make the vblank it was scheduled for? The slack
+ * moves up by a step on a miss and down by a fraction of a step on a hit,
+ * which settles where misses happen at the configured rate.
+ */
+static void
+repaint_timing_check_target(struct weston_output *output,
+			    const struct timespec *stamp,
+			    int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_repaint_timing *rt = &output->repaint_timing;
+	int32_t miss_percent = compositor->repaint_miss_percent;
+	struct timespec late;
+	uint32_t last_usec;
+	bool missed;
+
+	if (!rt->target_pending)
+		return;
+
+	rt->target_pending = false;
+	rt->frames++;
+
+	timespec_sub(&late, stamp, &rt->target);
+	missed = timespec_to_nsec(&late) > refresh_nsec / 2;
+	if (missed) {
+		rt->missed++;
+		rt->slack_usec += REPAINT_SLACK_STEP_USEC;
+		if (rt->slack_usec > refresh_nsec / 1000)
+			rt->slack_usec = refresh_nsec / 1000;
+	} else if (miss_percent > 0) {
+		rt->slack_usec -= REPAINT_SLACK_STEP_USEC * miss_percent /
+				  (100 - miss_percent);
+		if (rt->slack_usec < 0)
+			rt->slack_usec = 0;
+	}
+
+	if (compositor->flight_recorder_msec <= 0)
+		return;
+
+	last_usec = rt->samples[(rt->next_sample +
+				 WESTON_REPAINT_TIMING_SAMPLES - 1) %
+				WESTON_REPAINT_TIMING_SAMPLES];
+	if (missed)
+		weston_timeline_flight_dump(output, "missed vblank");
+	else if (compositor->flight_recorder_repaint_usec > 0 &&
+		 last_usec > (uint32_t) compositor->flight_recorder_repaint_usec)
+		weston_timeline_flight_dump(output, "slow repaint");
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a;
+	uint32_t ub = *(const uint32_t *)b;
+
+	if (ua < ub)
+		return -1;
+
+	return ua > ub;
+}
+
+/* Without adaptive repainting the window is the configured repaint_msec.
+ * Otherwise it is the repaint duration that only the allowed fraction of
+ * recent repaints exceeded, plus margins, rounded up to whole
+ * milliseconds for the repaint timer.
+ */
+static void
+output_update_repaint_window(struct weston_output *output,
+			     int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_repaint_timing *rt = &output->repaint_timing;
+	uint32_t sorted[WESTON_REPAINT_TIMING_SAMPLES];
+	unsigned n = rt->sample_count;
+	unsigned k;
+	int32_t window;
+
+	if (!compositor->repaint_adaptive || n < REPAINT_TIMING_MIN_SAMPLES) {
+		rt->window_usec = compositor->repaint_msec * 1000;
+		return;
+	}
+
+	memcpy(sorted, rt->samples, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_uint32);
+
+	k = n * (100 - compositor->repaint_miss_percent) / 100;
+	if (k >= n)
+		k = n - 1;
+	rt->estimate_usec = sorted[k];
+
+	window = rt->estimate_usec + REPAINT_MARGIN_USEC + rt->slack_usec;
+	window = (window + 999) / 1000 * 1000;
+	if (window > refresh_nsec / 1000)
+		window = refresh_nsec / 1000;
+
+	rt->window_usec = window;
+}
+
 WL_EXPORT void
 weston_output_finish_frame(struct weston_output *output,
 			   const struct timespec *stamp,
 			   uint32_t presented_flags)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct weston_repaint_timing *rt = &output->repaint_timing;
 	int32_t refresh_nsec;
 	struct timespec now;
 	struct timespec gone;
@@ -2469,10 +3502,14 @@ weston_output_finish_frame(struct weston_output *output,
 
 	output->frame_time = stamp->tv_sec * 1000 + stamp->tv_nsec / 1000000;
 
+	if (presented_flags != PRESENTATION_FEEDBACK_INVALID)
+		repaint_timing_check_target(output, stamp, refresh_nsec);
+	output_update_repaint_window(output, refresh_nsec);
+
 	weston_compositor_read_presentation_clock(compositor, &now);
 	timespec_sub(&gone, &now, stamp);
 	msec = (refresh_nsec - timespec_to_nsec(&gone)) / 1000000; /* floor */
-	msec -= compositor->repaint_msec;
+	msec -= rt->window_usec / 1000;
 
 	if (msec < -1000 || msec > 1000) {
 		static bool warned;
@@ -2492,6 +3529,18 @@ weston_output_finish_frame(struct weston_output *output,
 	if (presented_flags == PRESENTATION_FEEDBACK_INVALID && msec < 0)
 		msec += refresh_nsec / 1000000;
 
+	/* The repaint aims at the first vblank it can finish before. */
+	timespec_add_nsec(&rt->deadline, &now, msec < 1 ? 0 : msec * 1000000LL);
+	timespec_add_nsec(&rt->target, stamp, refresh_nsec);
+	timespec_sub(&gone, &rt->target, &rt->deadline);
+	while (timespec_to_nsec(&gone) < rt->window_usec * 1000LL) {
+		timespec_add_nsec(&rt->target, &rt->target, refresh_nsec);
+		timespec_sub(&gone, &rt->target, &rt->deadline);
+	}
+
+	TL_POINT("core_repaint_deadline", TLP_OUTPUT(output),
+		 TLP_REPAINT_TIMING(rt), TLP_END);
+
 	if (msec < 1)
 		output_repaint_timer_handler(output);
 	else
@@ -2506,17 +3555,31 @@ idle_repaint(void *data)
 	output->start_repaint_loop(output);
 }
 
+/* Layer entries being inserted or removed are always view layer links. */
+static void
+layer_entry_view_list_dirty(struct weston_layer_entry *entry)
+{
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
+	weston_compositor_view_list_dirty(view->surface->compositor);
+}
+
 WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	layer_entry_view_list_dirty(entry);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		layer_entry_view_list_dirty(entry);
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2725,16 +3788,37 @@ surface_set_input_region(struct wl_client *client,
 	}
 }
 
+static bool
+surface_subsurface_order_changed(struct weston_surface *surface)
+{
+	struct wl_list *cur = surface->subsurface_list.next;
+	struct weston_subsurface *sub;
+
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (cur != &sub->parent_link)
+			return true;
+		cur = cur->next;
+	}
+
+	return cur != &surface->subsurface_list;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	if (!surface_subsurface_order_changed(surface))
+		return;
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 	}
+
+	weston_compositor_view_list_dirty(surface->compositor);
 }
 
 static void
@@ -3308,6 +4392,7 @@ subsurface_configure(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 		surface->output = output;
 		weston_surface_update_output_mask(surface, 1u << output->id);
+		weston_compositor_view_list_dirty(compositor);
 	}
 }
 
@@ -3594,6 +4679,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_dirty(sub->surface->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -4113,6 +5199,7 @@ weston_output_destroy(struct weston_output *output)
 	}
 
 	wl_event_source_remove(output->repaint_timer);
+	wl_event_source_remove(output->frame_throttle_timer);
 
 	weston_presentation_feedback_discard_list(&output->feedback_list);
 
@@ -4123,6 +5210,8 @@ weston_output_destroy(struct weston_output *output)
 	wl_signal_emit(&output->destroy_signal, output);
 
 	free(output->name);
+	wl_array_release(&output->view_list);
+	weston_region_pool_release(&output->region_pool);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
 	output->compositor->output_id_pool &= ~(1u << output->id);
@@ -4326,10 +5415,16 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	wl_list_init(&output->resource_list);
 	wl_list_init(&output->feedback_list);
 	wl_list_init(&output->link);
+	wl_array_init(&output->view_list);
+	weston_region_pool_init(&output->region_pool);
+	output->view_list_serial = 0;
 
 	loop = wl_display_get_event_loop(c->wl_display);
 	output->repaint_timer = wl_event_loop_add_timer(loop,
 					output_repaint_timer_handler, output);
+	output->frame_throttle_timer =
+		wl_event_loop_add_timer(loop, output_frame_throttle_handler,
+					output);
 
 	/* Invert the output id pool and look for the lowest numbered
 	 * switch (the least significant bit).  Take that bit's position
@@ -4695,12 +5790,47 @@ timeline_key_binding_handler(struct weston_keyboard *keyboard, uint32_t time,
 {
 	struct weston_compositor *compositor = data;
 
-	if (weston_timeline_enabled_)
+	if (weston_timeline_is_open())
 		weston_timeline_close();
 	else
 		weston_timeline_open(compositor);
 }
 
+static void
+repaint_stats_binding_handler(struct weston_keyboard *keyboard, uint32_t time,
+			      uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+	struct weston_repaint_timing *rt;
+
+	weston_log("Repaint statistics:\n");
+	weston_log_continue(STAMP_SPACE "view list rebuilt %u times, "
+			    "reused %u times\n",
+			    compositor->view_list_rebuilds,
+			    compositor->view_list_rebuilds_skipped);
+	weston_log_continue(STAMP_SPACE "%u view transforms updated "
+			    "on the last repaint\n",
+			    compositor->transform_updates);
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		rt = &output->repaint_timing;
+		weston_log_continue(STAMP_SPACE "%s: window %d us, "
+				    "estimate %d us, %u of %u frames "
+				    "missed their vblank\n",
+				    output->name, rt->window_usec,
+				    rt->estimate_usec, rt->missed, rt->frames);
+		weston_log_continue(STAMP_SPACE "%s: %u scratch regions, "
+				    "%u scratch region slot allocations in "
+				    "the last frame, %u in total\n",
+				    output->name,
+				    (unsigned int)(output->region_pool.slots.size /
+				    sizeof(struct weston_region_slot *)),
+				    output->region_pool.last_frame_slot_allocs,
+				    output->region_pool.slot_allocs);
+	}
+}
+
 /** Create the compositor.
  *
  * This functions creates and initializes a compositor instance.
@@ -4741,6 +5871,16 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	ec->output_id_pool = 0;
 	ec->repaint_msec = DEFAULT_REPAINT_WINDOW;
+	ec->repaint_miss_percent = DEFAULT_REPAINT_MISS_PERCENT;
+	ec->frame_throttle_msec = DEFAULT_FRAME_THROTTLE_MSEC;
+
+	ec->pick_grid = zalloc(sizeof *ec->pick_grid);
+	if (!ec->pick_grid || pick_grid_init(ec->pick_grid) < 0)
+		goto fail;
+
+	ec->client_created_listener.notify = compositor_client_created;
+	wl_display_add_client_created_listener(ec->wl_display,
+					       &ec->client_created_listener);
 
 	if (!wl_global_create(ec->wl_display, &wl_compositor_interface, 4,
 			      ec, compositor_bind))
@@ -4770,6 +5910,12 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	wl_list_init(&ec->axis_binding_list);
 	wl_list_init(&ec->debug_binding_list);
 
+	wl_array_init(&ec->view_list_layers);
+	wl_list_init(&ec->transform_dirty_list);
+	wl_array_init(&ec->transform_records);
+	ec->view_list_needs_rebuild = true;
+	ec->view_output_serial = 1;
+
 	weston_plane_init(&ec->primary_plane, ec, 0, 0);
 	weston_compositor_stack_plane(ec, &ec->primary_plane, NULL);
 
@@ -4787,10 +5933,17 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
+	weston_compositor_add_debug_binding(ec, KEY_P,
+					    repaint_stats_binding_handler, ec);
 
 	return ec;
 
 fail:
+	if (ec->client_created_listener.notify)
+		wl_list_remove(&ec->client_created_listener.link);
+	if (ec->pick_grid)
+		pick_grid_release(ec->pick_grid);
+	free(ec->pick_grid);
 	free(ec);
 	return NULL;
 }
@@ -4820,6 +5973,13 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	weston_plane_release(&ec->primary_plane);
 
+	wl_array_release(&ec->view_list_layers);
+	wl_array_release(&ec->transform_records);
+	pick_grid_release(ec->pick_grid);
+	free(ec->pick_grid);
+	wl_list_remove(&ec->client_created_listener.link);
+	free(ec->frame_throttle_exempt);
+
 	wl_event_loop_destroy(ec->input_loop);
 }
 
@@ -58,6 +58,8 @@ struct weston_output;
 struct input_method;
 struct weston_pointer;
 struct linux_dmabuf_buffer;
+struct pick_grid;
+struct pick_grid_entry;
 
 enum weston_keyboard_modifier {
 	MODIFIER_CTRL = (1 << 0),
@@ -165,6 +167,51 @@ enum dpms_enum {
 	WESTON_DPMS_OFF
 };
 
+#define WESTON_REPAINT_TIMING_SAMPLES 64
+
+/* Repaint durations and vblank misses of an output, used to place the
+ * repaint deadline. See weston_output_finish_frame(). */
+struct weston_repaint_timing {
+	uint32_t samples[WESTON_REPAINT_TIMING_SAMPLES]; /* usec */
+	unsigned sample_count;
+	unsigned next_sample;
+
+	int32_t estimate_usec;		/* predicted repaint duration */
+	int32_t slack_usec;		/* grows on misses */
+	int32_t window_usec;		/* chosen repaint window */
+	struct timespec deadline;	/* when the repaint is scheduled */
+	struct timespec target;		/* vblank the repaint aims for */
+	bool target_pending;		/* repainted, waiting for vblank */
+
+	uint32_t frames;
+	uint32_t missed;
+};
+
+/* What a renderer submitted for one output repaint, for the timeline */
+struct weston_render_stats {
+	uint32_t views;		/* views with damage to paint */
+	uint32_t batches;	/* runs of geometry with one draw state */
+	uint32_t draw_calls;
+	uint32_t vertices;
+};
+
+/* Scratch regions for the repaint path. The n-th region handed out in a
+ * frame is the same region in every frame, so with a stable scene its
+ * rectangle storage is reused instead of being reallocated.
+ *
+ * The counters only cover the pool's own slots: new slots, and slots
+ * whose rectangle storage changed. Other regions on the repaint path,
+ * like view clips and plane damage, are not counted.
+ */
+struct weston_region_pool {
+	struct wl_array slots;		/* struct weston_region_slot * */
+	unsigned int used;		/* slots handed out this frame */
+
+	uint32_t frame_slot_allocs;	/* slot allocations, this frame */
+	uint32_t last_frame_slot_allocs;
+	uint32_t slot_allocs;		/* slot allocations, total */
+};
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -203,6 +250,17 @@ struct weston_output {
 	int destroying;
 	struct wl_list feedback_list;
 
+	/* Views shown on or vsynced to this output, in compositor view
+	 * list order: struct weston_view *. Only valid during repaint. */
+	struct wl_array view_list;
+	uint32_t view_list_serial;
+
+	struct weston_repaint_timing repaint_timing;
+
+	struct wl_event_source *frame_throttle_timer;
+
+	struct weston_region_pool region_pool;
+
 	char *make, *model, *serial_number;
 	uint32_t subpixel;
 	uint32_t transform;
@@ -617,11 +675,22 @@ struct weston_plane {
 	struct wl_list link;
 };
 
+/** Completion of weston_output_read_pixels_async(), status is 0 when the
+ * pixels are in place and -1 if reading them failed. */
+typedef void (*weston_read_pixels_func_t)(struct weston_output *output,
+					  int status, void *data);
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+	/** See weston_output_read_pixels_async(), optional */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format, void *pixels,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_read_pixels_func_t done, void *data);
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
@@ -738,7 +807,7 @@ struct weston_compositor {
 	struct wl_list output_list;
 	struct wl_list seat_list;
 	struct wl_list layer_list;
-	struct wl_list view_list;
+	struct wl_list view_list;	/* struct weston_view::link */
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -782,6 +851,42 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	bool repaint_adaptive;		/* derive window from repaint timing */
+	int32_t repaint_miss_percent;	/* vblank misses allowed, adaptive */
+
+	/* Hold back frame callbacks and presentation feedback of surfaces
+	 * that are fully occluded or off-screen. They are still released
+	 * every frame_throttle_msec, or never while hidden if zero. */
+	bool frame_throttle;
+	int32_t frame_throttle_msec;
+	char *frame_throttle_exempt;	/* comma separated executable paths */
+	struct wl_listener client_created_listener;
+
+	int32_t pixman_threads;	/* pixman renderer bands, 0 or 1 for none */
+	int32_t gl_atlas_size;	/* largest shm buffer side the GL renderer
+				 * packs into shared textures, 0 for none */
+
+	/* Timeline kept in memory and dumped when a repaint misses its
+	 * vblank or takes longer than flight_recorder_repaint_usec,
+	 * see weston_timeline_flight_start(). */
+	int32_t flight_recorder_msec;		/* 0 for none */
+	int32_t flight_recorder_repaint_usec;	/* 0 for misses only */
+
+	/* View list maintenance, see weston_compositor_view_list_dirty() */
+	bool view_list_needs_rebuild;
+	struct wl_array view_list_layers; /* layer order at last rebuild */
+	uint32_t view_list_serial;
+	uint32_t view_output_serial; /* bumped when output view lists change */
+	uint32_t view_list_rebuilds;
+	uint32_t view_list_rebuilds_skipped;
+
+	/* Roots of subtrees with dirty transforms, updated on repaint */
+	struct wl_list transform_dirty_list;
+	struct wl_array transform_records; /* reused by each update */
+	uint32_t transform_updates;	/* views updated by the last one */
+
+	/* Bounding boxes of views, for weston_compositor_pick_view() */
+	struct pick_grid *pick_grid;
 
 	int exit_code;
 
@@ -801,6 +906,7 @@ struct weston_buffer {
 	int32_t width, height;
 	uint32_t busy_count;
 	int y_inverted;
+	bool shm_planes_mapped;	/* see weston_buffer_shm_planes_mapped() */
 };
 
 struct weston_buffer_reference {
@@ -912,6 +1018,12 @@ struct weston_view {
 	 */
 	struct {
 		int dirty;
+		/* weston_compositor::transform_dirty_list, if this view is
+		 * the root of a dirty subtree */
+		struct wl_list dirty_link;
+		/* bumped each time the transform is recomputed, for
+		 * renderers caching geometry derived from the view */
+		uint32_t serial;
 
 		/* Approximations in global coordinates:
 		 * - boundingbox is guaranteed to include the whole view in
@@ -947,6 +1059,12 @@ struct weston_view {
 
 	/* Per-surface Presentation feedback flags, controlled by backend. */
 	uint32_t psf_flags;
+
+	/* Position in weston_compositor::view_list, valid only while
+	 * view_list_serial matches the compositor's. */
+	uint32_t view_list_serial;
+	uint32_t view_list_index;
+	struct pick_grid_entry *pick_entry; /* transform.boundingbox */
 };
 
 struct weston_surface_state {
@@ -1063,6 +1181,13 @@ struct weston_surface {
 	const char *role_name;
 
 	struct weston_timeline_object timeline;
+
+	/* Frame callback throttling while hidden, see
+	 * weston_compositor::frame_throttle. Shells may set
+	 * frame_throttle_exempt and frame_throttle_checked. */
+	bool frame_throttle_exempt;
+	bool frame_throttle_checked;
+	uint32_t frame_throttle_time;	/* last release, msec */
 };
 
 struct weston_subsurface {
@@ -1120,6 +1245,14 @@ void
 weston_view_from_global_float(struct weston_view *view,
 			      float x, float y, float *vx, float *vy);
 void
+weston_view_to_global_points(struct weston_view *view,
+			     const float *sx, const float *sy,
+			     float *x, float *y, int count);
+void
+weston_view_from_global_points(struct weston_view *view,
+			       const float *x, const float *y,
+			       float *vx, float *vy, int count);
+void
 weston_view_from_global(struct weston_view *view,
 			int32_t x, int32_t y, int32_t *vx, int32_t *vy);
 void
@@ -1202,6 +1335,9 @@ weston_layer_entry_remove(struct weston_layer_entry *entry);
 void
 weston_layer_init(struct weston_layer *layer, struct wl_list *below);
 
+void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor);
+
 void
 weston_layer_set_mask(struct weston_layer *layer, int x, int y, int width, int height);
 
@@ -1229,8 +1365,26 @@ weston_output_finish_frame(struct weston_output *output,
 			   uint32_t presented_flags);
 void
 weston_output_schedule_repaint(struct weston_output *output);
+pixman_region32_t *
+weston_output_get_scratch_region(struct weston_output *output);
+
+void
+weston_region_pool_init(struct weston_region_pool *pool);
+void
+weston_region_pool_release(struct weston_region_pool *pool);
+pixman_region32_t *
+weston_region_pool_get(struct weston_region_pool *pool);
+void
+weston_region_pool_reset(struct weston_region_pool *pool);
+
 void
 weston_output_damage(struct weston_output *output);
+int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format, void *pixels,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_func_t done, void *data);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
@@ -1442,6 +1596,24 @@ void
 weston_buffer_reference(struct weston_buffer_reference *ref,
 			struct weston_buffer *buffer);
 
+/* The YUV shm formats are laid out as in DRM, the planes following each
+ * other in the buffer without padding:
+ *
+ * YUV420: the Y plane of 'stride' bytes by 'height' rows, then U and V
+ * planes of 'stride / 2' bytes by '(height + 1) / 2' rows each.
+ *
+ * NV12: the Y plane, then '(height + 1) / 2' rows of 'stride' bytes of
+ * interleaved U and V samples.
+ *
+ * YUYV: one plane, 'stride' at least 2 * 'width'.
+ *
+ * wl_shm only checks that 'stride * height' bytes fit in the pool, so a
+ * renderer must check the rest before it reads the planes after the
+ * first one.
+ */
+bool
+weston_buffer_shm_planes_mapped(struct weston_buffer *buffer);
+
 uint32_t
 weston_compositor_get_time(void);
 
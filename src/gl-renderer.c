@@ -30,11 +30,17 @@
 #include <GLES2/gl2ext.h>
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <float.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <linux/input.h>
 #include <drm_fourcc.h>
 
@@ -44,7 +50,23 @@
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "weston-egl-ext.h"
+#include "timeline.h"
+
+/* Fragment shader variants, all built from fragment_shader_template.
+ * The values are seen by the GLSL preprocessor, see shader_variants[].
+ */
+enum gl_shader_variant {
+	SHADER_VARIANT_RGBA = 0,
+	SHADER_VARIANT_RGBX,
+	SHADER_VARIANT_EXTERNAL,
+	SHADER_VARIANT_Y_UV,
+	SHADER_VARIANT_Y_U_V,
+	SHADER_VARIANT_Y_XUXV,
+	SHADER_VARIANT_SOLID,
+	SHADER_VARIANT_COUNT
+};
 
 struct gl_shader {
 	GLuint program;
@@ -53,7 +75,7 @@ struct gl_shader {
 	GLint tex_uniforms[3];
 	GLint alpha_uniform;
 	GLint color_uniform;
-	const char *vertex_source, *fragment_source;
+	enum gl_shader_variant variant;
 };
 
 #define BUFFER_DAMAGE_COUNT 2
@@ -133,6 +155,47 @@ struct yuv_format_descriptor {
 	struct yuv_plane_descriptor plane[4];
 };
 
+/* Small shm buffers are packed into shared textures, the atlas pages, so
+ * that views of different surfaces can be drawn in one batch. A page is
+ * cut into shelves, rows as high as the first buffer placed in them,
+ * which are filled from left to right.
+ */
+#define GL_ATLAS_PAGE_SIZE 1024
+#define GL_ATLAS_MAX_PAGES 4
+/* Copy of the edge pixels around each buffer, for linear filtering */
+#define GL_ATLAS_GUTTER 1
+
+struct gl_atlas_shelf {
+	struct wl_list link;		/* gl_atlas_page::shelves, top down */
+	int y, height;
+	int x;				/* first free column */
+	int n_slots;
+};
+
+struct gl_atlas_page {
+	struct wl_list link;		/* gl_renderer::atlas_pages */
+	GLuint texture;
+	struct wl_list shelves;
+	int y;				/* first row below the shelves */
+	struct wl_list slots;		/* gl_atlas_slot::link */
+};
+
+struct gl_atlas_slot {
+	struct gl_atlas_page *page;	/* NULL when not in the atlas */
+	struct gl_atlas_shelf *shelf;
+	struct wl_list link;
+	int x, y;			/* of the buffer, inside the gutter */
+	int width, height;
+};
+
+struct gl_atlas_stats {
+	uint32_t placed;
+	uint32_t released;
+	uint32_t failed;		/* no room, own texture instead */
+	uint32_t shelves_reclaimed;
+	uint32_t pages_compacted;
+};
+
 struct gl_surface_state {
 	GLfloat color[4];
 	struct gl_shader *shader;
@@ -145,9 +208,15 @@ struct gl_surface_state {
 	/* These are only used by SHM surfaces to detect when we need
 	 * to do a full upload to specify a new internal texture
 	 * format */
-	GLenum gl_format;
+	GLenum gl_format[3];
 	GLenum gl_pixel_type;
 
+	/* Layout of the planes of a SHM buffer, one texture each: byte
+	 * offset in the buffer and subsampling against the first plane */
+	int offset[3];
+	int hsub[3];
+	int vsub[3];
+
 	struct egl_image* images[3];
 	GLenum target;
 	int num_images;
@@ -158,12 +227,94 @@ struct gl_surface_state {
 	int height; /* in pixels */
 	int y_inverted;
 
+	/* Where the buffer is when it shares an atlas page, instead of
+	 * the textures above */
+	struct gl_atlas_slot atlas;
+
 	struct weston_surface *surface;
 
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* A surface rectangle of a view, transformed to global coordinates */
+struct gl_view_quad {
+	struct polygon8 poly;
+	GLfloat x1, y1, x2, y2;		/* bounding box */
+};
+
+/* The quads of one surface region, e.g. the opaque region of a view */
+struct gl_view_region {
+	bool valid;
+	pixman_region32_t region;	/* surface coordinates */
+	struct wl_array quads;		/* struct gl_view_quad */
+};
+
+/* Geometry of a view cached across frames, so that only clipping against
+ * the damage is left to do while the view does not move.
+ */
+struct gl_view_state {
+	struct weston_view *view;
+
+	/* What the cache was computed from */
+	bool valid;
+	uint32_t transform_serial;
+	struct weston_matrix surface_to_buffer;
+	int pitch, height, y_inverted;
+	const struct gl_atlas_page *atlas_page;
+	int atlas_x, atlas_y;
+
+	/* Global coordinates to texture coordinates */
+	struct weston_matrix texture_matrix;
+
+	struct gl_view_region opaque;
+	struct gl_view_region blend;
+
+	struct wl_listener view_destroy_listener;
+	struct wl_listener renderer_destroy_listener;
+};
+
+/* OpenGL ES 3.0 entry points, not declared by the ES 2 headers */
+typedef void *(GL_APIENTRYP PFNWESTONGLMAPBUFFERRANGEPROC)
+	(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef GLboolean (GL_APIENTRYP PFNWESTONGLUNMAPBUFFERPROC) (GLenum target);
+
+/* Draw state of a run of triangles in the frame geometry */
+struct gl_batch {
+	struct gl_shader *shader;
+	struct gl_surface_state *gs;	/* textures and color */
+	float alpha;
+	GLint filter;
+	bool blend;
+
+	uint32_t first_vertex, n_vertices;
+	uint32_t first_index, n_indices;
+	int n_fans;
+};
+
+/* A read of output pixels into a pixel pack buffer, finished once the
+ * fence after it signals, see gl_renderer_read_pixels_async() */
+struct gl_read {
+	struct wl_list link;		/* gl_renderer::reads */
+	struct weston_output *output;
+	GLuint pbo;
+#ifdef EGL_KHR_fence_sync
+	EGLSyncKHR sync;
+#endif
+	void *pixels;
+	size_t size;
+	weston_read_pixels_func_t done;
+	void *data;
+};
+
+/* How often pending reads are checked for completion */
+#define GL_READ_POLL_MSEC 2
+
+/* Pixel buffer objects shm uploads rotate through */
+#define GL_UPLOAD_PBO_COUNT 3
+/* Damage is merged into at most this many uploads per surface */
+#define GL_UPLOAD_MAX_BOXES 4
+
 struct gl_renderer {
 	struct weston_renderer base;
 	int fragment_shader_debug;
@@ -177,6 +328,11 @@ struct gl_renderer {
 
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct wl_array indices;	/* GLushort */
+	struct wl_array batches;	/* struct gl_batch */
+	GLuint vertex_buffer;
+	GLuint index_buffer;
+	struct weston_render_stats render_stats;
 
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
@@ -190,6 +346,29 @@ struct gl_renderer {
 
 	int has_unpack_subimage;
 
+	/* Linked shader programs cached on disk, see shader_cache_init() */
+	int has_program_binary;
+#ifdef GL_OES_get_program_binary
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+#endif
+	char *shader_cache_dir;
+	uint64_t shader_driver_hash;
+
+	int has_pbo_upload;
+	PFNWESTONGLMAPBUFFERRANGEPROC map_buffer_range;
+	PFNWESTONGLUNMAPBUFFERPROC unmap_buffer;
+	GLuint upload_pbos[GL_UPLOAD_PBO_COUNT];
+	int upload_pbo_next;
+	struct wl_array upload_boxes;
+
+	/* Largest buffer side packed into the atlas, 0 for no atlas */
+	int atlas_max_size;
+	struct wl_list atlas_pages;	/* gl_atlas_page::link */
+	int atlas_page_count;
+	struct gl_atlas_stats atlas_stats;
+	struct wl_array atlas_scratch;
+
 	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
 	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
@@ -199,19 +378,22 @@ struct gl_renderer {
 
 	int has_egl_buffer_age;
 
+	int has_fence_sync;
+#ifdef EGL_KHR_fence_sync
+	PFNEGLCREATESYNCKHRPROC create_sync;
+	PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+	PFNEGLCLIENTWAITSYNCKHRPROC client_wait_sync;
+#endif
+	struct wl_list reads;		/* gl_read::link, oldest first */
+	struct wl_event_source *read_timer;
+
 	int has_configless_context;
 
 	int has_dmabuf_import;
 	struct wl_list dmabuf_images;
 
-	struct gl_shader texture_shader_rgba;
-	struct gl_shader texture_shader_rgbx;
-	struct gl_shader texture_shader_egl_external;
-	struct gl_shader texture_shader_y_uv;
-	struct gl_shader texture_shader_y_u_v;
-	struct gl_shader texture_shader_y_xuxv;
-	struct gl_shader invert_color_shader;
-	struct gl_shader solid_shader;
+	/* Compiled on first use, see ensure_shader() */
+	struct gl_shader shaders[SHADER_VARIANT_COUNT];
 	struct gl_shader *current_shader;
 
 	struct wl_signal destroy_signal;
@@ -253,6 +435,18 @@ get_renderer(struct weston_compositor *ec)
 	return (struct gl_renderer *)ec->renderer;
 }
 
+static int
+gl_renderer_create_view(struct weston_view *view);
+
+static inline struct gl_view_state *
+get_view_state(struct weston_view *view)
+{
+	if (!view->renderer_state)
+		gl_renderer_create_view(view);
+
+	return (struct gl_view_state *)view->renderer_state;
+}
+
 static struct egl_image*
 egl_image_create(struct gl_renderer *gr, EGLenum target,
 		 EGLClientBuffer buffer, const EGLint *attribs)
@@ -362,10 +556,76 @@ gl_renderer_print_egl_error_state(void)
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 #define min(a, b) (((a) > (b)) ? (b) : (a))
 
+static void
+view_region_init(struct gl_view_region *cache)
+{
+	cache->valid = false;
+	pixman_region32_init(&cache->region);
+	wl_array_init(&cache->quads);
+}
+
+static void
+view_region_fini(struct gl_view_region *cache)
+{
+	pixman_region32_fini(&cache->region);
+	wl_array_release(&cache->quads);
+}
+
+/*
+ * Transform the rectangles of 'surf_region' from surface coordinates into
+ * global coordinates, and store the resulting quadrilaterals along with
+ * their bounding boxes in 'cache'.
+ */
+static void
+view_region_update(struct gl_view_region *cache, struct weston_view *ev,
+		   pixman_region32_t *surf_region)
+{
+	struct gl_view_quad *quad;
+	pixman_box32_t *surf_rects;
+	int i, j, nsurf;
+
+	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
+
+	cache->quads.size = 0;
+	quad = wl_array_add(&cache->quads, nsurf * sizeof *quad);
+	if (!quad)
+		return;
+
+	for (i = 0; i < nsurf; i++, quad++) {
+		pixman_box32_t *surf_rect = &surf_rects[i];
+		struct polygon8 surf = {
+			{ surf_rect->x1, surf_rect->x2,
+			  surf_rect->x2, surf_rect->x1 },
+			{ surf_rect->y1, surf_rect->y1,
+			  surf_rect->y2, surf_rect->y2 },
+			4
+		};
+
+		/* transform surface to screen space: */
+		weston_view_to_global_points(ev, surf.x, surf.y,
+					     surf.x, surf.y, surf.n);
+		quad->poly = surf;
+
+		/* find bounding box: */
+		quad->x1 = quad->x2 = surf.x[0];
+		quad->y1 = quad->y2 = surf.y[0];
+
+		for (j = 1; j < surf.n; j++) {
+			quad->x1 = min(quad->x1, surf.x[j]);
+			quad->x2 = max(quad->x2, surf.x[j]);
+			quad->y1 = min(quad->y1, surf.y[j]);
+			quad->y2 = max(quad->y2, surf.y[j]);
+		}
+	}
+
+	pixman_region32_copy(&cache->region, surf_region);
+	cache->valid = true;
+}
+
 /*
  * Compute the boundary vertices of the intersection of the global coordinate
- * aligned rectangle 'rect', and an arbitrary quadrilateral produced from
- * 'surf_rect' when transformed from surface coordinates into global coordinates.
+ * aligned rectangle 'rect', and the arbitrary quadrilateral 'quad' produced
+ * from a surface rectangle by view_region_update().
  * The vertices are written to 'ex' and 'ey', and the return value is the
  * number of vertices. Vertices are produced in clockwise winding order.
  * Guarantees to produce either zero vertices, or 3-8 vertices with non-zero
@@ -373,44 +633,23 @@ gl_renderer_print_egl_error_state(void)
  */
 static int
 calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
-		pixman_box32_t *surf_rect, GLfloat *ex, GLfloat *ey)
+		struct gl_view_quad *quad, GLfloat *ex, GLfloat *ey)
 {
 
 	struct clip_context ctx;
-	int i, n;
-	GLfloat min_x, max_x, min_y, max_y;
-	struct polygon8 surf = {
-		{ surf_rect->x1, surf_rect->x2, surf_rect->x2, surf_rect->x1 },
-		{ surf_rect->y1, surf_rect->y1, surf_rect->y2, surf_rect->y2 },
-		4
-	};
+	int n;
+	struct polygon8 surf = quad->poly;
 
 	ctx.clip.x1 = rect->x1;
 	ctx.clip.y1 = rect->y1;
 	ctx.clip.x2 = rect->x2;
 	ctx.clip.y2 = rect->y2;
 
-	/* transform surface to screen space: */
-	for (i = 0; i < surf.n; i++)
-		weston_view_to_global_float(ev, surf.x[i], surf.y[i],
-					    &surf.x[i], &surf.y[i]);
-
-	/* find bounding box: */
-	min_x = max_x = surf.x[0];
-	min_y = max_y = surf.y[0];
-
-	for (i = 1; i < surf.n; i++) {
-		min_x = min(min_x, surf.x[i]);
-		max_x = max(max_x, surf.x[i]);
-		min_y = min(min_y, surf.y[i]);
-		max_y = max(max_y, surf.y[i]);
-	}
-
 	/* First, simple bounding box check to discard early transformed
 	 * surface rects that do not intersect with the clip region:
 	 */
-	if ((min_x >= ctx.clip.x2) || (max_x <= ctx.clip.x1) ||
-	    (min_y >= ctx.clip.y2) || (max_y <= ctx.clip.y1))
+	if ((quad->x1 >= ctx.clip.x2) || (quad->x2 <= ctx.clip.x1) ||
+	    (quad->y1 >= ctx.clip.y2) || (quad->y2 <= ctx.clip.y1))
 		return 0;
 
 	/* Simple case, bounding box edges are parallel to surface edges,
@@ -483,21 +722,89 @@ compress_bands(pixman_box32_t *inrects, int nrects,
 	return nout;
 }
 
+/* Global coordinates to normalized texture coordinates of the view */
+static void
+view_texture_matrix(struct weston_matrix *m, struct weston_view *ev,
+		    struct gl_surface_state *gs)
+{
+	/* Solid color surfaces have no texture, but avoid dividing by 0 */
+	float height = gs->height > 0 ? gs->height : 1;
+
+	if (ev->transform.enabled) {
+		*m = ev->transform.inverse;
+	} else {
+		weston_matrix_init(m);
+		weston_matrix_translate(m, -ev->geometry.x, -ev->geometry.y, 0);
+	}
+
+	weston_matrix_multiply(m, &ev->surface->surface_to_buffer_matrix);
+
+	/* Buffer coordinates to the slot of the buffer in its page */
+	if (gs->atlas.page) {
+		weston_matrix_translate(m, gs->atlas.x, gs->atlas.y, 0);
+		weston_matrix_scale(m, 1.0 / GL_ATLAS_PAGE_SIZE,
+				    1.0 / GL_ATLAS_PAGE_SIZE, 1);
+		return;
+	}
+
+	if (gs->y_inverted) {
+		weston_matrix_scale(m, 1.0 / gs->pitch, 1.0 / height, 1);
+	} else {
+		weston_matrix_scale(m, 1.0 / gs->pitch, -1.0 / height, 1);
+		weston_matrix_translate(m, 0, 1, 0);
+	}
+}
+
+/* Drops the cached geometry of a view if anything it depends on changed:
+ * the view transform (see weston_view_geometry_dirty()), the buffer
+ * transform, scale or viewport, or the texture layout, which includes
+ * the place of the buffer in the atlas.
+ */
+static void
+view_state_validate(struct gl_view_state *vs, struct weston_view *ev,
+		    struct gl_surface_state *gs)
+{
+	struct weston_matrix *s2b = &ev->surface->surface_to_buffer_matrix;
+
+	if (vs->valid &&
+	    vs->transform_serial == ev->transform.serial &&
+	    vs->pitch == gs->pitch && vs->height == gs->height &&
+	    vs->y_inverted == gs->y_inverted &&
+	    vs->atlas_page == gs->atlas.page &&
+	    vs->atlas_x == gs->atlas.x && vs->atlas_y == gs->atlas.y &&
+	    memcmp(&vs->surface_to_buffer, s2b, sizeof *s2b) == 0)
+		return;
+
+	vs->transform_serial = ev->transform.serial;
+	vs->surface_to_buffer = *s2b;
+	vs->pitch = gs->pitch;
+	vs->height = gs->height;
+	vs->y_inverted = gs->y_inverted;
+	vs->atlas_page = gs->atlas.page;
+	vs->atlas_x = gs->atlas.x;
+	vs->atlas_y = gs->atlas.y;
+	view_texture_matrix(&vs->texture_matrix, ev, gs);
+
+	vs->opaque.valid = false;
+	vs->blend.valid = false;
+	vs->valid = true;
+}
+
 static int
-texture_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+texture_region(struct weston_view *ev, struct gl_view_state *vs,
+	       pixman_region32_t *region, struct gl_view_region *cache)
 {
-	struct gl_surface_state *gs = get_surface_state(ev->surface);
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v, inv_width, inv_height;
+	struct gl_view_quad *quads = cache->quads.data;
+	GLfloat *v;
 	unsigned int *vtxcnt, nvtx = 0;
-	pixman_box32_t *rects, *surf_rects;
+	pixman_box32_t *rects;
 	pixman_box32_t *raw_rects;
 	int i, j, k, nrects, nsurf, raw_nrects;
 	bool used_band_compression;
 	raw_rects = pixman_region32_rectangles(region, &raw_nrects);
-	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
+	nsurf = cache->quads.size / sizeof *quads;
 
 	if (raw_nrects < 4) {
 		used_band_compression = false;
@@ -513,15 +820,11 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
 	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
 
-	inv_width = 1.0 / gs->pitch;
-        inv_height = 1.0 / gs->height;
-
 	for (i = 0; i < nrects; i++) {
 		pixman_box32_t *rect = &rects[i];
 		for (j = 0; j < nsurf; j++) {
-			pixman_box32_t *surf_rect = &surf_rects[j];
-			GLfloat sx, sy, bx, by;
 			GLfloat ex[8], ey[8];          /* edge points in screen space */
+			GLfloat tx[8], ty[8];          /* edge points in texture space */
 			int n;
 
 			/* The transformed surface, after clipping to the clip region,
@@ -538,43 +841,41 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 			 * form the intersection of the clip rect and the transformed
 			 * surface.
 			 */
-			n = calculate_edges(ev, rect, surf_rect, ex, ey);
+			n = calculate_edges(ev, rect, &quads[j], ex, ey);
 			if (n < 3)
 				continue;
 
+			if (weston_matrix_transform_xy(&vs->texture_matrix,
+						       ex, ey, tx, ty, n) > 0)
+				weston_log("warning: numerical instability in "
+					   "%s()\n", __func__);
+
 			/* emit edge points: */
 			for (k = 0; k < n; k++) {
-				weston_view_from_global_float(ev, ex[k], ey[k],
-							      &sx, &sy);
 				/* position: */
 				*(v++) = ex[k];
 				*(v++) = ey[k];
 				/* texcoord: */
-				weston_surface_to_buffer_float(ev->surface,
-							       sx, sy,
-							       &bx, &by);
-				*(v++) = bx * inv_width;
-				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
-				} else {
-					*(v++) = (gs->height - by) * inv_height;
-				}
+				*(v++) = tx[k];
+				*(v++) = ty[k];
 			}
 
 			vtxcnt[nvtx++] = n;
 		}
 	}
 
+	/* Drop the worst case space that was not used */
+	gr->vertices.size = (char *) v - (char *) gr->vertices.data;
+	gr->vtxcnt.size = (char *) (vtxcnt + nvtx) - (char *) gr->vtxcnt.data;
+
 	if (used_band_compression)
 		free(rects);
 	return nvtx;
 }
 
 static void
-triangle_fan_debug(struct weston_view *view, int first, int count)
+triangle_fan_debug(struct gl_renderer *gr, int first, int count)
 {
-	struct weston_compositor *compositor = view->surface->compositor;
-	struct gl_renderer *gr = get_renderer(compositor);
 	int i;
 	GLushort *buffer;
 	GLushort *index;
@@ -602,8 +903,8 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 		*index++ = first + i;
 	}
 
-	glUseProgram(gr->solid_shader.program);
-	glUniform4fv(gr->solid_shader.color_uniform, 1,
+	glUseProgram(gr->shaders[SHADER_VARIANT_SOLID].program);
+	glUniform4fv(gr->shaders[SHADER_VARIANT_SOLID].color_uniform, 1,
 			color[color_idx++ % ARRAY_LENGTH(color)]);
 	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
 	glUseProgram(gr->current_shader->program);
@@ -611,48 +912,239 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 }
 
 static void
-repaint_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+use_shader(struct gl_renderer *gr, struct gl_shader *shader);
+
+static bool
+batch_compatible(struct gl_batch *batch, struct gl_shader *shader,
+		 struct gl_surface_state *gs, float alpha,
+		 GLint filter, bool blend)
 {
-	struct weston_compositor *ec = ev->surface->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v;
+	if (batch->shader != shader || batch->alpha != alpha ||
+	    batch->filter != filter || batch->blend != blend)
+		return false;
+
+	if (batch->gs == gs)
+		return true;
+
+	/* Surfaces in the same atlas page share the texture */
+	if (gs->atlas.page && batch->gs->atlas.page == gs->atlas.page)
+		return true;
+
+	/* Solid color surfaces only differ in their color uniform */
+	return batch->gs->buffer_type == BUFFER_TYPE_SOLID &&
+		gs->buffer_type == BUFFER_TYPE_SOLID &&
+		memcmp(batch->gs->color, gs->color, sizeof gs->color) == 0;
+}
+
+/* The textures a surface is drawn from, its own or its atlas page */
+static int
+surface_textures(struct gl_surface_state *gs, const GLuint **textures)
+{
+	if (gs->atlas.page) {
+		*textures = &gs->atlas.page->texture;
+		return 1;
+	}
+
+	*textures = gs->textures;
+	return gs->num_textures;
+}
+
+/* Adds the fans texture_region() produced for a view to the geometry of
+ * the frame, as indexed triangles. The fans are appended to the last
+ * batch if that has the same state. Indices are relative to the first
+ * vertex of their batch, which is why batches are limited to 65536
+ * vertices.
+ */
+static void
+batch_add_region(struct gl_renderer *gr, struct weston_view *ev,
+		 struct gl_view_state *vs, struct gl_shader *shader, GLint filter, bool blend,
+		 pixman_region32_t *region, pixman_region32_t *surf_region,
+		 struct gl_view_region *cache)
+{
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_batch *batch = NULL;
 	unsigned int *vtxcnt;
-	int i, first, nfans;
+	GLushort *index;
+	uint32_t vertex, base;
+	int i, k, n, first_fan, nfans;
+
+	vertex = gr->vertices.size / (4 * sizeof(GLfloat));
+	first_fan = gr->vtxcnt.size / sizeof *vtxcnt;
 
 	/* The final region to be painted is the intersection of
 	 * 'region' and 'surf_region'. However, 'region' is in the global
 	 * coordinates, and 'surf_region' is in the surface-local
-	 * coordinates. texture_region() will iterate over all pairs of
-	 * rectangles from both regions, compute the intersection
-	 * polygon for each pair, and store it as a triangle fan if
-	 * it has a non-zero area (at least 3 vertices, actually).
+	 * coordinates. The rectangles of 'surf_region' are transformed
+	 * once and kept in 'cache' while the view does not change.
+	 * texture_region() will iterate over all pairs of damage
+	 * rectangles and transformed surface rectangles, compute the
+	 * intersection polygon for each pair, and store it as a triangle
+	 * fan if it has a non-zero area (at least 3 vertices, actually).
 	 */
-	nfans = texture_region(ev, region, surf_region);
+	if (!cache->valid || !pixman_region32_equal(&cache->region, surf_region))
+		view_region_update(cache, ev, surf_region);
+
+	nfans = texture_region(ev, vs, region, cache);
+	vtxcnt = (unsigned int *) gr->vtxcnt.data + first_fan;
+
+	if (gr->batches.size > 0)
+		batch = (struct gl_batch *)
+			((char *) gr->batches.data + gr->batches.size) - 1;
+
+	for (i = 0; i < nfans; vertex += vtxcnt[i], i++) {
+		n = vtxcnt[i];
+
+		if (!batch ||
+		    !batch_compatible(batch, shader, gs, ev->alpha,
+				      filter, blend) ||
+		    batch->n_vertices + n > 65536) {
+			batch = wl_array_add(&gr->batches, sizeof *batch);
+			if (!batch)
+				return;
+
+			batch->shader = shader;
+			batch->gs = gs;
+			batch->alpha = ev->alpha;
+			batch->filter = filter;
+			batch->blend = blend;
+			batch->first_vertex = vertex;
+			batch->n_vertices = 0;
+			batch->first_index = gr->indices.size / sizeof *index;
+			batch->n_indices = 0;
+			batch->n_fans = 0;
+		}
 
-	v = gr->vertices.data;
-	vtxcnt = gr->vtxcnt.data;
+		index = wl_array_add(&gr->indices, (n - 2) * 3 * sizeof *index);
+		if (!index)
+			return;
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glEnableVertexAttribArray(0);
+		base = vertex - batch->first_vertex;
+		for (k = 1; k < n - 1; k++) {
+			*index++ = base;
+			*index++ = base + k;
+			*index++ = base + k + 1;
+		}
 
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
+		batch->n_vertices += n;
+		batch->n_indices += (n - 2) * 3;
+		batch->n_fans++;
+	}
+}
+
+static void
+batch_uniforms(struct gl_batch *batch, struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_shader *shader = batch->shader;
+	const GLuint *textures;
+	int i, n;
+
+	glUniformMatrix4fv(shader->proj_uniform,
+			   1, GL_FALSE, go->output_matrix.d);
+	glUniform4fv(shader->color_uniform, 1, batch->gs->color);
+	glUniform1f(shader->alpha_uniform, batch->alpha);
+
+	n = surface_textures(batch->gs, &textures);
+	for (i = 0; i < n; i++)
+		glUniform1i(shader->tex_uniforms[i], i);
+}
+
+/* Uploads the geometry gathered since the last flush into the streaming
+ * buffers and draws every batch with one call.
+ */
+static void
+batch_flush(struct gl_renderer *gr, struct weston_output *output)
+{
+	struct gl_batch *batch, debug_batch;
+	struct gl_surface_state *gs;
+	unsigned int *vtxcnt = gr->vtxcnt.data;
+	const GLsizei stride = 4 * sizeof(GLfloat);
+	const GLuint *textures;
+	uintptr_t offset;
+	int i, n, fan = 0, first;
+
+	if (gr->batches.size == 0)
+		goto out;
+
+	/* New storage every time, the GPU may still read the old one */
+	glBindBuffer(GL_ARRAY_BUFFER, gr->vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, gr->vertices.size, gr->vertices.data,
+		     GL_STREAM_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gr->index_buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, gr->indices.size,
+		     gr->indices.data, GL_STREAM_DRAW);
+
+	glEnableVertexAttribArray(0);
 	glEnableVertexAttribArray(1);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	/* The debug lines need the projection of the solid shader */
+	if (gr->fan_debug) {
+		debug_batch = *(struct gl_batch *) gr->batches.data;
+		debug_batch.shader = &gr->shaders[SHADER_VARIANT_SOLID];
+		use_shader(gr, &gr->shaders[SHADER_VARIANT_SOLID]);
+		batch_uniforms(&debug_batch, output);
+	}
+
+	wl_array_for_each(batch, &gr->batches) {
+		gs = batch->gs;
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
-			triangle_fan_debug(ev, first, vtxcnt[i]);
-		first += vtxcnt[i];
+		use_shader(gr, batch->shader);
+		batch_uniforms(batch, output);
+
+		n = surface_textures(gs, &textures);
+		for (i = 0; i < n; i++) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(gs->target, textures[i]);
+			glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER,
+					batch->filter);
+			glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER,
+					batch->filter);
+		}
+
+		if (batch->blend)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
+
+		/* position and texcoord of the first vertex of the batch */
+		offset = (uintptr_t) batch->first_vertex * stride;
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride,
+				      (void *) offset);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+				      (void *) (offset + 2 * sizeof(GLfloat)));
+
+		offset = (uintptr_t) batch->first_index * sizeof(GLushort);
+		glDrawElements(GL_TRIANGLES, batch->n_indices,
+			       GL_UNSIGNED_SHORT, (void *) offset);
+		gr->render_stats.draw_calls++;
+
+		if (gr->fan_debug) {
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			for (i = 0, first = 0; i < batch->n_fans; i++) {
+				triangle_fan_debug(gr, first, vtxcnt[fan]);
+				first += vtxcnt[fan++];
+			}
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,
+				     gr->index_buffer);
+		}
 	}
 
+	gr->render_stats.batches += gr->batches.size / sizeof *batch;
+	gr->render_stats.vertices += gr->vertices.size / stride;
+
 	glDisableVertexAttribArray(1);
 	glDisableVertexAttribArray(0);
 
+	/* The borders and other draws use client side arrays */
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+out:
 	gr->vertices.size = 0;
 	gr->vtxcnt.size = 0;
+	gr->indices.size = 0;
+	gr->batches.size = 0;
 }
 
 static int
@@ -679,22 +1171,22 @@ use_output(struct weston_output *output)
 }
 
 static int
-shader_init(struct gl_shader *shader, struct gl_renderer *gr,
-		   const char *vertex_source, const char *fragment_source);
+shader_init(struct gl_shader *shader, struct gl_renderer *gr);
 
 static void
-use_shader(struct gl_renderer *gr, struct gl_shader *shader)
+ensure_shader(struct gl_renderer *gr, struct gl_shader *shader)
 {
-	if (!shader->program) {
-		int ret;
+	if (shader->program)
+		return;
 
-		ret =  shader_init(shader, gr,
-				   shader->vertex_source,
-				   shader->fragment_source);
+	if (shader_init(shader, gr) < 0)
+		weston_log("warning: failed to compile shader\n");
+}
 
-		if (ret < 0)
-			weston_log("warning: failed to compile shader\n");
-	}
+static void
+use_shader(struct gl_renderer *gr, struct gl_shader *shader)
+{
+	ensure_shader(gr, shader);
 
 	if (gr->current_shader == shader)
 		return;
@@ -702,24 +1194,6 @@ use_shader(struct gl_renderer *gr, struct gl_shader *shader)
 	gr->current_shader = shader;
 }
 
-static void
-shader_uniforms(struct gl_shader *shader,
-		struct weston_view *view,
-		struct weston_output *output)
-{
-	int i;
-	struct gl_surface_state *gs = get_surface_state(view->surface);
-	struct gl_output_state *go = get_output_state(output);
-
-	glUniformMatrix4fv(shader->proj_uniform,
-			   1, GL_FALSE, go->output_matrix.d);
-	glUniform4fv(shader->color_uniform, 1, gs->color);
-	glUniform1f(shader->alpha_uniform, view->alpha);
-
-	for (i = 0; i < gs->num_textures; i++)
-		glUniform1i(shader->tex_uniforms[i], i);
-}
-
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
 	  pixman_region32_t *damage) /* in global coordinates */
@@ -728,13 +1202,15 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
 	/* repaint bounding region in global coordinates: */
-	pixman_region32_t repaint;
+	pixman_region32_t *repaint;
 	/* opaque region in surface coordinates: */
-	pixman_region32_t surface_opaque;
+	pixman_region32_t *surface_opaque;
 	/* non-opaque region in surface coordinates: */
-	pixman_region32_t surface_blend;
+	pixman_region32_t *surface_blend;
+	pixman_region32_t surface_rect, fallback, *tmp;
+	struct gl_view_state *vs, uncached;
+	struct gl_shader *shader;
 	GLint filter;
-	int i;
 
 	/* In case of a runtime switch of renderers, we may not have received
 	 * an attach for this surface since the switch. In that case we don't
@@ -742,23 +1218,33 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!gs->shader)
 		return;
 
-	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &ev->transform.boundingbox, damage);
-	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
+	repaint = weston_output_get_scratch_region(output);
+	tmp = weston_output_get_scratch_region(output);
+	if (repaint && tmp) {
+		pixman_region32_intersect(tmp, &ev->transform.boundingbox,
+					  damage);
+		pixman_region32_subtract(repaint, tmp, &ev->clip);
+	} else {
+		/* Out of memory; the views above are drawn later, over
+		 * what is not clipped here. */
+		repaint = damage;
+	}
 
-	if (!pixman_region32_not_empty(&repaint))
-		goto out;
+	if (!pixman_region32_not_empty(repaint))
+		return;
 
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	gr->render_stats.views++;
 
-	if (gr->fan_debug) {
-		use_shader(gr, &gr->solid_shader);
-		shader_uniforms(&gr->solid_shader, ev, output);
+	/* Without a view state the geometry is computed for this frame
+	 * only. */
+	vs = get_view_state(ev);
+	if (!vs) {
+		memset(&uncached, 0, sizeof uncached);
+		view_region_init(&uncached.opaque);
+		view_region_init(&uncached.blend);
+		vs = &uncached;
 	}
-
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
+	view_state_validate(vs, ev, gs);
 
 	if (ev->transform.enabled || output->zoom.active ||
 	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
@@ -766,72 +1252,79 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	else
 		filter = GL_NEAREST;
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
-	}
-
-	/* blended region is whole surface minus opaque region: */
-	pixman_region32_init_rect(&surface_blend, 0, 0,
+	/* blended region is whole surface minus opaque region. When
+	 * the pool is out of memory, the local regions are worked on
+	 * in place instead. */
+	pixman_region32_init_rect(&surface_rect, 0, 0,
 				  ev->surface->width, ev->surface->height);
-	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_blend, &surface_blend,
+	pixman_region32_init(&fallback);
+	surface_blend = weston_output_get_scratch_region(output);
+	if (!surface_blend)
+		surface_blend = &surface_rect;
+	if (ev->geometry.scissor_enabled) {
+		tmp = weston_output_get_scratch_region(output);
+		if (!tmp)
+			tmp = &surface_rect;
+		pixman_region32_intersect(tmp, &surface_rect,
 					  &ev->geometry.scissor);
-	pixman_region32_subtract(&surface_blend, &surface_blend,
-				 &ev->surface->opaque);
+		pixman_region32_subtract(surface_blend, tmp,
+					 &ev->surface->opaque);
+	} else {
+		pixman_region32_subtract(surface_blend, &surface_rect,
+					 &ev->surface->opaque);
+	}
 
 	/* XXX: Should we be using ev->transform.opaque here? */
-	pixman_region32_init(&surface_opaque);
-	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_opaque,
+	if (ev->geometry.scissor_enabled) {
+		surface_opaque = weston_output_get_scratch_region(output);
+		if (!surface_opaque)
+			surface_opaque = &fallback;
+		pixman_region32_intersect(surface_opaque,
 					  &ev->surface->opaque,
 					  &ev->geometry.scissor);
-	else
-		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
-
-	if (pixman_region32_not_empty(&surface_opaque)) {
-		if (gs->shader == &gr->texture_shader_rgba) {
-			/* Special case for RGBA textures with possibly
-			 * bad data in alpha channel: use the shader
-			 * that forces texture alpha = 1.0.
-			 * Xwayland surfaces need this.
-			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
-		}
+	} else {
+		surface_opaque = &ev->surface->opaque;
+	}
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
+	if (pixman_region32_not_empty(surface_opaque)) {
+		/* Special case for RGBA textures with possibly
+		 * bad data in alpha channel: use the shader
+		 * that forces texture alpha = 1.0.
+		 * Xwayland surfaces need this.
+		 */
+		if (gs->shader == &gr->shaders[SHADER_VARIANT_RGBA])
+			shader = &gr->shaders[SHADER_VARIANT_RGBX];
 		else
-			glDisable(GL_BLEND);
-
-		repaint_region(ev, &repaint, &surface_opaque);
-	}
+			shader = gs->shader;
 
-	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+		batch_add_region(gr, ev, vs, shader, filter, ev->alpha < 1.0,
+				 repaint, surface_opaque, &vs->opaque);
 	}
 
-	pixman_region32_fini(&surface_blend);
-	pixman_region32_fini(&surface_opaque);
+	if (pixman_region32_not_empty(surface_blend))
+		batch_add_region(gr, ev, vs, gs->shader, filter, true,
+				 repaint, surface_blend, &vs->blend);
 
-out:
-	pixman_region32_fini(&repaint);
+	if (vs == &uncached) {
+		view_region_fini(&uncached.opaque);
+		view_region_fini(&uncached.blend);
+	}
+	pixman_region32_fini(&fallback);
+	pixman_region32_fini(&surface_rect);
 }
 
 static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	struct weston_view **views = output->view_list.data;
+	int i = output->view_list.size / sizeof *views;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	while (i-- > 0)
+		if (views[i]->plane == &compositor->primary_plane)
+			draw_view(views[i], output, damage);
+
+	batch_flush(get_renderer(compositor), output);
 }
 
 static void
@@ -921,7 +1414,7 @@ draw_output_borders(struct weston_output *output,
 {
 	struct gl_output_state *go = get_output_state(output);
 	struct gl_renderer *gr = get_renderer(output->compositor);
-	struct gl_shader *shader = &gr->texture_shader_rgba;
+	struct gl_shader *shader = &gr->shaders[SHADER_VARIANT_RGBA];
 	struct gl_border_image *top, *bottom, *left, *right;
 	struct weston_matrix matrix;
 	int full_width, full_height;
@@ -1130,7 +1623,10 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_union(&total_damage, &buffer_damage, output_damage);
 	border_damage |= go->border_status;
 
+	memset(&gr->render_stats, 0, sizeof gr->render_stats);
 	repaint_views(output, &total_damage);
+	TL_POINT("renderer_views_drawn", TLP_OUTPUT(output),
+		 TLP_RENDER_STATS(&gr->render_stats), TLP_END);
 
 	pixman_region32_fini(&total_damage);
 	pixman_region32_fini(&buffer_damage);
@@ -1221,7 +1717,804 @@ gl_renderer_read_pixels(struct weston_output *output,
 	glReadPixels(x, y, width, height, gl_format,
 		     GL_UNSIGNED_BYTE, pixels);
 
-	return 0;
+	return 0;
+}
+
+/* Copies the pixels of a read to the caller, once the GPU wrote them or
+ * waiting for that if 'wait' is set. Returns false if still pending.
+ */
+static bool
+gl_read_finish(struct gl_renderer *gr, struct gl_read *read, bool wait)
+{
+	void *src;
+	int status = -1;
+
+#ifdef EGL_KHR_fence_sync
+	if (read->sync != EGL_NO_SYNC_KHR) {
+		if (!wait &&
+		    gr->client_wait_sync(gr->egl_display, read->sync, 0, 0) ==
+		    EGL_TIMEOUT_EXPIRED_KHR)
+			return false;
+
+		gr->destroy_sync(gr->egl_display, read->sync);
+	}
+#endif
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, read->pbo);
+	src = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0, read->size,
+				   GL_MAP_READ_BIT);
+	if (src) {
+		memcpy(read->pixels, src, read->size);
+		if (gr->unmap_buffer(GL_PIXEL_PACK_BUFFER))
+			status = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glDeleteBuffers(1, &read->pbo);
+
+	wl_list_remove(&read->link);
+	read->done(read->output, status, read->data);
+	free(read);
+
+	return true;
+}
+
+/* Finishes the reads that are done, in the order they were started. All
+ * reads of 'output' are finished if it is not NULL, waiting for them.
+ */
+static void
+gl_renderer_finish_reads(struct gl_renderer *gr, struct weston_output *output)
+{
+	struct gl_read *read, *next;
+
+	wl_list_for_each_safe(read, next, &gr->reads, link) {
+		if (output && read->output == output)
+			gl_read_finish(gr, read, true);
+		else if (!gl_read_finish(gr, read, false) && !output)
+			break;
+	}
+
+	if (!wl_list_empty(&gr->reads))
+		wl_event_source_timer_update(gr->read_timer,
+					     GL_READ_POLL_MSEC);
+}
+
+static int
+read_timer_handler(void *data)
+{
+	struct gl_renderer *gr = data;
+
+	gl_renderer_finish_reads(gr, NULL);
+
+	return 0;
+}
+
+/* Reads through a pixel pack buffer, so that glReadPixels() returns
+ * before the GPU finished the frame. The pixels are copied out when the
+ * fence after the read signals, or on the next poll without fences.
+ */
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format, void *pixels,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_func_t done, void *data)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_output_state *go = get_output_state(output);
+	struct wl_event_loop *loop;
+	struct gl_read *read;
+	GLenum gl_format;
+
+	if (!gr->has_pbo_upload) {
+		if (gl_renderer_read_pixels(output, format, pixels,
+					    x, y, width, height) < 0)
+			return -1;
+
+		done(output, 0, data);
+		return 0;
+	}
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		gl_format = GL_BGRA_EXT;
+		break;
+	case PIXMAN_a8b8g8r8:
+		gl_format = GL_RGBA;
+		break;
+	default:
+		return -1;
+	}
+
+	if (!gr->read_timer) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		gr->read_timer = wl_event_loop_add_timer(loop,
+							 read_timer_handler,
+							 gr);
+		if (!gr->read_timer)
+			return -1;
+	}
+
+	if (use_output(output) < 0)
+		return -1;
+
+	read = zalloc(sizeof *read);
+	if (!read)
+		return -1;
+
+	read->output = output;
+	read->pixels = pixels;
+	read->size = (size_t) width * height * 4;
+	read->done = done;
+	read->data = data;
+
+	glGenBuffers(1, &read->pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, read->pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, read->size, NULL, GL_STREAM_READ);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+#ifdef EGL_KHR_fence_sync
+	read->sync = EGL_NO_SYNC_KHR;
+	if (gr->has_fence_sync) {
+		read->sync = gr->create_sync(gr->egl_display,
+					     EGL_SYNC_FENCE_KHR, NULL);
+		/* Make sure the fence gets to the GPU at all */
+		glFlush();
+	}
+#endif
+
+	wl_list_insert(gr->reads.prev, &read->link);
+	wl_event_source_timer_update(gr->read_timer, GL_READ_POLL_MSEC);
+
+	return 0;
+}
+
+static int64_t
+box_area(const pixman_box32_t *box)
+{
+	return (int64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+/* Merges neighbouring boxes while the merged box is at most twice the
+ * area it replaces. If that still leaves too many boxes, everything is
+ * uploaded as one box. Returns the number of boxes left.
+ */
+static int
+coalesce_upload_boxes(pixman_box32_t *boxes, int n)
+{
+	pixman_box32_t merged;
+	int64_t covered = 0;
+	int i, count = 0;
+
+	for (i = 0; i < n; i++) {
+		if (count > 0) {
+			merged.x1 = MIN(boxes[count - 1].x1, boxes[i].x1);
+			merged.y1 = MIN(boxes[count - 1].y1, boxes[i].y1);
+			merged.x2 = MAX(boxes[count - 1].x2, boxes[i].x2);
+			merged.y2 = MAX(boxes[count - 1].y2, boxes[i].y2);
+
+			if (box_area(&merged) <=
+			    2 * (covered + box_area(&boxes[i]))) {
+				boxes[count - 1] = merged;
+				covered += box_area(&boxes[i]);
+				continue;
+			}
+		}
+
+		covered = box_area(&boxes[i]);
+		boxes[count++] = boxes[i];
+	}
+
+	if (count > GL_UPLOAD_MAX_BOXES) {
+		for (i = 1; i < count; i++) {
+			boxes[0].x1 = MIN(boxes[0].x1, boxes[i].x1);
+			boxes[0].y1 = MIN(boxes[0].y1, boxes[i].y1);
+			boxes[0].x2 = MAX(boxes[0].x2, boxes[i].x2);
+			boxes[0].y2 = MAX(boxes[0].y2, boxes[i].y2);
+		}
+		count = 1;
+	}
+
+	return count;
+}
+
+static int
+gl_format_bpp(GLenum format, GLenum type)
+{
+	if (type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (format) {
+	case GL_LUMINANCE:
+		return 1;
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+/* Rows of the 1 and 2 byte planes are only as aligned as the client
+ * made them, while GL assumes 4 bytes unless told otherwise. Uploads
+ * straight from the shm buffer set this per plane and restore the
+ * default of 4 when done.
+ */
+static void
+plane_unpack_alignment(struct gl_surface_state *gs, int plane)
+{
+	int bpp = gl_format_bpp(gs->gl_format[plane], gs->gl_pixel_type);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, bpp < 4 ? 1 : 4);
+}
+
+/* Rows of a plane, the subsampled planes of odd heights rounding up */
+static int
+plane_height(struct gl_surface_state *gs, int plane)
+{
+	return (gs->height + gs->vsub[plane] - 1) / gs->vsub[plane];
+}
+
+/* The texels of a plane covering 'box', given in buffer pixels */
+static void
+plane_box(struct gl_surface_state *gs, int plane,
+	  const pixman_box32_t *box, pixman_box32_t *out)
+{
+	int hsub = gs->hsub[plane];
+	int vsub = gs->vsub[plane];
+
+	out->x1 = box->x1 / hsub;
+	out->y1 = box->y1 / vsub;
+	out->x2 = MIN((box->x2 + hsub - 1) / hsub, gs->pitch / hsub);
+	out->y2 = MIN((box->y2 + vsub - 1) / vsub, (gs->height + vsub - 1) / vsub);
+}
+
+/* Copies the boxes of a plane of the shm buffer into the next pixel
+ * buffer object, rows packed at 4 byte alignment, and queues the texture
+ * uploads from it. The GPU reads the pixels later, while the client
+ * buffer can be released as soon as this returns.
+ */
+static bool
+upload_plane_pbo(struct gl_renderer *gr, struct gl_surface_state *gs,
+		 struct wl_shm_buffer *shm_buffer, int plane,
+		 const pixman_box32_t *buffer_boxes, int n, bool full)
+{
+	int bpp = gl_format_bpp(gs->gl_format[plane], gs->gl_pixel_type);
+	int stride = gs->pitch / gs->hsub[plane] * bpp;
+	pixman_box32_t boxes[GL_UPLOAD_MAX_BOXES];
+	size_t size = 0, offset = 0, row;
+	uint8_t *data, *dst;
+	int i, y, w;
+
+	assert(n <= GL_UPLOAD_MAX_BOXES);
+
+	for (i = 0; i < n; i++) {
+		plane_box(gs, plane, &buffer_boxes[i], &boxes[i]);
+		size += ((boxes[i].x2 - boxes[i].x1) * bpp + 3) / 4 * 4 *
+			(boxes[i].y2 - boxes[i].y1);
+	}
+	if (size == 0)
+		return true;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER,
+		     gr->upload_pbos[gr->upload_pbo_next]);
+	gr->upload_pbo_next = (gr->upload_pbo_next + 1) % GL_UPLOAD_PBO_COUNT;
+
+	/* Orphan the storage, the GPU may still be reading it */
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	dst = gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size,
+				   GL_MAP_WRITE_BIT |
+				   GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!dst) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	data = (uint8_t *) wl_shm_buffer_get_data(shm_buffer) +
+		gs->offset[plane];
+	wl_shm_buffer_begin_access(shm_buffer);
+	for (i = 0; i < n; i++) {
+		w = (boxes[i].x2 - boxes[i].x1) * bpp;
+		row = (w + 3) / 4 * 4;
+		for (y = boxes[i].y1; y < boxes[i].y2; y++) {
+			memcpy(dst, data + y * stride + boxes[i].x1 * bpp, w);
+			dst += row;
+		}
+	}
+	wl_shm_buffer_end_access(shm_buffer);
+
+	if (!gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER)) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+
+	if (full) {
+		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format[plane],
+			     gs->pitch / gs->hsub[plane],
+			     plane_height(gs, plane), 0,
+			     gs->gl_format[plane], gs->gl_pixel_type, NULL);
+	} else {
+		for (i = 0; i < n; i++) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0,
+					boxes[i].x1, boxes[i].y1,
+					boxes[i].x2 - boxes[i].x1,
+					boxes[i].y2 - boxes[i].y1,
+					gs->gl_format[plane],
+					gs->gl_pixel_type,
+					(void *) offset);
+			offset += ((boxes[i].x2 - boxes[i].x1) * bpp + 3) /
+				4 * 4 * (boxes[i].y2 - boxes[i].y1);
+		}
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return true;
+}
+
+static void
+atlas_log(struct gl_renderer *gr, const char *event)
+{
+	struct gl_atlas_stats *stats = &gr->atlas_stats;
+
+	weston_log("GL atlas: %s, %d pages, %u buffers placed, %u released, "
+		   "%u did not fit, %u shelves reclaimed, %u pages compacted\n",
+		   event, gr->atlas_page_count, stats->placed,
+		   stats->released, stats->failed, stats->shelves_reclaimed,
+		   stats->pages_compacted);
+}
+
+static GLuint
+atlas_texture_create(void)
+{
+	GLuint texture;
+
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
+		     GL_ATLAS_PAGE_SIZE, GL_ATLAS_PAGE_SIZE, 0,
+		     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return texture;
+}
+
+static struct gl_atlas_page *
+atlas_page_create(struct gl_renderer *gr)
+{
+	struct gl_atlas_page *page;
+
+	page = zalloc(sizeof *page);
+	if (!page)
+		return NULL;
+
+	page->texture = atlas_texture_create();
+	wl_list_init(&page->shelves);
+	wl_list_init(&page->slots);
+	wl_list_insert(gr->atlas_pages.prev, &page->link);
+	gr->atlas_page_count++;
+
+	atlas_log(gr, "page created");
+
+	return page;
+}
+
+static void
+atlas_shelves_release(struct wl_list *shelves)
+{
+	struct gl_atlas_shelf *shelf, *next;
+
+	wl_list_for_each_safe(shelf, next, shelves, link)
+		free(shelf);
+	wl_list_init(shelves);
+}
+
+static void
+atlas_page_destroy(struct gl_renderer *gr, struct gl_atlas_page *page)
+{
+	assert(wl_list_empty(&page->slots));
+
+	glDeleteTextures(1, &page->texture);
+	atlas_shelves_release(&page->shelves);
+	wl_list_remove(&page->link);
+	gr->atlas_page_count--;
+	free(page);
+}
+
+/* Finds room for a w by h box among the shelves, or opens a new shelf
+ * at 'bottom', the first row below them. Returns the shelf and the
+ * column of the box in 'x'.
+ */
+static struct gl_atlas_shelf *
+atlas_shelf_place(struct wl_list *shelves, int *bottom, int w, int h,
+		  int *x)
+{
+	struct gl_atlas_shelf *shelf;
+
+	wl_list_for_each(shelf, shelves, link) {
+		if (shelf->height < h || GL_ATLAS_PAGE_SIZE - shelf->x < w)
+			continue;
+
+		/* Leave tall shelves to tall buffers, unless empty */
+		if (shelf->n_slots > 0 && shelf->height > h + h / 2)
+			continue;
+
+		goto found;
+	}
+
+	if (GL_ATLAS_PAGE_SIZE - *bottom < h)
+		return NULL;
+
+	shelf = zalloc(sizeof *shelf);
+	if (!shelf)
+		return NULL;
+
+	shelf->y = *bottom;
+	shelf->height = h;
+	*bottom += h;
+	wl_list_insert(shelves->prev, &shelf->link);
+
+found:
+	*x = shelf->x;
+	shelf->x += w;
+	shelf->n_slots++;
+
+	return shelf;
+}
+
+static bool
+atlas_page_place(struct gl_atlas_page *page, struct gl_atlas_slot *slot,
+		 int width, int height)
+{
+	struct gl_atlas_shelf *shelf;
+	int x;
+
+	shelf = atlas_shelf_place(&page->shelves, &page->y,
+				  width + 2 * GL_ATLAS_GUTTER,
+				  height + 2 * GL_ATLAS_GUTTER, &x);
+	if (!shelf)
+		return false;
+
+	slot->page = page;
+	slot->shelf = shelf;
+	slot->x = x + GL_ATLAS_GUTTER;
+	slot->y = shelf->y + GL_ATLAS_GUTTER;
+	slot->width = width;
+	slot->height = height;
+	wl_list_insert(&page->slots, &slot->link);
+
+	return true;
+}
+
+static int
+atlas_slot_compare(const void *a, const void *b)
+{
+	const struct gl_atlas_slot *sa = *(const struct gl_atlas_slot **) a;
+	const struct gl_atlas_slot *sb = *(const struct gl_atlas_slot **) b;
+
+	return sb->height - sa->height;
+}
+
+/* Repacks the slots of a page, tallest first, into a new texture. This
+ * gives back the holes released buffers left in the shelves. The
+ * contents are copied on the GPU, the buffers are long gone.
+ */
+static bool
+atlas_page_compact(struct gl_renderer *gr, struct gl_atlas_page *page)
+{
+	struct gl_atlas_slot **slots, *slot;
+	struct gl_atlas_shelf **shelves;
+	struct wl_list new_shelves;
+	int *columns;
+	int i, n, bottom = 0;
+	GLuint fbo, texture;
+	GLenum status;
+	bool ret = false;
+
+	n = wl_list_length(&page->slots);
+	slots = calloc(n, sizeof *slots);
+	shelves = calloc(n, sizeof *shelves);
+	columns = calloc(n, sizeof *columns);
+	wl_list_init(&new_shelves);
+	if (!slots || !shelves || !columns)
+		goto out;
+
+	i = 0;
+	wl_list_for_each(slot, &page->slots, link)
+		slots[i++] = slot;
+	qsort(slots, n, sizeof *slots, atlas_slot_compare);
+
+	for (i = 0; i < n; i++) {
+		shelves[i] = atlas_shelf_place(&new_shelves, &bottom,
+					slots[i]->width + 2 * GL_ATLAS_GUTTER,
+					slots[i]->height + 2 * GL_ATLAS_GUTTER,
+					&columns[i]);
+		if (!shelves[i])
+			goto out;
+	}
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, page->texture, 0);
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		weston_log("GL atlas: cannot compact, fbo error: %#x\n",
+			   status);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &fbo);
+		goto out;
+	}
+
+	texture = atlas_texture_create();
+	glBindTexture(GL_TEXTURE_2D, texture);
+	for (i = 0; i < n; i++) {
+		slot = slots[i];
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0,
+				    columns[i], shelves[i]->y,
+				    slot->x - GL_ATLAS_GUTTER,
+				    slot->y - GL_ATLAS_GUTTER,
+				    slot->width + 2 * GL_ATLAS_GUTTER,
+				    slot->height + 2 * GL_ATLAS_GUTTER);
+
+		slot->shelf = shelves[i];
+		slot->x = columns[i] + GL_ATLAS_GUTTER;
+		slot->y = shelves[i]->y + GL_ATLAS_GUTTER;
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(1, &page->texture);
+	page->texture = texture;
+
+	atlas_shelves_release(&page->shelves);
+	wl_list_insert_list(&page->shelves, &new_shelves);
+	wl_list_init(&new_shelves);
+	page->y = bottom;
+
+	gr->atlas_stats.pages_compacted++;
+	atlas_log(gr, "page compacted");
+	ret = true;
+
+out:
+	atlas_shelves_release(&new_shelves);
+	free(columns);
+	free(shelves);
+	free(slots);
+
+	return ret;
+}
+
+static int
+atlas_page_used(struct gl_atlas_page *page)
+{
+	struct gl_atlas_slot *slot;
+	int area = 0;
+
+	wl_list_for_each(slot, &page->slots, link)
+		area += (slot->width + 2 * GL_ATLAS_GUTTER) *
+			(slot->height + 2 * GL_ATLAS_GUTTER);
+
+	return area;
+}
+
+static bool
+atlas_alloc(struct gl_renderer *gr, struct gl_surface_state *gs,
+	    int width, int height)
+{
+	struct gl_atlas_page *page, *emptiest = NULL;
+	int area, used, least = GL_ATLAS_PAGE_SIZE * GL_ATLAS_PAGE_SIZE;
+
+	wl_list_for_each(page, &gr->atlas_pages, link) {
+		if (atlas_page_place(page, &gs->atlas, width, height))
+			goto placed;
+
+		used = atlas_page_used(page);
+		if (used < least) {
+			least = used;
+			emptiest = page;
+		}
+	}
+
+	if (gr->atlas_page_count < GL_ATLAS_MAX_PAGES) {
+		page = atlas_page_create(gr);
+		if (page && atlas_page_place(page, &gs->atlas, width, height))
+			goto placed;
+	} else if (emptiest) {
+		/* All pages in use, compact the one with the most room
+		 * if that room would be enough */
+		area = (width + 2 * GL_ATLAS_GUTTER) *
+			(height + 2 * GL_ATLAS_GUTTER);
+		if (GL_ATLAS_PAGE_SIZE * GL_ATLAS_PAGE_SIZE - least >= area &&
+		    atlas_page_compact(gr, emptiest) &&
+		    atlas_page_place(emptiest, &gs->atlas, width, height))
+			goto placed;
+	}
+
+	gr->atlas_stats.failed++;
+	return false;
+
+placed:
+	gr->atlas_stats.placed++;
+	return true;
+}
+
+static void
+atlas_release(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	struct gl_atlas_slot *slot = &gs->atlas;
+	struct gl_atlas_page *page = slot->page;
+	struct gl_atlas_shelf *shelf = slot->shelf;
+
+	if (!page)
+		return;
+
+	wl_list_remove(&slot->link);
+	slot->page = NULL;
+	slot->shelf = NULL;
+	gr->atlas_stats.released++;
+
+	/* Only a shelf without buffers gets its columns back */
+	if (--shelf->n_slots == 0) {
+		shelf->x = 0;
+		gr->atlas_stats.shelves_reclaimed++;
+	}
+
+	/* and empty shelves at the bottom give their rows back */
+	while (!wl_list_empty(&page->shelves)) {
+		shelf = container_of(page->shelves.prev,
+				     struct gl_atlas_shelf, link);
+		if (shelf->n_slots > 0)
+			break;
+
+		page->y = shelf->y;
+		wl_list_remove(&shelf->link);
+		free(shelf);
+	}
+
+	/* Keep one page around for the next cursor or icon */
+	if (wl_list_empty(&page->slots) && gr->atlas_page_count > 1) {
+		atlas_page_destroy(gr, page);
+		atlas_log(gr, "page released");
+	}
+}
+
+/* Moves a shm buffer in or out of the atlas when its size or format
+ * changed. Returns true if the texture contents need to be uploaded
+ * again.
+ */
+static bool
+atlas_update(struct gl_renderer *gr, struct gl_surface_state *gs,
+	     struct weston_buffer *buffer, int num_planes, bool changed)
+{
+	struct gl_atlas_slot *slot = &gs->atlas;
+	bool fits;
+
+	/* atlas_upload() copies whole rows of width * 4 bytes, while
+	 * wl_shm only checks that the stride covers the width */
+	fits = gr->atlas_max_size > 0 && num_planes == 1 &&
+		gs->gl_format[0] == GL_BGRA_EXT &&
+		buffer->width <= gr->atlas_max_size &&
+		buffer->height <= gr->atlas_max_size &&
+		wl_shm_buffer_get_stride(buffer->shm_buffer) >=
+		buffer->width * 4;
+
+	if (slot->page && fits &&
+	    slot->width == buffer->width && slot->height == buffer->height)
+		return false;
+
+	if (!slot->page && !changed)
+		return false;
+
+	atlas_release(gr, gs);
+	if (fits)
+		atlas_alloc(gr, gs, buffer->width, buffer->height);
+
+	return true;
+}
+
+/* Uploads the whole buffer with the gutter around it in one go. Atlas
+ * buffers are small enough for that to be cheaper than one upload per
+ * damage rectangle.
+ */
+static void
+atlas_upload(struct gl_renderer *gr, struct gl_surface_state *gs,
+	     struct wl_shm_buffer *shm_buffer)
+{
+	struct gl_atlas_slot *slot = &gs->atlas;
+	const int g = GL_ATLAS_GUTTER;
+	int width = slot->width + 2 * g;
+	int height = slot->height + 2 * g;
+	int stride = wl_shm_buffer_get_stride(shm_buffer);
+	uint8_t *data, *src, *dst, *row;
+	int x, y, sy;
+
+	gr->atlas_scratch.size = 0;
+	dst = wl_array_add(&gr->atlas_scratch, width * height * 4);
+	if (!dst)
+		return;
+
+	data = wl_shm_buffer_get_data(shm_buffer);
+	wl_shm_buffer_begin_access(shm_buffer);
+	for (y = 0; y < height; y++) {
+		sy = y < g ? 0 : y - g;
+		if (sy >= slot->height)
+			sy = slot->height - 1;
+		src = data + sy * stride;
+		row = dst + y * width * 4;
+
+		memcpy(row + g * 4, src, slot->width * 4);
+		for (x = 0; x < g; x++) {
+			memcpy(row + x * 4, src, 4);
+			memcpy(row + (width - 1 - x) * 4,
+			       src + (slot->width - 1) * 4, 4);
+		}
+	}
+	wl_shm_buffer_end_access(shm_buffer);
+
+	if (gr->has_unpack_subimage || gr->has_pbo_upload) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, slot->page->texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, slot->x - g, slot->y - g,
+			width, height, GL_BGRA_EXT, GL_UNSIGNED_BYTE, dst);
+}
+
+static bool
+flush_damage_pbo(struct weston_surface *surface)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct wl_shm_buffer *shm_buffer = gs->buffer_ref.buffer->shm_buffer;
+	pixman_box32_t *rectangles, *boxes;
+	pixman_box32_t full_box;
+	bool full = gs->needs_full_upload;
+	int i, j, n;
+
+	if (full) {
+		full_box.x1 = 0;
+		full_box.y1 = 0;
+		full_box.x2 = gs->pitch;
+		full_box.y2 = gs->height;
+		boxes = &full_box;
+		n = 1;
+	} else {
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+
+		gr->upload_boxes.size = 0;
+		boxes = wl_array_add(&gr->upload_boxes, n * sizeof *boxes);
+		if (!boxes)
+			return false;
+
+		for (i = 0; i < n; i++)
+			boxes[i] = weston_surface_to_buffer_rect(surface,
+								 rectangles[i]);
+
+		n = coalesce_upload_boxes(boxes, n);
+	}
+
+	for (j = 0; j < gs->num_textures; j++) {
+		glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+		if (!upload_plane_pbo(gr, gs, shm_buffer, j, boxes, n, full))
+			return false;
+	}
+
+	return true;
 }
 
 static void
@@ -1232,10 +2525,11 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct weston_buffer *buffer = gs->buffer_ref.buffer;
 	struct weston_view *view;
 	bool texture_used;
+	uint8_t *data;
+	int j;
 
 #ifdef GL_EXT_unpack_subimage
 	pixman_box32_t *rectangles;
-	void *data;
 	int i, n;
 #endif
 
@@ -1264,48 +2558,79 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	    !gs->needs_full_upload)
 		goto done;
 
-	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+	if (gs->atlas.page) {
+		atlas_upload(gr, gs, buffer->shm_buffer);
+		goto done;
+	}
+
+	if (gr->has_pbo_upload && flush_damage_pbo(surface))
+		goto done;
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
 
 	if (!gr->has_unpack_subimage) {
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
-			     gs->pitch, buffer->height, 0,
-			     gs->gl_format, gs->gl_pixel_type,
-			     wl_shm_buffer_get_data(buffer->shm_buffer));
+		for (j = 0; j < gs->num_textures; j++) {
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			plane_unpack_alignment(gs, j);
+			glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format[j],
+				     gs->pitch / gs->hsub[j],
+				     plane_height(gs, j), 0,
+				     gs->gl_format[j], gs->gl_pixel_type,
+				     data + gs->offset[j]);
+		}
 		wl_shm_buffer_end_access(buffer->shm_buffer);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
 		goto done;
 	}
 
 #ifdef GL_EXT_unpack_subimage
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
-	data = wl_shm_buffer_get_data(buffer->shm_buffer);
-
 	if (gs->needs_full_upload) {
 		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
 		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
-			     gs->pitch, buffer->height, 0,
-			     gs->gl_format, gs->gl_pixel_type, data);
+		for (j = 0; j < gs->num_textures; j++) {
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT,
+				      gs->pitch / gs->hsub[j]);
+			plane_unpack_alignment(gs, j);
+			glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format[j],
+				     gs->pitch / gs->hsub[j],
+				     plane_height(gs, j), 0,
+				     gs->gl_format[j], gs->gl_pixel_type,
+				     data + gs->offset[j]);
+		}
 		wl_shm_buffer_end_access(buffer->shm_buffer);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 		goto done;
 	}
 
 	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
 	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < n; i++) {
-		pixman_box32_t r;
-
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
-
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
-				r.x2 - r.x1, r.y2 - r.y1,
-				gs->gl_format, gs->gl_pixel_type, data);
+	for (j = 0; j < gs->num_textures; j++) {
+		glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT,
+			      gs->pitch / gs->hsub[j]);
+		plane_unpack_alignment(gs, j);
+
+		for (i = 0; i < n; i++) {
+			pixman_box32_t r;
+
+			r = weston_surface_to_buffer_rect(surface,
+							  rectangles[i]);
+			plane_box(gs, j, &r, &r);
+
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
+					r.x2 - r.x1, r.y2 - r.y1,
+					gs->gl_format[j], gs->gl_pixel_type,
+					data + gs->offset[j]);
+		}
 	}
 	wl_shm_buffer_end_access(buffer->shm_buffer);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 #endif
 
 done:
@@ -1321,7 +2646,15 @@ ensure_textures(struct gl_surface_state *gs, int num_textures)
 {
 	int i;
 
-	if (num_textures <= gs->num_textures)
+	/* A buffer with fewer planes than the last one */
+	if (num_textures < gs->num_textures) {
+		glDeleteTextures(gs->num_textures - num_textures,
+				 &gs->textures[num_textures]);
+		gs->num_textures = num_textures;
+		return;
+	}
+
+	if (num_textures == gs->num_textures)
 		return;
 
 	for (i = gs->num_textures; i < num_textures; i++) {
@@ -1343,59 +2676,118 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 	struct weston_compositor *ec = es->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(es);
-	GLenum gl_format, gl_pixel_type;
-	int pitch;
+	GLenum gl_format[3] = { 0, 0, 0 };
+	GLenum gl_pixel_type;
+	int offset[3] = { 0, 0, 0 };
+	int hsub[3] = { 1, 1, 1 };
+	int vsub[3] = { 1, 1, 1 };
+	int pitch, stride, num_planes = 1;
+	bool changed;
 
 	buffer->shm_buffer = shm_buffer;
 	buffer->width = wl_shm_buffer_get_width(shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(shm_buffer);
+	stride = wl_shm_buffer_get_stride(shm_buffer);
 
 	switch (wl_shm_buffer_get_format(shm_buffer)) {
 	case WL_SHM_FORMAT_XRGB8888:
-		gs->shader = &gr->texture_shader_rgbx;
-		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
-		gl_format = GL_BGRA_EXT;
+		gs->shader = &gr->shaders[SHADER_VARIANT_RGBX];
+		pitch = stride / 4;
+		gl_format[0] = GL_BGRA_EXT;
 		gl_pixel_type = GL_UNSIGNED_BYTE;
 		break;
 	case WL_SHM_FORMAT_ARGB8888:
-		gs->shader = &gr->texture_shader_rgba;
-		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
-		gl_format = GL_BGRA_EXT;
+		gs->shader = &gr->shaders[SHADER_VARIANT_RGBA];
+		pitch = stride / 4;
+		gl_format[0] = GL_BGRA_EXT;
 		gl_pixel_type = GL_UNSIGNED_BYTE;
 		break;
 	case WL_SHM_FORMAT_RGB565:
-		gs->shader = &gr->texture_shader_rgbx;
-		pitch = wl_shm_buffer_get_stride(shm_buffer) / 2;
-		gl_format = GL_RGB;
+		gs->shader = &gr->shaders[SHADER_VARIANT_RGBX];
+		pitch = stride / 2;
+		gl_format[0] = GL_RGB;
 		gl_pixel_type = GL_UNSIGNED_SHORT_5_6_5;
 		break;
+	case WL_SHM_FORMAT_YUV420:
+		/* Y plane, then U and V at half the stride and height */
+		gs->shader = &gr->shaders[SHADER_VARIANT_Y_U_V];
+		pitch = stride;
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		num_planes = 3;
+		gl_format[0] = gl_format[1] = gl_format[2] = GL_LUMINANCE;
+		offset[1] = stride * buffer->height;
+		offset[2] = offset[1] + stride / 2 * ((buffer->height + 1) / 2);
+		hsub[1] = hsub[2] = 2;
+		vsub[1] = vsub[2] = 2;
+		break;
+	case WL_SHM_FORMAT_NV12:
+		/* The interleaved UV plane goes to luminance (read as .g)
+		 * and alpha, the layout the y_xuxv shader samples */
+		gs->shader = &gr->shaders[SHADER_VARIANT_Y_XUXV];
+		pitch = stride;
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		num_planes = 2;
+		gl_format[0] = GL_LUMINANCE;
+		gl_format[1] = GL_LUMINANCE_ALPHA;
+		offset[1] = stride * buffer->height;
+		hsub[1] = 2;
+		vsub[1] = 2;
+		break;
+	case WL_SHM_FORMAT_YUYV:
+		/* Y from the luminance of a two channel texture, U and V
+		 * from the green and alpha of a half width RGBA texture */
+		gs->shader = &gr->shaders[SHADER_VARIANT_Y_XUXV];
+		pitch = stride / 2;
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		num_planes = 2;
+		gl_format[0] = GL_LUMINANCE_ALPHA;
+		gl_format[1] = GL_RGBA;
+		hsub[1] = 2;
+		break;
 	default:
 		weston_log("warning: unknown shm buffer format: %08x\n",
 			   wl_shm_buffer_get_format(shm_buffer));
 		return;
 	}
 
+	if (!weston_buffer_shm_planes_mapped(buffer)) {
+		weston_log("YUV buffer planes do not fit in its shm pool\n");
+		atlas_release(gr, gs);
+		weston_buffer_reference(&gs->buffer_ref, NULL);
+		gs->buffer_type = BUFFER_TYPE_NULL;
+		gs->y_inverted = 1;
+		return;
+	}
+
 	/* Only allocate a texture if it doesn't match existing one.
 	 * If a switch from DRM allocated buffer to a SHM buffer is
 	 * happening, we need to allocate a new texture buffer. */
-	if (pitch != gs->pitch ||
-	    buffer->height != gs->height ||
-	    gl_format != gs->gl_format ||
-	    gl_pixel_type != gs->gl_pixel_type ||
-	    gs->buffer_type != BUFFER_TYPE_SHM) {
+	changed = pitch != gs->pitch ||
+		buffer->height != gs->height ||
+		memcmp(gl_format, gs->gl_format, sizeof gl_format) != 0 ||
+		memcmp(offset, gs->offset, sizeof offset) != 0 ||
+		gl_pixel_type != gs->gl_pixel_type ||
+		gs->buffer_type != BUFFER_TYPE_SHM;
+	if (changed) {
 		gs->pitch = pitch;
 		gs->height = buffer->height;
 		gs->target = GL_TEXTURE_2D;
-		gs->gl_format = gl_format;
+		memcpy(gs->gl_format, gl_format, sizeof gl_format);
+		memcpy(gs->offset, offset, sizeof offset);
+		memcpy(gs->hsub, hsub, sizeof hsub);
+		memcpy(gs->vsub, vsub, sizeof vsub);
 		gs->gl_pixel_type = gl_pixel_type;
 		gs->buffer_type = BUFFER_TYPE_SHM;
 		gs->needs_full_upload = true;
 		gs->y_inverted = 1;
 
 		gs->surface = es;
-
-		ensure_textures(gs, 1);
 	}
+
+	if (atlas_update(gr, gs, buffer, num_planes, changed))
+		gs->needs_full_upload = true;
+
+	ensure_textures(gs, gs->atlas.page ? 0 : num_planes);
 }
 
 static void
@@ -1427,24 +2819,24 @@ gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
 	case EGL_TEXTURE_RGBA:
 	default:
 		num_planes = 1;
-		gs->shader = &gr->texture_shader_rgba;
+		gs->shader = &gr->shaders[SHADER_VARIANT_RGBA];
 		break;
 	case EGL_TEXTURE_EXTERNAL_WL:
 		num_planes = 1;
 		gs->target = GL_TEXTURE_EXTERNAL_OES;
-		gs->shader = &gr->texture_shader_egl_external;
+		gs->shader = &gr->shaders[SHADER_VARIANT_EXTERNAL];
 		break;
 	case EGL_TEXTURE_Y_UV_WL:
 		num_planes = 2;
-		gs->shader = &gr->texture_shader_y_uv;
+		gs->shader = &gr->shaders[SHADER_VARIANT_Y_UV];
 		break;
 	case EGL_TEXTURE_Y_U_V_WL:
 		num_planes = 3;
-		gs->shader = &gr->texture_shader_y_u_v;
+		gs->shader = &gr->shaders[SHADER_VARIANT_Y_U_V];
 		break;
 	case EGL_TEXTURE_Y_XUXV_WL:
 		num_planes = 2;
-		gs->shader = &gr->texture_shader_y_xuxv;
+		gs->shader = &gr->shaders[SHADER_VARIANT_Y_XUXV];
 		break;
 	}
 
@@ -1690,13 +3082,13 @@ import_yuv_dmabuf(struct gl_renderer *gr,
 
 	switch (format->texture_type) {
 	case EGL_TEXTURE_Y_XUXV_WL:
-		image->shader = &gr->texture_shader_y_xuxv;
+		image->shader = &gr->shaders[SHADER_VARIANT_Y_XUXV];
 		break;
 	case EGL_TEXTURE_Y_UV_WL:
-		image->shader = &gr->texture_shader_y_uv;
+		image->shader = &gr->shaders[SHADER_VARIANT_Y_UV];
 		break;
 	case EGL_TEXTURE_Y_U_V_WL:
-		image->shader = &gr->texture_shader_y_u_v;
+		image->shader = &gr->shaders[SHADER_VARIANT_Y_U_V];
 		break;
 	default:
 		assert(false);
@@ -1742,10 +3134,10 @@ import_dmabuf(struct gl_renderer *gr,
 
 		switch (image->target) {
 		case GL_TEXTURE_2D:
-			image->shader = &gr->texture_shader_rgba;
+			image->shader = &gr->shaders[SHADER_VARIANT_RGBA];
 			break;
 		default:
-			image->shader = &gr->texture_shader_egl_external;
+			image->shader = &gr->shaders[SHADER_VARIANT_EXTERNAL];
 		}
 	} else {
 		if (!import_yuv_dmabuf(gr, image)) {
@@ -1895,6 +3287,10 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 
 	weston_buffer_reference(&gs->buffer_ref, buffer);
 
+	shm_buffer = buffer ? wl_shm_buffer_get(buffer->resource) : NULL;
+	if (!shm_buffer)
+		atlas_release(gr, gs);
+
 	if (!buffer) {
 		for (i = 0; i < gs->num_images; i++) {
 			egl_image_unref(gs->images[i]);
@@ -1908,8 +3304,6 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		return;
 	}
 
-	shm_buffer = wl_shm_buffer_get(buffer->resource);
-
 	if (shm_buffer)
 		gl_renderer_attach_shm(es, buffer, shm_buffer);
 	else if (gr->query_buffer(gr->egl_display, (void *) buffer->resource,
@@ -1922,7 +3316,12 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		weston_buffer_reference(&gs->buffer_ref, NULL);
 		gs->buffer_type = BUFFER_TYPE_NULL;
 		gs->y_inverted = 1;
+		return;
 	}
+
+	/* Build the shader now rather than in the middle of a repaint */
+	if (gs->shader)
+		ensure_shader(gr, gs->shader);
 }
 
 static void
@@ -1940,7 +3339,7 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 	gs->pitch = 1;
 	gs->height = 1;
 
-	gs->shader = &gr->solid_shader;
+	gs->shader = &gr->shaders[SHADER_VARIANT_SOLID];
 }
 
 static void
@@ -2004,12 +3403,15 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
+	struct gl_atlas_slot *slot = &gs->atlas;
+	GLfloat texcoords[4 * 2];
+	const GLuint *textures;
 	int cw, ch;
 	GLuint fbo;
 	GLuint tex;
 	GLenum status;
 	const GLfloat *proj;
-	int i;
+	int i, n;
 
 	gl_renderer_surface_get_content_size(surface, &cw, &ch);
 
@@ -2056,11 +3458,12 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	glUniformMatrix4fv(gs->shader->proj_uniform, 1, GL_FALSE, proj);
 	glUniform1f(gs->shader->alpha_uniform, 1.0f);
 
-	for (i = 0; i < gs->num_textures; i++) {
+	n = surface_textures(gs, &textures);
+	for (i = 0; i < n; i++) {
 		glUniform1i(gs->shader->tex_uniforms[i], i);
 
 		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
+		glBindTexture(gs->target, textures[i]);
 		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	}
@@ -2070,7 +3473,17 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	glEnableVertexAttribArray(0);
 
 	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	memcpy(texcoords, verts, sizeof texcoords);
+	if (slot->page) {
+		for (i = 0; i < 4; i++) {
+			texcoords[i * 2] = (slot->x + texcoords[i * 2] *
+					    slot->width) / GL_ATLAS_PAGE_SIZE;
+			texcoords[i * 2 + 1] = (slot->y + texcoords[i * 2 + 1] *
+						slot->height) /
+					       GL_ATLAS_PAGE_SIZE;
+		}
+	}
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
 	glEnableVertexAttribArray(1);
 
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
@@ -2099,6 +3512,7 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 	gs->surface->renderer_state = NULL;
 
 	glDeleteTextures(gs->num_textures, gs->textures);
+	atlas_release(gr, gs);
 
 	for (i = 0; i < gs->num_images; i++)
 		egl_image_unref(gs->images[i]);
@@ -2176,6 +3590,66 @@ gl_renderer_create_surface(struct weston_surface *surface)
 	return 0;
 }
 
+static void
+view_state_destroy(struct gl_view_state *vs)
+{
+	wl_list_remove(&vs->view_destroy_listener.link);
+	wl_list_remove(&vs->renderer_destroy_listener.link);
+
+	vs->view->renderer_state = NULL;
+
+	view_region_fini(&vs->opaque);
+	view_region_fini(&vs->blend);
+	free(vs);
+}
+
+static void
+view_state_handle_view_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_view_state *vs;
+
+	vs = container_of(listener, struct gl_view_state,
+			  view_destroy_listener);
+
+	view_state_destroy(vs);
+}
+
+static void
+view_state_handle_renderer_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_view_state *vs;
+
+	vs = container_of(listener, struct gl_view_state,
+			  renderer_destroy_listener);
+
+	view_state_destroy(vs);
+}
+
+static int
+gl_renderer_create_view(struct weston_view *view)
+{
+	struct gl_view_state *vs;
+	struct gl_renderer *gr = get_renderer(view->surface->compositor);
+
+	vs = zalloc(sizeof *vs);
+	if (vs == NULL)
+		return -1;
+
+	vs->view = view;
+	view_region_init(&vs->opaque);
+	view_region_init(&vs->blend);
+	view->renderer_state = vs;
+
+	vs->view_destroy_listener.notify = view_state_handle_view_destroy;
+	wl_signal_add(&view->destroy_signal, &vs->view_destroy_listener);
+
+	vs->renderer_destroy_listener.notify =
+		view_state_handle_renderer_destroy;
+	wl_signal_add(&gr->destroy_signal, &vs->renderer_destroy_listener);
+
+	return 0;
+}
+
 static const char vertex_shader[] =
 	"uniform mat4 proj;\n"
 	"attribute vec2 position;\n"
@@ -2187,102 +3661,72 @@ static const char vertex_shader[] =
 	"   v_texcoord = texcoord;\n"
 	"}\n";
 
-/* Declare common fragment shader uniforms */
-#define FRAGMENT_CONVERT_YUV						\
-	"  y *= alpha;\n"						\
-	"  u *= alpha;\n"						\
-	"  v *= alpha;\n"						\
-	"  gl_FragColor.r = y + 1.59602678 * v;\n"			\
-	"  gl_FragColor.g = y - 0.39176229 * u - 0.81296764 * v;\n"	\
-	"  gl_FragColor.b = y + 2.01723214 * u;\n"			\
-	"  gl_FragColor.a = alpha;\n"
-
-static const char fragment_debug[] =
-	"  gl_FragColor = vec4(0.0, 0.3, 0.0, 0.2) + gl_FragColor * 0.8;\n";
-
-static const char fragment_brace[] =
-	"}\n";
-
-static const char texture_fragment_shader_rgba[] =
-	"precision mediump float;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform sampler2D tex;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
-	;
-
-static const char texture_fragment_shader_rgbx[] =
-	"precision mediump float;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform sampler2D tex;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor.rgb = alpha * texture2D(tex, v_texcoord).rgb\n;"
-	"   gl_FragColor.a = alpha;\n"
-	;
+/* Preprocessor symbols for the variants, in enum gl_shader_variant order */
+static const char * const shader_variants[] = {
+	"RGBA", "RGBX", "EXTERNAL", "Y_UV", "Y_U_V", "Y_XUXV", "SOLID"
+};
 
-static const char texture_fragment_shader_egl_external[] =
+/* The fragment shader of every variant. shader_init() prepends the
+ * definitions of DEF_VARIANT and DEF_DEBUG.
+ */
+static const char fragment_shader_template[] =
+	"#if DEF_VARIANT == SHADER_VARIANT_EXTERNAL\n"
 	"#extension GL_OES_EGL_image_external : require\n"
+	"#endif\n"
 	"precision mediump float;\n"
 	"varying vec2 v_texcoord;\n"
-	"uniform samplerExternalOES tex;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
-	;
-
-static const char texture_fragment_shader_y_uv[] =
-	"precision mediump float;\n"
-	"uniform sampler2D tex;\n"
-	"uniform sampler2D tex1;\n"
-	"varying vec2 v_texcoord;\n"
 	"uniform float alpha;\n"
-	"void main() {\n"
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).r - 0.5;\n"
-	"  float v = texture2D(tex1, v_texcoord).g - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	;
-
-static const char texture_fragment_shader_y_u_v[] =
-	"precision mediump float;\n"
+	"#if DEF_VARIANT == SHADER_VARIANT_SOLID\n"
+	"uniform vec4 color;\n"
+	"#elif DEF_VARIANT == SHADER_VARIANT_EXTERNAL\n"
+	"uniform samplerExternalOES tex;\n"
+	"#else\n"
 	"uniform sampler2D tex;\n"
+	"#endif\n"
+	"#if DEF_VARIANT == SHADER_VARIANT_Y_UV || "
+	"DEF_VARIANT == SHADER_VARIANT_Y_U_V || "
+	"DEF_VARIANT == SHADER_VARIANT_Y_XUXV\n"
+	"#define DEF_YUV 1\n"
 	"uniform sampler2D tex1;\n"
+	"#endif\n"
+	"#if DEF_VARIANT == SHADER_VARIANT_Y_U_V\n"
 	"uniform sampler2D tex2;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
-	"void main() {\n"
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).x - 0.5;\n"
-	"  float v = texture2D(tex2, v_texcoord).x - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	;
-
-static const char texture_fragment_shader_y_xuxv[] =
-	"precision mediump float;\n"
-	"uniform sampler2D tex;\n"
-	"uniform sampler2D tex1;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
-	"void main() {\n"
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).g - 0.5;\n"
-	"  float v = texture2D(tex1, v_texcoord).a - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	;
-
-static const char solid_fragment_shader[] =
-	"precision mediump float;\n"
-	"uniform vec4 color;\n"
-	"uniform float alpha;\n"
+	"#endif\n"
+	"\n"
+	"vec4 sample_input()\n"
+	"{\n"
+	"#if DEF_VARIANT == SHADER_VARIANT_SOLID\n"
+	"   return color;\n"
+	"#elif DEF_VARIANT == SHADER_VARIANT_RGBX\n"
+	"   return vec4(texture2D(tex, v_texcoord).rgb, 1.0);\n"
+	"#elif defined(DEF_YUV)\n"
+	"   float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
+	"#if DEF_VARIANT == SHADER_VARIANT_Y_UV\n"
+	"   float u = texture2D(tex1, v_texcoord).r - 0.5;\n"
+	"   float v = texture2D(tex1, v_texcoord).g - 0.5;\n"
+	"#elif DEF_VARIANT == SHADER_VARIANT_Y_U_V\n"
+	"   float u = texture2D(tex1, v_texcoord).x - 0.5;\n"
+	"   float v = texture2D(tex2, v_texcoord).x - 0.5;\n"
+	"#else\n"
+	"   float u = texture2D(tex1, v_texcoord).g - 0.5;\n"
+	"   float v = texture2D(tex1, v_texcoord).a - 0.5;\n"
+	"#endif\n"
+	"   return vec4(y + 1.59602678 * v,\n"
+	"               y - 0.39176229 * u - 0.81296764 * v,\n"
+	"               y + 2.01723214 * u,\n"
+	"               1.0);\n"
+	"#else\n"
+	"   return texture2D(tex, v_texcoord);\n"
+	"#endif\n"
+	"}\n"
+	"\n"
 	"void main()\n"
 	"{\n"
-	"   gl_FragColor = alpha * color\n;"
-	;
+	"   gl_FragColor = alpha * sample_input();\n"
+	"#if DEF_DEBUG\n"
+	"   gl_FragColor = vec4(0.0, 0.3, 0.0, 0.2) + gl_FragColor * 0.8;\n"
+	"#endif\n"
+	"}\n";
 
 static int
 compile_shader(GLenum type, int count, const char **sources)
@@ -2304,44 +3748,325 @@ compile_shader(GLenum type, int count, const char **sources)
 	return s;
 }
 
+/* Program binaries are stored as one file per program, named after the
+ * hash of the driver strings and of the shader sources. A file from an
+ * older driver is simply never looked up, and one the driver rejects is
+ * replaced after compiling the program again.
+ */
+#define SHADER_CACHE_MAGIC 0x42505357	/* "WSPB" */
+#define SHADER_CACHE_VERSION 1
+
+struct shader_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+/* 64 bit FNV-1a */
+static uint64_t
+shader_cache_hash(uint64_t hash, const char *str)
+{
+	/* hash the terminating nul too, so that "ab" "c" != "a" "bc" */
+	do {
+		hash ^= (unsigned char) *str;
+		hash *= 0x100000001b3ULL;
+	} while (*str++);
+
+	return hash;
+}
+
 static int
-shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
-		   const char *vertex_source, const char *fragment_source)
+shader_cache_mkdir(const char *path)
 {
-	char msg[512];
-	GLint status;
-	int count;
-	const char *sources[3];
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -1;
 
-	shader->vertex_shader =
-		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+	return 0;
+}
 
-	if (renderer->fragment_shader_debug) {
-		sources[0] = fragment_source;
-		sources[1] = fragment_debug;
-		sources[2] = fragment_brace;
-		count = 3;
-	} else {
-		sources[0] = fragment_source;
-		sources[1] = fragment_brace;
-		count = 2;
+static void
+shader_cache_init(struct gl_renderer *gr, const char *extensions)
+{
+#ifdef GL_OES_get_program_binary
+	const char *xdg_cache_home, *home, *str;
+	const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	GLint formats = 0;
+	char *base = NULL;
+	unsigned int i;
+
+	if (!strstr(extensions, "GL_OES_get_program_binary"))
+		return;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	if (formats <= 0)
+		return;
+
+	gr->get_program_binary =
+		(void *) eglGetProcAddress("glGetProgramBinaryOES");
+	gr->program_binary = (void *) eglGetProcAddress("glProgramBinaryOES");
+	if (!gr->get_program_binary || !gr->program_binary)
+		return;
+
+	/* $XDG_CACHE_HOME/weston/shaders, or ~/.cache/weston/shaders */
+	xdg_cache_home = getenv("XDG_CACHE_HOME");
+	home = getenv("HOME");
+	if (xdg_cache_home && xdg_cache_home[0] == '/') {
+		base = strdup(xdg_cache_home);
+	} else if (home) {
+		if (asprintf(&base, "%s/.cache", home) < 0)
+			base = NULL;
+	}
+	if (!base || shader_cache_mkdir(base) < 0)
+		goto out;
+
+	if (asprintf(&gr->shader_cache_dir, "%s/weston", base) < 0) {
+		gr->shader_cache_dir = NULL;
+		goto out;
+	}
+	if (shader_cache_mkdir(gr->shader_cache_dir) < 0)
+		goto err;
+
+	free(gr->shader_cache_dir);
+	if (asprintf(&gr->shader_cache_dir, "%s/weston/shaders", base) < 0) {
+		gr->shader_cache_dir = NULL;
+		goto out;
+	}
+	if (shader_cache_mkdir(gr->shader_cache_dir) < 0)
+		goto err;
+
+	gr->shader_driver_hash = 0xcbf29ce484222325ULL;
+	for (i = 0; i < ARRAY_LENGTH(strings); i++) {
+		str = (const char *) glGetString(strings[i]);
+		gr->shader_driver_hash =
+			shader_cache_hash(gr->shader_driver_hash,
+					  str ? str : "");
 	}
 
-	shader->fragment_shader =
-		compile_shader(GL_FRAGMENT_SHADER, count, sources);
+	gr->has_program_binary = 1;
+	goto out;
 
-	shader->program = glCreateProgram();
-	glAttachShader(shader->program, shader->vertex_shader);
-	glAttachShader(shader->program, shader->fragment_shader);
-	glBindAttribLocation(shader->program, 0, "position");
-	glBindAttribLocation(shader->program, 1, "texcoord");
+err:
+	weston_log("Cannot create shader cache directory %s: %m\n",
+		   gr->shader_cache_dir);
+	free(gr->shader_cache_dir);
+	gr->shader_cache_dir = NULL;
+out:
+	free(base);
+#endif
+}
+
+static uint64_t
+shader_cache_key(struct gl_renderer *gr, const char *vertex_source,
+		 const char **sources, int count)
+{
+	uint64_t key;
+	int i;
+
+	key = shader_cache_hash(gr->shader_driver_hash, vertex_source);
+	for (i = 0; i < count; i++)
+		key = shader_cache_hash(key, sources[i]);
+
+	return key;
+}
+
+static char *
+shader_cache_path(struct gl_renderer *gr, uint64_t key)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%016llx", gr->shader_cache_dir,
+		     (unsigned long long) key) < 0)
+		return NULL;
+
+	return path;
+}
+
+/* Creates shader->program from a cached binary. Returns -1 if there is
+ * none, or if the driver does not take it.
+ */
+static int
+shader_cache_load(struct gl_renderer *gr, struct gl_shader *shader,
+		  uint64_t key)
+{
+#ifdef GL_OES_get_program_binary
+	struct shader_cache_header header;
+	GLint status = GL_FALSE;
+	void *binary = NULL;
+	char *path;
+	FILE *fp;
+
+	path = shader_cache_path(gr, key);
+	if (!path)
+		return -1;
+
+	fp = fopen(path, "rb");
+	free(path);
+	if (!fp)
+		return -1;
+
+	if (fread(&header, sizeof header, 1, fp) != 1 ||
+	    header.magic != SHADER_CACHE_MAGIC ||
+	    header.version != SHADER_CACHE_VERSION ||
+	    header.key != key || header.length == 0)
+		goto out;
 
-	glLinkProgram(shader->program);
+	binary = malloc(header.length);
+	if (!binary || fread(binary, header.length, 1, fp) != 1)
+		goto out;
+
+	shader->program = glCreateProgram();
+	gr->program_binary(shader->program, header.format,
+			   binary, header.length);
 	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
 	if (!status) {
-		glGetProgramInfoLog(shader->program, sizeof msg, NULL, msg);
-		weston_log("link info: %s\n", msg);
-		return -1;
+		glDeleteProgram(shader->program);
+		shader->program = 0;
+	}
+
+out:
+	free(binary);
+	fclose(fp);
+
+	return status ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+static void
+shader_cache_store(struct gl_renderer *gr, struct gl_shader *shader,
+		   uint64_t key)
+{
+#ifdef GL_OES_get_program_binary
+	struct shader_cache_header header;
+	GLint length = 0;
+	GLenum format;
+	void *binary = NULL;
+	char *path, *tmp = NULL;
+	FILE *fp;
+
+	glGetProgramiv(shader->program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	path = shader_cache_path(gr, key);
+	if (!path)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		goto out;
+
+	gr->get_program_binary(shader->program, length, &length,
+			       &format, binary);
+	if (length <= 0)
+		goto out;
+
+	header.magic = SHADER_CACHE_MAGIC;
+	header.version = SHADER_CACHE_VERSION;
+	header.key = key;
+	header.format = format;
+	header.length = length;
+
+	/* Write a private file and rename it, so that a concurrent
+	 * compositor never reads a partial binary */
+	if (asprintf(&tmp, "%s.%d", path, (int) getpid()) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+
+	fp = fopen(tmp, "wb");
+	if (!fp)
+		goto out;
+
+	if (fwrite(&header, sizeof header, 1, fp) != 1 ||
+	    fwrite(binary, length, 1, fp) != 1) {
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+
+out:
+	free(tmp);
+	free(binary);
+	free(path);
+#endif
+}
+
+/* Writes the #defines selecting the variant of fragment_shader_template */
+static void
+shader_variant_defines(char *buf, size_t size, enum gl_shader_variant variant,
+		       int debug)
+{
+	int i, len;
+
+	len = 0;
+	for (i = 0; i < SHADER_VARIANT_COUNT; i++)
+		len += snprintf(buf + len, size - len,
+				"#define SHADER_VARIANT_%s %d\n",
+				shader_variants[i], i);
+
+	snprintf(buf + len, size - len,
+		 "#define DEF_VARIANT %d\n"
+		 "#define DEF_DEBUG %d\n",
+		 variant, debug);
+}
+
+static int
+shader_init(struct gl_shader *shader, struct gl_renderer *renderer)
+{
+	char msg[512];
+	char defines[512];
+	GLint status;
+	int count;
+	const char *sources[2];
+	const char *vertex_source = vertex_shader;
+	struct timespec start, end, elapsed;
+	uint64_t key = 0;
+	bool cached = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	shader_variant_defines(defines, sizeof defines, shader->variant,
+			       renderer->fragment_shader_debug);
+	sources[0] = defines;
+	sources[1] = fragment_shader_template;
+	count = 2;
+
+	if (renderer->has_program_binary) {
+		key = shader_cache_key(renderer, vertex_source,
+				       sources, count);
+		cached = shader_cache_load(renderer, shader, key) == 0;
+	}
+
+	if (!cached) {
+		shader->vertex_shader =
+			compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+		shader->fragment_shader =
+			compile_shader(GL_FRAGMENT_SHADER, count, sources);
+
+		shader->program = glCreateProgram();
+		glAttachShader(shader->program, shader->vertex_shader);
+		glAttachShader(shader->program, shader->fragment_shader);
+		glBindAttribLocation(shader->program, 0, "position");
+		glBindAttribLocation(shader->program, 1, "texcoord");
+
+		glLinkProgram(shader->program);
+		glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+		if (!status) {
+			glGetProgramInfoLog(shader->program, sizeof msg,
+					    NULL, msg);
+			weston_log("link info: %s\n", msg);
+			return -1;
+		}
+
+		if (renderer->has_program_binary)
+			shader_cache_store(renderer, shader, key);
 	}
 
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
@@ -2351,6 +4076,14 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
 	shader->color_uniform = glGetUniformLocation(shader->program, "color");
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespec_sub(&elapsed, &end, &start);
+	weston_log("GL shader %s%s %s in %.2f ms\n",
+		   shader_variants[shader->variant],
+		   renderer->fragment_shader_debug ? " (debug)" : "",
+		   cached ? "loaded from cache" : "compiled",
+		   timespec_to_nsec(&elapsed) / 1000000.0);
+
 	return 0;
 }
 
@@ -2620,6 +4353,8 @@ gl_renderer_output_destroy(struct weston_output *output)
 	struct gl_output_state *go = get_output_state(output);
 	int i;
 
+	gl_renderer_finish_reads(gr, output);
+
 	for (i = 0; i < 2; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
@@ -2639,9 +4374,21 @@ gl_renderer_destroy(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	struct dmabuf_image *image, *next;
+	struct gl_atlas_page *page, *page_next;
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	if (gr->read_timer)
+		wl_event_source_remove(gr->read_timer);
+
+	wl_list_for_each_safe(page, page_next, &gr->atlas_pages, link)
+		atlas_page_destroy(gr, page);
+
+	if (gr->has_pbo_upload)
+		glDeleteBuffers(GL_UPLOAD_PBO_COUNT, gr->upload_pbos);
+	glDeleteBuffers(1, &gr->vertex_buffer);
+	glDeleteBuffers(1, &gr->index_buffer);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
@@ -2659,12 +4406,17 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->upload_boxes);
+	wl_array_release(&gr->indices);
+	wl_array_release(&gr->batches);
+	wl_array_release(&gr->atlas_scratch);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
 
+	free(gr->shader_cache_dir);
 	free(gr);
 }
 
@@ -2732,6 +4484,20 @@ gl_renderer_setup_egl_extensions(struct weston_compositor *ec)
 			   "supported. Performance could be affected.\n");
 #endif
 
+#ifdef EGL_KHR_fence_sync
+	if (strstr(extensions, "EGL_KHR_fence_sync")) {
+		gr->create_sync =
+			(void *) eglGetProcAddress("eglCreateSyncKHR");
+		gr->destroy_sync =
+			(void *) eglGetProcAddress("eglDestroySyncKHR");
+		gr->client_wait_sync =
+			(void *) eglGetProcAddress("eglClientWaitSyncKHR");
+		if (gr->create_sync && gr->destroy_sync &&
+		    gr->client_wait_sync)
+			gr->has_fence_sync = 1;
+	}
+#endif
+
 #ifdef EGL_MESA_configless_context
 	if (strstr(extensions, "EGL_MESA_configless_context"))
 		gr->has_configless_context = 1;
@@ -2865,6 +4631,7 @@ gl_renderer_create(struct weston_compositor *ec, EGLenum platform,
 		return -1;
 
 	gr->base.read_pixels = gl_renderer_read_pixels;
+	gr->base.read_pixels_async = gl_renderer_read_pixels_async;
 	gr->base.repaint_output = gl_renderer_repaint_output;
 	gr->base.flush_damage = gl_renderer_flush_damage;
 	gr->base.attach = gl_renderer_attach;
@@ -2925,10 +4692,15 @@ gl_renderer_create(struct weston_compositor *ec, EGLenum platform,
 		goto fail_with_error;
 
 	wl_list_init(&gr->dmabuf_images);
+	wl_list_init(&gr->atlas_pages);
+	wl_list_init(&gr->reads);
 	if (gr->has_dmabuf_import)
 		gr->base.import_dmabuf = gl_renderer_import_dmabuf;
 
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUV420);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_NV12);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
 
 	wl_signal_init(&gr->destroy_signal);
 
@@ -2953,30 +4725,12 @@ static int
 compile_shaders(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
+	int i;
 
-	gr->texture_shader_rgba.vertex_source = vertex_shader;
-	gr->texture_shader_rgba.fragment_source = texture_fragment_shader_rgba;
-
-	gr->texture_shader_rgbx.vertex_source = vertex_shader;
-	gr->texture_shader_rgbx.fragment_source = texture_fragment_shader_rgbx;
-
-	gr->texture_shader_egl_external.vertex_source = vertex_shader;
-	gr->texture_shader_egl_external.fragment_source =
-		texture_fragment_shader_egl_external;
-
-	gr->texture_shader_y_uv.vertex_source = vertex_shader;
-	gr->texture_shader_y_uv.fragment_source = texture_fragment_shader_y_uv;
-
-	gr->texture_shader_y_u_v.vertex_source = vertex_shader;
-	gr->texture_shader_y_u_v.fragment_source =
-		texture_fragment_shader_y_u_v;
-
-	gr->texture_shader_y_xuxv.vertex_source = vertex_shader;
-	gr->texture_shader_y_xuxv.fragment_source =
-		texture_fragment_shader_y_xuxv;
-
-	gr->solid_shader.vertex_source = vertex_shader;
-	gr->solid_shader.fragment_source = solid_fragment_shader;
+	/* Only label the variants, ensure_shader() builds them once a
+	 * buffer needs one */
+	for (i = 0; i < SHADER_VARIANT_COUNT; i++)
+		gr->shaders[i].variant = i;
 
 	return 0;
 }
@@ -2988,16 +4742,12 @@ fragment_debug_binding(struct weston_keyboard *keyboard, uint32_t time,
 	struct weston_compositor *ec = data;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct weston_output *output;
+	int i;
 
 	gr->fragment_shader_debug ^= 1;
 
-	shader_release(&gr->texture_shader_rgba);
-	shader_release(&gr->texture_shader_rgbx);
-	shader_release(&gr->texture_shader_egl_external);
-	shader_release(&gr->texture_shader_y_uv);
-	shader_release(&gr->texture_shader_y_u_v);
-	shader_release(&gr->texture_shader_y_xuxv);
-	shader_release(&gr->solid_shader);
+	for (i = 0; i < SHADER_VARIANT_COUNT; i++)
+		shader_release(&gr->shaders[i]);
 
 	/* Force use_shader() to call glUseProgram(), since we need to use
 	 * the recompiled version of the shader. */
@@ -3023,6 +4773,9 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	const char *extensions;
+	const char *version;
+	int major;
+	GLint max_texture_size;
 	EGLConfig context_config;
 	EGLBoolean ret;
 
@@ -3089,8 +4842,33 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (strstr(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+	shader_cache_init(gr, extensions);
+
+	/* Pixel buffer objects and the unpack row length are core in
+	 * OpenGL ES 3.0, which Mesa gives us for a version 2 context */
+	version = (const char *) glGetString(GL_VERSION);
+	if (version && sscanf(version, "OpenGL ES %d.", &major) == 1 &&
+	    major >= 3) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+		if (gr->map_buffer_range && gr->unmap_buffer) {
+			glGenBuffers(GL_UPLOAD_PBO_COUNT, gr->upload_pbos);
+			gr->has_pbo_upload = 1;
+		}
+	}
+
+	/* Larger buffers would not leave much room for others */
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	if (max_texture_size >= GL_ATLAS_PAGE_SIZE)
+		gr->atlas_max_size = MIN(ec->gl_atlas_size,
+					 GL_ATLAS_PAGE_SIZE / 4);
+
 	glActiveTexture(GL_TEXTURE0);
 
+	glGenBuffers(1, &gr->vertex_buffer);
+	glGenBuffers(1, &gr->index_buffer);
+
 	if (compile_shaders(ec))
 		return -1;
 
@@ -3108,8 +4886,22 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through PBO: %s\n",
+			    gr->has_pbo_upload ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    !gr->has_pbo_upload ? "no" :
+			    gr->has_fence_sync ? "yes" : "yes, without fences");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "shader program cache: %s\n",
+			    gr->has_program_binary ?
+			    gr->shader_cache_dir : "no");
+	if (gr->atlas_max_size > 0)
+		weston_log_continue(STAMP_SPACE "texture atlas: buffers up "
+				    "to %dx%d\n", gr->atlas_max_size,
+				    gr->atlas_max_size);
+	else
+		weston_log_continue(STAMP_SPACE "texture atlas: no\n");
 
 
 	return 0;
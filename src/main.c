@@ -42,6 +42,7 @@
 #endif
 
 #include "compositor.h"
+#include "timeline.h"
 #include "../shared/os-compatibility.h"
 #include "../shared/helpers.h"
 #include "git-version.h"
@@ -255,6 +256,8 @@ usage(int error_code)
 		"  -i, --idle-time=SECS\tIdle time in seconds\n"
 		"  --modules\t\tLoad the comma-separated list of modules\n"
 		"  --log=FILE\t\tLog to the given file\n"
+		"  --pixman-threads=N\tComposite in N bands in parallel with the\n"
+		"\t\t\t  pixman renderer\n"
 		"  -c, --config=FILE\tConfig file to load, defaults to weston.ini\n"
 		"  --no-config\t\tDo not read weston.ini\n"
 		"  -h, --help\t\tThis help message\n\n");
@@ -499,6 +502,13 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int repaint_adaptive;
+	int miss_percent;
+	int frame_throttle;
+	int frame_throttle_msec;
+	int gl_atlas_size;
+	int flight_recorder;
+	int flight_repaint_msec;
 	int vt_switching;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
@@ -537,6 +547,66 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	weston_log("Output repaint window is %d ms maximum.\n",
 		   ec->repaint_msec);
 
+	weston_config_section_get_bool(s, "adaptive-repaint",
+				       &repaint_adaptive, false);
+	ec->repaint_adaptive = repaint_adaptive;
+	weston_config_section_get_int(s, "repaint-miss-rate", &miss_percent,
+				      ec->repaint_miss_percent);
+	if (miss_percent < 0 || miss_percent > 50) {
+		weston_log("Invalid repaint-miss-rate value in config: %d\n",
+			   miss_percent);
+	} else {
+		ec->repaint_miss_percent = miss_percent;
+	}
+	if (ec->repaint_adaptive)
+		weston_log("Adaptive repaint window, "
+			   "aiming at %d%% missed vblanks.\n",
+			   ec->repaint_miss_percent);
+
+	weston_config_section_get_bool(s, "throttle-hidden-surfaces",
+				       &frame_throttle, false);
+	ec->frame_throttle = frame_throttle;
+	weston_config_section_get_int(s, "hidden-frame-interval",
+				      &frame_throttle_msec,
+				      ec->frame_throttle_msec);
+	if (frame_throttle_msec < 0) {
+		weston_log("Invalid hidden-frame-interval value in config: %d\n",
+			   frame_throttle_msec);
+	} else {
+		ec->frame_throttle_msec = frame_throttle_msec;
+	}
+	weston_config_section_get_string(s, "throttle-exempt",
+					 &ec->frame_throttle_exempt, NULL);
+	if (ec->frame_throttle)
+		weston_log("Throttling frame callbacks of hidden surfaces "
+			   "to one per %d ms.\n", ec->frame_throttle_msec);
+
+	weston_config_section_get_int(s, "gl-atlas-size", &gl_atlas_size, 0);
+	if (gl_atlas_size < 0) {
+		weston_log("Invalid gl-atlas-size value in config: %d\n",
+			   gl_atlas_size);
+	} else {
+		ec->gl_atlas_size = gl_atlas_size;
+	}
+
+	weston_config_section_get_int(s, "flight-recorder",
+				      &flight_recorder, 0);
+	if (flight_recorder < 0 || flight_recorder > 600) {
+		weston_log("Invalid flight-recorder value in config: %d\n",
+			   flight_recorder);
+	} else {
+		ec->flight_recorder_msec = flight_recorder * 1000;
+	}
+	weston_config_section_get_int(s, "flight-recorder-repaint",
+				      &flight_repaint_msec, 0);
+	if (flight_repaint_msec < 0 || flight_repaint_msec > 1000) {
+		weston_log("Invalid flight-recorder-repaint value in "
+			   "config: %d\n", flight_repaint_msec);
+	} else {
+		ec->flight_recorder_repaint_usec = flight_repaint_msec * 1000;
+	}
+	weston_timeline_flight_start(ec);
+
 	return 0;
 }
 
@@ -692,6 +762,7 @@ int main(int argc, char *argv[])
 	char *log = NULL;
 	char *server_socket = NULL, *end;
 	int32_t idle_time = -1;
+	int32_t pixman_threads = -1;
 	int32_t help = 0;
 	char *socket_name = NULL;
 	int32_t version = 0;
@@ -711,6 +782,7 @@ int main(int argc, char *argv[])
 		{ WESTON_OPTION_INTEGER, "idle-time", 'i', &idle_time },
 		{ WESTON_OPTION_STRING, "modules", 0, &option_modules },
 		{ WESTON_OPTION_STRING, "log", 0, &log },
+		{ WESTON_OPTION_INTEGER, "pixman-threads", 0, &pixman_threads },
 		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
 		{ WESTON_OPTION_BOOLEAN, "version", 0, &version },
 		{ WESTON_OPTION_BOOLEAN, "no-config", 0, &noconfig },
@@ -778,6 +850,11 @@ int main(int argc, char *argv[])
 	if (weston_compositor_init_config(ec, config) < 0)
 		goto out;
 
+	if (pixman_threads < 0)
+		weston_config_section_get_int(section, "pixman-threads",
+					      &pixman_threads, 0);
+	ec->pixman_threads = pixman_threads > 0 ? pixman_threads : 0;
+
 	if (load_backend(ec, backend, &argc, argv, config) < 0) {
 		weston_log("fatal: failed to create compositor backend\n");
 		goto out;
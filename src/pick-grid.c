@@ -0,0 +1,307 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pick-grid.h"
+
+#define CELL_SHIFT 7			/* 128x128 pixel cells */
+#define BUCKET_COUNT 256		/* must be a power of two */
+#define MAX_ENTRY_CELLS 64		/* beyond this, entry is large */
+
+static inline int32_t
+cell_of(int32_t c)
+{
+	/* arithmetic shift rounds towards negative infinity */
+	return c >> CELL_SHIFT;
+}
+
+static inline unsigned
+bucket_of(int32_t cx, int32_t cy)
+{
+	uint32_t h = (uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u;
+
+	return h & (BUCKET_COUNT - 1);
+}
+
+static int
+bucket_add(struct pick_grid_bucket *bucket, struct pick_grid_entry *entry)
+{
+	struct pick_grid_entry **entries;
+	int alloc;
+
+	if (bucket->count == bucket->alloc) {
+		alloc = bucket->alloc ? bucket->alloc * 2 : 8;
+		entries = realloc(bucket->entries, alloc * sizeof *entries);
+		if (!entries)
+			return -1;
+
+		bucket->entries = entries;
+		bucket->alloc = alloc;
+	}
+
+	bucket->entries[bucket->count++] = entry;
+	bucket->sorted_serial = 0;
+
+	return 0;
+}
+
+static void
+bucket_del(struct pick_grid_bucket *bucket, struct pick_grid_entry *entry)
+{
+	int i;
+
+	/* Removal keeps the bucket sorted. */
+	for (i = bucket->count - 1; i >= 0; i--) {
+		if (bucket->entries[i] == entry) {
+			memmove(&bucket->entries[i], &bucket->entries[i + 1],
+				(bucket->count - i - 1) *
+				sizeof bucket->entries[0]);
+			bucket->count--;
+			return;
+		}
+	}
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+	const struct pick_grid_entry *ea = *(struct pick_grid_entry **)a;
+	const struct pick_grid_entry *eb = *(struct pick_grid_entry **)b;
+
+	if (ea->order < eb->order)
+		return -1;
+
+	return ea->order > eb->order;
+}
+
+static void
+bucket_sort(struct pick_grid *grid, struct pick_grid_bucket *bucket)
+{
+	if (bucket->sorted_serial == grid->order_serial)
+		return;
+
+	qsort(bucket->entries, bucket->count, sizeof bucket->entries[0],
+	      compare_entries);
+	bucket->sorted_serial = grid->order_serial;
+}
+
+static void
+bucket_release(struct pick_grid_bucket *bucket)
+{
+	free(bucket->entries);
+	memset(bucket, 0, sizeof *bucket);
+}
+
+int
+pick_grid_init(struct pick_grid *grid)
+{
+	memset(grid, 0, sizeof *grid);
+	grid->order_serial = 1;
+
+	grid->buckets = calloc(BUCKET_COUNT, sizeof *grid->buckets);
+	if (!grid->buckets)
+		return -1;
+
+	return 0;
+}
+
+void
+pick_grid_release(struct pick_grid *grid)
+{
+	int i;
+
+	if (grid->buckets) {
+		for (i = 0; i < BUCKET_COUNT; i++)
+			bucket_release(&grid->buckets[i]);
+		free(grid->buckets);
+	}
+
+	bucket_release(&grid->large);
+	grid->buckets = NULL;
+}
+
+void
+pick_grid_entry_init(struct pick_grid_entry *entry)
+{
+	memset(entry, 0, sizeof *entry);
+}
+
+void
+pick_grid_remove(struct pick_grid *grid, struct pick_grid_entry *entry)
+{
+	int32_t cx, cy;
+
+	if (entry->missing) {
+		entry->missing = false;
+		grid->incomplete = --grid->missing > 0;
+	}
+
+	if (!entry->indexed)
+		return;
+
+	if (!grid->buckets) {
+		/* released already, nothing to unlink from */
+		entry->indexed = false;
+		return;
+	}
+
+	if (entry->large) {
+		bucket_del(&grid->large, entry);
+	} else {
+		for (cy = entry->cy1; cy <= entry->cy2; cy++)
+			for (cx = entry->cx1; cx <= entry->cx2; cx++)
+				bucket_del(&grid->buckets[bucket_of(cx, cy)],
+					   entry);
+	}
+
+	entry->indexed = false;
+	grid->entries--;
+}
+
+/** Tell the grid that the order of entries has changed
+ *
+ * Call this after changing pick_grid_entry::order of indexed entries.
+ */
+void
+pick_grid_reorder(struct pick_grid *grid)
+{
+	if (++grid->order_serial == 0)
+		++grid->order_serial;
+}
+
+static int
+grid_insert(struct pick_grid *grid, struct pick_grid_entry *entry)
+{
+	int64_t cells;
+	int32_t cx, cy;
+
+	entry->cx1 = cell_of(entry->box.x1);
+	entry->cy1 = cell_of(entry->box.y1);
+	entry->cx2 = cell_of(entry->box.x2 - 1);
+	entry->cy2 = cell_of(entry->box.y2 - 1);
+
+	cells = (int64_t)(entry->cx2 - entry->cx1 + 1) *
+		(entry->cy2 - entry->cy1 + 1);
+	entry->large = cells > MAX_ENTRY_CELLS;
+
+	if (entry->large)
+		return bucket_add(&grid->large, entry);
+
+	for (cy = entry->cy1; cy <= entry->cy2; cy++) {
+		for (cx = entry->cx1; cx <= entry->cx2; cx++) {
+			if (bucket_add(&grid->buckets[bucket_of(cx, cy)],
+				       entry) < 0)
+				goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	/* Undo the partial insertion, cells before (cx, cy). */
+	while (cy > entry->cy1 || cx > entry->cx1) {
+		if (--cx < entry->cx1) {
+			cx = entry->cx2;
+			cy--;
+		}
+		bucket_del(&grid->buckets[bucket_of(cx, cy)], entry);
+	}
+
+	return -1;
+}
+
+/** Index an entry with the given box, or update its box
+ *
+ * Empty boxes are not indexed. If memory runs out, the entry is left
+ * out and grid->incomplete is set; the user must then fall back to
+ * searching without the grid. It is cleared again once every entry
+ * left out has been indexed by a later update, or removed.
+ */
+void
+pick_grid_update(struct pick_grid *grid, struct pick_grid_entry *entry,
+		 const pixman_box32_t *box)
+{
+	if (entry->indexed &&
+	    entry->box.x1 == box->x1 && entry->box.y1 == box->y1 &&
+	    entry->box.x2 == box->x2 && entry->box.y2 == box->y2)
+		return;
+
+	pick_grid_remove(grid, entry);
+
+	if (box->x1 >= box->x2 || box->y1 >= box->y2 || !grid->buckets)
+		return;
+
+	entry->box = *box;
+	if (grid_insert(grid, entry) < 0) {
+		entry->missing = true;
+		grid->missing++;
+		grid->incomplete = true;
+		return;
+	}
+
+	entry->indexed = true;
+	grid->entries++;
+}
+
+static inline bool
+box_contains(const pixman_box32_t *box, int32_t x, int32_t y)
+{
+	return x >= box->x1 && x < box->x2 && y >= box->y1 && y < box->y2;
+}
+
+/** Call func for every entry whose box contains the point
+ *
+ * Entries are visited in ascending order. An entry may be visited more
+ * than once.
+ */
+void
+pick_grid_for_each_at(struct pick_grid *grid, int32_t x, int32_t y,
+		      pick_grid_func_t func, void *data)
+{
+	struct pick_grid_bucket *bucket, *large = &grid->large;
+	struct pick_grid_entry *entry;
+	int i = 0, j = 0;
+
+	bucket = &grid->buckets[bucket_of(cell_of(x), cell_of(y))];
+	bucket_sort(grid, bucket);
+	bucket_sort(grid, large);
+
+	/* merge the cell bucket with the large entries */
+	while (i < bucket->count || j < large->count) {
+		if (j == large->count ||
+		    (i < bucket->count &&
+		     bucket->entries[i]->order < large->entries[j]->order))
+			entry = bucket->entries[i++];
+		else
+			entry = large->entries[j++];
+
+		if (box_contains(&entry->box, x, y) && func(entry, data))
+			return;
+	}
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_PICK_GRID_H
+#define WESTON_PICK_GRID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pixman.h>
+
+/* A spatial index of bounding boxes for answering "what contains this
+ * point" without walking every box.
+ *
+ * Space is divided into square cells, and each cell is hashed into a
+ * fixed number of buckets. Every entry is listed in the bucket of each
+ * cell its box touches. Boxes touching too many cells, like fullscreen
+ * backgrounds, are kept in a separate list that is always searched.
+ *
+ * Entries carry a user defined order, lowest first. Buckets are sorted
+ * lazily when searched, so that the search can stop at the first hit.
+ */
+
+struct pick_grid_bucket {
+	struct pick_grid_entry **entries;
+	int count;
+	int alloc;
+	uint32_t sorted_serial;
+};
+
+struct pick_grid_entry {
+	pixman_box32_t box;		/* the indexed box */
+	int32_t cx1, cy1, cx2, cy2;	/* cells covered, inclusive */
+	uint32_t order;
+	bool indexed;
+	bool large;
+	bool missing;			/* left out for lack of memory */
+};
+
+struct pick_grid {
+	struct pick_grid_bucket *buckets;
+	struct pick_grid_bucket large;
+	int entries;
+	uint32_t order_serial;
+
+	/* An allocation failed and some entry is missing, until all
+	 * missing entries have been indexed or removed. */
+	bool incomplete;
+	int missing;
+};
+
+/* Return non-zero to stop the iteration. */
+typedef int (*pick_grid_func_t)(struct pick_grid_entry *entry, void *data);
+
+int
+pick_grid_init(struct pick_grid *grid);
+
+void
+pick_grid_release(struct pick_grid *grid);
+
+void
+pick_grid_entry_init(struct pick_grid_entry *entry);
+
+void
+pick_grid_update(struct pick_grid *grid, struct pick_grid_entry *entry,
+		 const pixman_box32_t *box);
+
+void
+pick_grid_remove(struct pick_grid *grid, struct pick_grid_entry *entry);
+
+void
+pick_grid_reorder(struct pick_grid *grid);
+
+void
+pick_grid_for_each_at(struct pick_grid *grid, int32_t x, int32_t y,
+		      pick_grid_func_t func, void *data);
+
+#endif
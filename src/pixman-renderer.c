@@ -29,25 +29,102 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUV_NEON 1
+#endif
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
 
 #include <linux/input.h>
 
+/* With more than one band, the damage of an output is split into
+ * horizontal bands in output space, and each band is composited on its
+ * own thread. Band 0 is painted by the main thread. Splitting into whole
+ * rows keeps every scanline span the same as without bands, so the result
+ * does not depend on the number of bands.
+ */
+#define PIXMAN_MAX_BANDS 16
+#define PIXMAN_MIN_BAND_ROWS 64
+
+/* Number of frames of damage kept for hardware buffers that are reused */
+#define PIXMAN_BUFFER_DAMAGE_COUNT 3
+
 struct pixman_output_state {
-	void *shadow_buffer;
+	bool use_shadow;
+	void *shadow_buffer;	/* created on first use without use_shadow */
 	pixman_image_t *shadow_image;
+	bool shadow_complete;	/* has every frame, so far */
 	pixman_image_t *hw_buffer;
+
+	/* The hardware buffers of the last frames, most recent first, and
+	 * the damage of these frames. A buffer found here lacks the damage
+	 * of the frames after it. */
+	pixman_image_t *age_buffers[PIXMAN_BUFFER_DAMAGE_COUNT];
+	pixman_region32_t frame_damage[PIXMAN_BUFFER_DAMAGE_COUNT];
+	int32_t damage_x, damage_y;	/* output position of the damage */
+};
+
+struct pixman_band {
+	struct weston_output *output;
+	pixman_region32_t *damage;	/* in global coordinates */
+	pixman_image_t *target;
+	struct weston_region_pool *pool;
+	bool threaded;	/* other bands are painted at the same time */
+	int overdraw;	/* most boxes composite_clipped() painted */
+};
+
+struct pixman_band_worker {
+	struct pixman_renderer *renderer;
+	int index;
+	pthread_t thread;
+
+	struct pixman_band band;
+	pixman_region32_t damage;
+	struct weston_region_pool pool;
+};
+
+/* Number of images of recently attached shm buffers kept per surface */
+#define PIXMAN_SHM_IMAGE_CACHE 4
+
+struct pixman_shm_image {
+	struct wl_shm_pool *pool;	/* reference, keeps data mapped */
+	void *data;
+	pixman_format_code_t format;
+	int32_t width, height, stride;
+	pixman_image_t *image;
+	uint32_t last_use;
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color;	/* of a solid color image */
 	struct weston_buffer_reference buffer_ref;
 
+	struct pixman_shm_image shm_images[PIXMAN_SHM_IMAGE_CACHE];
+	uint32_t shm_image_serial;
+
+	/* Solid mask of the alpha of the views, rebuilt when that changes */
+	pixman_image_t *mask_image;
+	uint16_t mask_alpha;
+
+	/* YUV shm buffers are converted into this image on flush_damage */
+	pixman_image_t *yuv_image;
+	uint32_t yuv_format;	/* of the attached buffer, or 0 */
+	bool yuv_full;		/* convert everything, not just damage */
+	uint8_t *yuv_scratch;	/* unpacked samples of a row */
+	int32_t yuv_scratch_width;
+
 	struct wl_listener buffer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
@@ -60,9 +137,24 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	int n_bands;
+	struct pixman_band_worker *workers;	/* n_bands - 1 */
+	pthread_mutex_t band_mutex;
+	pthread_cond_t band_work_cond;
+	pthread_cond_t band_done_cond;
+	uint32_t band_serial;	/* bumped for every dispatch */
+	int band_active;	/* bands of the current dispatch */
+	int band_pending;	/* worker bands not painted yet */
+	bool band_quit;
+	bool overdraw_warned;
+
 	struct wl_signal destroy_signal;
 };
 
+static const pixman_color_t debug_red = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
+};
+
 static inline struct pixman_output_state *
 get_output_state(struct weston_output *output)
 {
@@ -212,12 +304,13 @@ region_intersect_only_translation(pixman_region32_t *result_global,
 
 	assert(view_transformation_is_translation(view));
 
-	/* Convert from surface to global coordinates */
-	pixman_region32_copy(result_global, surf);
+	/* Intersect in surface coordinates, so that no copy of surf is
+	 * needed, then convert the result to global coordinates */
 	weston_view_to_global_float(view, 0, 0, &view_x, &view_y);
+	pixman_region32_translate(global, -(int)view_x, -(int)view_y);
+	pixman_region32_intersect(result_global, global, surf);
+	pixman_region32_translate(global, (int)view_x, (int)view_y);
 	pixman_region32_translate(result_global, (int)view_x, (int)view_y);
-
-	pixman_region32_intersect(result_global, result_global, global);
 }
 
 static void
@@ -244,7 +337,27 @@ composite_whole(pixman_op_t op,
 				 dest_width, dest_height);
 }
 
+/* Sources without pixels are solid colors, which look the same whatever
+ * the transform and filter. Leaving those alone lets the bands share the
+ * image once it was validated, see validate_image().
+ */
 static void
+composite_solid(pixman_op_t op,
+		pixman_image_t *src,
+		pixman_image_t *mask,
+		pixman_image_t *dest)
+{
+	pixman_image_composite32(op, src, mask, dest,
+				 0, 0, /* src_x, src_y */
+				 0, 0, /* mask_x, mask_y */
+				 0, 0, /* dest_x, dest_y */
+				 pixman_image_get_width(dest),
+				 pixman_image_get_height(dest));
+}
+
+/* Returns the number of times the source was painted, one per box of
+ * src_clip. */
+static int
 composite_clipped(pixman_image_t *src,
 		  pixman_image_t *mask,
 		  pixman_image_t *dest,
@@ -305,43 +418,75 @@ composite_clipped(pixman_image_t *src,
 		pixman_image_unref(boximg);
 	}
 
-	if (n_box > 1) {
-		static bool warned = false;
+	return n_box;
+}
 
-		if (!warned)
-			weston_log("Pixman-renderer warning: %dx overdraw\n",
-				   n_box);
-		warned = true;
-	}
+/* composite_whole() sets the transform and filter of its source, so while
+ * several bands are painted at once each of them wraps the surface image
+ * in an image of its own. The pixels are not copied.
+ */
+static pixman_image_t *
+band_source_image(struct pixman_band *band, struct pixman_surface_state *ps)
+{
+	if (!band->threaded)
+		return pixman_image_ref(ps->image);
+
+	return pixman_image_create_bits_no_clear(
+			pixman_image_get_format(ps->image),
+			pixman_image_get_width(ps->image),
+			pixman_image_get_height(ps->image),
+			pixman_image_get_data(ps->image),
+			pixman_image_get_stride(ps->image));
+}
+
+static pixman_image_t *
+surface_update_mask(struct pixman_surface_state *ps, uint16_t alpha)
+{
+	pixman_color_t mask = { 0, };
+
+	if (ps->mask_image && ps->mask_alpha == alpha)
+		return ps->mask_image;
+
+	if (ps->mask_image)
+		pixman_image_unref(ps->mask_image);
+
+	mask.alpha = alpha;
+	ps->mask_image = pixman_image_create_solid_fill(&mask);
+	ps->mask_alpha = alpha;
+
+	return ps->mask_image;
 }
 
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
- * \param output The output being painted.
+ * \param band The band of the output being painted.
  * \param repaint_output The region to be painted in output coordinates.
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
  * \param pixman_op Compositing operator, either SRC or OVER.
  */
 static void
-repaint_region(struct weston_view *ev, struct weston_output *output,
+repaint_region(struct weston_view *ev, struct pixman_band *band,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
 {
+	struct weston_output *output = band->output;
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
-	pixman_image_t *mask_image;
+	pixman_image_t *mask_image = NULL;
+	pixman_image_t *band_mask = NULL;
+	pixman_image_t *src_image;
 	pixman_color_t mask = { 0, };
+	int overdraw;
 
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(band->target, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -353,97 +498,117 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
 
+	/* The surface mask is prepared before bands are painted, other
+	 * views of the surface get masks of their own */
 	if (ev->alpha < 1.0) {
 		mask.alpha = 0xffff * ev->alpha;
-		mask_image = pixman_image_create_solid_fill(&mask);
-	} else {
-		mask_image = NULL;
+		if (ps->mask_image && ps->mask_alpha == mask.alpha)
+			mask_image = ps->mask_image;
+		else if (band->threaded)
+			mask_image = band_mask =
+				pixman_image_create_solid_fill(&mask);
+		else
+			mask_image = surface_update_mask(ps, mask.alpha);
 	}
 
-	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
-				  &transform, filter, source_clip);
-	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+	if (source_clip) {
+		overdraw = composite_clipped(ps->image, mask_image,
+					     band->target, &transform, filter,
+					     source_clip);
+		band->overdraw = MAX(band->overdraw, overdraw);
+	} else if (!pixman_image_get_data(ps->image)) {
+		composite_solid(pixman_op, ps->image, mask_image,
+				band->target);
+	} else {
+		src_image = band_source_image(band, ps);
+		composite_whole(pixman_op, src_image, mask_image,
+				band->target, &transform, filter);
+		pixman_image_unref(src_image);
+	}
 
-	if (mask_image)
-		pixman_image_unref(mask_image);
+	if (band_mask)
+		pixman_image_unref(band_mask);
 
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
 	if (pr->repaint_debug)
-		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
-					 NULL /* mask */,
-					 po->shadow_image, /* dest */
-					 0, 0, /* src_x, src_y */
-					 0, 0, /* mask_x, mask_y */
-					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+		composite_solid(PIXMAN_OP_OVER, pr->debug_color, NULL,
+				band->target);
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	pixman_image_set_clip_region32 (band->target, NULL);
 }
 
 static void
-draw_view_translated(struct weston_view *view, struct weston_output *output,
+draw_view_translated(struct weston_view *view, struct pixman_band *band,
 		     pixman_region32_t *repaint_global)
 {
+	struct weston_output *output = band->output;
 	struct weston_surface *surface = view->surface;
 	/* non-opaque region in surface coordinates: */
-	pixman_region32_t surface_blend;
+	pixman_region32_t *surface_blend;
 	/* region to be painted in output coordinates: */
-	pixman_region32_t repaint_output;
-
-	pixman_region32_init(&repaint_output);
+	pixman_region32_t *repaint_output;
+	pixman_region32_t surface_rect, fallback;
 
 	/* Blended region is whole surface minus opaque region,
-	 * unless surface alpha forces us to blend all.
+	 * unless surface alpha forces us to blend all. The local
+	 * regions are used when the pool is out of memory.
 	 */
-	pixman_region32_init_rect(&surface_blend, 0, 0,
+	pixman_region32_init_rect(&surface_rect, 0, 0,
 				  surface->width, surface->height);
+	pixman_region32_init(&fallback);
+	surface_blend = &surface_rect;
 
 	if (!(view->alpha < 1.0)) {
-		pixman_region32_subtract(&surface_blend, &surface_blend,
+		surface_blend = weston_region_pool_get(band->pool);
+		if (!surface_blend)
+			surface_blend = &surface_rect;
+		pixman_region32_subtract(surface_blend, &surface_rect,
 					 &surface->opaque);
 
 		if (pixman_region32_not_empty(&surface->opaque)) {
-			region_intersect_only_translation(&repaint_output,
+			repaint_output = weston_region_pool_get(band->pool);
+			if (!repaint_output)
+				repaint_output = &fallback;
+			region_intersect_only_translation(repaint_output,
 							  repaint_global,
 							  &surface->opaque,
 							  view);
-			region_global_to_output(output, &repaint_output);
+			region_global_to_output(output, repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
+			repaint_region(view, band, repaint_output, NULL,
 				       PIXMAN_OP_SRC);
 		}
 	}
 
-	if (pixman_region32_not_empty(&surface_blend)) {
-		region_intersect_only_translation(&repaint_output,
+	if (pixman_region32_not_empty(surface_blend)) {
+		repaint_output = weston_region_pool_get(band->pool);
+		if (!repaint_output)
+			repaint_output = &fallback;
+		region_intersect_only_translation(repaint_output,
 						  repaint_global,
-						  &surface_blend, view);
-		region_global_to_output(output, &repaint_output);
+						  surface_blend, view);
+		region_global_to_output(output, repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, band, repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
-	pixman_region32_fini(&surface_blend);
-	pixman_region32_fini(&repaint_output);
+	pixman_region32_fini(&fallback);
+	pixman_region32_fini(&surface_rect);
 }
 
 static void
 draw_view_source_clipped(struct weston_view *view,
-			 struct weston_output *output,
+			 struct pixman_band *band,
 			 pixman_region32_t *repaint_global)
 {
+	struct weston_output *output = band->output;
 	struct weston_surface *surface = view->surface;
 	pixman_region32_t surf_region;
 	pixman_region32_t buffer_region;
-	pixman_region32_t repaint_output;
+	pixman_region32_t *repaint_output, fallback;
 
 	/* Do not bother separating the opaque region from non-opaque.
 	 * Source clipping requires PIXMAN_OP_OVER in all cases, so painting
@@ -459,37 +624,46 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_init(&buffer_region);
 	weston_surface_to_buffer_region(surface, &surf_region, &buffer_region);
 
-	pixman_region32_init(&repaint_output);
-	pixman_region32_copy(&repaint_output, repaint_global);
-	region_global_to_output(output, &repaint_output);
+	pixman_region32_init(&fallback);
+	repaint_output = weston_region_pool_get(band->pool);
+	if (!repaint_output)
+		repaint_output = &fallback;
+	pixman_region32_copy(repaint_output, repaint_global);
+	region_global_to_output(output, repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, band, repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
-	pixman_region32_fini(&repaint_output);
+	pixman_region32_fini(&fallback);
 	pixman_region32_fini(&buffer_region);
 	pixman_region32_fini(&surf_region);
 }
 
 static void
-draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+draw_view(struct weston_view *ev, struct pixman_band *band)
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
 	/* repaint bounding region in global coordinates: */
-	pixman_region32_t repaint;
+	pixman_region32_t *repaint, *tmp;
 
 	/* No buffer attached */
 	if (!ps->image)
 		return;
 
-	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &ev->transform.boundingbox, damage);
-	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
+	repaint = weston_region_pool_get(band->pool);
+	tmp = weston_region_pool_get(band->pool);
+	if (repaint && tmp) {
+		pixman_region32_intersect(tmp, &ev->transform.boundingbox,
+					  band->damage);
+		pixman_region32_subtract(repaint, tmp, &ev->clip);
+	} else {
+		/* Out of memory; the views above are painted later, over
+		 * what is not clipped here. */
+		repaint = band->damage;
+	}
 
-	if (!pixman_region32_not_empty(&repaint))
-		goto out;
+	if (!pixman_region32_not_empty(repaint))
+		return;
 
 	if (view_transformation_is_translation(ev)) {
 		/* The simple case: The surface regions opaque, non-opaque,
@@ -499,7 +673,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, band, repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -508,48 +682,406 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, band, repaint);
 	}
-
-out:
-	pixman_region32_fini(&repaint);
 }
+
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_band(struct pixman_band *band)
 {
+	struct weston_output *output = band->output;
 	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	struct weston_view **views = output->view_list.data;
+	int i = output->view_list.size / sizeof *views;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	while (i-- > 0)
+		if (views[i]->plane == &compositor->primary_plane)
+			draw_view(views[i], band);
+}
+
+static bool
+output_rows_are_global_columns(struct weston_output *output)
+{
+	switch (output->transform) {
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_270:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* The number of bands worth painting the damage in, or 1 */
+static int
+band_count(struct pixman_renderer *pr, struct weston_output *output,
+	   pixman_region32_t *damage)
+{
+	pixman_box32_t *extents = pixman_region32_extents(damage);
+	int rows;
+
+	/* Zoom rounds output regions outwards, adjacent bands would
+	 * overlap */
+	if (pr->n_bands < 2 || output->zoom.active)
+		return 1;
+
+	if (output_rows_are_global_columns(output))
+		rows = extents->x2 - extents->x1;
+	else
+		rows = extents->y2 - extents->y1;
+
+	rows = rows * output->current_scale / PIXMAN_MIN_BAND_ROWS;
+
+	return rows > 1 ? MIN(rows, pr->n_bands) : 1;
 }
 
 static void
-copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
+band_damage(pixman_region32_t *band_damage, pixman_region32_t *damage,
+	    struct weston_output *output, int index, int count)
 {
-	struct pixman_output_state *po = get_output_state(output);
-	pixman_region32_t output_region;
+	pixman_box32_t extents = *pixman_region32_extents(damage);
+	int32_t lo, hi;
+
+	if (output_rows_are_global_columns(output)) {
+		lo = extents.x1 + (extents.x2 - extents.x1) * index / count;
+		hi = extents.x1 + (extents.x2 - extents.x1) *
+			(index + 1) / count;
+		pixman_region32_intersect_rect(band_damage, damage,
+					       lo, extents.y1, hi - lo,
+					       extents.y2 - extents.y1);
+	} else {
+		lo = extents.y1 + (extents.y2 - extents.y1) * index / count;
+		hi = extents.y1 + (extents.y2 - extents.y1) *
+			(index + 1) / count;
+		pixman_region32_intersect_rect(band_damage, damage,
+					       extents.x1, lo,
+					       extents.x2 - extents.x1, hi - lo);
+	}
+}
+
+static void *
+band_worker_main(void *data)
+{
+	struct pixman_band_worker *worker = data;
+	struct pixman_renderer *pr = worker->renderer;
+	uint32_t serial = 0;
+
+	pthread_mutex_lock(&pr->band_mutex);
+	for (;;) {
+		while (!pr->band_quit && pr->band_serial == serial)
+			pthread_cond_wait(&pr->band_work_cond,
+					  &pr->band_mutex);
+		if (pr->band_quit)
+			break;
+
+		serial = pr->band_serial;
+		if (worker->index >= pr->band_active)
+			continue;
+
+		pthread_mutex_unlock(&pr->band_mutex);
+
+		repaint_band(&worker->band);
+		weston_region_pool_reset(&worker->pool);
+
+		pthread_mutex_lock(&pr->band_mutex);
+		if (--pr->band_pending == 0)
+			pthread_cond_signal(&pr->band_done_cond);
+	}
+	pthread_mutex_unlock(&pr->band_mutex);
+
+	return NULL;
+}
+
+/* pixman computes the properties of an image when it is first used in a
+ * composite operation. Doing that before the bands start leaves shared
+ * images read-only for them. Nothing is painted.
+ */
+static void
+validate_image(pixman_image_t *image, pixman_image_t *dest)
+{
+	pixman_image_composite32(PIXMAN_OP_DST, image, NULL, dest,
+				 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+static void
+prepare_view(struct weston_view *view, pixman_image_t *target)
+{
+	struct pixman_surface_state *ps = get_surface_state(view->surface);
+
+	if (!ps->image)
+		return;
+
+	if (!pixman_image_get_data(ps->image))
+		validate_image(ps->image, target);
 
-	pixman_region32_init(&output_region);
-	pixman_region32_copy(&output_region, region);
+	if (view->alpha < 1.0)
+		validate_image(surface_update_mask(ps, 0xffff * view->alpha),
+			       target);
+}
 
-	region_global_to_output(output, &output_region);
+/* composite_clipped() paints the source once for each box of its clip.
+ * The bands only count that, it is logged from here once they are done.
+ */
+static void
+report_overdraw(struct pixman_renderer *pr, int overdraw)
+{
+	if (overdraw < 2 || pr->overdraw_warned)
+		return;
+
+	weston_log("Pixman-renderer warning: %dx overdraw\n", overdraw);
+	pr->overdraw_warned = true;
+}
+
+/* An image of the pixels of target with a clip region of its own */
+static pixman_image_t *
+band_target_image(pixman_image_t *target)
+{
+	return pixman_image_create_bits_no_clear(
+			pixman_image_get_format(target),
+			pixman_image_get_width(target),
+			pixman_image_get_height(target),
+			pixman_image_get_data(target),
+			pixman_image_get_stride(target));
+}
+
+static void
+repaint_surfaces(struct weston_output *output, pixman_region32_t *damage,
+		 pixman_image_t *target)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct weston_view **views = output->view_list.data;
+	struct pixman_band_worker *worker;
+	struct pixman_band band;
+	pixman_region32_t *band_region = NULL;
+	int i, n;
+
+	band.output = output;
+	band.damage = damage;
+	band.target = target;
+	band.pool = &output->region_pool;
+	band.threaded = false;
+	band.overdraw = 0;
+
+	/* Paint in one band if the pool is out of memory */
+	n = band_count(pr, output, damage);
+	if (n > 1) {
+		band_region = weston_region_pool_get(&output->region_pool);
+		if (!band_region)
+			n = 1;
+	}
+
+	for (i = 1; i < n; i++) {
+		worker = &pr->workers[i - 1];
+		worker->band.target = band_target_image(target);
+		if (!worker->band.target) {
+			n = i;
+			break;
+		}
+	}
+
+	if (n < 2) {
+		repaint_band(&band);
+		report_overdraw(pr, band.overdraw);
+		return;
+	}
+
+	/* Surface states and masks are created on first use, do that
+	 * here rather than on the workers */
+	for (i = 0; i < (int) (output->view_list.size / sizeof *views); i++)
+		prepare_view(views[i], target);
+	if (pr->repaint_debug)
+		validate_image(pr->debug_color, target);
+
+	pthread_mutex_lock(&pr->band_mutex);
+	for (i = 1; i < n; i++) {
+		worker = &pr->workers[i - 1];
+		worker->band.output = output;
+		worker->band.overdraw = 0;
+		band_damage(&worker->damage, damage, output, i, n);
+	}
+	pr->band_active = n;
+	pr->band_pending = n - 1;
+	pr->band_serial++;
+	pthread_cond_broadcast(&pr->band_work_cond);
+	pthread_mutex_unlock(&pr->band_mutex);
+
+	band.damage = band_region;
+	band.threaded = true;
+	band_damage(band.damage, damage, output, 0, n);
+	repaint_band(&band);
+
+	pthread_mutex_lock(&pr->band_mutex);
+	while (pr->band_pending > 0)
+		pthread_cond_wait(&pr->band_done_cond, &pr->band_mutex);
+	pthread_mutex_unlock(&pr->band_mutex);
+
+	for (i = 1; i < n; i++) {
+		worker = &pr->workers[i - 1];
+		pixman_image_unref(worker->band.target);
+		worker->band.target = NULL;
+		band.overdraw = MAX(band.overdraw, worker->band.overdraw);
+	}
+	report_overdraw(pr, band.overdraw);
+}
+
+static void
+copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t *output_region, fallback;
+	pixman_box32_t *extents;
+
+	pixman_region32_init(&fallback);
+	output_region = weston_output_get_scratch_region(output);
+	if (!output_region)
+		output_region = &fallback;
+	pixman_region32_copy(output_region, region);
+
+	region_global_to_output(output, output_region);
+	if (!pixman_region32_not_empty(output_region)) {
+		pixman_region32_fini(&fallback);
+		return;
+	}
 
-	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
-	pixman_region32_fini(&output_region);
+	pixman_image_set_clip_region32 (po->hw_buffer, output_region);
 
+	/* Only walk the rows and columns that are copied */
+	extents = pixman_region32_extents(output_region);
 	pixman_image_composite32(PIXMAN_OP_SRC,
 				 po->shadow_image, /* src */
 				 NULL /* mask */,
 				 po->hw_buffer, /* dest */
-				 0, 0, /* src_x, src_y */
+				 extents->x1, extents->y1, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
-				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->hw_buffer), /* width */
-				 pixman_image_get_height (po->hw_buffer) /* height */);
+				 extents->x1, extents->y1, /* dest_x, dest_y */
+				 extents->x2 - extents->x1, /* width */
+				 extents->y2 - extents->y1 /* height */);
 
 	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
+	pixman_region32_fini(&fallback);
+}
+
+/* Frames since hw_buffer was painted last, or 0 if unknown */
+static int
+output_buffer_age(struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	int i;
+
+	/* The damage history is in global coordinates */
+	if (po->damage_x != output->x || po->damage_y != output->y)
+		return 0;
+
+	for (i = 0; i < PIXMAN_BUFFER_DAMAGE_COUNT; i++)
+		if (po->age_buffers[i] == po->hw_buffer)
+			return i + 1;
+
+	return 0;
+}
+
+/* The region hw_buffer has to be updated in: the damage of this frame
+ * and of the frames painted into other buffers since hw_buffer was
+ * painted last. */
+static void
+output_get_buffer_damage(struct weston_output *output,
+			 pixman_region32_t *output_damage,
+			 pixman_region32_t *buffer_damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	int age = output_buffer_age(output);
+	int i;
+
+	if (age == 0) {
+		pixman_region32_copy(buffer_damage, &output->region);
+		return;
+	}
+
+	pixman_region32_copy(buffer_damage, output_damage);
+	for (i = 0; i < age - 1; i++)
+		pixman_region32_union(buffer_damage, buffer_damage,
+				      &po->frame_damage[i]);
+}
+
+static void
+output_rotate_buffer_damage(struct weston_output *output,
+			    pixman_region32_t *output_damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	const int last = PIXMAN_BUFFER_DAMAGE_COUNT - 1;
+	pixman_region32_t tmp;
+	int i;
+
+	if (po->age_buffers[last])
+		pixman_image_unref(po->age_buffers[last]);
+
+	for (i = last; i > 0; i--) {
+		po->age_buffers[i] = po->age_buffers[i - 1];
+		tmp = po->frame_damage[i];
+		po->frame_damage[i] = po->frame_damage[i - 1];
+		po->frame_damage[i - 1] = tmp;
+	}
+
+	/* Hold a reference, so a new buffer cannot take the address of
+	 * an old one */
+	po->age_buffers[0] = pixman_image_ref(po->hw_buffer);
+	pixman_region32_copy(&po->frame_damage[0], output_damage);
+	po->damage_x = output->x;
+	po->damage_y = output->y;
+}
+
+static void
+output_clear_buffer_damage(struct pixman_output_state *po)
+{
+	int i;
+
+	for (i = 0; i < PIXMAN_BUFFER_DAMAGE_COUNT; i++) {
+		if (po->age_buffers[i])
+			pixman_image_unref(po->age_buffers[i]);
+		po->age_buffers[i] = NULL;
+	}
+}
+
+static int
+output_create_shadow(struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	int w = output->current_mode->width;
+	int h = output->current_mode->height;
+
+	po->shadow_buffer = malloc(w * h * 4);
+	if (!po->shadow_buffer)
+		return -1;
+
+	po->shadow_image =
+		pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
+					 po->shadow_buffer, w * 4);
+	if (!po->shadow_image) {
+		free(po->shadow_buffer);
+		po->shadow_buffer = NULL;
+		return -1;
+	}
+
+	po->shadow_complete = false;
+
+	return 0;
+}
+
+/* Whether views can be composited into hw_buffer itself, with the same
+ * result as compositing into the shadow image and copying */
+static bool
+output_renders_direct(struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+
+	if (po->use_shadow)
+		return false;
+
+	return pixman_image_get_format(po->hw_buffer) == PIXMAN_x8r8g8b8 &&
+		pixman_image_get_width(po->hw_buffer) ==
+			output->current_mode->width &&
+		pixman_image_get_height(po->hw_buffer) ==
+			output->current_mode->height;
 }
 
 static void
@@ -557,12 +1089,44 @@ pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t *buffer_damage, fallback;
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	/* Used when the pool is out of memory */
+	pixman_region32_init(&fallback);
+	buffer_damage = weston_output_get_scratch_region(output);
+	if (!buffer_damage)
+		buffer_damage = &fallback;
+	output_get_buffer_damage(output, output_damage, buffer_damage);
+
+	if (output_renders_direct(output)) {
+		repaint_surfaces(output, buffer_damage, po->hw_buffer);
+		po->shadow_complete = false;
+	} else {
+		if (!po->shadow_image && output_create_shadow(output) < 0) {
+			weston_log("Pixman renderer: failed to create shadow "
+				   "image for output %s\n", output->name);
+			pixman_region32_fini(&fallback);
+			return;
+		}
+
+		if (po->shadow_complete) {
+			repaint_surfaces(output, output_damage,
+					 po->shadow_image);
+		} else {
+			repaint_surfaces(output, &output->region,
+					 po->shadow_image);
+			pixman_region32_copy(buffer_damage, &output->region);
+			po->shadow_complete = true;
+		}
+
+		copy_to_hw_buffer(output, buffer_damage);
+	}
+
+	pixman_region32_fini(&fallback);
+	output_rotate_buffer_damage(output, output_damage);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -570,10 +1134,279 @@ pixman_renderer_repaint_output(struct weston_output *output,
 	/* Actual flip should be done by caller */
 }
 
+/* 8 bit YUV in BT.601 limited range to x8r8g8b8. The arithmetic is the
+ * usual integer form, in a range the SIMD versions reproduce exactly.
+ */
+static inline uint8_t
+yuv_clamp(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline uint32_t
+yuv_pixel(int y, int u, int v)
+{
+	int c = y - 16, d = u - 128, e = v - 128;
+
+	return 0xff000000 |
+		yuv_clamp((298 * c + 409 * e + 128) >> 8) << 16 |
+		yuv_clamp((298 * c - 100 * d - 208 * e + 128) >> 8) << 8 |
+		yuv_clamp((298 * c + 516 * d + 128) >> 8);
+}
+
+#if defined(__SSE2__)
+/* a * ka + b * kb + p * kp + 128, then >> 8, for eight 16 bit lanes */
+static inline __m128i
+yuv_channel_sse2(__m128i a, __m128i b, __m128i p, int16_t ka, int16_t kb,
+		 int16_t kp)
+{
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i kab = _mm_set1_epi32((uint16_t) ka |
+					   (uint32_t) (uint16_t) kb << 16);
+	const __m128i kpr = _mm_set1_epi32((uint16_t) kp | 128 << 16);
+	__m128i lo, hi;
+
+	lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), kab),
+			   _mm_madd_epi16(_mm_unpacklo_epi16(p, one), kpr));
+	hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), kab),
+			   _mm_madd_epi16(_mm_unpackhi_epi16(p, one), kpr));
+
+	return _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+}
+
+static inline void
+yuv_block_sse2(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+	       const uint8_t *v)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c, d, e, uu, vv, r, g, b, bg, ra;
+	uint32_t u4, v4;
+
+	memcpy(&u4, u, 4);
+	memcpy(&v4, v, 4);
+	uu = _mm_cvtsi32_si128(u4);
+	vv = _mm_cvtsi32_si128(v4);
+
+	/* one chroma sample for two pixels */
+	uu = _mm_unpacklo_epi8(uu, uu);
+	vv = _mm_unpacklo_epi8(vv, vv);
+
+	c = _mm_sub_epi16(_mm_unpacklo_epi8(
+		_mm_loadl_epi64((const __m128i *) y), zero),
+		_mm_set1_epi16(16));
+	d = _mm_sub_epi16(_mm_unpacklo_epi8(uu, zero), _mm_set1_epi16(128));
+	e = _mm_sub_epi16(_mm_unpacklo_epi8(vv, zero), _mm_set1_epi16(128));
+
+	r = yuv_channel_sse2(c, e, d, 298, 409, 0);
+	g = yuv_channel_sse2(c, d, e, 298, -100, -208);
+	b = yuv_channel_sse2(c, d, e, 298, 516, 0);
+
+	r = _mm_packus_epi16(r, r);
+	g = _mm_packus_epi16(g, g);
+	b = _mm_packus_epi16(b, b);
+
+	bg = _mm_unpacklo_epi8(b, g);
+	ra = _mm_unpacklo_epi8(r, _mm_set1_epi8((char) 0xff));
+	_mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *) (dst + 4), _mm_unpackhi_epi16(bg, ra));
+}
+#elif defined(YUV_NEON)
+static inline uint8x8_t
+yuv_channel_neon(int16x8_t a, int16x8_t b, int16x8_t p, int16_t ka,
+		 int16_t kb, int16_t kp)
+{
+	const int32x4_t round = vdupq_n_s32(128);
+	int32x4_t lo, hi;
+
+	lo = vmlal_n_s16(vmull_n_s16(vget_low_s16(a), ka),
+			 vget_low_s16(b), kb);
+	lo = vaddq_s32(vmlal_n_s16(lo, vget_low_s16(p), kp), round);
+	hi = vmlal_n_s16(vmull_n_s16(vget_high_s16(a), ka),
+			 vget_high_s16(b), kb);
+	hi = vaddq_s32(vmlal_n_s16(hi, vget_high_s16(p), kp), round);
+
+	return vqmovun_s16(vcombine_s16(vqshrn_n_s32(lo, 8),
+					vqshrn_n_s32(hi, 8)));
+}
+
+static inline void
+yuv_block_neon(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+	       const uint8_t *v)
+{
+	uint8x8x4_t px;
+	int16x8_t c, d, e;
+	uint8x8_t uu, vv;
+	uint32_t u4, v4;
+
+	memcpy(&u4, u, 4);
+	memcpy(&v4, v, 4);
+
+	/* one chroma sample for two pixels */
+	uu = vreinterpret_u8_u32(vdup_n_u32(u4));
+	uu = vzip_u8(uu, uu).val[0];
+	vv = vreinterpret_u8_u32(vdup_n_u32(v4));
+	vv = vzip_u8(vv, vv).val[0];
+
+	c = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y))),
+		      vdupq_n_s16(16));
+	d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uu)), vdupq_n_s16(128));
+	e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vv)), vdupq_n_s16(128));
+
+	px.val[0] = yuv_channel_neon(c, d, e, 298, 516, 0);
+	px.val[1] = yuv_channel_neon(c, d, e, 298, -100, -208);
+	px.val[2] = yuv_channel_neon(c, e, d, 298, 409, 0);
+	px.val[3] = vdup_n_u8(0xff);
+	vst4_u8((uint8_t *) dst, px);
+}
+#endif
+
+/* Converts 'width' pixels, starting at an even pixel. u and v have one
+ * sample for every two pixels.
+ */
+static void
+yuv_row(uint32_t *dst, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	int width)
+{
+	int x = 0;
+
+#if defined(__SSE2__)
+	for (; x + 8 <= width; x += 8)
+		yuv_block_sse2(dst + x, y + x, u + x / 2, v + x / 2);
+#elif defined(YUV_NEON)
+	for (; x + 8 <= width; x += 8)
+		yuv_block_neon(dst + x, y + x, u + x / 2, v + x / 2);
+#endif
+
+	for (; x < width; x++)
+		dst[x] = yuv_pixel(y[x], u[x / 2], v[x / 2]);
+}
+
+static bool
+is_yuv_format(uint32_t format)
+{
+	return format == WL_SHM_FORMAT_YUV420 ||
+		format == WL_SHM_FORMAT_NV12 ||
+		format == WL_SHM_FORMAT_YUYV;
+}
+
+/* Bytes of the scratch row convert_yuv_box() unpacks samples into */
+static int32_t
+yuv_scratch_size(int32_t width)
+{
+	return width + 2 * ((width + 1) / 2);
+}
+
+/* Converts 'box' of a YUV shm buffer into the x8r8g8b8 image 'image',
+ * using 'scratch' of yuv_scratch_size() of the buffer width. The planes
+ * are laid out as described in compositor.h.
+ */
+static void
+convert_yuv_box(pixman_image_t *image, uint8_t *scratch, uint32_t format,
+		const uint8_t *data, int32_t stride, int32_t height,
+		const pixman_box32_t *box)
+{
+	uint32_t *dst = pixman_image_get_data(image);
+	int dst_stride = pixman_image_get_stride(image) / 4;
+	const uint8_t *chroma = data + stride * height;
+	const uint8_t *yp, *up, *vp, *src;
+	uint8_t *ybuf, *ubuf, *vbuf;
+	int x1 = box->x1 & ~1;
+	int width = box->x2 - x1;
+	int samples = (width + 1) / 2;
+	int row, crow, i;
+
+	if (width <= 0 || box->y2 <= box->y1)
+		return;
+
+	ybuf = scratch;
+	ubuf = ybuf + width;
+	vbuf = ubuf + samples;
+
+	for (row = box->y1; row < box->y2; row++) {
+		/* the 4:2:0 formats have (height + 1) / 2 chroma rows */
+		crow = row / 2;
+
+		switch (format) {
+		case WL_SHM_FORMAT_YUV420:
+			yp = data + row * stride + x1;
+			up = chroma + crow * (stride / 2) + x1 / 2;
+			vp = chroma + (height + 1) / 2 * (stride / 2) +
+				crow * (stride / 2) + x1 / 2;
+			break;
+		case WL_SHM_FORMAT_NV12:
+			yp = data + row * stride + x1;
+			src = chroma + crow * stride + x1;
+			for (i = 0; i < samples; i++) {
+				ubuf[i] = src[2 * i];
+				vbuf[i] = src[2 * i + 1];
+			}
+			up = ubuf;
+			vp = vbuf;
+			break;
+		case WL_SHM_FORMAT_YUYV:
+		default:
+			src = data + row * stride + x1 * 2;
+			for (i = 0; i < samples; i++) {
+				ybuf[2 * i] = src[4 * i];
+				ubuf[i] = src[4 * i + 1];
+				if (2 * i + 1 < width)
+					ybuf[2 * i + 1] = src[4 * i + 2];
+				vbuf[i] = src[4 * i + 3];
+			}
+			yp = ybuf;
+			up = ubuf;
+			vp = vbuf;
+			break;
+		}
+
+		yuv_row(dst + row * dst_stride + x1, yp, up, vp, width);
+	}
+}
+
 static void
 pixman_renderer_flush_damage(struct weston_surface *surface)
 {
-	/* No-op for pixman renderer */
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	struct weston_buffer *buffer = ps->buffer_ref.buffer;
+	struct wl_shm_buffer *shm_buffer;
+	pixman_box32_t *rects, box;
+	int i, n;
+
+	/* Only YUV buffers need work, others are composited in place */
+	if (!ps->yuv_format || !buffer || !buffer->shm_buffer)
+		return;
+
+	shm_buffer = buffer->shm_buffer;
+	wl_shm_buffer_begin_access(shm_buffer);
+
+	if (ps->yuv_full) {
+		box.x1 = 0;
+		box.y1 = 0;
+		box.x2 = buffer->width;
+		box.y2 = buffer->height;
+		convert_yuv_box(ps->yuv_image, ps->yuv_scratch,
+				ps->yuv_format,
+				wl_shm_buffer_get_data(shm_buffer),
+				wl_shm_buffer_get_stride(shm_buffer),
+				buffer->height, &box);
+		ps->yuv_full = false;
+	} else {
+		rects = pixman_region32_rectangles(&surface->damage, &n);
+		for (i = 0; i < n; i++) {
+			box = weston_surface_to_buffer_rect(surface, rects[i]);
+			box.x1 = MAX(box.x1, 0);
+			box.y1 = MAX(box.y1, 0);
+			box.x2 = MIN(box.x2, buffer->width);
+			box.y2 = MIN(box.y2, buffer->height);
+			convert_yuv_box(ps->yuv_image, ps->yuv_scratch,
+					ps->yuv_format,
+					wl_shm_buffer_get_data(shm_buffer),
+					wl_shm_buffer_get_stride(shm_buffer),
+					buffer->height, &box);
+		}
+	}
+
+	wl_shm_buffer_end_access(shm_buffer);
 }
 
 static void
@@ -592,12 +1425,79 @@ buffer_state_handle_buffer_destroy(struct wl_listener *listener, void *data)
 	ps->buffer_destroy_listener.notify = NULL;
 }
 
+static void
+shm_image_release(struct pixman_shm_image *entry)
+{
+	if (entry->image) {
+		pixman_image_unref(entry->image);
+		wl_shm_pool_unref(entry->pool);
+	}
+
+	memset(entry, 0, sizeof *entry);
+}
+
+/* Clients cycle through a few buffers at fixed offsets in a pool, so the
+ * images of the last buffers are kept and reused while the pool mapping
+ * does not move. The pool reference keeps the pixels mapped after the
+ * buffer is destroyed.
+ */
+static pixman_image_t *
+surface_get_shm_image(struct pixman_surface_state *ps,
+		      struct wl_shm_buffer *shm_buffer,
+		      pixman_format_code_t format,
+		      int32_t width, int32_t height)
+{
+	struct pixman_shm_image *entry, *lru = &ps->shm_images[0];
+	struct wl_shm_pool *pool;
+	void *data = wl_shm_buffer_get_data(shm_buffer);
+	int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+	unsigned int i;
+
+	pool = wl_shm_buffer_ref_pool(shm_buffer);
+	ps->shm_image_serial++;
+
+	for (i = 0; i < ARRAY_LENGTH(ps->shm_images); i++) {
+		entry = &ps->shm_images[i];
+
+		if (entry->image && entry->pool == pool &&
+		    entry->data == data && entry->format == format &&
+		    entry->width == width && entry->height == height &&
+		    entry->stride == stride) {
+			wl_shm_pool_unref(pool);
+			entry->last_use = ps->shm_image_serial;
+			return pixman_image_ref(entry->image);
+		}
+
+		if (entry->last_use < lru->last_use)
+			lru = entry;
+	}
+
+	shm_image_release(lru);
+	lru->image = pixman_image_create_bits(format, width, height,
+					      data, stride);
+	if (!lru->image) {
+		wl_shm_pool_unref(pool);
+		return NULL;
+	}
+
+	lru->pool = pool;
+	lru->data = data;
+	lru->format = format;
+	lru->width = width;
+	lru->height = height;
+	lru->stride = stride;
+	lru->last_use = ps->shm_image_serial;
+
+	return pixman_image_ref(lru->image);
+}
+
 static void
 pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 {
 	struct pixman_surface_state *ps = get_surface_state(es);
 	struct wl_shm_buffer *shm_buffer;
 	pixman_format_code_t pixman_format;
+	bool was_yuv = ps->yuv_format != 0;
 
 	weston_buffer_reference(&ps->buffer_ref, buffer);
 
@@ -611,6 +1511,8 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		ps->image = NULL;
 	}
 
+	ps->yuv_format = 0;
+
 	if (!buffer)
 		return;
 
@@ -632,6 +1534,12 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	case WL_SHM_FORMAT_RGB565:
 		pixman_format = PIXMAN_r5g6b5;
 		break;
+	case WL_SHM_FORMAT_YUV420:
+	case WL_SHM_FORMAT_NV12:
+	case WL_SHM_FORMAT_YUYV:
+		/* converted by pixman_renderer_flush_damage() */
+		pixman_format = PIXMAN_x8r8g8b8;
+		break;
 	default:
 		weston_log("Unsupported SHM buffer format\n");
 		weston_buffer_reference(&ps->buffer_ref, NULL);
@@ -643,10 +1551,61 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	buffer->width = wl_shm_buffer_get_width(shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(shm_buffer);
 
-	ps->image = pixman_image_create_bits(pixman_format,
-		buffer->width, buffer->height,
-		wl_shm_buffer_get_data(shm_buffer),
-		wl_shm_buffer_get_stride(shm_buffer));
+	/* convert_yuv_box() reads two bytes per pixel of YUYV rows */
+	if (wl_shm_buffer_get_format(shm_buffer) == WL_SHM_FORMAT_YUYV &&
+	    wl_shm_buffer_get_stride(shm_buffer) < 2 * buffer->width) {
+		weston_log("YUYV buffer stride too small for its width\n");
+		weston_buffer_reference(&ps->buffer_ref, NULL);
+		return;
+	}
+
+	if (!weston_buffer_shm_planes_mapped(buffer)) {
+		weston_log("YUV buffer planes do not fit in its shm pool\n");
+		weston_buffer_reference(&ps->buffer_ref, NULL);
+		return;
+	}
+
+	if (is_yuv_format(wl_shm_buffer_get_format(shm_buffer))) {
+		/* the image only holds what damage built on if the
+		 * previous buffer was converted into it */
+		if (!was_yuv)
+			ps->yuv_full = true;
+
+		if (!ps->yuv_image ||
+		    pixman_image_get_width(ps->yuv_image) != buffer->width ||
+		    pixman_image_get_height(ps->yuv_image) != buffer->height) {
+			if (ps->yuv_image)
+				pixman_image_unref(ps->yuv_image);
+			ps->yuv_image =
+				pixman_image_create_bits(pixman_format,
+							 buffer->width,
+							 buffer->height,
+							 NULL, 0);
+			ps->yuv_full = true;
+		}
+
+		if (ps->yuv_scratch_width < buffer->width) {
+			free(ps->yuv_scratch);
+			ps->yuv_scratch =
+				malloc(yuv_scratch_size(buffer->width));
+			ps->yuv_scratch_width =
+				ps->yuv_scratch ? buffer->width : 0;
+		}
+
+		ps->yuv_format = wl_shm_buffer_get_format(shm_buffer);
+		ps->image = ps->yuv_image && ps->yuv_scratch ?
+			pixman_image_ref(ps->yuv_image) : NULL;
+	} else {
+		ps->image = surface_get_shm_image(ps, shm_buffer,
+						  pixman_format,
+						  buffer->width,
+						  buffer->height);
+	}
+	if (!ps->image) {
+		weston_log("Failed to create pixman image for shm buffer\n");
+		weston_buffer_reference(&ps->buffer_ref, NULL);
+		return;
+	}
 
 	ps->buffer_destroy_listener.notify =
 		buffer_state_handle_buffer_destroy;
@@ -657,6 +1616,8 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 static void
 pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 {
+	unsigned int i;
+
 	wl_list_remove(&ps->surface_destroy_listener.link);
 	wl_list_remove(&ps->renderer_destroy_listener.link);
 	if (ps->buffer_destroy_listener.notify) {
@@ -670,6 +1631,13 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	for (i = 0; i < ARRAY_LENGTH(ps->shm_images); i++)
+		shm_image_release(&ps->shm_images[i]);
+	if (ps->mask_image)
+		pixman_image_unref(ps->mask_image);
+	if (ps->yuv_image)
+		pixman_image_unref(ps->yuv_image);
+	free(ps->yuv_scratch);
 	weston_buffer_reference(&ps->buffer_ref, NULL);
 	free(ps);
 }
@@ -734,6 +1702,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -743,11 +1712,100 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	ps->image = pixman_image_create_solid_fill(&color);
 }
 
+static int
+pixman_renderer_start_bands(struct pixman_renderer *pr, int n_bands)
+{
+	struct pixman_band_worker *worker;
+	sigset_t set, saved;
+	int i;
+
+	if (n_bands > PIXMAN_MAX_BANDS) {
+		weston_log("Pixman renderer: limiting %d threads to %d\n",
+			   n_bands, PIXMAN_MAX_BANDS);
+		n_bands = PIXMAN_MAX_BANDS;
+	}
+
+	pr->workers = zalloc((n_bands - 1) * sizeof *pr->workers);
+	if (!pr->workers)
+		return -1;
+
+	pthread_mutex_init(&pr->band_mutex, NULL);
+	pthread_cond_init(&pr->band_work_cond, NULL);
+	pthread_cond_init(&pr->band_done_cond, NULL);
+
+	/* Signals are for the main thread, except for faults of the
+	 * worker itself, like SIGBUS from a truncated shm pool */
+	sigfillset(&set);
+	sigdelset(&set, SIGBUS);
+	sigdelset(&set, SIGSEGV);
+	sigdelset(&set, SIGFPE);
+	sigdelset(&set, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &set, &saved);
+
+	for (i = 1; i < n_bands; i++) {
+		worker = &pr->workers[i - 1];
+		worker->renderer = pr;
+		worker->index = i;
+		pixman_region32_init(&worker->damage);
+		weston_region_pool_init(&worker->pool);
+		worker->band.damage = &worker->damage;
+		worker->band.pool = &worker->pool;
+		worker->band.threaded = true;
+
+		if (pthread_create(&worker->thread, NULL,
+				   band_worker_main, worker) != 0) {
+			weston_log("Pixman renderer: failed to create "
+				   "thread: %m\n");
+			weston_region_pool_release(&worker->pool);
+			pixman_region32_fini(&worker->damage);
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	pr->n_bands = i;
+	weston_log("Pixman renderer compositing in up to %d bands.\n",
+		   pr->n_bands);
+
+	return 0;
+}
+
+static void
+pixman_renderer_stop_bands(struct pixman_renderer *pr)
+{
+	struct pixman_band_worker *worker;
+	int i;
+
+	if (!pr->workers)
+		return;
+
+	pthread_mutex_lock(&pr->band_mutex);
+	pr->band_quit = true;
+	pthread_cond_broadcast(&pr->band_work_cond);
+	pthread_mutex_unlock(&pr->band_mutex);
+
+	for (i = 1; i < pr->n_bands; i++) {
+		worker = &pr->workers[i - 1];
+		pthread_join(worker->thread, NULL);
+		weston_region_pool_release(&worker->pool);
+		pixman_region32_fini(&worker->damage);
+	}
+
+	pthread_cond_destroy(&pr->band_done_cond);
+	pthread_cond_destroy(&pr->band_work_cond);
+	pthread_mutex_destroy(&pr->band_mutex);
+	free(pr->workers);
+	pr->workers = NULL;
+	pr->n_bands = 1;
+}
+
 static void
 pixman_renderer_destroy(struct weston_compositor *ec)
 {
 	struct pixman_renderer *pr = get_renderer(ec);
 
+	pixman_renderer_stop_bands(pr);
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
 	free(pr);
@@ -812,11 +1870,7 @@ debug_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color = pixman_image_create_solid_fill(&debug_red);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -854,9 +1908,17 @@ pixman_renderer_init(struct weston_compositor *ec)
 						    debug_binding, ec);
 
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUV420);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_NV12);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	renderer->n_bands = 1;
+	if (ec->pixman_threads > 1 &&
+	    pixman_renderer_start_bands(renderer, ec->pixman_threads) < 0)
+		weston_log("Pixman renderer: compositing on one thread\n");
+
 	return 0;
 }
 
@@ -875,38 +1937,38 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 	}
 }
 
+/** Create the renderer state of an output
+ *
+ * \param output The output.
+ * \param flags A bitmask of enum pixman_renderer_output_flags.
+ *
+ * Without PIXMAN_RENDERER_OUTPUT_USE_SHADOW, views are composited straight
+ * into the buffer set with pixman_renderer_output_set_buffer(), unless
+ * its format or size differ from the output mode. Backends should ask for
+ * a shadow image when their buffers are slow to read from, or visible
+ * while they are painted.
+ */
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
 	struct pixman_output_state *po;
-	int w, h;
+	int i;
 
 	po = zalloc(sizeof *po);
 	if (po == NULL)
 		return -1;
 
-	/* set shadow image transformation */
-	w = output->current_mode->width;
-	h = output->current_mode->height;
-
-	po->shadow_buffer = malloc(w * h * 4);
-
-	if (!po->shadow_buffer) {
-		free(po);
-		return -1;
-	}
-
-	po->shadow_image =
-		pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
-					 po->shadow_buffer, w * 4);
+	output->renderer_state = po;
 
-	if (!po->shadow_image) {
-		free(po->shadow_buffer);
+	po->use_shadow = !!(flags & PIXMAN_RENDERER_OUTPUT_USE_SHADOW);
+	if (po->use_shadow && output_create_shadow(output) < 0) {
+		output->renderer_state = NULL;
 		free(po);
 		return -1;
 	}
 
-	output->renderer_state = po;
+	for (i = 0; i < PIXMAN_BUFFER_DAMAGE_COUNT; i++)
+		pixman_region32_init(&po->frame_damage[i]);
 
 	return 0;
 }
@@ -915,8 +1977,14 @@ WL_EXPORT void
 pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	int i;
+
+	output_clear_buffer_damage(po);
+	for (i = 0; i < PIXMAN_BUFFER_DAMAGE_COUNT; i++)
+		pixman_region32_fini(&po->frame_damage[i]);
 
-	pixman_image_unref(po->shadow_image);
+	if (po->shadow_image)
+		pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
@@ -25,19 +25,23 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/uio.h>
 
 #include "compositor.h"
 #include "weston-screenshooter-server-protocol.h"
 #include "shared/helpers.h"
 
 #include "wcap/wcap-decode.h"
+#include "wcap/wcap-encode.h"
 
 struct screenshooter {
 	struct weston_compositor *ec;
@@ -49,7 +53,9 @@ struct screenshooter {
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
-	struct weston_buffer *buffer;
+	struct weston_buffer *buffer;	/* NULL once destroyed */
+	struct wl_listener buffer_destroy_listener;
+	uint8_t *pixels;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
@@ -118,32 +124,45 @@ copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
 }
 
 static void
-screenshooter_frame_notify(struct wl_listener *listener, void *data)
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l)
+{
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	free(l->pixels);
+	free(l);
+}
+
+static void
+screenshooter_buffer_destroy(struct wl_listener *listener, void *data)
 {
 	struct screenshooter_frame_listener *l =
-		container_of(listener,
-			     struct screenshooter_frame_listener, listener);
-	struct weston_output *output = data;
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
+
+	wl_list_remove(&listener->link);
+	l->buffer = NULL;
+}
+
+static void
+screenshooter_read_done(struct weston_output *output, int status, void *data)
+{
+	struct screenshooter_frame_listener *l = data;
 	struct weston_compositor *compositor = output->compositor;
 	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	uint8_t *pixels = l->pixels, *d, *s;
 
-	output->disable_planes--;
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	if (!l->buffer) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
 
-	if (pixels == NULL) {
+	if (status < 0) {
 		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+		screenshooter_frame_listener_destroy(l);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
-
 	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
 
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
@@ -173,8 +192,46 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
 	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
-	free(l);
+	screenshooter_frame_listener_destroy(l);
+}
+
+static void
+screenshooter_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener,
+			     struct screenshooter_frame_listener, listener);
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+	int32_t stride;
+
+	output->disable_planes--;
+	wl_list_remove(&listener->link);
+
+	if (!l->buffer) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
+
+	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+	l->pixels = malloc(stride * l->buffer->height);
+
+	if (l->pixels == NULL) {
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
+
+	/* The copy to the buffer waits for the GPU, not the repaint */
+	if (weston_output_read_pixels_async(output,
+			     compositor->read_format, l->pixels,
+			     0, 0, output->current_mode->width,
+			     output->current_mode->height,
+			     screenshooter_read_done, l) < 0) {
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		screenshooter_frame_listener_destroy(l);
+	}
 }
 
 WL_EXPORT int
@@ -206,6 +263,9 @@ weston_screenshooter_shoot(struct weston_output *output,
 	}
 
 	l->buffer = buffer;
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
+	l->pixels = NULL;
 	l->done = done;
 	l->data = data;
 	l->listener.notify = screenshooter_frame_notify;
@@ -308,49 +368,345 @@ screenshooter_binding(struct weston_keyboard *keyboard, uint32_t time,
 	free(screenshooter_exe);
 }
 
+/* Frames read back but not encoded yet, beyond which frames are dropped */
+#define WESTON_RECORDER_QUEUE_MAX 4
+/* The encoded stream goes to the file in writes of this size */
+#define WESTON_RECORDER_WRITE_SIZE (1024 * 1024)
+/* Time between keyframes, which bounds how far wcap-decode replays the
+ * recording to get to any one frame */
+#define WESTON_RECORDER_KEYFRAME_MSECS 5000
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
+	int width, height, do_yflip;
+	struct wl_listener frame_listener;
+	struct wl_listener compositor_destroy_listener;
+	struct wl_list frames;		/* weston_recorder_frame::link */
+	int destroying;
+	bool draining;			/* no frame is dropped any more */
+	bool write_error_logged;
+	uint32_t dropped;
+	uint32_t keyframe_msecs;
+	bool keyframe_due;
+
+	/* Frames handed to the encoder thread, in order, how many of
+	 * them are not freed yet, and what the thread reports back */
+	pthread_t encoder;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	struct wl_list queue;
+	int queued;
+	bool quit;
+	int write_error;		/* errno of the first failed write */
+
+	/* Only used by the encoder thread once it runs */
+	uint32_t *frame;
 	uint32_t *tmpbuf;
-	uint32_t total;
+	uint8_t *out;
+	size_t out_len;
+	bool write_failed;
+	uint64_t total;
 	int fd;
-	struct wl_listener frame_listener;
-	int count, destroying;
+	int count;
+	struct wl_array index;		/* struct wcap_index_entry */
+	bool index_failed;
 };
 
-static uint32_t *
-output_run(uint32_t *p, uint32_t delta, int run)
+/* The damage of one output frame, encoded once all of its rectangles
+ * were read back */
+struct weston_recorder_frame {
+	struct wl_list link;		/* weston_recorder::frames or queue */
+	struct weston_recorder *recorder;
+	uint32_t msecs;
+	uint32_t flags;			/* WCAP_FRAME_* */
+	pixman_box32_t *rects;
+	int nrects;
+	uint32_t *pixels;		/* the rectangles one after another */
+	int pending;			/* reads not done yet */
+	int failed;
+};
+
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static void
+weston_recorder_frame_free(struct weston_recorder_frame *frame)
 {
-	int i;
+	wl_list_remove(&frame->link);
+	free(frame->rects);
+	free(frame->pixels);
+	free(frame);
+}
 
-	while (run > 0) {
-		if (run <= 0xe0) {
-			*p++ = delta | ((run - 1) << 24);
+static void
+weston_recorder_write_out(struct weston_recorder *recorder,
+			  const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ssize_t ret;
+	int error;
+
+	while (len > 0 && !recorder->write_failed) {
+		ret = write(recorder->fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			/* weston_log() is not thread safe, the main thread
+			 * reports this */
+			error = errno;
+			pthread_mutex_lock(&recorder->mutex);
+			recorder->write_error = error;
+			pthread_mutex_unlock(&recorder->mutex);
+			recorder->write_failed = true;
 			break;
 		}
 
-		i = 24 - __builtin_clz(run);
-		*p++ = delta | ((i + 0xe0) << 24);
-		run -= 1 << (7 + i);
+		p += ret;
+		len -= ret;
 	}
+}
 
-	return p;
+static void
+weston_recorder_flush_out(struct weston_recorder *recorder)
+{
+	weston_recorder_write_out(recorder, recorder->out, recorder->out_len);
+	recorder->out_len = 0;
 }
 
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+/* Appends to the file through the write buffer, which is passed over
+ * for data larger than itself. */
+static void
+weston_recorder_write(struct weston_recorder *recorder,
+		      const void *data, size_t len)
 {
-	unsigned char dr, dg, db;
+	recorder->total += len;
+
+	if (recorder->out_len + len > WESTON_RECORDER_WRITE_SIZE)
+		weston_recorder_flush_out(recorder);
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+	if (len >= WESTON_RECORDER_WRITE_SIZE) {
+		weston_recorder_write_out(recorder, data, len);
+		return;
+	}
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+	memcpy(recorder->out + recorder->out_len, data, len);
+	recorder->out_len += len;
 }
 
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
+weston_recorder_encode(struct weston_recorder *recorder,
+		       struct weston_recorder_frame *frame)
+{
+	pixman_box32_t *r = frame->rects;
+	struct wcap_rectangle wr;
+	int i, n = frame->nrects, width, height;
+	uint32_t *p, *rect;
+	struct wcap_frame_header_v2 header;
+	struct wcap_index_entry *entry;
+	uint32_t *outbuf;
+
+	entry = NULL;
+	if (!recorder->index_failed) {
+		entry = wl_array_add(&recorder->index, sizeof *entry);
+		recorder->index_failed = entry == NULL;
+	}
+	if (entry) {
+		entry->offset_lo = recorder->total & 0xffffffff;
+		entry->offset_hi = recorder->total >> 32;
+		entry->msecs = frame->msecs;
+		entry->flags = frame->flags;
+	}
+
+	/* A keyframe covers the whole output and is encoded against
+	 * zeros, so decoding can start there */
+	if (frame->flags & WCAP_FRAME_KEYFRAME)
+		memset(recorder->frame, 0,
+		       recorder->width * recorder->height * 4);
+
+	header.msecs = frame->msecs;
+	header.nrects = n;
+	header.flags = frame->flags;
+	weston_recorder_write(recorder, &header, sizeof header);
+	weston_recorder_write(recorder, r, n * sizeof *r);
+
+	rect = frame->pixels;
+	for (i = 0; i < n; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+		wr.x1 = r[i].x1;
+		wr.y1 = r[i].y1;
+		wr.x2 = r[i].x2;
+		wr.y2 = r[i].y2;
+
+		/* The runs of a bottom up rectangle can overwrite the
+		 * pixels they were made of, top down ones go elsewhere */
+		if (recorder->do_yflip) {
+			outbuf = rect;
+			p = wcap_encode_rectangle(outbuf, recorder->frame,
+						  recorder->width, &wr,
+						  rect, width);
+		} else {
+			outbuf = recorder->tmpbuf;
+			p = wcap_encode_rectangle(outbuf, recorder->frame,
+						  recorder->width, &wr,
+						  rect + width * (height - 1),
+						  -width);
+		}
+
+		weston_recorder_write(recorder, outbuf, (p - outbuf) * 4);
+		rect += width * height;
+
+#if 0
+		fprintf(stderr,
+			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
+			width, height, r[i].x1, r[i].y1,
+			width * height * 4, (int) (p - outbuf) * 4,
+			(float) (p - outbuf) / (width * height),
+			(int) (recorder->total / 1024 / 1024));
+#endif
+	}
+
+	recorder->count++;
+}
+
+/* Ends the file with the index of all frames, unless some of them are
+ * missing from it */
+static void
+weston_recorder_write_index(struct weston_recorder *recorder)
+{
+	struct wcap_trailer trailer;
+
+	if (recorder->index_failed || recorder->count == 0) {
+		weston_log("recorder: not writing a frame index\n");
+		return;
+	}
+
+	trailer.index_lo = recorder->total & 0xffffffff;
+	trailer.index_hi = recorder->total >> 32;
+	trailer.nframes = recorder->count;
+	trailer.magic = WCAP_INDEX_MAGIC;
+
+	weston_recorder_write(recorder, recorder->index.data,
+			      recorder->index.size);
+	weston_recorder_write(recorder, &trailer, sizeof trailer);
+}
+
+/* Encodes and writes the queued frames until told to quit, which it
+ * does once the queue is empty. */
+static void *
+weston_recorder_encoder_main(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+	for (;;) {
+		while (wl_list_empty(&recorder->queue) && !recorder->quit)
+			pthread_cond_wait(&recorder->queue_cond,
+					  &recorder->mutex);
+		if (wl_list_empty(&recorder->queue))
+			break;
+
+		frame = container_of(recorder->queue.next,
+				     struct weston_recorder_frame, link);
+		wl_list_remove(&frame->link);
+		wl_list_init(&frame->link);
+		pthread_mutex_unlock(&recorder->mutex);
+
+		weston_recorder_encode(recorder, frame);
+		weston_recorder_frame_free(frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->queued--;
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	weston_recorder_write_index(recorder);
+	weston_recorder_flush_out(recorder);
+
+	return NULL;
+}
+
+/* Logs a write error of the encoder thread, once */
+static void
+weston_recorder_report_error(struct weston_recorder *recorder)
+{
+	int error;
+
+	if (recorder->write_error_logged)
+		return;
+
+	pthread_mutex_lock(&recorder->mutex);
+	error = recorder->write_error;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (error == 0)
+		return;
+
+	weston_log("recorder: write failed: %s\n", strerror(error));
+	recorder->write_error_logged = true;
+}
+
+/* Hands the frames read back so far to the encoder, oldest first, since
+ * each is a delta against the one before. A frame that does not fit in
+ * the queue is dropped, unless the recorder is draining.
+ */
+static void
+weston_recorder_flush(struct weston_recorder *recorder)
+{
+	struct weston_recorder_frame *frame, *next;
+	bool queued;
+
+	weston_recorder_report_error(recorder);
+
+	wl_list_for_each_safe(frame, next, &recorder->frames, link) {
+		if (frame->pending > 0)
+			break;
+
+		queued = false;
+		if (!frame->failed) {
+			pthread_mutex_lock(&recorder->mutex);
+			if (recorder->queued < WESTON_RECORDER_QUEUE_MAX ||
+			    recorder->draining) {
+				wl_list_remove(&frame->link);
+				wl_list_insert(recorder->queue.prev,
+					       &frame->link);
+				recorder->queued++;
+				queued = true;
+				pthread_cond_signal(&recorder->queue_cond);
+			}
+			pthread_mutex_unlock(&recorder->mutex);
+		}
+
+		if (queued)
+			continue;
+
+		/* What the frame changed is lost, so record all of the
+		 * next one */
+		if (frame->flags & WCAP_FRAME_KEYFRAME)
+			recorder->keyframe_due = true;
+		recorder->dropped++;
+		if (!recorder->draining)
+			weston_output_damage(recorder->output);
+		weston_recorder_frame_free(frame);
+	}
+
+	if (recorder->destroying && wl_list_empty(&recorder->frames))
+		weston_recorder_destroy(recorder);
+}
+
+static void
+weston_recorder_read_done(struct weston_output *output, int status,
+			  void *data)
+{
+	struct weston_recorder_frame *frame = data;
+
+	if (status < 0)
+		frame->failed = 1;
+
+	if (--frame->pending == 0)
+		weston_recorder_flush(frame->recorder);
+}
 
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
@@ -359,25 +715,20 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
+	struct weston_recorder_frame *frame;
 	pixman_box32_t *r;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
+	int i, n, width, height;
 	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	size_t size = 0;
+	uint32_t *rect;
+
+	/* Frames still being read keep the recorder around, but no new
+	 * ones are recorded */
+	if (recorder->destroying) {
+		wl_list_remove(&recorder->frame_listener.link);
+		wl_list_init(&recorder->frame_listener.link);
+	}
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -390,77 +741,76 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 	pixman_region32_fini(&damage);
 
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+	if (n == 0)
+		goto out;
+
+	frame = zalloc(sizeof *frame);
+	if (frame == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		weston_output_damage(output);
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	for (i = 0; i < n; i++)
+		size += (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	frame->recorder = recorder;
+	frame->msecs = output->frame_time;
+
+	/* Only a frame that repaints all of the output can be a keyframe,
+	 * so ask for one when the next keyframe is due */
+	if (frame->msecs - recorder->keyframe_msecs >=
+	    WESTON_RECORDER_KEYFRAME_MSECS)
+		recorder->keyframe_due = true;
+	if (recorder->keyframe_due &&
+	    size == (size_t) recorder->width * recorder->height) {
+		frame->flags |= WCAP_FRAME_KEYFRAME;
+		recorder->keyframe_due = false;
+		recorder->keyframe_msecs = frame->msecs;
+	} else if (recorder->keyframe_due) {
+		weston_output_damage(output);
+	}
+	frame->nrects = n;
+	frame->rects = malloc(n * sizeof *r);
+	frame->pixels = malloc(size * 4);
+	wl_list_insert(recorder->frames.prev, &frame->link);
+	if (frame->rects == NULL || frame->pixels == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		frame->failed = 1;
+		goto out;
+	}
+	memcpy(frame->rects, r, n * sizeof *r);
 
+	/* Held until all reads were started, some finish right away */
+	frame->pending = 1;
+
+	rect = frame->pixels;
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
+		if (recorder->do_yflip)
 			y_orig = output->current_mode->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
+		frame->pending++;
+		if (weston_output_read_pixels_async(output,
+				compositor->read_format, rect,
+				r[i].x1, y_orig, width, height,
+				weston_recorder_read_done, frame) < 0) {
+			frame->pending--;
+			frame->failed = 1;
 		}
 
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
-
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
+		rect += width * height;
 	}
 
-	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
+	frame->pending--;
 
-	if (recorder->destroying)
-		weston_recorder_destroy(recorder);
+out:
+	pixman_region32_fini(&transformed_damage);
+	weston_recorder_flush(recorder);
 }
 
 static void
@@ -469,12 +819,64 @@ weston_recorder_free(struct weston_recorder *recorder)
 	if (recorder == NULL)
 		return;
 
+	wl_array_release(&recorder->index);
+	free(recorder->out);
 	free(recorder->tmpbuf);
-	free(recorder->rect);
 	free(recorder->frame);
 	free(recorder);
 }
 
+static int
+weston_recorder_start_encoder(struct weston_recorder *recorder)
+{
+	sigset_t set, saved;
+	int ret;
+
+	wl_list_init(&recorder->queue);
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->queue_cond, NULL);
+
+	/* Signals are for the main thread */
+	sigfillset(&set);
+	sigdelset(&set, SIGBUS);
+	sigdelset(&set, SIGSEGV);
+	sigdelset(&set, SIGFPE);
+	sigdelset(&set, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &set, &saved);
+	ret = pthread_create(&recorder->encoder, NULL,
+			     weston_recorder_encoder_main, recorder);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (ret != 0) {
+		weston_log("recorder: failed to create encoder thread: %s\n",
+			   strerror(ret));
+		pthread_cond_destroy(&recorder->queue_cond);
+		pthread_mutex_destroy(&recorder->mutex);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Writes out what was recorded before the compositor goes away. Reads
+ * still in flight finish when their output is destroyed, the last one
+ * destroys the recorder.
+ */
+static void
+weston_recorder_compositor_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_recorder *recorder =
+		container_of(listener, struct weston_recorder,
+			     compositor_destroy_listener);
+
+	recorder->destroying = 1;
+	recorder->draining = true;
+	wl_list_remove(&recorder->frame_listener.link);
+	wl_list_init(&recorder->frame_listener.link);
+
+	weston_recorder_flush(recorder);
+}
+
 static void
 weston_recorder_create(struct weston_output *output, const char *filename)
 {
@@ -495,10 +897,17 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	stride = output->current_mode->width;
 	size = stride * 4 * output->current_mode->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	recorder->out = malloc(WESTON_RECORDER_WRITE_SIZE);
 	recorder->output = output;
-
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	recorder->width = output->current_mode->width;
+	recorder->height = output->current_mode->height;
+	recorder->do_yflip = do_yflip;
+	recorder->fd = -1;
+	recorder->keyframe_due = true;
+	wl_list_init(&recorder->frames);
+	wl_array_init(&recorder->index);
+
+	if (recorder->frame == NULL || recorder->out == NULL) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
@@ -511,7 +920,7 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		}
 	}
 
-	header.magic = WCAP_HEADER_MAGIC;
+	header.magic = WCAP_HEADER_MAGIC_V2;
 
 	switch (compositor->read_format) {
 	case PIXMAN_x8r8g8b8:
@@ -536,10 +945,19 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 
 	header.width = output->current_mode->width;
 	header.height = output->current_mode->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	weston_recorder_write(recorder, &header, sizeof header);
+
+	if (weston_recorder_start_encoder(recorder) < 0) {
+		close(recorder->fd);
+		goto err_recorder;
+	}
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
+	recorder->compositor_destroy_listener.notify =
+		weston_recorder_compositor_destroy;
+	wl_signal_add(&compositor->destroy_signal,
+		      &recorder->compositor_destroy_listener);
 	output->disable_planes++;
 	weston_output_damage(output);
 
@@ -550,10 +968,26 @@ err_recorder:
 	return;
 }
 
+/* Waits for the encoder to write out the queued frames */
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
+	wl_list_remove(&recorder->compositor_destroy_listener.link);
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = true;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->encoder, NULL);
+	weston_recorder_report_error(recorder);
+	pthread_cond_destroy(&recorder->queue_cond);
+	pthread_mutex_destroy(&recorder->mutex);
+
+	weston_log("recorder stopped, total file size %dM, %d frames, "
+		   "%u dropped\n", (int) (recorder->total / (1024 * 1024)),
+		   recorder->count, recorder->dropped);
+
 	close(recorder->fd);
 	recorder->output->disable_planes--;
 	weston_recorder_free(recorder);
@@ -580,9 +1014,7 @@ recorder_binding(struct weston_keyboard *keyboard, uint32_t time,
 		recorder = container_of(listener, struct weston_recorder,
 					frame_listener);
 
-		weston_log(
-			"stopping recorder, total file size %dM, %d frames\n",
-			recorder->total / (1024 * 1024), recorder->count);
+		weston_log("stopping recorder\n");
 
 		recorder->destroying = 1;
 		weston_output_schedule_repaint(recorder->output);
@@ -0,0 +1,364 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include "timeline.h"
+#include "timeline-format.h"
+
+/* Converts a binary timeline log into the JSON that wesgr reads */
+
+struct convert {
+	const uint8_t *data, *end;
+	char **names;
+	uint32_t names_size;
+	FILE *out;
+};
+
+static const struct timeline_record *
+next_record(struct convert *c, const uint8_t **p)
+{
+	const struct timeline_record *r = (const void *) *p;
+
+	if (*p == c->end)
+		return NULL;
+
+	if ((size_t) (c->end - *p) < sizeof *r ||
+	    r->size < sizeof *r || r->size % 8 != 0 ||
+	    r->size > c->end - *p) {
+		fprintf(stderr, "truncated or corrupt record at %zu\n",
+			(size_t) (*p - c->data));
+		return NULL;
+	}
+
+	*p += r->size;
+
+	return r;
+}
+
+/* The string after a record of len bytes, or NULL */
+static const char *
+record_string(const struct timeline_record *r, size_t len)
+{
+	const char *str = (const char *) r + len;
+
+	if (r->size <= len || !memchr(str, '\0', r->size - len))
+		return NULL;
+
+	return str;
+}
+
+static int
+add_name(struct convert *c, const struct timeline_record *r)
+{
+	const char *name = record_string(r, sizeof(struct timeline_name));
+	uint32_t size;
+	char **names;
+
+	if (!name)
+		return 0;
+
+	if (r->id >= c->names_size) {
+		size = c->names_size ? c->names_size : 64;
+		while (size <= r->id)
+			size *= 2;
+		names = realloc(c->names, size * sizeof *names);
+		if (!names)
+			return -1;
+		memset(names + c->names_size, 0,
+		       (size - c->names_size) * sizeof *names);
+		c->names = names;
+		c->names_size = size;
+	}
+
+	free(c->names[r->id]);
+	c->names[r->id] = strdup(name);
+
+	return c->names[r->id] ? 0 : -1;
+}
+
+static void
+print_quoted_string(FILE *fp, const char *str)
+{
+	if (!str) {
+		fprintf(fp, "null");
+		return;
+	}
+
+	fprintf(fp, "\"%s\"", str);
+}
+
+static void
+print_object(struct convert *c, const struct timeline_record *r)
+{
+	const struct timeline_object *obj = (const void *) r;
+	const char *desc = NULL;
+
+	if (r->size < sizeof *obj)
+		return;
+	if (obj->has_desc)
+		desc = record_string(r, sizeof *obj);
+
+	switch (obj->type) {
+	case TLT_OUTPUT:
+		fprintf(c->out, "{ \"id\":%u, "
+			"\"type\":\"weston_output\", \"name\":", r->id);
+		print_quoted_string(c->out, desc);
+		fprintf(c->out, " }\n");
+		break;
+	case TLT_SURFACE:
+		fprintf(c->out, "{ \"id\":%u, "
+			"\"type\":\"weston_surface\", \"desc\":", r->id);
+		print_quoted_string(c->out, desc);
+		if (obj->main_surface)
+			fprintf(c->out, ", \"main_surface\":%u",
+				obj->main_surface);
+		fprintf(c->out, " }\n");
+		break;
+	}
+}
+
+/* Prints one argument of a point, returns its size or 0 if it does not
+ * fit in len bytes or is of an unknown type */
+static size_t
+print_arg(struct convert *c, const uint8_t *p, size_t len)
+{
+	const struct timeline_arg_object *ao = (const void *) p;
+	const struct timeline_arg_vblank *av = (const void *) p;
+	const struct timeline_arg_repaint_timing *ar = (const void *) p;
+	const struct timeline_arg_render_stats *as = (const void *) p;
+
+	if (len < sizeof(uint32_t))
+		return 0;
+
+	switch (*(const uint32_t *) p) {
+	case TLT_OUTPUT:
+	case TLT_SURFACE:
+		if (len < sizeof *ao)
+			return 0;
+		fprintf(c->out, ", \"%s\":%u",
+			ao->type == TLT_OUTPUT ? "wo" : "ws", ao->id);
+		return sizeof *ao;
+	case TLT_VBLANK:
+		if (len < sizeof *av)
+			return 0;
+		fprintf(c->out, ", \"vblank\":[%" PRId64 ", %ld]",
+			av->sec, (long) av->nsec);
+		return sizeof *av;
+	case TLT_REPAINT_TIMING:
+		if (len < sizeof *ar)
+			return 0;
+		fprintf(c->out, ", \"repaint\":{ "
+			"\"deadline\":[%" PRId64 ", %ld], "
+			"\"target\":[%" PRId64 ", %ld], "
+			"\"window_us\":%d, \"estimate_us\":%d, "
+			"\"slack_us\":%d, "
+			"\"frames\":%u, \"missed\":%u }",
+			ar->deadline_sec, (long) ar->deadline_nsec,
+			ar->target_sec, (long) ar->target_nsec,
+			ar->window_usec, ar->estimate_usec,
+			ar->slack_usec, ar->frames, ar->missed);
+		return sizeof *ar;
+	case TLT_RENDER_STATS:
+		if (len < sizeof *as)
+			return 0;
+		fprintf(c->out, ", \"render\":{ \"views\":%u, "
+			"\"batches\":%u, \"draw_calls\":%u, "
+			"\"vertices\":%u }",
+			as->views, as->batches, as->draw_calls,
+			as->vertices);
+		return sizeof *as;
+	default:
+		return 0;
+	}
+}
+
+static int
+print_point(struct convert *c, const struct timeline_record *r)
+{
+	const struct timeline_point *point = (const void *) r;
+	const uint8_t *p = (const uint8_t *) (point + 1);
+	const uint8_t *end = (const uint8_t *) r + r->size;
+	const char *name = NULL;
+	size_t len;
+	uint32_t i;
+
+	if (r->size < sizeof *point)
+		return -1;
+	if (r->id < c->names_size)
+		name = c->names[r->id];
+
+	fprintf(c->out, "{ \"T\":[%" PRId64 ", %ld], \"N\":\"%s\"",
+		point->sec, (long) point->nsec, name ? name : "");
+
+	for (i = 0; i < point->nargs; i++) {
+		len = print_arg(c, p, end - p);
+		if (len == 0)
+			return -1;
+		p += len;
+	}
+
+	fprintf(c->out, " }\n");
+
+	return 0;
+}
+
+static int
+convert(struct convert *c)
+{
+	const struct timeline_header *header = (const void *) c->data;
+	const struct timeline_record *r;
+	const uint8_t *p;
+
+	if ((size_t) (c->end - c->data) < sizeof *header ||
+	    header->magic != TIMELINE_MAGIC) {
+		fprintf(stderr, "not a weston timeline log\n");
+		return -1;
+	}
+	if (header->version != TIMELINE_VERSION) {
+		fprintf(stderr, "unsupported timeline log version %u\n",
+			header->version);
+		return -1;
+	}
+
+	/* Points of one thread can name strings another thread's
+	 * records introduced, so collect all names first */
+	p = (const uint8_t *) (header + 1);
+	while ((r = next_record(c, &p)))
+		if (r->type == TLR_NAME && add_name(c, r) < 0)
+			return -1;
+
+	p = (const uint8_t *) (header + 1);
+	while ((r = next_record(c, &p))) {
+		switch (r->type) {
+		case TLR_OBJECT:
+			print_object(c, r);
+			break;
+		case TLR_POINT:
+			if (print_point(c, r) < 0) {
+				fprintf(stderr, "corrupt point at %zu\n",
+					(size_t) ((const uint8_t *) r -
+						  c->data));
+				return -1;
+			}
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static uint8_t *
+read_file(const char *filename, size_t *size)
+{
+	uint8_t *data = NULL, *tmp;
+	size_t len = 0, alloc = 0, n;
+	FILE *fp;
+
+	fp = fopen(filename, "rb");
+	if (!fp)
+		return NULL;
+
+	do {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 1 << 20;
+			tmp = realloc(data, alloc);
+			if (!tmp) {
+				free(data);
+				fclose(fp);
+				return NULL;
+			}
+			data = tmp;
+		}
+		n = fread(data + len, 1, alloc - len, fp);
+		len += n;
+	} while (n > 0);
+
+	fclose(fp);
+	*size = len;
+
+	return data;
+}
+
+static void
+usage(int exit_code)
+{
+	fprintf(stderr, "usage: weston-timeline-convert [--help] "
+		"<timeline log> [<json file>]\n\n"
+		"Converts a binary weston timeline log to JSON, written to\n"
+		"the given file or stdout.\n");
+
+	exit(exit_code);
+}
+
+int main(int argc, char *argv[])
+{
+	struct convert c = { 0 };
+	uint8_t *data;
+	size_t size;
+	uint32_t i;
+	int ret;
+
+	if (argc > 1 && strcmp(argv[1], "--help") == 0)
+		usage(EXIT_SUCCESS);
+	if (argc < 2 || argc > 3)
+		usage(EXIT_FAILURE);
+
+	data = read_file(argv[1], &size);
+	if (!data) {
+		fprintf(stderr, "cannot read %s: %m\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	c.out = stdout;
+	if (argc == 3) {
+		c.out = fopen(argv[2], "w");
+		if (!c.out) {
+			fprintf(stderr, "cannot open %s: %m\n", argv[2]);
+			free(data);
+			return EXIT_FAILURE;
+		}
+	}
+
+	c.data = data;
+	c.end = data + size;
+	ret = convert(&c);
+
+	if (c.out != stdout)
+		fclose(c.out);
+	for (i = 0; i < c.names_size; i++)
+		free(c.names[i]);
+	free(c.names);
+	free(data);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
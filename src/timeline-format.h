@@ -0,0 +1,121 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_FORMAT_H
+#define WESTON_TIMELINE_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ * The timeline log is a header followed by a stream of records, all in
+ * CPU endianness. weston-timeline-convert turns it into the JSON that
+ * wesgr reads.
+ *
+ * Every record starts with struct timeline_record and is padded to a
+ * multiple of 8 bytes. Names and objects are described by a record of
+ * their own before the first point that refers to them.
+ */
+
+#define TIMELINE_MAGIC		0x544c4257	/* "WBLT" */
+#define TIMELINE_VERSION	1
+
+struct timeline_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t clock_id;
+	uint32_t pad;
+};
+
+enum timeline_record_type {
+	TLR_NAME = 1,
+	TLR_OBJECT,
+	TLR_POINT,
+};
+
+struct timeline_record {
+	uint16_t type;			/* enum timeline_record_type */
+	uint16_t size;			/* bytes, this header included */
+	uint32_t id;			/* of the name or object */
+};
+
+/* Followed by the NUL terminated name */
+struct timeline_name {
+	struct timeline_record base;
+};
+
+/* Followed by the NUL terminated name of an output or description of a
+ * surface, if has_desc is set */
+struct timeline_object {
+	struct timeline_record base;
+	uint32_t type;			/* TLT_OUTPUT or TLT_SURFACE */
+	uint32_t main_surface;		/* object id, 0 for none */
+	uint32_t has_desc;
+	uint32_t pad;
+};
+
+/* Followed by nargs arguments, each starting with its
+ * enum timeline_type */
+struct timeline_point {
+	struct timeline_record base;	/* id is the name id */
+	int64_t sec;
+	uint32_t nsec;
+	uint32_t nargs;
+};
+
+struct timeline_arg_object {
+	uint32_t type;			/* TLT_OUTPUT or TLT_SURFACE */
+	uint32_t id;
+};
+
+struct timeline_arg_vblank {
+	uint32_t type;
+	uint32_t pad;
+	int64_t sec;
+	int64_t nsec;
+};
+
+struct timeline_arg_repaint_timing {
+	uint32_t type;
+	int32_t window_usec;
+	int64_t deadline_sec;
+	int64_t deadline_nsec;
+	int64_t target_sec;
+	int64_t target_nsec;
+	int32_t estimate_usec;
+	int32_t slack_usec;
+	uint32_t frames;
+	uint32_t missed;
+};
+
+struct timeline_arg_render_stats {
+	uint32_t type;
+	uint32_t views;
+	uint32_t batches;
+	uint32_t draw_calls;
+	uint32_t vertices;
+	uint32_t pad;
+};
+
+#endif /* WESTON_TIMELINE_FORMAT_H */
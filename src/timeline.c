@@ -27,31 +27,141 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "timeline.h"
+#include "timeline-format.h"
 #include "compositor.h"
 #include "file-util.h"
+#include "shared/timespec-util.h"
+
+/* Bytes of records a thread can have waiting to be written, a power
+ * of two */
+#define TIMELINE_RING_SIZE (1 << 20)
+/* Bytes of records a second the flight recorder makes room for, and
+ * the most it keeps per thread */
+#define TIMELINE_FLIGHT_RATE (256 << 10)
+#define TIMELINE_FLIGHT_MAX (64 << 20)
+/* How often the records are written to the file */
+#define TIMELINE_FLUSH_MSEC 100
+/* Names whose id a thread remembers, a power of two */
+#define TIMELINE_NAMES 256
+/* Bytes of names and object descriptions a flight recorder thread
+ * keeps between dumps, a power of two */
+#define TIMELINE_DESC_SIZE (64 << 10)
+/* Objects it remembers having described, a power of two */
+#define TIMELINE_DESC_IDS 1024
+/* Room for a point and its arguments */
+#define TIMELINE_POINT_MAX 512
+
+#define TIMELINE_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+struct timeline_name_slot {
+	const char *name;
+	uint32_t id;
+};
+
+/*
+ * The records of one thread. Only that thread appends at head and only
+ * the flush thread takes records from tail, so neither takes a lock.
+ * A record that does not fit is dropped. A flight recorder ring is not
+ * flushed; instead the oldest records are overwritten.
+ */
+struct timeline_ring {
+	struct wl_list link;		/* timeline_log::rings */
+	uint8_t *data;
+	size_t size;			/* a power of two */
+	bool overwrite;
+	uint64_t head, tail;		/* bytes appended, bytes written */
+	uint32_t dropped;
+	struct timeline_name_slot names[TIMELINE_NAMES];
+	struct timeline_descs *descs;	/* flight recorder only */
+};
+
+/*
+ * The names and objects the points of a flight recorder ring refer to.
+ * They are described here rather than in the ring, where they would be
+ * overwritten, once each between two dumps. A dump hands them over
+ * with the ring, so the descriptions of objects gone since are dropped
+ * and the rest are described again as the next points refer to them.
+ */
+struct timeline_descs {
+	struct timeline_ring ring;	/* never wraps, nor is flushed */
+	uint32_t ids[TIMELINE_DESC_IDS];	/* objects described */
+};
+
+/* The records of a ring handed over to the flush thread to be written
+ * as a flight recorder dump, after the descriptions they refer to. */
+struct timeline_dump {
+	uint8_t *data;
+	size_t size;
+	uint64_t tail, head;
+	struct timeline_descs *descs;
+	struct timespec cutoff;		/* points before are left out */
+
+	/* Set by the flush thread, logged by the compositor thread as
+	 * weston_log() is not thread safe */
+	FILE *file;
+	char fname[1000];
+	int error;			/* errno if no file was written */
+	bool unreported;
+};
+
+enum timeline_mode {
+	TIMELINE_OFF = 0,
+	TIMELINE_LOG,			/* everything goes to a file */
+	TIMELINE_FLIGHT,		/* last moments are kept in memory */
+};
 
 struct timeline_log {
 	clock_t clk_id;
+	enum timeline_mode mode;
 	FILE *file;
 	unsigned series;
+	struct weston_compositor *compositor;
 	struct wl_listener compositor_destroy_listener;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t flush_cond;
+	struct wl_list rings;		/* timeline_ring::link */
+	pthread_t flusher;
+	bool quit;
+
+	int32_t flight_msec;		/* 0 if there is no flight recorder */
+	size_t flight_ring_size;
+	struct timeline_dump dump_slot;
+	struct timeline_dump *dump;	/* being written by the flush thread */
+	uint8_t *spare;			/* ring data the next dump swaps in */
+	struct timeline_descs *spare_descs;
+	struct timespec last_dump;
+	uint32_t dumps_skipped;
 };
 
 WL_EXPORT int weston_timeline_enabled_;
-static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
+static struct timeline_log timeline_ = {
+	.clk_id = CLOCK_MONOTONIC,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.flush_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* The ring of the calling thread, if it was made for this series */
+static __thread struct timeline_ring *timeline_ring_;
+static __thread unsigned timeline_ring_series_;
 
 static int
 weston_timeline_do_open(void)
 {
 	const char *prefix = "weston-timeline-";
-	const char *suffix = ".log";
+	const char *suffix = ".bin";
 	char fname[1000];
+	struct timeline_header header;
 
 	timeline_.file = file_create_dated(prefix, suffix,
 					   fname, sizeof(fname));
@@ -71,26 +181,312 @@ weston_timeline_do_open(void)
 		return -1;
 	}
 
+	header.magic = TIMELINE_MAGIC;
+	header.version = TIMELINE_VERSION;
+	header.clock_id = timeline_.clk_id;
+	header.pad = 0;
+	fwrite(&header, sizeof header, 1, timeline_.file);
+
 	weston_log("Opened timeline file '%s'\n", fname);
 
 	return 0;
 }
 
+/* Writes len bytes from pos of a ring buffer of the given size */
 static void
-timeline_notify_destroy(struct wl_listener *listener, void *data)
+ring_write(FILE *file, const uint8_t *data, size_t size,
+	   uint64_t pos, size_t len)
 {
-	weston_timeline_close();
+	size_t offset = pos & (size - 1);
+	size_t n = len;
+
+	if (n > size - offset)
+		n = size - offset;
+
+	fwrite(data + offset, 1, n, file);
+	fwrite(data, 1, len - n, file);
 }
 
-void
-weston_timeline_open(struct weston_compositor *compositor)
+static void
+timeline_flush_ring(struct timeline_ring *ring)
 {
-	if (weston_timeline_enabled_)
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	ring_write(timeline_.file, ring->data, ring->size,
+		   ring->tail, head - ring->tail);
+
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+static void
+timeline_flush(void)
+{
+	struct timeline_ring *ring;
+
+	wl_list_for_each(ring, &timeline_.rings, link)
+		timeline_flush_ring(ring);
+
+	fflush(timeline_.file);
+}
+
+/* Writes the rings out every TIMELINE_FLUSH_MSEC, and once more when
+ * the log is closed. */
+static void *
+timeline_flush_main(void *data)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&timeline_.mutex);
+	while (!timeline_.quit) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TIMELINE_FLUSH_MSEC * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&timeline_.flush_cond,
+				       &timeline_.mutex, &ts);
+
+		timeline_flush();
+	}
+	/* Whatever was logged since the last flush, or everything if the
+	 * log was closed before this thread first got the lock. */
+	timeline_flush();
+	pthread_mutex_unlock(&timeline_.mutex);
+
+	return NULL;
+}
+
+/* Records are 8 byte aligned in a ring of a power of two size, so
+ * a record header never wraps around. */
+static const struct timeline_record *
+dump_record(struct timeline_dump *dump, uint64_t pos)
+{
+	return (const void *) (dump->data + (pos & (dump->size - 1)));
+}
+
+static void
+dump_copy(struct timeline_dump *dump, uint64_t pos, void *dst, size_t len)
+{
+	size_t offset = pos & (dump->size - 1);
+	size_t n = len;
+
+	if (n > dump->size - offset)
+		n = dump->size - offset;
+
+	memcpy(dst, dump->data + offset, n);
+	memcpy((uint8_t *) dst + n, dump->data, len - n);
+}
+
+static void
+dump_write_records(struct timeline_dump *dump, uint64_t pos, uint64_t end)
+{
+	const struct timeline_record *r;
+	struct timeline_point point;
+
+	while (pos < end) {
+		r = dump_record(dump, pos);
+		if (r->size == 0)
+			break;
+
+		if (r->type == TLR_POINT) {
+			dump_copy(dump, pos, &point, sizeof point);
+			if (point.sec < dump->cutoff.tv_sec ||
+			    (point.sec == dump->cutoff.tv_sec &&
+			     point.nsec < dump->cutoff.tv_nsec)) {
+				pos += r->size;
+				continue;
+			}
+		}
+
+		ring_write(dump->file, dump->data, dump->size, pos, r->size);
+		pos += r->size;
+	}
+}
+
+static void
+timeline_write_dump(struct timeline_dump *dump)
+{
+	struct timeline_header header;
+
+	dump->file = file_create_dated("weston-flight-", ".bin",
+				       dump->fname, sizeof dump->fname);
+	if (!dump->file) {
+		dump->error = errno;
 		return;
+	}
+
+	header.magic = TIMELINE_MAGIC;
+	header.version = TIMELINE_VERSION;
+	header.clock_id = timeline_.clk_id;
+	header.pad = 0;
+	fwrite(&header, sizeof header, 1, dump->file);
+
+	fwrite(dump->descs->ring.data, 1, dump->descs->ring.head,
+	       dump->file);
+	dump_write_records(dump, dump->tail, dump->head);
+
+	fclose(dump->file);
+	dump->file = NULL;
+}
+
+static struct timeline_descs *
+timeline_descs_create(void)
+{
+	struct timeline_descs *descs;
+
+	descs = zalloc(sizeof *descs);
+	if (!descs)
+		return NULL;
 
-	if (weston_timeline_do_open() < 0)
+	descs->ring.size = TIMELINE_DESC_SIZE;
+	descs->ring.data = malloc(descs->ring.size);
+	if (!descs->ring.data) {
+		free(descs);
+		return NULL;
+	}
+
+	return descs;
+}
+
+static void
+timeline_descs_reset(struct timeline_descs *descs)
+{
+	descs->ring.head = 0;
+	memset(descs->ring.names, 0, sizeof descs->ring.names);
+	memset(descs->ids, 0, sizeof descs->ids);
+}
+
+static void
+timeline_descs_destroy(struct timeline_descs *descs)
+{
+	if (!descs)
+		return;
+
+	free(descs->ring.data);
+	free(descs);
+}
+
+/* Writes the flight recorder dumps as they are made, and the one still
+ * pending when the recorder is stopped. The file is created here, and
+ * the ring data and descriptions of a dump, emptied, are the spares of
+ * the next one. */
+static void *
+timeline_dump_main(void *data)
+{
+	struct timeline_dump *dump;
+
+	pthread_mutex_lock(&timeline_.mutex);
+	while (1) {
+		while (!timeline_.dump && !timeline_.quit)
+			pthread_cond_wait(&timeline_.flush_cond,
+					  &timeline_.mutex);
+
+		dump = timeline_.dump;
+		if (!dump)
+			break;
+
+		pthread_mutex_unlock(&timeline_.mutex);
+		timeline_write_dump(dump);
+		timeline_descs_reset(dump->descs);
+		pthread_mutex_lock(&timeline_.mutex);
+
+		timeline_.spare = dump->data;
+		timeline_.spare_descs = dump->descs;
+		dump->data = NULL;
+		dump->descs = NULL;
+		timeline_.dump = NULL;
+	}
+	pthread_mutex_unlock(&timeline_.mutex);
+
+	return NULL;
+}
+
+static int
+timeline_start_flusher(void *(*func)(void *))
+{
+	sigset_t set, saved;
+	int ret;
+
+	timeline_.quit = false;
+
+	/* Signals are for the main thread, except for faults of the
+	 * flush thread itself */
+	sigfillset(&set);
+	sigdelset(&set, SIGBUS);
+	sigdelset(&set, SIGSEGV);
+	sigdelset(&set, SIGFPE);
+	sigdelset(&set, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &set, &saved);
+	ret = pthread_create(&timeline_.flusher, NULL, func, NULL);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (ret != 0) {
+		weston_log("Timeline: failed to create flush thread: %s\n",
+			   strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+timeline_notify_destroy(struct wl_listener *listener, void *data);
+
+/* Logs how the last flight recorder dump went, once the flush thread is
+ * done with it */
+static void
+timeline_report_dump(void)
+{
+	struct timeline_dump *dump = &timeline_.dump_slot;
+
+	if (!dump->unreported)
 		return;
 
+	dump->unreported = false;
+	if (dump->error)
+		weston_log("Timeline: cannot write flight recorder dump: %s\n",
+			   dump->error == ETIME ?
+			   "failure in datetime formatting" :
+			   strerror(dump->error));
+	else
+		weston_log("Timeline: wrote flight recorder dump '%s'\n",
+			   dump->fname);
+}
+
+static int
+timeline_start(struct weston_compositor *compositor, enum timeline_mode mode)
+{
+	/* The ring data of the first dump, later ones reuse the data of
+	 * the dump before */
+	if (mode == TIMELINE_FLIGHT) {
+		timeline_.spare = malloc(timeline_.flight_ring_size);
+		timeline_.spare_descs = timeline_descs_create();
+		if (!timeline_.spare || !timeline_.spare_descs) {
+			free(timeline_.spare);
+			timeline_.spare = NULL;
+			timeline_descs_destroy(timeline_.spare_descs);
+			timeline_.spare_descs = NULL;
+			weston_log("Timeline: out of memory for the flight "
+				   "recorder\n");
+			return -1;
+		}
+	}
+
+	wl_list_init(&timeline_.rings);
+	timeline_.mode = mode;
+	if (timeline_start_flusher(mode == TIMELINE_LOG ?
+				   timeline_flush_main :
+				   timeline_dump_main) < 0) {
+		free(timeline_.spare);
+		timeline_.spare = NULL;
+		timeline_descs_destroy(timeline_.spare_descs);
+		timeline_.spare_descs = NULL;
+		timeline_.mode = TIMELINE_OFF;
+		return -1;
+	}
+
+	timeline_.compositor = compositor;
 	timeline_.compositor_destroy_listener.notify = timeline_notify_destroy;
 	wl_signal_add(&compositor->destroy_signal,
 		      &timeline_.compositor_destroy_listener);
@@ -99,46 +495,334 @@ weston_timeline_open(struct weston_compositor *compositor)
 		++timeline_.series;
 
 	weston_timeline_enabled_ = 1;
+
+	return 0;
 }
 
-void
-weston_timeline_close(void)
+static void
+timeline_stop(void)
 {
-	if (!weston_timeline_enabled_)
-		return;
+	struct timeline_ring *ring, *next;
+	uint32_t dropped = 0;
 
 	weston_timeline_enabled_ = 0;
 
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
+	pthread_mutex_lock(&timeline_.mutex);
+	timeline_.quit = true;
+	pthread_cond_signal(&timeline_.flush_cond);
+	pthread_mutex_unlock(&timeline_.mutex);
+	pthread_join(timeline_.flusher, NULL);
+
+	timeline_report_dump();
+	free(timeline_.spare);
+	timeline_.spare = NULL;
+	if (timeline_.spare_descs)
+		dropped += timeline_.spare_descs->ring.dropped;
+	timeline_descs_destroy(timeline_.spare_descs);
+	timeline_.spare_descs = NULL;
+
+	wl_list_for_each_safe(ring, next, &timeline_.rings, link) {
+		dropped += ring->dropped;
+		if (ring->descs)
+			dropped += ring->descs->ring.dropped;
+		wl_list_remove(&ring->link);
+		timeline_descs_destroy(ring->descs);
+		free(ring->data);
+		free(ring);
+	}
+
+	if (dropped)
+		weston_log("Timeline: %u records did not fit in the "
+			   "buffer and were dropped.\n", dropped);
+	if (timeline_.dumps_skipped)
+		weston_log("Timeline: %u flight recorder dumps were skipped, "
+			   "too soon after the previous one.\n",
+			   timeline_.dumps_skipped);
+	timeline_.dumps_skipped = 0;
+
+	timeline_.mode = TIMELINE_OFF;
+}
+
+static void
+timeline_flight_resume(struct weston_compositor *compositor)
+{
+	if (timeline_.flight_msec > 0)
+		timeline_start(compositor, TIMELINE_FLIGHT);
+}
+
+static void
+timeline_close_log(void)
+{
+	timeline_stop();
+
 	fclose(timeline_.file);
 	timeline_.file = NULL;
 	weston_log("Timeline log file closed.\n");
 }
 
-struct timeline_emit_context {
-	FILE *cur;
-	FILE *out;
-	unsigned series;
-};
+static void
+timeline_notify_destroy(struct wl_listener *listener, void *data)
+{
+	if (timeline_.mode == TIMELINE_LOG)
+		timeline_close_log();
+	else
+		timeline_stop();
+
+	timeline_.flight_msec = 0;
+}
+
+/* While the log is open, it takes the place of the flight recorder */
+void
+weston_timeline_open(struct weston_compositor *compositor)
+{
+	if (timeline_.mode == TIMELINE_LOG)
+		return;
+
+	if (timeline_.mode == TIMELINE_FLIGHT)
+		timeline_stop();
+
+	if (weston_timeline_do_open() == 0) {
+		if (timeline_start(compositor, TIMELINE_LOG) == 0)
+			return;
+
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+	}
+
+	timeline_flight_resume(compositor);
+}
+
+void
+weston_timeline_close(void)
+{
+	struct weston_compositor *compositor = timeline_.compositor;
+
+	if (timeline_.mode != TIMELINE_LOG)
+		return;
+
+	timeline_close_log();
+	timeline_flight_resume(compositor);
+}
+
+int
+weston_timeline_is_open(void)
+{
+	return timeline_.mode == TIMELINE_LOG;
+}
+
+/** Keep the last moments of the timeline in memory
+ *
+ * \param compositor The compositor, whose flight_recorder_msec tells
+ * how many milliseconds of timeline points to keep.
+ *
+ * Unlike the log, the flight recorder only writes a file when
+ * weston_timeline_flight_dump() is called, for instance when a repaint
+ * misses its vblank.
+ */
+void
+weston_timeline_flight_start(struct weston_compositor *compositor)
+{
+	size_t size = TIMELINE_RING_SIZE;
+	uint64_t bytes;
+
+	if (timeline_.mode != TIMELINE_OFF ||
+	    compositor->flight_recorder_msec <= 0)
+		return;
+
+	bytes = (uint64_t) compositor->flight_recorder_msec *
+		TIMELINE_FLIGHT_RATE / 1000;
+	while (size < bytes && size < TIMELINE_FLIGHT_MAX)
+		size *= 2;
+
+	timeline_.flight_msec = compositor->flight_recorder_msec;
+	timeline_.flight_ring_size = size;
+	timeline_.last_dump.tv_sec = 0;
+	timeline_.last_dump.tv_nsec = 0;
+
+	if (timeline_start(compositor, TIMELINE_FLIGHT) < 0) {
+		timeline_.flight_msec = 0;
+		return;
+	}
+
+	weston_log("Timeline flight recorder keeps the last %d ms, "
+		   "in up to %zu KiB per thread.\n",
+		   timeline_.flight_msec, size >> 10);
+}
+
+static struct timeline_ring *
+timeline_get_ring(void)
+{
+	struct timeline_ring *ring;
+
+	if (timeline_ring_series_ == timeline_.series)
+		return timeline_ring_;
+
+	ring = zalloc(sizeof *ring);
+	if (!ring)
+		return NULL;
+
+	if (timeline_.mode == TIMELINE_FLIGHT) {
+		ring->size = timeline_.flight_ring_size;
+		ring->overwrite = true;
+		ring->descs = timeline_descs_create();
+		if (!ring->descs) {
+			free(ring);
+			return NULL;
+		}
+	} else {
+		ring->size = TIMELINE_RING_SIZE;
+	}
+
+	ring->data = malloc(ring->size);
+	if (!ring->data) {
+		timeline_descs_destroy(ring->descs);
+		free(ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&timeline_.mutex);
+	wl_list_insert(&timeline_.rings, &ring->link);
+	pthread_mutex_unlock(&timeline_.mutex);
+
+	timeline_ring_ = ring;
+	timeline_ring_series_ = timeline_.series;
+
+	return ring;
+}
+
+static void
+ring_copy(struct timeline_ring *ring, uint64_t pos,
+	  const void *data, size_t len)
+{
+	size_t offset = pos & (ring->size - 1);
+	size_t n = len;
+
+	if (n > ring->size - offset)
+		n = ring->size - offset;
+
+	memcpy(ring->data + offset, data, n);
+	memcpy(ring->data, (const uint8_t *) data + n, len - n);
+}
+
+/* Forgets the oldest records until len more bytes fit. Only the owner
+ * of a flight recorder ring moves its tail. */
+static void
+ring_evict(struct timeline_ring *ring, size_t len)
+{
+	const struct timeline_record *r;
+
+	while (ring->head + len - ring->tail > ring->size) {
+		r = (const void *) (ring->data +
+				    (ring->tail & (ring->size - 1)));
+		ring->tail += r->size;
+	}
+}
+
+/* Appends a record, followed by str and padding if str is not NULL */
+static bool
+ring_append(struct timeline_ring *ring, void *record, size_t len,
+	    const char *str)
+{
+	static const uint8_t zeros[8];
+	struct timeline_record *r = record;
+	uint64_t pos = ring->head;
+	size_t slen = str ? strlen(str) + 1 : 0;
+	size_t size = TIMELINE_ALIGN(len + slen);
+	uint64_t tail;
+
+	if (ring->overwrite && size <= UINT16_MAX)
+		ring_evict(ring, size);
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (size > UINT16_MAX || pos + size - tail > ring->size) {
+		ring->dropped++;
+		return false;
+	}
+
+	r->size = size;
+	ring_copy(ring, pos, record, len);
+	if (str) {
+		ring_copy(ring, pos + len, str, slen);
+		ring_copy(ring, pos + len + slen, zeros, size - len - slen);
+	}
+
+	__atomic_store_n(&ring->head, pos + size, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static unsigned
+timeline_next_id(unsigned *idc)
+{
+	unsigned id;
+
+	do
+		id = __atomic_add_fetch(idc, 1, __ATOMIC_RELAXED);
+	while (id == 0);
+
+	return id;
+}
 
 static unsigned
 timeline_new_id(void)
 {
 	static unsigned idc;
 
-	if (++idc == 0)
-		++idc;
+	return timeline_next_id(&idc);
+}
+
+/* Names are counted apart from objects, whose ids end up in the JSON */
+static unsigned
+timeline_new_name_id(void)
+{
+	static unsigned idc;
+
+	return timeline_next_id(&idc);
+}
+
+/* The ring names and objects are described in */
+static struct timeline_ring *
+desc_ring(struct timeline_ring *ring)
+{
+	return ring->descs ? &ring->descs->ring : ring;
+}
 
-	return idc;
+/* Names are string literals, so the pointer is the key */
+static uint32_t
+timeline_name_id(struct timeline_ring *ring, const char *name)
+{
+	struct timeline_name_slot *slot = NULL;
+	struct timeline_name rec;
+	uintptr_t hash = ((uintptr_t) name * 2654435761u) >> 8;
+	unsigned i;
+
+	ring = desc_ring(ring);
+	for (i = 0; i < TIMELINE_NAMES; i++) {
+		slot = &ring->names[(hash + i) & (TIMELINE_NAMES - 1)];
+		if (slot->name == name)
+			return slot->id;
+		if (!slot->name)
+			break;
+	}
+
+	rec.base.type = TLR_NAME;
+	rec.base.id = timeline_new_name_id();
+	if (ring_append(ring, &rec, sizeof rec, name) &&
+	    slot && !slot->name) {
+		slot->name = name;
+		slot->id = rec.base.id;
+	}
+
+	return rec.base.id;
 }
 
 static int
-check_series(struct timeline_emit_context *ctx,
-	     struct weston_timeline_object *to)
+check_series(struct weston_timeline_object *to)
 {
-	if (to->series == 0 || to->series != ctx->series) {
-		to->series = ctx->series;
+	if (to->series == 0 || to->series != timeline_.series) {
+		to->series = timeline_.series;
 		to->id = timeline_new_id();
 		return 1;
 	}
@@ -151,119 +835,116 @@ check_series(struct timeline_emit_context *ctx,
 	return 0;
 }
 
-static void
-fprint_quoted_string(FILE *fp, const char *str)
+/* Remembers that a flight recorder ring has described the object since
+ * the last dump. If there is no room left, it is described every
+ * time. */
+static int
+descs_add_id(struct timeline_descs *descs, uint32_t id)
 {
-	if (!str) {
-		fprintf(fp, "null");
-		return;
+	uint32_t *slot;
+	unsigned i;
+
+	for (i = 0; i < TIMELINE_DESC_IDS; i++) {
+		slot = &descs->ids[(id * 2654435761u + i) &
+				   (TIMELINE_DESC_IDS - 1)];
+		if (*slot == id)
+			return 0;
+		if (*slot == 0) {
+			*slot = id;
+			return 1;
+		}
 	}
 
-	fprintf(fp, "\"%s\"", str);
+	return 1;
 }
 
 static int
-emit_weston_output(struct timeline_emit_context *ctx, void *obj)
+check_description(struct timeline_ring *ring,
+		  struct weston_timeline_object *to)
 {
-	struct weston_output *o = obj;
+	int refresh = check_series(to);
 
-	if (check_series(ctx, &o->timeline)) {
-		fprintf(ctx->out, "{ \"id\":%u, "
-			"\"type\":\"weston_output\", \"name\":",
-			o->timeline.id);
-		fprint_quoted_string(ctx->out, o->name);
-		fprintf(ctx->out, " }\n");
-	}
+	if (ring->descs && descs_add_id(ring->descs, to->id))
+		refresh = 1;
+
+	return refresh;
+}
 
-	fprintf(ctx->cur, "\"wo\":%u", o->timeline.id);
+static void
+emit_object(struct timeline_ring *ring, struct weston_timeline_object *to,
+	    uint32_t type, uint32_t main_surface, const char *desc)
+{
+	struct timeline_object rec;
 
-	return 1;
+	rec.base.type = TLR_OBJECT;
+	rec.base.id = to->id;
+	rec.type = type;
+	rec.main_surface = main_surface;
+	rec.has_desc = desc != NULL;
+	rec.pad = 0;
+
+	/* Described again with the next point otherwise */
+	if (!ring_append(desc_ring(ring), &rec, sizeof rec, desc))
+		to->force_refresh = 1;
 }
 
 static void
-check_weston_surface_description(struct timeline_emit_context *ctx,
+check_weston_surface_description(struct timeline_ring *ring,
 				 struct weston_surface *s)
 {
 	struct weston_surface *mains;
+	uint32_t main_id = 0;
 	char d[512];
-	char mainstr[32];
 
-	if (!check_series(ctx, &s->timeline))
+	if (!check_description(ring, &s->timeline))
 		return;
 
 	mains = weston_surface_get_main_surface(s);
 	if (mains != s) {
-		check_weston_surface_description(ctx, mains);
-		if (snprintf(mainstr, sizeof(mainstr),
-			     ", \"main_surface\":%u", mains->timeline.id) < 0)
-			mainstr[0] = '\0';
-	} else {
-		mainstr[0] = '\0';
+		check_weston_surface_description(ring, mains);
+		main_id = mains->timeline.id;
 	}
 
 	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
 		d[0] = '\0';
 
-	fprintf(ctx->out, "{ \"id\":%u, "
-		"\"type\":\"weston_surface\", \"desc\":", s->timeline.id);
-	fprint_quoted_string(ctx->out, d[0] ? d : NULL);
-	fprintf(ctx->out, "%s }\n", mainstr);
-}
-
-static int
-emit_weston_surface(struct timeline_emit_context *ctx, void *obj)
-{
-	struct weston_surface *s = obj;
-
-	check_weston_surface_description(ctx, s);
-	fprintf(ctx->cur, "\"ws\":%u", s->timeline.id);
-
-	return 1;
-}
-
-static int
-emit_vblank_timestamp(struct timeline_emit_context *ctx, void *obj)
-{
-	struct timespec *ts = obj;
-
-	fprintf(ctx->cur, "\"vblank\":[%" PRId64 ", %ld]",
-		(int64_t)ts->tv_sec, ts->tv_nsec);
-
-	return 1;
+	emit_object(ring, &s->timeline, TLT_SURFACE, main_id,
+		    d[0] ? d : NULL);
 }
 
-typedef int (*type_func)(struct timeline_emit_context *ctx, void *obj);
-
-static const type_func type_dispatch[] = {
-	[TLT_OUTPUT] = emit_weston_output,
-	[TLT_SURFACE] = emit_weston_surface,
-	[TLT_VBLANK] = emit_vblank_timestamp,
-};
-
 WL_EXPORT void
 weston_timeline_point(const char *name, ...)
 {
-	va_list argp;
-	struct timespec ts;
+	uint64_t buf[TIMELINE_POINT_MAX / sizeof(uint64_t)];
+	struct timeline_point *point = (void *) buf;
+	uint8_t *p = (uint8_t *) (point + 1);
+	uint8_t *end = (uint8_t *) buf + sizeof buf;
+	struct timeline_arg_object *ao;
+	struct timeline_arg_vblank *av;
+	struct timeline_arg_repaint_timing *ar;
+	struct timeline_arg_render_stats *as;
+	const struct weston_repaint_timing *rt;
+	const struct weston_render_stats *rs;
+	const struct timespec *vt;
+	struct weston_output *o;
+	struct weston_surface *s;
+	struct timeline_ring *ring;
 	enum timeline_type otype;
+	struct timespec ts;
+	va_list argp;
 	void *obj;
-	char buf[512];
-	struct timeline_emit_context ctx;
 
 	clock_gettime(timeline_.clk_id, &ts);
 
-	ctx.out = timeline_.file;
-	ctx.cur = fmemopen(buf, sizeof(buf), "w");
-	ctx.series = timeline_.series;
-
-	if (!ctx.cur) {
-		weston_log("Timeline error in fmemopen, closing.\n");
-		weston_timeline_close();
+	ring = timeline_get_ring();
+	if (!ring)
 		return;
-	}
 
-	fprintf(ctx.cur, "{ \"T\":[%" PRId64 ", %ld], \"N\":\"%s\"",
-		(int64_t)ts.tv_sec, ts.tv_nsec, name);
+	point->base.type = TLR_POINT;
+	point->base.id = timeline_name_id(ring, name);
+	point->sec = ts.tv_sec;
+	point->nsec = ts.tv_nsec;
+	point->nargs = 0;
 
 	va_start(argp, name);
 	while (1) {
@@ -272,21 +953,141 @@ weston_timeline_point(const char *name, ...)
 			break;
 
 		obj = va_arg(argp, void *);
-		if (type_dispatch[otype]) {
-			fprintf(ctx.cur, ", ");
-			type_dispatch[otype](&ctx, obj);
+		if (p + sizeof *ar > end)
+			continue;
+
+		switch (otype) {
+		case TLT_OUTPUT:
+			o = obj;
+			if (check_description(ring, &o->timeline))
+				emit_object(ring, &o->timeline, TLT_OUTPUT,
+					    0, o->name);
+			ao = (void *) p;
+			ao->type = otype;
+			ao->id = o->timeline.id;
+			p += sizeof *ao;
+			break;
+		case TLT_SURFACE:
+			s = obj;
+			check_weston_surface_description(ring, s);
+			ao = (void *) p;
+			ao->type = otype;
+			ao->id = s->timeline.id;
+			p += sizeof *ao;
+			break;
+		case TLT_VBLANK:
+			vt = obj;
+			av = (void *) p;
+			av->type = otype;
+			av->pad = 0;
+			av->sec = vt->tv_sec;
+			av->nsec = vt->tv_nsec;
+			p += sizeof *av;
+			break;
+		case TLT_REPAINT_TIMING:
+			rt = obj;
+			ar = (void *) p;
+			ar->type = otype;
+			ar->window_usec = rt->window_usec;
+			ar->deadline_sec = rt->deadline.tv_sec;
+			ar->deadline_nsec = rt->deadline.tv_nsec;
+			ar->target_sec = rt->target.tv_sec;
+			ar->target_nsec = rt->target.tv_nsec;
+			ar->estimate_usec = rt->estimate_usec;
+			ar->slack_usec = rt->slack_usec;
+			ar->frames = rt->frames;
+			ar->missed = rt->missed;
+			p += sizeof *ar;
+			break;
+		case TLT_RENDER_STATS:
+			rs = obj;
+			as = (void *) p;
+			as->type = otype;
+			as->views = rs->views;
+			as->batches = rs->batches;
+			as->draw_calls = rs->draw_calls;
+			as->vertices = rs->vertices;
+			as->pad = 0;
+			p += sizeof *as;
+			break;
+		default:
+			continue;
 		}
+
+		point->nargs++;
 	}
 	va_end(argp);
 
-	fprintf(ctx.cur, " }\n");
-	fflush(ctx.cur);
-	if (ferror(ctx.cur)) {
-		weston_log("Timeline error in constructing entry, closing.\n");
-		weston_timeline_close();
-	} else {
-		fprintf(ctx.out, "%s", buf);
+	ring_append(ring, point, p - (uint8_t *) buf, NULL);
+}
+
+/** Write what the flight recorder holds to a file
+ *
+ * \param output The output the trouble was seen on.
+ * \param reason What went wrong, for the log.
+ *
+ * Hands the ring of the calling thread, which must be the compositor
+ * thread, over to the flush thread along with the names and objects
+ * described since the last dump, and swaps in the spare ring data and
+ * descriptions, so the repaint loop neither allocates, walks the
+ * objects nor waits for the file. The file is created and written by
+ * the flush thread, and its name is logged at the next dump or when the
+ * recorder stops. The dump has the points of the last
+ * flight_recorder_msec. Dumps are made at most once in that time, as
+ * the ring only holds a full window again by then.
+ */
+void
+weston_timeline_flight_dump(struct weston_output *output, const char *reason)
+{
+	struct timeline_ring *ring = timeline_ring_;
+	struct timeline_dump *dump = &timeline_.dump_slot;
+	struct timeline_descs *descs;
+	struct timespec now, gone;
+	uint8_t *data;
+	bool busy;
+
+	if (timeline_.mode != TIMELINE_FLIGHT ||
+	    timeline_ring_series_ != timeline_.series)
+		return;
+
+	clock_gettime(timeline_.clk_id, &now);
+	timespec_sub(&gone, &now, &timeline_.last_dump);
+	pthread_mutex_lock(&timeline_.mutex);
+	busy = timeline_.dump != NULL;
+	data = timeline_.spare;
+	descs = timeline_.spare_descs;
+	pthread_mutex_unlock(&timeline_.mutex);
+	if (!busy)
+		timeline_report_dump();
+	if (busy || !data || !descs || timespec_to_nsec(&gone) <
+			     timeline_.flight_msec * 1000000LL) {
+		timeline_.dumps_skipped++;
+		return;
 	}
 
-	fclose(ctx.cur);
+	dump->data = ring->data;
+	dump->size = ring->size;
+	dump->tail = ring->tail;
+	dump->head = ring->head;
+	dump->descs = ring->descs;
+	timespec_add_nsec(&dump->cutoff, &now,
+			  -timeline_.flight_msec * 1000000LL);
+	dump->error = 0;
+	dump->unreported = true;
+
+	ring->data = data;
+	ring->tail = ring->head;
+	ring->descs = descs;
+
+	pthread_mutex_lock(&timeline_.mutex);
+	timeline_.spare = NULL;
+	timeline_.spare_descs = NULL;
+	timeline_.dump = dump;
+	pthread_cond_signal(&timeline_.flush_cond);
+	pthread_mutex_unlock(&timeline_.mutex);
+
+	timeline_.last_dump = now;
+
+	weston_log("Timeline: %s on output %s, dumping the last %d ms\n",
+		   reason, output->name, timeline_.flight_msec);
 }
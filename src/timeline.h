@@ -30,6 +30,7 @@
 extern int weston_timeline_enabled_;
 
 struct weston_compositor;
+struct weston_output;
 
 void
 weston_timeline_open(struct weston_compositor *compositor);
@@ -37,11 +38,22 @@ weston_timeline_open(struct weston_compositor *compositor);
 void
 weston_timeline_close(void);
 
+int
+weston_timeline_is_open(void);
+
+void
+weston_timeline_flight_start(struct weston_compositor *compositor);
+
+void
+weston_timeline_flight_dump(struct weston_output *output, const char *reason);
+
 enum timeline_type {
 	TLT_END = 0,
 	TLT_OUTPUT,
 	TLT_SURFACE,
 	TLT_VBLANK,
+	TLT_REPAINT_TIMING,
+	TLT_RENDER_STATS,
 };
 
 #define TYPEVERIFY(type, arg) ({			\
@@ -53,6 +65,10 @@ enum timeline_type {
 #define TLP_OUTPUT(o) TLT_OUTPUT, TYPEVERIFY(struct weston_output *, (o))
 #define TLP_SURFACE(s) TLT_SURFACE, TYPEVERIFY(struct weston_surface *, (s))
 #define TLP_VBLANK(t) TLT_VBLANK, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_REPAINT_TIMING(t) TLT_REPAINT_TIMING, \
+	TYPEVERIFY(const struct weston_repaint_timing *, (t))
+#define TLP_RENDER_STATS(s) TLT_RENDER_STATS, \
+	TYPEVERIFY(const struct weston_render_stats *, (s))
 
 #define TL_POINT(...) do { \
 	if (weston_timeline_enabled_) \
@@ -31,7 +31,9 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <string.h>
 
+#include "shared/helpers.h"
 #include "shared/matrix.h"
 
 struct inverse_matrix {
@@ -184,6 +186,18 @@ randomize_matrix(struct weston_matrix *m)
 #endif
 }
 
+/* A well conditioned matrix whose type rules out the fast paths, so
+ * that the speed loops time the general code. */
+static void
+general_matrix(struct weston_matrix *m)
+{
+	unsigned i;
+
+	for (i = 0; i < 16; ++i)
+		m->d[i] = (i % 5 == 0 ? 2.0 : 0.0) + 0.5 * frand();
+	m->type = WESTON_MATRIX_TRANSFORM_OTHER;
+}
+
 /* Take a matrix, compute inverse, multiply together
  * and subtract the identity matrix to get the error matrix.
  * Return the largest absolute value from the error matrix.
@@ -274,19 +288,22 @@ static void __attribute__((noinline))
 test_loop_speed_matrixvector(void)
 {
 	struct weston_matrix m;
-	struct weston_vector v = { { 0.5, 0.5, 0.5, 1.0 } };
+	struct weston_vector v = { { 0.5, 0.5, 0.5, 1.0 } }, w;
 	unsigned long count = 0;
 	double t;
 
 	printf("\nRunning 3 s test on weston_matrix_transform()...\n");
 
-	weston_matrix_init(&m);
+	general_matrix(&m);
 
 	running = 1;
 	alarm(3);
 	reset_timer();
 	while (running) {
-		weston_matrix_transform(&m, &v);
+		/* from the same vector each time, so that it neither
+		 * overflows nor becomes denormal */
+		w = v;
+		weston_matrix_transform(&m, &w);
 		count++;
 	}
 	t = read_timer();
@@ -300,20 +317,21 @@ test_loop_speed_inversetransform(void)
 {
 	struct weston_matrix m;
 	struct inverse_matrix inv;
-	struct weston_vector v = { { 0.5, 0.5, 0.5, 1.0 } };
+	struct weston_vector v = { { 0.5, 0.5, 0.5, 1.0 } }, w;
 	unsigned long count = 0;
 	double t;
 
 	printf("\nRunning 3 s test on inverse_transform()...\n");
 
-	weston_matrix_init(&m);
+	general_matrix(&m);
 	matrix_invert(inv.LU, inv.perm, &m);
 
 	running = 1;
 	alarm(3);
 	reset_timer();
 	while (running) {
-		inverse_transform(inv.LU, inv.perm, v.f);
+		w = v;
+		inverse_transform(inv.LU, inv.perm, w.f);
 		count++;
 	}
 	t = read_timer();
@@ -332,7 +350,7 @@ test_loop_speed_invert(void)
 
 	printf("\nRunning 3 s test on matrix_invert()...\n");
 
-	weston_matrix_init(&m);
+	general_matrix(&m);
 
 	running = 1;
 	alarm(3);
@@ -356,7 +374,7 @@ test_loop_speed_invert_explicit(void)
 
 	printf("\nRunning 3 s test on weston_matrix_invert()...\n");
 
-	weston_matrix_init(&m);
+	general_matrix(&m);
 
 	running = 1;
 	alarm(3);
@@ -371,6 +389,360 @@ test_loop_speed_invert_explicit(void)
 	       count, t, 1e9 * t / count);
 }
 
+/* The plain versions of the matrix operations, without the fast paths,
+ * for checking and comparing against.
+ */
+static void __attribute__((noinline))
+ref_multiply(struct weston_matrix *m, const struct weston_matrix *n)
+{
+	struct weston_matrix tmp;
+	const float *row, *column;
+	div_t d;
+	int i, j;
+
+	for (i = 0; i < 16; i++) {
+		tmp.d[i] = 0;
+		d = div(i, 4);
+		row = m->d + d.quot * 4;
+		column = n->d + d.rem;
+		for (j = 0; j < 4; j++)
+			tmp.d[i] += row[j] * column[j * 4];
+	}
+	tmp.type = m->type | n->type;
+	memcpy(m, &tmp, sizeof tmp);
+}
+
+static void __attribute__((noinline))
+ref_transform(const struct weston_matrix *matrix, struct weston_vector *v)
+{
+	int i, j;
+	struct weston_vector t;
+
+	for (i = 0; i < 4; i++) {
+		t.f[i] = 0;
+		for (j = 0; j < 4; j++)
+			t.f[i] += v->f[j] * matrix->d[i + j * 4];
+	}
+
+	*v = t;
+}
+
+static int __attribute__((noinline))
+ref_invert(struct weston_matrix *inverse, const struct weston_matrix *matrix)
+{
+	struct inverse_matrix q;
+	unsigned c;
+
+	if (matrix_invert(q.LU, q.perm, matrix) < 0)
+		return -1;
+
+	weston_matrix_init(inverse);
+	for (c = 0; c < 4; ++c)
+		inverse_transform(q.LU, q.perm, &inverse->d[c * 4]);
+	inverse->type = matrix->type;
+
+	return 0;
+}
+
+static const unsigned kinds[] = {
+	0,
+	WESTON_MATRIX_TRANSFORM_TRANSLATE,
+	WESTON_MATRIX_TRANSFORM_SCALE,
+	WESTON_MATRIX_TRANSFORM_TRANSLATE | WESTON_MATRIX_TRANSFORM_SCALE,
+	WESTON_MATRIX_TRANSFORM_TRANSLATE | WESTON_MATRIX_TRANSFORM_ROTATE,
+	WESTON_MATRIX_TRANSFORM_TRANSLATE | WESTON_MATRIX_TRANSFORM_SCALE |
+	WESTON_MATRIX_TRANSFORM_ROTATE,
+};
+
+static const char *
+kind_name(unsigned kind)
+{
+	switch (kind) {
+	case 0:
+		return "identity";
+	case WESTON_MATRIX_TRANSFORM_TRANSLATE:
+		return "translate";
+	case WESTON_MATRIX_TRANSFORM_SCALE:
+		return "scale";
+	case WESTON_MATRIX_TRANSFORM_TRANSLATE | WESTON_MATRIX_TRANSFORM_SCALE:
+		return "scale+translate";
+	case WESTON_MATRIX_TRANSFORM_TRANSLATE | WESTON_MATRIX_TRANSFORM_ROTATE:
+		return "rotate+translate";
+	default:
+		return "general";
+	}
+}
+
+/* Build a matrix through the API, so that its type is set. */
+static void
+random_typed_matrix(struct weston_matrix *m, unsigned kind)
+{
+	double a;
+
+	weston_matrix_init(m);
+
+	if (kind & WESTON_MATRIX_TRANSFORM_SCALE)
+		weston_matrix_scale(m, copysign(0.25 + fabs(frand()) * 4, frand()),
+				    copysign(0.25 + fabs(frand()) * 4, frand()),
+				    1.0 + fabs(frand()));
+	if (kind & WESTON_MATRIX_TRANSFORM_ROTATE) {
+		a = frand() * M_PI;
+		weston_matrix_rotate_xy(m, cos(a), sin(a));
+	}
+	if (kind & WESTON_MATRIX_TRANSFORM_TRANSLATE)
+		weston_matrix_translate(m, frand() * 2000, frand() * 2000,
+					frand() * 10);
+}
+
+static double
+relative_error(float value, float ref)
+{
+	return fabs((double)value - ref) / fmax(1.0, fabs(ref));
+}
+
+static double
+matrix_error(const struct weston_matrix *m, const struct weston_matrix *ref)
+{
+	double err, errsup = 0.0;
+	unsigned i;
+
+	for (i = 0; i < 16; i++) {
+		err = relative_error(m->d[i], ref->d[i]);
+		if (!(err <= errsup))
+			errsup = err;
+	}
+
+	return errsup;
+}
+
+/* Check the specialized and vectorized paths against the plain ones,
+ * for every combination of matrix types. They must round identically,
+ * which needs multiplies and adds not to be fused (-ffp-contract=off).
+ */
+static int
+test_fast_paths(void)
+{
+	struct weston_matrix m, n, fast, ref;
+	struct weston_vector v, vref;
+	float x[7], y[7], fx[7], fy[7];
+	double err, errsup[4] = { 0.0 };
+	unsigned a, b, i, k, iter;
+	int failed = 0, r1, r2;
+
+	printf("\nChecking the specialized matrix operations...\n");
+
+	for (a = 0; a < ARRAY_LENGTH(kinds); a++)
+	for (b = 0; b < ARRAY_LENGTH(kinds); b++)
+	for (iter = 0; iter < 1000; iter++) {
+		random_typed_matrix(&m, kinds[a]);
+		random_typed_matrix(&n, kinds[b]);
+
+		fast = m;
+		weston_matrix_multiply(&fast, &n);
+		ref = m;
+		ref_multiply(&ref, &n);
+		err = matrix_error(&fast, &ref);
+		if (err > errsup[0])
+			errsup[0] = err;
+		if (err != 0.0 || fast.type != ref.type)
+			failed++;
+
+		for (i = 0; i < 4; i++)
+			v.f[i] = frand() * 1000;
+		vref = v;
+		weston_matrix_transform(&m, &v);
+		ref_transform(&m, &vref);
+		for (i = 0; i < 4; i++) {
+			err = relative_error(v.f[i], vref.f[i]);
+			if (err > errsup[1])
+				errsup[1] = err;
+			if (err != 0.0)
+				failed++;
+		}
+
+		r1 = weston_matrix_invert(&fast, &m);
+		r2 = ref_invert(&ref, &m);
+		if (r1 != r2) {
+			failed++;
+		} else if (r1 == 0) {
+			err = matrix_error(&fast, &ref);
+			if (err > errsup[2])
+				errsup[2] = err;
+			if (err != 0.0)
+				failed++;
+
+			/* in place, inverse and matrix being the same */
+			fast = m;
+			if (weston_matrix_invert(&fast, &fast) != 0 ||
+			    matrix_error(&fast, &ref) != 0.0 ||
+			    fast.type != ref.type)
+				failed++;
+		}
+
+		for (k = 0; k < ARRAY_LENGTH(x); k++) {
+			x[k] = frand() * 1000;
+			y[k] = frand() * 1000;
+		}
+		weston_matrix_transform_xy(&m, x, y, fx, fy, ARRAY_LENGTH(x));
+		for (k = 0; k < ARRAY_LENGTH(x); k++) {
+			vref.f[0] = x[k];
+			vref.f[1] = y[k];
+			vref.f[2] = 0.0f;
+			vref.f[3] = 1.0f;
+			ref_transform(&m, &vref);
+			if (fabsf(vref.f[3]) < 1e-6)
+				continue;
+			err = fmax(relative_error(fx[k], vref.f[0] / vref.f[3]),
+				   relative_error(fy[k], vref.f[1] / vref.f[3]));
+			if (err > errsup[3])
+				errsup[3] = err;
+			if (err != 0.0)
+				failed++;
+		}
+	}
+
+	printf("max relative error: multiply %g, transform %g, invert %g, "
+	       "transform_xy %g\n", errsup[0], errsup[1], errsup[2],
+	       errsup[3]);
+	printf("%d mismatches.\n", failed);
+
+	return failed;
+}
+
+#define SPEED_ITERATIONS 2000000
+
+static volatile float sink;
+
+static double
+speed_multiply(void (*multiply)(struct weston_matrix *,
+				const struct weston_matrix *),
+	       const struct weston_matrix *m, const struct weston_matrix *n)
+{
+	struct weston_matrix tmp;
+	unsigned long i;
+
+	reset_timer();
+	for (i = 0; i < SPEED_ITERATIONS; i++) {
+		tmp = *m;
+		multiply(&tmp, n);
+		sink = tmp.d[12];
+	}
+
+	return 1e9 * read_timer() / SPEED_ITERATIONS;
+}
+
+static double
+speed_transform(void (*transform)(struct weston_matrix *,
+				  struct weston_vector *),
+		struct weston_matrix *m)
+{
+	struct weston_vector v;
+	unsigned long i;
+
+	reset_timer();
+	for (i = 0; i < SPEED_ITERATIONS; i++) {
+		v.f[0] = i;
+		v.f[1] = 0.5f;
+		v.f[2] = 0.0f;
+		v.f[3] = 1.0f;
+		transform(m, &v);
+		sink = v.f[0];
+	}
+
+	return 1e9 * read_timer() / SPEED_ITERATIONS;
+}
+
+static double
+speed_invert(int (*invert)(struct weston_matrix *,
+			   const struct weston_matrix *),
+	     const struct weston_matrix *m)
+{
+	struct weston_matrix inverse;
+	unsigned long i;
+
+	reset_timer();
+	for (i = 0; i < SPEED_ITERATIONS; i++) {
+		invert(&inverse, m);
+		sink = inverse.d[12];
+	}
+
+	return 1e9 * read_timer() / SPEED_ITERATIONS;
+}
+
+static void
+ref_transform_nonconst(struct weston_matrix *m, struct weston_vector *v)
+{
+	ref_transform(m, v);
+}
+
+#define POINT_COUNT 1024
+
+/* ns per point, batched and one by one */
+static void
+speed_points(const struct weston_matrix *m, double *batch, double *single)
+{
+	static float x[POINT_COUNT], y[POINT_COUNT];
+	struct weston_vector v;
+	unsigned long i, rounds = SPEED_ITERATIONS / POINT_COUNT;
+	int k;
+
+	for (k = 0; k < POINT_COUNT; k++) {
+		x[k] = k;
+		y[k] = POINT_COUNT - k;
+	}
+
+	reset_timer();
+	for (i = 0; i < rounds; i++) {
+		weston_matrix_transform_xy(m, x, y, x, y, POINT_COUNT);
+		sink = x[0];
+	}
+	*batch = 1e9 * read_timer() / (rounds * POINT_COUNT);
+
+	reset_timer();
+	for (i = 0; i < rounds; i++) {
+		for (k = 0; k < POINT_COUNT; k++) {
+			v.f[0] = x[k];
+			v.f[1] = y[k];
+			v.f[2] = 0.0f;
+			v.f[3] = 1.0f;
+			ref_transform(m, &v);
+			x[k] = v.f[0] / v.f[3];
+			y[k] = v.f[1] / v.f[3];
+		}
+		sink = x[0];
+	}
+	*single = 1e9 * read_timer() / (rounds * POINT_COUNT);
+}
+
+static void
+test_speed_kernels(void)
+{
+	struct weston_matrix m, n;
+	double batch, single;
+	unsigned k;
+
+	printf("\nSpeed of the specialized paths, ns per call "
+	       "(plain version in parentheses):\n");
+	printf("%-17s %16s %16s %16s %16s\n", "type", "multiply",
+	       "transform", "invert", "points");
+
+	for (k = 0; k < ARRAY_LENGTH(kinds); k++) {
+		random_typed_matrix(&m, kinds[k]);
+		random_typed_matrix(&n, kinds[k]);
+		speed_points(&m, &batch, &single);
+
+		printf("%-17s %6.1f (%6.1f) %6.1f (%6.1f) %6.1f (%6.1f) "
+		       "%6.1f (%6.1f)\n", kind_name(kinds[k]),
+		       speed_multiply(weston_matrix_multiply, &m, &n),
+		       speed_multiply(ref_multiply, &m, &n),
+		       speed_transform(weston_matrix_transform, &m),
+		       speed_transform(ref_transform_nonconst, &m),
+		       speed_invert(weston_matrix_invert, &m),
+		       speed_invert(ref_invert, &m),
+		       batch, single);
+	}
+}
+
 int main(void)
 {
 	struct sigaction ding;
@@ -414,11 +786,15 @@ int main(void)
 	print_matrix(&M);
 	printf("max abs error: %g, original determinant %g\n", errsup, det);
 
+	ret = test_fast_paths() ? 1 : 0;
+
 	test_loop_precision();
 	test_loop_speed_matrixvector();
 	test_loop_speed_inversetransform();
 	test_loop_speed_invert();
 	test_loop_speed_invert_explicit();
 
-	return 0;
+	test_speed_kernels();
+
+	return ret;
 }
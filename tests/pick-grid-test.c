@@ -0,0 +1,239 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "src/pick-grid.h"
+
+#define OUTPUT_WIDTH 1920
+#define OUTPUT_HEIGHT 1080
+#define PICK_COUNT 200000
+
+/* A stack of boxes, index 0 is the topmost, like a view list. */
+struct box_stack {
+	int count;
+	pixman_region32_t *regions;
+	struct pick_grid_entry *entries;
+	struct pick_grid grid;
+};
+
+struct pick_result {
+	struct box_stack *stack;
+	int best;
+};
+
+static void
+box_stack_init(struct box_stack *stack, int count)
+{
+	pixman_box32_t box;
+	int i, w, h;
+
+	stack->count = count;
+	stack->regions = calloc(count, sizeof *stack->regions);
+	stack->entries = calloc(count, sizeof *stack->entries);
+	assert(stack->regions && stack->entries);
+	assert(pick_grid_init(&stack->grid) == 0);
+
+	for (i = 0; i < count; i++) {
+		if (i == count - 1) {
+			/* the background */
+			w = OUTPUT_WIDTH;
+			h = OUTPUT_HEIGHT;
+			box.x1 = 0;
+			box.y1 = 0;
+		} else if (i % 4 == 0) {
+			/* windows */
+			w = 200 + random() % 600;
+			h = 150 + random() % 450;
+			box.x1 = random() % (OUTPUT_WIDTH - 100) - 50;
+			box.y1 = random() % (OUTPUT_HEIGHT - 100) - 50;
+		} else {
+			/* popups, tooltips and sub-surfaces */
+			w = 20 + random() % 200;
+			h = 20 + random() % 150;
+			box.x1 = random() % OUTPUT_WIDTH;
+			box.y1 = random() % OUTPUT_HEIGHT;
+		}
+		box.x2 = box.x1 + w;
+		box.y2 = box.y1 + h;
+
+		pixman_region32_init_with_extents(&stack->regions[i], &box);
+		pick_grid_entry_init(&stack->entries[i]);
+		stack->entries[i].order = i;
+		pick_grid_update(&stack->grid, &stack->entries[i], &box);
+	}
+	pick_grid_reorder(&stack->grid);
+
+	assert(!stack->grid.incomplete);
+	assert(stack->grid.entries == count);
+}
+
+static void
+box_stack_release(struct box_stack *stack)
+{
+	int i;
+
+	for (i = 0; i < stack->count; i++) {
+		pick_grid_remove(&stack->grid, &stack->entries[i]);
+		pixman_region32_fini(&stack->regions[i]);
+	}
+
+	assert(stack->grid.entries == 0);
+	pick_grid_release(&stack->grid);
+	free(stack->regions);
+	free(stack->entries);
+}
+
+/* What weston_compositor_pick_view() did before the grid. */
+static int
+pick_scan(struct box_stack *stack, int x, int y)
+{
+	int i;
+
+	for (i = 0; i < stack->count; i++)
+		if (pixman_region32_contains_point(&stack->regions[i],
+						   x, y, NULL))
+			return i;
+
+	return -1;
+}
+
+static int
+pick_visit(struct pick_grid_entry *entry, void *data)
+{
+	struct pick_result *result = data;
+
+	/* visited topmost first */
+	result->best = entry - result->stack->entries;
+
+	return 1;
+}
+
+static int
+pick_grid(struct box_stack *stack, int x, int y)
+{
+	struct pick_result result = { stack, -1 };
+
+	pick_grid_for_each_at(&stack->grid, x, y, pick_visit, &result);
+
+	return result.best;
+}
+
+static double
+time_picks(struct box_stack *stack, int (*pick)(struct box_stack *, int, int),
+	   long *sum)
+{
+	struct timespec begin, end;
+	int i;
+
+	*sum = 0;
+	srandom(42);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < PICK_COUNT; i++)
+		*sum += pick(stack, random() % OUTPUT_WIDTH,
+			     random() % OUTPUT_HEIGHT);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - begin.tv_sec) * 1e9 +
+	       (end.tv_nsec - begin.tv_nsec);
+}
+
+TEST(grid_matches_scan)
+{
+	struct box_stack stack;
+	int i, x, y;
+
+	srandom(13);
+	box_stack_init(&stack, 300);
+
+	for (i = 0; i < 100000; i++) {
+		x = random() % (OUTPUT_WIDTH + 200) - 100;
+		y = random() % (OUTPUT_HEIGHT + 200) - 100;
+		assert(pick_grid(&stack, x, y) == pick_scan(&stack, x, y));
+	}
+
+	box_stack_release(&stack);
+}
+
+TEST(grid_update_moves_entry)
+{
+	struct pick_grid grid;
+	struct pick_grid_entry entry;
+	pixman_box32_t box = { -300, -300, -100, -100 };
+	pixman_box32_t moved = { 1000, 1000, 1200, 1100 };
+	pixman_box32_t empty = { 5, 5, 5, 5 };
+	struct box_stack stack = { 1, NULL, &entry };
+	struct pick_result result = { &stack, -1 };
+
+	assert(pick_grid_init(&grid) == 0);
+	pick_grid_entry_init(&entry);
+
+	pick_grid_update(&grid, &entry, &box);
+	pick_grid_for_each_at(&grid, -200, -200, pick_visit, &result);
+	assert(result.best == 0);
+
+	pick_grid_update(&grid, &entry, &moved);
+	result.best = -1;
+	pick_grid_for_each_at(&grid, -200, -200, pick_visit, &result);
+	assert(result.best == -1);
+	pick_grid_for_each_at(&grid, 1199, 1099, pick_visit, &result);
+	assert(result.best == 0);
+
+	pick_grid_update(&grid, &entry, &empty);
+	assert(!entry.indexed);
+	assert(grid.entries == 0);
+
+	pick_grid_release(&grid);
+}
+
+TEST(pick_benchmark)
+{
+	static const int counts[] = { 10, 100, 1000 };
+	struct box_stack stack;
+	double scan_ns, grid_ns;
+	long scan_sum, grid_sum;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(counts); i++) {
+		srandom(13);
+		box_stack_init(&stack, counts[i]);
+
+		scan_ns = time_picks(&stack, pick_scan, &scan_sum);
+		grid_ns = time_picks(&stack, pick_grid, &grid_sum);
+		assert(scan_sum == grid_sum);
+
+		printf("%4d views: scan %7.1f ns/pick, grid %7.1f ns/pick\n",
+		       counts[i], scan_ns / PICK_COUNT, grid_ns / PICK_COUNT);
+
+		box_stack_release(&stack);
+	}
+}
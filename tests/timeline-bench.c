@@ -0,0 +1,290 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/compositor.h"
+#include "src/timeline.h"
+
+/* Times TL_POINT with weston_timeline_point() and with the fprintf
+ * based JSON writer it replaced, for the kinds of points the repaint
+ * loop emits.
+ */
+
+#define BURST 8000
+#define BURSTS 25
+
+static struct timespec begin_time;
+static char timeline_file[1000];
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+/* What timeline.c needs from the rest of the compositor */
+
+WL_EXPORT int
+weston_log(const char *fmt, ...)
+{
+	char buf[1100];
+	va_list argp;
+
+	va_start(argp, fmt);
+	vsnprintf(buf, sizeof buf, fmt, argp);
+	va_end(argp);
+
+	sscanf(buf, "Opened timeline file '%999[^']'", timeline_file);
+
+	return fprintf(stderr, "%s", buf);
+}
+
+WL_EXPORT struct weston_surface *
+weston_surface_get_main_surface(struct weston_surface *surface)
+{
+	return surface;
+}
+
+/* The timeline writer as it was, minus surfaces */
+
+static FILE *reference_file;
+static unsigned reference_id;
+
+static void
+reference_point(const char *name, ...)
+{
+	va_list argp;
+	struct timespec ts;
+	enum timeline_type otype;
+	void *obj;
+	char buf[512];
+	FILE *cur;
+	struct weston_output *o;
+	struct timespec *vt;
+	struct weston_repaint_timing *rt;
+	struct weston_render_stats *rs;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	cur = fmemopen(buf, sizeof(buf), "w");
+	if (!cur)
+		abort();
+
+	fprintf(cur, "{ \"T\":[%" PRId64 ", %ld], \"N\":\"%s\"",
+		(int64_t)ts.tv_sec, ts.tv_nsec, name);
+
+	va_start(argp, name);
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+		fprintf(cur, ", ");
+		switch (otype) {
+		case TLT_OUTPUT:
+			o = obj;
+			if (o->timeline.series != 1) {
+				o->timeline.series = 1;
+				o->timeline.id = ++reference_id;
+				fprintf(reference_file, "{ \"id\":%u, "
+					"\"type\":\"weston_output\", "
+					"\"name\":\"%s\" }\n",
+					o->timeline.id, o->name);
+			}
+			fprintf(cur, "\"wo\":%u", o->timeline.id);
+			break;
+		case TLT_VBLANK:
+			vt = obj;
+			fprintf(cur, "\"vblank\":[%" PRId64 ", %ld]",
+				(int64_t)vt->tv_sec, vt->tv_nsec);
+			break;
+		case TLT_REPAINT_TIMING:
+			rt = obj;
+			fprintf(cur, "\"repaint\":{ "
+				"\"deadline\":[%" PRId64 ", %ld], "
+				"\"target\":[%" PRId64 ", %ld], "
+				"\"window_us\":%d, \"estimate_us\":%d, "
+				"\"slack_us\":%d, "
+				"\"frames\":%u, \"missed\":%u }",
+				(int64_t)rt->deadline.tv_sec,
+				rt->deadline.tv_nsec,
+				(int64_t)rt->target.tv_sec, rt->target.tv_nsec,
+				rt->window_usec, rt->estimate_usec,
+				rt->slack_usec, rt->frames, rt->missed);
+			break;
+		case TLT_RENDER_STATS:
+			rs = obj;
+			fprintf(cur, "\"render\":{ \"views\":%u, "
+				"\"batches\":%u, \"draw_calls\":%u, "
+				"\"vertices\":%u }",
+				rs->views, rs->batches, rs->draw_calls,
+				rs->vertices);
+			break;
+		default:
+			break;
+		}
+	}
+	va_end(argp);
+
+	fprintf(cur, " }\n");
+	fflush(cur);
+	fprintf(reference_file, "%s", buf);
+	fclose(cur);
+}
+
+enum bench_case {
+	CASE_NAME,
+	CASE_OUTPUT,
+	CASE_REPAINT,
+	CASE_RENDER,
+	CASE_COUNT
+};
+
+static const char *case_names[] = {
+	[CASE_NAME] = "name only",
+	[CASE_OUTPUT] = "output",
+	[CASE_REPAINT] = "output, repaint timing",
+	[CASE_RENDER] = "output, render stats",
+};
+
+struct bench {
+	struct weston_output *output;
+	struct weston_repaint_timing rt;
+	struct weston_render_stats rs;
+	struct timespec vblank;
+};
+
+#define BENCH_POINTS(point, b, c) do {					\
+	switch (c) {							\
+	case CASE_NAME:							\
+		point("core_repaint_req", TLP_END);			\
+		break;							\
+	case CASE_OUTPUT:						\
+		point("core_repaint_begin",				\
+		      TLP_OUTPUT((b)->output), TLP_END);		\
+		break;							\
+	case CASE_REPAINT:						\
+		point("core_repaint_deadline",				\
+		      TLP_OUTPUT((b)->output),				\
+		      TLP_REPAINT_TIMING(&(b)->rt), TLP_END);		\
+		break;							\
+	default:							\
+		point("renderer_views_drawn",				\
+		      TLP_OUTPUT((b)->output),				\
+		      TLP_RENDER_STATS(&(b)->rs), TLP_END);		\
+		break;							\
+	}								\
+} while (0)
+
+/* Seconds per point, in bursts that fit the ring buffer with pauses
+ * for the flush thread to empty it */
+static double
+run(struct bench *b, enum bench_case c, int reference)
+{
+	struct timespec pause = { 0, 150 * 1000 * 1000 };
+	double total = 0;
+	int i, j;
+
+	for (j = 0; j < BURSTS; j++) {
+		reset_timer();
+		for (i = 0; i < BURST; i++) {
+			if (reference)
+				BENCH_POINTS(reference_point, b, c);
+			else
+				BENCH_POINTS(weston_timeline_point, b, c);
+		}
+		total += read_timer();
+
+		if (!reference)
+			nanosleep(&pause, NULL);
+	}
+
+	return total / (BURST * BURSTS);
+}
+
+int main(void)
+{
+	struct weston_compositor compositor;
+	struct bench b;
+	double before, after;
+	int c;
+
+	memset(&compositor, 0, sizeof compositor);
+	wl_signal_init(&compositor.destroy_signal);
+
+	memset(&b, 0, sizeof b);
+	b.output = calloc(1, sizeof *b.output);
+	b.output->name = strdup("bench");
+	b.rt.window_usec = 7000;
+	b.rt.estimate_usec = 4000;
+	b.rt.slack_usec = 1000;
+	b.rs.views = 12;
+	b.rs.batches = 3;
+	b.rs.draw_calls = 3;
+	b.rs.vertices = 480;
+
+	reference_file = tmpfile();
+	weston_timeline_open(&compositor);
+	if (!reference_file || !weston_timeline_enabled_)
+		return EXIT_FAILURE;
+
+	for (c = 0; c < CASE_COUNT; c++) {
+		before = run(&b, c, 1);
+		after = run(&b, c, 0);
+		printf("%-24s fprintf %6.0f ns, binary %6.0f ns per point\n",
+		       case_names[c], before * 1e9, after * 1e9);
+	}
+
+	weston_timeline_close();
+	fclose(reference_file);
+	if (timeline_file[0])
+		unlink(timeline_file);
+
+	free(b.output->name);
+	free(b.output);
+
+	return EXIT_SUCCESS;
+}
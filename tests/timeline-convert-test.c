@@ -0,0 +1,379 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "weston-test-runner.h"
+
+#include "src/compositor.h"
+#include "src/timeline.h"
+
+/* Writes the same points with weston_timeline_point() and with the
+ * fprintf based JSON writer it replaced, runs weston-timeline-convert on
+ * the binary log and checks that it gives the same JSON, line for line,
+ * apart from the timestamps of the points.
+ */
+
+static char timeline_file[1000];
+
+/* What timeline.c needs from the rest of the compositor */
+
+WL_EXPORT int
+weston_log(const char *fmt, ...)
+{
+	char buf[1100];
+	va_list argp;
+
+	va_start(argp, fmt);
+	vsnprintf(buf, sizeof buf, fmt, argp);
+	va_end(argp);
+
+	sscanf(buf, "Opened timeline file '%999[^']'", timeline_file);
+
+	return fprintf(stderr, "%s", buf);
+}
+
+struct test_surface {
+	struct weston_surface base;
+	struct weston_surface *main_surface;
+	const char *label;
+};
+
+WL_EXPORT struct weston_surface *
+weston_surface_get_main_surface(struct weston_surface *surface)
+{
+	struct test_surface *ts = (struct test_surface *) surface;
+
+	return ts->main_surface ? ts->main_surface : surface;
+}
+
+static int
+test_surface_get_label(struct weston_surface *surface, char *buf, size_t len)
+{
+	struct test_surface *ts = (struct test_surface *) surface;
+
+	if (!ts->label)
+		return -1;
+
+	return snprintf(buf, len, "%s", ts->label);
+}
+
+/* The timeline writer as it was */
+
+static FILE *reference_file;
+static unsigned reference_id;
+
+static int
+reference_check_series(struct weston_timeline_object *to)
+{
+	if (to->series != 1) {
+		to->series = 1;
+		to->id = ++reference_id;
+		return 1;
+	}
+
+	if (to->force_refresh) {
+		to->force_refresh = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+reference_quoted_string(const char *str)
+{
+	if (!str)
+		fprintf(reference_file, "null");
+	else
+		fprintf(reference_file, "\"%s\"", str);
+}
+
+static void
+reference_surface(struct weston_surface *s)
+{
+	struct weston_surface *mains;
+	char d[512];
+	char mainstr[32];
+
+	if (!reference_check_series(&s->timeline))
+		return;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s) {
+		reference_surface(mains);
+		snprintf(mainstr, sizeof(mainstr),
+			 ", \"main_surface\":%u", mains->timeline.id);
+	} else {
+		mainstr[0] = '\0';
+	}
+
+	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
+		d[0] = '\0';
+
+	fprintf(reference_file, "{ \"id\":%u, "
+		"\"type\":\"weston_surface\", \"desc\":", s->timeline.id);
+	reference_quoted_string(d[0] ? d : NULL);
+	fprintf(reference_file, "%s }\n", mainstr);
+}
+
+static void
+reference_point(const char *name, ...)
+{
+	va_list argp;
+	struct timespec ts;
+	enum timeline_type otype;
+	void *obj;
+	char buf[512];
+	FILE *cur;
+	struct weston_output *o;
+	struct weston_surface *s;
+	struct timespec *vt;
+	struct weston_repaint_timing *rt;
+	struct weston_render_stats *rs;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	cur = fmemopen(buf, sizeof(buf), "w");
+	assert(cur);
+
+	fprintf(cur, "{ \"T\":[%" PRId64 ", %ld], \"N\":\"%s\"",
+		(int64_t)ts.tv_sec, ts.tv_nsec, name);
+
+	va_start(argp, name);
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+		fprintf(cur, ", ");
+		switch (otype) {
+		case TLT_OUTPUT:
+			o = obj;
+			if (reference_check_series(&o->timeline)) {
+				fprintf(reference_file, "{ \"id\":%u, "
+					"\"type\":\"weston_output\", "
+					"\"name\":", o->timeline.id);
+				reference_quoted_string(o->name);
+				fprintf(reference_file, " }\n");
+			}
+			fprintf(cur, "\"wo\":%u", o->timeline.id);
+			break;
+		case TLT_SURFACE:
+			s = obj;
+			reference_surface(s);
+			fprintf(cur, "\"ws\":%u", s->timeline.id);
+			break;
+		case TLT_VBLANK:
+			vt = obj;
+			fprintf(cur, "\"vblank\":[%" PRId64 ", %ld]",
+				(int64_t)vt->tv_sec, vt->tv_nsec);
+			break;
+		case TLT_REPAINT_TIMING:
+			rt = obj;
+			fprintf(cur, "\"repaint\":{ "
+				"\"deadline\":[%" PRId64 ", %ld], "
+				"\"target\":[%" PRId64 ", %ld], "
+				"\"window_us\":%d, \"estimate_us\":%d, "
+				"\"slack_us\":%d, "
+				"\"frames\":%u, \"missed\":%u }",
+				(int64_t)rt->deadline.tv_sec,
+				rt->deadline.tv_nsec,
+				(int64_t)rt->target.tv_sec, rt->target.tv_nsec,
+				rt->window_usec, rt->estimate_usec,
+				rt->slack_usec, rt->frames, rt->missed);
+			break;
+		case TLT_RENDER_STATS:
+			rs = obj;
+			fprintf(cur, "\"render\":{ \"views\":%u, "
+				"\"batches\":%u, \"draw_calls\":%u, "
+				"\"vertices\":%u }",
+				rs->views, rs->batches, rs->draw_calls,
+				rs->vertices);
+			break;
+		default:
+			break;
+		}
+	}
+	va_end(argp);
+
+	fprintf(cur, " }\n");
+	fflush(cur);
+	fprintf(reference_file, "%s", buf);
+	fclose(cur);
+}
+
+/* One set of objects per writer, as each keeps its ids in them */
+struct scene {
+	struct weston_output output[2];
+	struct test_surface main_surface, sub_surface, unlabeled;
+	struct weston_repaint_timing rt;
+	struct weston_render_stats rs;
+	struct timespec vblank;
+};
+
+static void
+scene_init(struct scene *sc)
+{
+	memset(sc, 0, sizeof *sc);
+
+	sc->output[0].name = "HDMI-A-1";
+	sc->output[1].name = "DP-2";
+
+	sc->main_surface.label = "xdg_surface \"terminal\"";
+	sc->main_surface.base.get_label = test_surface_get_label;
+	sc->sub_surface.label = "sub-surface";
+	sc->sub_surface.base.get_label = test_surface_get_label;
+	sc->sub_surface.main_surface = &sc->main_surface.base;
+	sc->unlabeled.base.get_label = test_surface_get_label;
+
+	sc->rt.window_usec = 7000;
+	sc->rt.deadline.tv_sec = 12;
+	sc->rt.deadline.tv_nsec = 345678;
+	sc->rt.target.tv_sec = 12;
+	sc->rt.target.tv_nsec = 16345678;
+	sc->rt.estimate_usec = 4000;
+	sc->rt.slack_usec = -250;
+	sc->rt.frames = 100;
+	sc->rt.missed = 3;
+	sc->rs.views = 12;
+	sc->rs.batches = 3;
+	sc->rs.draw_calls = 4;
+	sc->rs.vertices = 480;
+	sc->vblank.tv_sec = 12;
+	sc->vblank.tv_nsec = 999999999;
+}
+
+static void
+run_scene(struct scene *sc, void (*point)(const char *name, ...))
+{
+	struct weston_output *o0 = &sc->output[0], *o1 = &sc->output[1];
+	struct weston_surface *sub = &sc->sub_surface.base;
+	struct weston_surface *mains = &sc->main_surface.base;
+	struct weston_surface *unlabeled = &sc->unlabeled.base;
+	int i;
+
+	point("core_repaint_req", TLP_END);
+	for (i = 0; i < 3; i++) {
+		point("core_repaint_begin", TLP_OUTPUT(o0), TLP_END);
+		point("core_repaint_deadline", TLP_OUTPUT(o0),
+		      TLP_REPAINT_TIMING(&sc->rt), TLP_END);
+		point("core_flush_damage", TLP_SURFACE(sub),
+		      TLP_OUTPUT(o0), TLP_END);
+		point("renderer_views_drawn", TLP_OUTPUT(o0),
+		      TLP_RENDER_STATS(&sc->rs), TLP_END);
+		point("core_repaint_finished", TLP_OUTPUT(o0),
+		      TLP_VBLANK(&sc->vblank), TLP_END);
+	}
+
+	point("core_flush_damage", TLP_SURFACE(unlabeled),
+	      TLP_OUTPUT(o1), TLP_END);
+
+	/* As when a surface gets a new label */
+	mains->timeline.force_refresh = 1;
+	sc->main_surface.label = "xdg_surface \"editor\"";
+	point("core_commit_damage", TLP_SURFACE(mains), TLP_END);
+	point("core_commit_damage", TLP_SURFACE(sub), TLP_END);
+}
+
+/* Leaves out the timestamp of a point */
+static const char *
+skip_timestamp(const char *line)
+{
+	static const char prefix[] = "{ \"T\":[";
+	const char *end;
+
+	if (strncmp(line, prefix, strlen(prefix)) != 0)
+		return line;
+
+	end = strchr(line, ']');
+	assert(end);
+
+	return end;
+}
+
+TEST(converter_matches_old_writer)
+{
+	struct weston_compositor compositor;
+	struct scene *reference, *binary;
+	char command[2200], expected[1024], line[1024];
+	const char *builddir;
+	FILE *converted;
+	int lines = 0;
+
+	reference = malloc(sizeof *reference);
+	binary = malloc(sizeof *binary);
+	assert(reference && binary);
+	scene_init(reference);
+	scene_init(binary);
+
+	reference_file = tmpfile();
+	assert(reference_file);
+	run_scene(reference, reference_point);
+	rewind(reference_file);
+
+	memset(&compositor, 0, sizeof compositor);
+	wl_signal_init(&compositor.destroy_signal);
+	weston_timeline_open(&compositor);
+	assert(weston_timeline_is_open());
+	run_scene(binary, weston_timeline_point);
+	weston_timeline_close();
+	assert(timeline_file[0]);
+
+	builddir = getenv("abs_builddir");
+	snprintf(command, sizeof command, "%s/weston-timeline-convert %s",
+		 builddir ? builddir : ".", timeline_file);
+	converted = popen(command, "r");
+	assert(converted);
+
+	while (fgets(expected, sizeof expected, reference_file)) {
+		assert(fgets(line, sizeof line, converted));
+		if (strcmp(skip_timestamp(line),
+			   skip_timestamp(expected)) != 0) {
+			fprintf(stderr, "expected: %sconverted: %s",
+				expected, line);
+			assert(0);
+		}
+		lines++;
+	}
+	assert(!fgets(line, sizeof line, converted));
+	assert(pclose(converted) == 0);
+	assert(lines > 0);
+
+	fclose(reference_file);
+	unlink(timeline_file);
+	free(binary);
+	free(reference);
+}
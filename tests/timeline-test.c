@@ -0,0 +1,276 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "weston-test-runner.h"
+
+#include "src/compositor.h"
+#include "src/timeline.h"
+#include "src/timeline-format.h"
+
+/* Runs the flight recorder with a compositor that has just an output,
+ * and reads back the dumps it writes: what eviction keeps of a ring
+ * that wrapped, the names and objects written before the points that
+ * refer to them, and the points older than the window left out.
+ */
+
+#define MAX_IDS 1024
+
+static char dump_file[1000];
+
+/* What timeline.c needs from the rest of the compositor */
+
+WL_EXPORT int
+weston_log(const char *fmt, ...)
+{
+	char buf[1100];
+	va_list argp;
+
+	va_start(argp, fmt);
+	vsnprintf(buf, sizeof buf, fmt, argp);
+	va_end(argp);
+
+	sscanf(buf, "Timeline: wrote flight recorder dump '%999[^']'",
+	       dump_file);
+
+	return fprintf(stderr, "%s", buf);
+}
+
+WL_EXPORT struct weston_surface *
+weston_surface_get_main_surface(struct weston_surface *surface)
+{
+	return surface;
+}
+
+struct recorder {
+	struct weston_compositor compositor;
+	struct weston_output output;
+};
+
+static void
+recorder_start(struct recorder *rec, int32_t msec)
+{
+	memset(rec, 0, sizeof *rec);
+	wl_signal_init(&rec->compositor.destroy_signal);
+	wl_list_init(&rec->compositor.output_list);
+	wl_list_init(&rec->compositor.view_list);
+
+	rec->output.name = "test";
+	rec->output.compositor = &rec->compositor;
+	wl_list_insert(&rec->compositor.output_list, &rec->output.link);
+
+	rec->compositor.flight_recorder_msec = msec;
+	weston_timeline_flight_start(&rec->compositor);
+	assert(weston_timeline_enabled_);
+}
+
+/* Stopping waits for the dump being written, and logs its name */
+static void
+recorder_stop(struct recorder *rec)
+{
+	wl_signal_emit(&rec->compositor.destroy_signal, &rec->compositor);
+	assert(!weston_timeline_enabled_);
+}
+
+/* Points carry their sequence number as the vblank seconds */
+static void
+emit_points(struct recorder *rec, int first, int count)
+{
+	struct timespec seq = { 0, 0 };
+	int i;
+
+	for (i = first; i < first + count; i++) {
+		seq.tv_sec = i;
+		TL_POINT("test_point", TLP_OUTPUT(&rec->output),
+			 TLP_VBLANK(&seq), TLP_END);
+	}
+}
+
+static void
+sleep_msec(int msec)
+{
+	struct timespec ts = { msec / 1000, (msec % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+struct dump_points {
+	int count;
+	int first, last;	/* sequence numbers */
+};
+
+/* Checks that the dump is made of whole records that only refer to
+ * names and objects described before them, and that the points are
+ * consecutive. Removes the file. */
+static void
+read_dump(struct dump_points *points)
+{
+	bool names[MAX_IDS] = { false }, objects[MAX_IDS] = { false };
+	const struct timeline_header *header;
+	const struct timeline_record *r;
+	const struct timeline_point *point;
+	const struct timeline_arg_object *ao;
+	const struct timeline_arg_vblank *av;
+	uint8_t *data, *p, *end;
+	FILE *file;
+	long size;
+
+	assert(dump_file[0]);
+	file = fopen(dump_file, "r");
+	assert(file);
+	assert(fseek(file, 0, SEEK_END) == 0);
+	size = ftell(file);
+	assert(size >= (long) sizeof *header);
+	rewind(file);
+	data = malloc(size);
+	assert(data);
+	assert(fread(data, 1, size, file) == (size_t) size);
+	fclose(file);
+	unlink(dump_file);
+	dump_file[0] = '\0';
+
+	header = (const void *) data;
+	assert(header->magic == TIMELINE_MAGIC);
+	assert(header->version == TIMELINE_VERSION);
+
+	points->count = 0;
+	p = data + sizeof *header;
+	end = data + size;
+	while (p < end) {
+		r = (const void *) p;
+		assert(p + sizeof *r <= end);
+		assert(r->size >= sizeof *r && r->size % 8 == 0);
+		assert(p + r->size <= end);
+		assert(r->id < MAX_IDS);
+
+		switch (r->type) {
+		case TLR_NAME:
+			names[r->id] = true;
+			break;
+		case TLR_OBJECT:
+			objects[r->id] = true;
+			break;
+		case TLR_POINT:
+			point = (const void *) p;
+			assert(names[r->id]);
+			assert(point->nargs == 2);
+			ao = (const void *) (point + 1);
+			assert(ao->type == TLT_OUTPUT);
+			assert(ao->id < MAX_IDS && objects[ao->id]);
+			av = (const void *) (ao + 1);
+			assert(av->type == TLT_VBLANK);
+
+			if (points->count == 0)
+				points->first = av->sec;
+			else
+				assert(av->sec == points->last + 1);
+			points->last = av->sec;
+			points->count++;
+			break;
+		default:
+			assert(0 && "unknown record type");
+		}
+
+		p += r->size;
+	}
+
+	free(data);
+}
+
+TEST(flight_dump_evicts_oldest_records)
+{
+	struct recorder rec;
+	struct dump_points points;
+	int count = 200000;
+
+	/* Well within the window, but more than the ring holds. The
+	 * name and output are described apart, and are still known */
+	recorder_start(&rec, 10000);
+	emit_points(&rec, 0, count);
+	weston_timeline_flight_dump(&rec.output, "test");
+	recorder_stop(&rec);
+
+	read_dump(&points);
+	assert(points.count > 0);
+	assert(points.first > 0);
+	assert(points.last == count - 1);
+}
+
+TEST(flight_dump_leaves_out_old_points)
+{
+	struct recorder rec;
+	struct dump_points points;
+
+	recorder_start(&rec, 100);
+	emit_points(&rec, 0, 10);
+	sleep_msec(250);
+	emit_points(&rec, 10, 10);
+	weston_timeline_flight_dump(&rec.output, "test");
+	recorder_stop(&rec);
+
+	read_dump(&points);
+	assert(points.count == 10);
+	assert(points.first == 10);
+	assert(points.last == 19);
+}
+
+TEST(flight_dump_reuses_ring_data)
+{
+	struct recorder rec;
+	struct dump_points points;
+
+	recorder_start(&rec, 100);
+	emit_points(&rec, 0, 10);
+	weston_timeline_flight_dump(&rec.output, "test");
+
+	/* Too soon, skipped */
+	emit_points(&rec, 10, 10);
+	weston_timeline_flight_dump(&rec.output, "test");
+
+	/* The first dump is reported by the next one, which goes to the
+	 * ring data the first one was written from */
+	sleep_msec(150);
+	emit_points(&rec, 20, 10);
+	weston_timeline_flight_dump(&rec.output, "test");
+	read_dump(&points);
+	assert(points.count == 10);
+	assert(points.first == 0);
+
+	recorder_stop(&rec);
+	read_dump(&points);
+	assert(points.count == 10);
+	assert(points.first == 20);
+	assert(points.last == 29);
+}
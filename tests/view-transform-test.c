@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "src/compositor.h"
+
+/* A parent moved and updated on its own, as shells do right after
+ * weston_view_set_position(), must not leave its child behind: the
+ * next repaint has to bring the child along.
+ */
+
+struct transform_test {
+	struct weston_compositor *compositor;
+	struct weston_view *parent;
+	struct weston_view *child;
+	struct wl_event_source *timer;
+	int polls;
+};
+
+static void
+check_child(struct transform_test *t)
+{
+	pixman_box32_t *box;
+	float x, y;
+
+	weston_view_to_global_float(t->child, 0, 0, &x, &y);
+	fprintf(stderr, "child origin maps to %f, %f\n", x, y);
+	assert(x == 105 && y == 55);
+
+	box = pixman_region32_extents(&t->child->transform.boundingbox);
+	assert(box->x1 == 105 && box->y1 == 55);
+	assert(box->x2 == 125 && box->y2 == 75);
+}
+
+static int
+poll_child(void *data)
+{
+	struct transform_test *t = data;
+
+	/* Repaint runs every frame on the headless backend */
+	if (t->child->transform.dirty && ++t->polls < 200) {
+		wl_event_source_timer_update(t->timer, 10);
+		return 0;
+	}
+
+	assert(!t->child->transform.dirty);
+	check_child(t);
+
+	wl_event_source_remove(t->timer);
+	wl_display_terminate(t->compositor->wl_display);
+
+	return 0;
+}
+
+static void
+subsurface_parent_moved(void *data)
+{
+	struct transform_test *t = data;
+	struct weston_compositor *compositor = t->compositor;
+	struct weston_surface *parent_surface, *child_surface;
+	struct wl_event_loop *loop;
+
+	parent_surface = weston_surface_create(compositor);
+	child_surface = weston_surface_create(compositor);
+	assert(parent_surface && child_surface);
+	parent_surface->width = 200;
+	parent_surface->height = 200;
+	child_surface->width = 20;
+	child_surface->height = 20;
+
+	t->parent = weston_view_create(parent_surface);
+	t->child = weston_view_create(child_surface);
+	assert(t->parent && t->child);
+
+	weston_view_set_transform_parent(t->child, t->parent);
+	weston_view_set_position(t->parent, 10, 10);
+	weston_view_set_position(t->child, 5, 5);
+	weston_view_update_transform(t->child);
+
+	weston_view_set_position(t->parent, 100, 50);
+	weston_view_update_transform(t->parent);
+	assert(t->child->transform.dirty);
+
+	/* Still dirty, so this must not be lost either */
+	weston_view_geometry_dirty(t->child);
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	t->timer = wl_event_loop_add_timer(loop, poll_child, t);
+	assert(t->timer);
+	wl_event_source_timer_update(t->timer, 10);
+
+	weston_compositor_schedule_repaint(compositor);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	static struct transform_test t;
+	struct wl_event_loop *loop;
+
+	t.compositor = compositor;
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, subsurface_parent_moved, &t);
+
+	return 0;
+}
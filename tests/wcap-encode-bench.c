@@ -0,0 +1,449 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared/helpers.h"
+#include "wcap/wcap-decode.h"
+#include "wcap/wcap-encode.h"
+
+/* Encodes frame sequences with the scalar encoder the recorder used to
+ * have and with wcap_encode_rectangle(), checks that they produce the
+ * same stream, and reports how fast each is. Besides full frames read
+ * bottom up, the check covers frames read top down, encoding in place as
+ * the recorder does for bottom up reads, and frames split into
+ * rectangles of odd sizes.
+ */
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+static uint32_t *
+ref_output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+static uint32_t
+ref_component_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+/* The loop of the recorder before the vectorized encoder, for one
+ * rectangle with its bottom row at 'pixels' */
+static uint32_t *
+ref_encode(uint32_t *p, uint32_t *frame, int stride,
+	   const struct wcap_rectangle *rect,
+	   const uint32_t *pixels, int src_stride)
+{
+	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
+	uint32_t delta, prev, next, *d;
+	const uint32_t *s;
+	int j, k, run;
+
+	run = prev = 0;
+	for (j = 0; j < height; j++) {
+		s = pixels + src_stride * j;
+		d = frame + stride * (rect->y2 - j - 1) + rect->x1;
+
+		for (k = 0; k < width; k++) {
+			next = *s++;
+			delta = ref_component_delta(next, *d);
+			*d++ = next;
+			if (run == 0 || delta == prev) {
+				run++;
+			} else {
+				p = ref_output_run(p, prev, run);
+				run = 1;
+			}
+			prev = delta;
+		}
+	}
+
+	return ref_output_run(p, prev, run);
+}
+
+struct sequence {
+	const char *name;
+	int width, height;
+	int count;
+	/* Fills in frame 'n', bottom row first, returns 0 at the end */
+	int (*get)(struct sequence *seq, int n, uint32_t *pixels);
+	struct wcap_decoder *decoder;
+};
+
+static uint32_t rand_state = 13;
+
+static uint32_t
+rand_next(void)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state;
+}
+
+/* The same desktop every frame, all deltas zero */
+static int
+get_static(struct sequence *seq, int n, uint32_t *pixels)
+{
+	int x, y;
+
+	for (y = 0; y < seq->height; y++)
+		for (x = 0; x < seq->width; x++)
+			*pixels++ = 0xff000000 | (y * 255 / seq->height) << 8 |
+				    (x * 255 / seq->width);
+
+	return n < seq->count;
+}
+
+/* A textured window moving over a gradient */
+static int
+get_window(struct sequence *seq, int n, uint32_t *pixels)
+{
+	int x, y, wx = n * 7 % (seq->width / 2), wy = n * 3 % (seq->height / 2);
+	uint32_t *p = pixels;
+
+	get_static(seq, 0, pixels);
+	for (y = wy; y < wy + seq->height / 2; y++) {
+		p = pixels + y * seq->width + wx;
+		for (x = 0; x < seq->width / 2; x++)
+			*p++ = ((x / 8 + (y - wy) / 8) & 1) ?
+				0xffeeeeee : 0xff202020 | (x & 0xff);
+	}
+
+	return n < seq->count;
+}
+
+/* Noise, every pixel different from the one before it */
+static int
+get_noise(struct sequence *seq, int n, uint32_t *pixels)
+{
+	int i;
+
+	for (i = 0; i < seq->width * seq->height; i++)
+		pixels[i] = rand_next() >> 8 | 0xff000000;
+
+	return n < seq->count;
+}
+
+/* Frames decoded from a recording */
+static int
+get_recorded(struct sequence *seq, int n, uint32_t *pixels)
+{
+	int y;
+
+	if (!wcap_decoder_get_frame(seq->decoder))
+		return 0;
+
+	for (y = 0; y < seq->height; y++)
+		memcpy(pixels + y * seq->width,
+		       seq->decoder->frame +
+		       (seq->height - y - 1) * seq->width, seq->width * 4);
+
+	return 1;
+}
+
+/* Splits the frame into a grid of up to 3x3 rectangles, with the lines
+ * between them moving from frame to frame. Returns the number of
+ * rectangles. */
+static int
+get_rects(struct sequence *seq, int n, struct wcap_rectangle *rects)
+{
+	int xs[4], ys[4], i, j, count = 0;
+
+	xs[0] = 0;
+	xs[1] = 1 + n * 13 % (seq->width / 2);
+	xs[2] = xs[1] + 1 + n * 7 % (seq->width - xs[1]);
+	xs[3] = seq->width;
+	ys[0] = 0;
+	ys[1] = 1 + n * 5 % (seq->height / 2);
+	ys[2] = ys[1] + 1 + n * 11 % (seq->height - ys[1]);
+	ys[3] = seq->height;
+
+	for (j = 0; j < 3; j++) {
+		for (i = 0; i < 3; i++) {
+			if (xs[i] == xs[i + 1] || ys[j] == ys[j + 1])
+				continue;
+
+			rects[count].x1 = xs[i];
+			rects[count].y1 = ys[j];
+			rects[count].x2 = xs[i + 1];
+			rects[count].y2 = ys[j + 1];
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* Compares what a variant of the encoding produced with the reference */
+static int
+check_variant(struct sequence *seq, int n, const char *variant,
+	      const uint32_t *out, const uint32_t *end,
+	      const uint32_t *ref_out, const uint32_t *ref_end,
+	      const uint32_t *frame, const uint32_t *ref_frame)
+{
+	size_t size = (size_t) seq->width * seq->height;
+
+	if (end - out == ref_end - ref_out &&
+	    memcmp(out, ref_out, (end - out) * 4) == 0 &&
+	    memcmp(frame, ref_frame, size * 4) == 0)
+		return 0;
+
+	printf("%s: frame %d differs (%s)\n", seq->name, n, variant);
+
+	return 1;
+}
+
+/* Encodes the frame again from the state before it, 'prev', the ways the
+ * recorder calls wcap_encode_rectangle() besides the one timed. */
+static int
+check_variants(struct sequence *seq, int n, const uint32_t *pixels,
+	       const uint32_t *prev, const uint32_t *ref_frame,
+	       const uint32_t *ref_out, const uint32_t *ref_end,
+	       uint32_t *scratch, uint32_t *buf, uint32_t *out)
+{
+	size_t size = (size_t) seq->width * seq->height;
+	int width = seq->width, height = seq->height;
+	struct wcap_rectangle rect = { 0, 0, width, height };
+	struct wcap_rectangle rects[9];
+	uint32_t *end, *p;
+	const uint32_t *src;
+	int i, y, nrects, failed = 0;
+
+	/* Read top down, encoded from the last row up */
+	for (y = 0; y < height; y++)
+		memcpy(buf + width * (height - y - 1), pixels + width * y,
+		       width * 4);
+	memcpy(scratch, prev, size * 4);
+	end = wcap_encode_rectangle(out, scratch, width, &rect,
+				    buf + width * (height - 1), -width);
+	failed += check_variant(seq, n, "negative stride", out, end,
+				ref_out, ref_end, scratch, ref_frame);
+
+	/* The runs written over the pixels they were made of */
+	memcpy(buf, pixels, size * 4);
+	memcpy(scratch, prev, size * 4);
+	end = wcap_encode_rectangle(buf, scratch, width, &rect, buf, width);
+	failed += check_variant(seq, n, "in place", buf, end,
+				ref_out, ref_end, scratch, ref_frame);
+
+	/* Rectangles, their pixels taken from the bottom up frame. The
+	 * reference goes to 'buf', and 'scratch' is reset in between. */
+	nrects = get_rects(seq, n, rects);
+	memcpy(scratch, prev, size * 4);
+	for (i = 0, p = buf; i < nrects; i++) {
+		src = pixels + width * (height - rects[i].y2) + rects[i].x1;
+		p = ref_encode(p, scratch, width, &rects[i], src, width);
+	}
+	memcpy(scratch, prev, size * 4);
+	for (i = 0, end = out; i < nrects; i++) {
+		src = pixels + width * (height - rects[i].y2) + rects[i].x1;
+		end = wcap_encode_rectangle(end, scratch, width, &rects[i],
+					    src, width);
+	}
+	failed += check_variant(seq, n, "rectangles", out, end,
+				buf, p, scratch, ref_frame);
+
+	return failed;
+}
+
+static int
+run_sequence(struct sequence *seq)
+{
+	size_t size = (size_t) seq->width * seq->height;
+	uint32_t *pixels, *ref_frame, *frame, *ref_out, *out, *ref_end, *end;
+	uint32_t *prev, *scratch, *buf;
+	struct wcap_rectangle rect = { 0, 0, seq->width, seq->height };
+	double ref_time = 0, time = 0;
+	uint64_t bytes = 0;
+	int n, failed = 0;
+
+	pixels = malloc(size * 4);
+	ref_frame = calloc(size, 4);
+	frame = calloc(size, 4);
+	ref_out = malloc(size * 4);
+	out = malloc(size * 4);
+	prev = malloc(size * 4);
+	scratch = malloc(size * 4);
+	buf = malloc(size * 4);
+	if (!pixels || !ref_frame || !frame || !ref_out || !out ||
+	    !prev || !scratch || !buf) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (n = 0; seq->get(seq, n, pixels); n++) {
+		memcpy(prev, ref_frame, size * 4);
+
+		reset_timer();
+		ref_end = ref_encode(ref_out, ref_frame, seq->width, &rect,
+				     pixels, seq->width);
+		ref_time += read_timer();
+
+		reset_timer();
+		end = wcap_encode_rectangle(out, frame, seq->width, &rect,
+					    pixels, seq->width);
+		time += read_timer();
+
+		bytes += (end - out) * 4;
+		failed += check_variant(seq, n, "full frame", out, end,
+					ref_out, ref_end, frame, ref_frame);
+		failed += check_variants(seq, n, pixels, prev, ref_frame,
+					 ref_out, ref_end, scratch, buf, out);
+	}
+
+	if (n > 0)
+		printf("%-10s %4dx%-4d %5d frames %8.1f MiB  "
+		       "%8.1f fps (scalar %7.1f), %6.0f Mpixel/s\n",
+		       seq->name, seq->width, seq->height, n,
+		       bytes / (1024.0 * 1024.0), n / time, n / ref_time,
+		       size * n / time * 1e-6);
+
+	free(buf);
+	free(scratch);
+	free(prev);
+	free(out);
+	free(ref_out);
+	free(frame);
+	free(ref_frame);
+	free(pixels);
+
+	return failed;
+}
+
+static void
+usage(int exit_code)
+{
+	fprintf(stderr, "usage: wcap-encode-bench [--size=WxH] "
+		"[--frames=N] [FILE.wcap...]\n\n"
+		"Encodes synthetic frames, and the frames of the given "
+		"recordings, with the\nscalar and the vectorized wcap "
+		"encoder and compares the results.\n");
+	exit(exit_code);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sequence seq;
+	int width = 3840, height = 2160, frames = 60;
+	int i, failed = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0)
+			usage(EXIT_SUCCESS);
+		else if (sscanf(argv[i], "--size=%dx%d",
+				&width, &height) == 2)
+			;
+		else if (sscanf(argv[i], "--frames=%d", &frames) == 1)
+			;
+		else if (argv[i][0] == '-')
+			usage(EXIT_FAILURE);
+	}
+
+	if (width < 2 || height < 2 || frames < 1)
+		usage(EXIT_FAILURE);
+
+	seq.width = width;
+	seq.height = height;
+	seq.count = frames;
+	seq.decoder = NULL;
+
+	seq.name = "static";
+	seq.get = get_static;
+	failed += run_sequence(&seq);
+
+	seq.name = "window";
+	seq.get = get_window;
+	failed += run_sequence(&seq);
+
+	seq.name = "noise";
+	seq.get = get_noise;
+	seq.count = frames < 10 ? frames : 10;
+	failed += run_sequence(&seq);
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '-')
+			continue;
+
+		seq.decoder = wcap_decoder_create(argv[i]);
+		if (!seq.decoder) {
+			fprintf(stderr, "cannot read %s\n", argv[i]);
+			failed++;
+			continue;
+		}
+
+		seq.name = argv[i];
+		seq.width = seq.decoder->width;
+		seq.height = seq.decoder->height;
+		seq.get = get_recorded;
+		failed += run_sequence(&seq);
+		wcap_decoder_destroy(seq.decoder);
+	}
+
+	printf("%d mismatches.\n", failed);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -35,11 +35,14 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
-#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <cairo.h>
 
 #include "wcap-decode.h"
+#include "wcap-yuv.h"
 
 static void
 write_png(struct wcap_decoder *decoder, const char *filename)
@@ -55,157 +58,342 @@ write_png(struct wcap_decoder *decoder, const char *filename)
 	cairo_surface_destroy(surface);
 }
 
-static inline int
-rgb_to_yuv(uint32_t format, uint32_t p, int *u, int *v)
+/* Frames in flight between decoding and writing them out */
+#define YUV_FRAMES 3
+#define YUV_MAX_THREADS 16
+/* Smaller frames are gathered into writes of this size */
+#define YUV_WRITE_SIZE (4 * 1024 * 1024)
+
+struct yuv_frame {
+	uint32_t *rgb;
+	unsigned char *yuv;
+	int bands_done;
+};
+
+/* Converts decoded frames in row bands on a pool of threads and has
+ * another thread write them out in order, so the main thread can go
+ * on decoding.
+ */
+struct yuv_output {
+	uint32_t format;
+	int width, height, depth;
+	size_t size;
+	int discard;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t band_cond;	/* bands to convert */
+	pthread_cond_t done_cond;	/* frames to write */
+	pthread_cond_t free_cond;	/* frames to fill */
+	struct yuv_frame frames[YUV_FRAMES];
+	int head, queued;
+	int convert, band, bands, band_rows;
+	int write;
+	int quit;
+
+	pthread_t threads[YUV_MAX_THREADS];
+	int nthreads;
+	pthread_t writer;
+
+	/* Only used by the writer thread */
+	unsigned char *out;
+	size_t out_len;
+	int write_failed;
+};
+
+static void
+yuv_write_out(struct yuv_output *yuv, const void *data, size_t len)
 {
-	int r, g, b, y;
-
-	switch (format) {
-	case WCAP_FORMAT_XRGB8888:
-		r = (p >> 16) & 0xff;
-		g = (p >> 8) & 0xff;
-		b = (p >> 0) & 0xff;
-		break;
-	case WCAP_FORMAT_XBGR8888:
-		r = (p >> 0) & 0xff;
-		g = (p >> 8) & 0xff;
-		b = (p >> 16) & 0xff;
-		break;
-	default:
-		assert(0);
+	const unsigned char *p = data;
+	ssize_t ret;
+
+	while (len > 0 && !yuv->write_failed) {
+		ret = write(STDOUT_FILENO, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			fprintf(stderr, "write failed: %m\n");
+			yuv->write_failed = 1;
+			break;
+		}
+
+		p += ret;
+		len -= ret;
 	}
+}
+
+static void
+yuv_flush_out(struct yuv_output *yuv)
+{
+	yuv_write_out(yuv, yuv->out, yuv->out_len);
+	yuv->out_len = 0;
+}
 
-	y = (19595 * r + 38469 * g + 7472 * b) >> 16;
-	if (y > 255)
-		y = 255;
+static void
+yuv_write(struct yuv_output *yuv, const void *data, size_t len)
+{
+	if (yuv->discard)
+		return;
 
-	*u += 46727 * (r - y);
-	*v += 36962 * (b - y);
+	if (yuv->out_len + len > YUV_WRITE_SIZE)
+		yuv_flush_out(yuv);
 
-	return y;
+	if (len >= YUV_WRITE_SIZE) {
+		yuv_write_out(yuv, data, len);
+		return;
+	}
+
+	memcpy(yuv->out + yuv->out_len, data, len);
+	yuv->out_len += len;
 }
 
-static inline
-int clamp_uv(int u)
+static void *
+yuv_convert_main(void *data)
 {
-	int clamp = (u >> 18) + 128;
+	struct yuv_output *yuv = data;
+	struct yuv_frame *frame;
+	int y1, y2;
+
+	pthread_mutex_lock(&yuv->mutex);
+	for (;;) {
+		while (yuv->bands == 0 && !yuv->quit)
+			pthread_cond_wait(&yuv->band_cond, &yuv->mutex);
+		if (yuv->bands == 0)
+			break;
 
-	if (clamp < 0)
-		return 0;
-	else if (clamp > 255)
-		return 255;
-	else
-		return clamp;
+		frame = &yuv->frames[yuv->convert];
+		y1 = yuv->band * yuv->band_rows;
+		if (++yuv->band * yuv->band_rows >= yuv->height) {
+			yuv->band = 0;
+			yuv->convert = (yuv->convert + 1) % YUV_FRAMES;
+		}
+		yuv->bands--;
+		pthread_mutex_unlock(&yuv->mutex);
+
+		y2 = y1 + yuv->band_rows;
+		if (y2 > yuv->height)
+			y2 = yuv->height;
+		if (yuv->depth == 444)
+			wcap_convert_to_yuv444(yuv->format, frame->rgb,
+					       yuv->width, yuv->height,
+					       y1, y2, frame->yuv);
+		else
+			wcap_convert_to_yv12(yuv->format, frame->rgb,
+					     yuv->width, yuv->height,
+					     y1, y2, frame->yuv);
+
+		pthread_mutex_lock(&yuv->mutex);
+		frame->bands_done++;
+		pthread_cond_signal(&yuv->done_cond);
+	}
+	pthread_mutex_unlock(&yuv->mutex);
+
+	return NULL;
 }
 
-static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+static int
+yuv_frame_bands(struct yuv_output *yuv)
 {
-	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
-	int i, u_accum, v_accum, stride0, stride1;
-	uint32_t format = decoder->format;
-
-	stride0 = decoder->width;
-	stride1 = decoder->width / 2;
-	for (i = 0; i < decoder->height; i += 2) {
-		y1 = out + stride0 * i;
-		y2 = y1 + stride0;
-		v = out + stride0 * decoder->height + stride1 * i / 2;
-		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
-		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
-
-		while (p1 < end) {
-			u_accum = 0;
-			v_accum = 0;
-			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
-			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
-			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
-			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
-			u[0] = clamp_uv(u_accum);
-			v[0] = clamp_uv(v_accum);
-
-			y1 += 2;
-			p1 += 2;
-			y2 += 2;
-			p2 += 2;
-			u++;
-			v++;
-		}
+	return (yuv->height + yuv->band_rows - 1) / yuv->band_rows;
+}
+
+static void *
+yuv_write_main(void *data)
+{
+	static const char header[] = "FRAME\n";
+	struct yuv_output *yuv = data;
+	struct yuv_frame *frame;
+
+	pthread_mutex_lock(&yuv->mutex);
+	for (;;) {
+		while (yuv->queued == 0 && !yuv->quit)
+			pthread_cond_wait(&yuv->done_cond, &yuv->mutex);
+		if (yuv->queued == 0)
+			break;
+
+		frame = &yuv->frames[yuv->write];
+		while (frame->bands_done < yuv_frame_bands(yuv))
+			pthread_cond_wait(&yuv->done_cond, &yuv->mutex);
+		pthread_mutex_unlock(&yuv->mutex);
+
+		yuv_write(yuv, header, strlen(header));
+		yuv_write(yuv, frame->yuv, yuv->size);
+
+		pthread_mutex_lock(&yuv->mutex);
+		frame->bands_done = 0;
+		yuv->write = (yuv->write + 1) % YUV_FRAMES;
+		yuv->queued--;
+		pthread_cond_signal(&yuv->free_cond);
 	}
+	pthread_mutex_unlock(&yuv->mutex);
+
+	yuv_flush_out(yuv);
+
+	return NULL;
 }
 
+/* Copies the current frame of the decoder, which goes on to the next
+ * one right away, and queues it for conversion */
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+yuv_output_frame(struct yuv_output *yuv, struct wcap_decoder *decoder)
 {
+	struct yuv_frame *frame;
+
+	pthread_mutex_lock(&yuv->mutex);
+	while (yuv->queued == YUV_FRAMES)
+		pthread_cond_wait(&yuv->free_cond, &yuv->mutex);
+	frame = &yuv->frames[yuv->head];
+	pthread_mutex_unlock(&yuv->mutex);
+
+	memcpy(frame->rgb, decoder->frame, yuv->width * yuv->height * 4);
+
+	pthread_mutex_lock(&yuv->mutex);
+	yuv->head = (yuv->head + 1) % YUV_FRAMES;
+	yuv->queued++;
+	yuv->bands += yuv_frame_bands(yuv);
+	pthread_cond_broadcast(&yuv->band_cond);
+	pthread_mutex_unlock(&yuv->mutex);
+}
 
-	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
-	int u, v;
-	int i, stride, psize;
-	uint32_t format = decoder->format;
-
-	stride = decoder->width;
-	psize = stride * decoder->height;
-	for (i = 0; i < decoder->height; i++) {
-		yp = out + stride * i;
-		up = yp + (psize * 2);
-		vp = yp + (psize * 1);
-		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;
-		while (rp < end) {
-			u = 0;
-			v = 0;
-			yp[0] = rgb_to_yuv(format, rp[0], &u, &v);
-			up[0] = clamp_uv(u/.3);
-			vp[0] = clamp_uv(v/.3);
-			up++;
-			vp++;
-			yp++;
-			rp++;
-		}
+static void
+yuv_output_destroy(struct yuv_output *yuv)
+{
+	int i;
+
+	pthread_mutex_lock(&yuv->mutex);
+	yuv->quit = 1;
+	pthread_cond_broadcast(&yuv->band_cond);
+	pthread_cond_broadcast(&yuv->done_cond);
+	pthread_mutex_unlock(&yuv->mutex);
+
+	for (i = 0; i < yuv->nthreads; i++)
+		pthread_join(yuv->threads[i], NULL);
+	pthread_join(yuv->writer, NULL);
+
+	pthread_cond_destroy(&yuv->band_cond);
+	pthread_cond_destroy(&yuv->done_cond);
+	pthread_cond_destroy(&yuv->free_cond);
+	pthread_mutex_destroy(&yuv->mutex);
+
+	for (i = 0; i < YUV_FRAMES; i++) {
+		free(yuv->frames[i].rgb);
+		free(yuv->frames[i].yuv);
 	}
+	free(yuv->out);
+	free(yuv);
 }
 
-static void
-output_yuv_frame(struct wcap_decoder *decoder, int depth)
+static struct yuv_output *
+yuv_output_create(struct wcap_decoder *decoder, int depth, int discard)
 {
-	static unsigned char *out;
-	int size;
+	struct yuv_output *yuv;
+	long ncpus;
+	int i, bands;
+
+	yuv = calloc(1, sizeof *yuv);
+	if (yuv == NULL)
+		return NULL;
+
+	yuv->format = decoder->format;
+	yuv->width = decoder->width;
+	yuv->height = decoder->height;
+	yuv->depth = depth;
+	yuv->discard = discard;
+	if (depth == 444)
+		yuv->size = (size_t) yuv->width * yuv->height * 3;
+	else
+		yuv->size = (size_t) yuv->width * yuv->height * 3 / 2;
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
+	yuv->out = malloc(YUV_WRITE_SIZE);
+	if (yuv->out == NULL) {
+		free(yuv);
+		return NULL;
+	}
+
+	for (i = 0; i < YUV_FRAMES; i++) {
+		yuv->frames[i].rgb = malloc(yuv->width * yuv->height * 4);
+		yuv->frames[i].yuv = malloc(yuv->size);
+		if (yuv->frames[i].rgb == NULL ||
+		    yuv->frames[i].yuv == NULL) {
+			goto err_frames;
+		}
+	}
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	if (ncpus > YUV_MAX_THREADS)
+		ncpus = YUV_MAX_THREADS;
+
+	/* A few bands per thread even out uneven progress; 4:2:0 bands
+	 * start on even rows */
+	bands = ncpus * 4;
+	yuv->band_rows = (yuv->height + bands - 1) / bands;
+	yuv->band_rows = (yuv->band_rows + 1) & ~1;
+
+	pthread_mutex_init(&yuv->mutex, NULL);
+	pthread_cond_init(&yuv->band_cond, NULL);
+	pthread_cond_init(&yuv->done_cond, NULL);
+	pthread_cond_init(&yuv->free_cond, NULL);
+
+	if (pthread_create(&yuv->writer, NULL, yuv_write_main, yuv) != 0) {
+		fprintf(stderr, "failed to create writer thread\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < ncpus; i++) {
+		if (pthread_create(&yuv->threads[i], NULL,
+				   yuv_convert_main, yuv) != 0)
+			break;
+		yuv->nthreads++;
+	}
+	if (yuv->nthreads == 0) {
+		fprintf(stderr, "failed to create conversion threads\n");
+		exit(EXIT_FAILURE);
 	}
-	if (out == NULL)
-		out = malloc(size);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
+	return yuv;
+
+err_frames:
+	for (i = 0; i < YUV_FRAMES; i++) {
+		free(yuv->frames[i].rgb);
+		free(yuv->frames[i].yuv);
 	}
+	free(yuv->out);
+	free(yuv);
+
+	return NULL;
+}
+
+static double
+timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 static void
 usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
-		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] [--bench]\n"
+		"\t[--rate=<num:denom>] [--from=<msecs>] [--to=<msecs>]\n"
+		"\t<wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--from=<msecs>\t\tstart --all and --yuv4mpeg2 at the given\n"
+		"\t\t\t\ttime from the start of the recording\n"
+		"\t--to=<msecs>\t\tend --all and --yuv4mpeg2 at the given\n"
+		"\t\t\t\ttime from the start of the recording\n"
+		"\t--bench\t\t\treport how many frames per second were\n"
+		"\t\t\t\tdecoded and converted, without --yuv4mpeg2\n"
+		"\t\t\t\tthe 4:2:0 output is thrown away\n\n");
 
 	exit(exit_code);
 }
@@ -213,11 +401,14 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
+	struct yuv_output *yuv = NULL;
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
+	int bench = 0;
+	double start_time, elapsed;
+	int num = 30, denom = 1, from = 0, to = -1;
 	char filename[200];
 	char *mode;
-	uint32_t msecs, frame_time;
+	uint32_t msecs, frame_time, start;
 
 	for (i = 1, j = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--yuv4mpeg2-444") == 0) {
@@ -228,12 +419,18 @@ int main(int argc, char *argv[])
 			usage(EXIT_SUCCESS);
 		} else if (strcmp(argv[i], "--all") == 0) {
 			all = 1;
+		} else if (strcmp(argv[i], "--bench") == 0) {
+			bench = 1;
 		} else if (sscanf(argv[i], "--frame=%d", &output_frame) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d", &num) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
 			;
+		} else if (sscanf(argv[i], "--from=%d", &from) == 1) {
+			;
+		} else if (sscanf(argv[i], "--to=%d", &to) == 1) {
+			;
 		} else if (strcmp(argv[i], "--") == 0) {
 			break;
 		} else if (argv[i][0] == '-') {
@@ -252,6 +449,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "invalid rate, denom can not be 0\n");
 		exit(EXIT_FAILURE);
 	}
+	if (from < 0 || (to >= 0 && to < from)) {
+		fprintf(stderr, "invalid time range\n");
+		exit(EXIT_FAILURE);
+	}
 
 	decoder = wcap_decoder_create(argv[1]);
 	if (decoder == NULL) {
@@ -279,27 +480,81 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
+	if (output_frame >= 0) {
+		if (!wcap_decoder_seek(decoder, output_frame)) {
+			fprintf(stderr, "no frame %d in wcap file\n",
+				output_frame);
+			exit(EXIT_FAILURE);
+		}
+		snprintf(filename, sizeof filename,
+			 "wcap-frame-%d.png", output_frame);
+		write_png(decoder, filename);
+		fprintf(stderr, "wrote %s\n", filename);
+	}
+
+	if (!all && !yuv4mpeg2 && !bench) {
+		/* Without an index, count the frames by decoding them */
+		if (decoder->index == NULL)
+			while (wcap_decoder_get_frame(decoder))
+				;
+		fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
+			decoder->width, decoder->height,
+			decoder->index ? (int) decoder->nframes :
+			(int) decoder->count);
+
+		wcap_decoder_destroy(decoder);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (yuv4mpeg2 || bench) {
+		if (decoder->format != WCAP_FORMAT_XRGB8888 &&
+		    decoder->format != WCAP_FORMAT_XBGR8888) {
+			fprintf(stderr, "unsupported pixel format for yuv\n");
+			exit(EXIT_FAILURE);
+		}
+
+		yuv = yuv_output_create(decoder,
+					yuv4mpeg2 ? yuv4mpeg2 : 420,
+					!yuv4mpeg2);
+		if (yuv == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	start_time = timestamp();
 	i = 0;
-	has_frame = wcap_decoder_get_frame(decoder);
-	msecs = decoder->msecs;
+	has_frame = wcap_decoder_seek(decoder, 0);
+	start = decoder->msecs;
+	if (has_frame && from > 0)
+		has_frame = wcap_decoder_seek_msecs(decoder, start + from);
+	msecs = start + from;
 	frame_time = 1000 * denom / num;
-	while (has_frame) {
-		if (all || i == output_frame) {
+	while (has_frame && (to < 0 || msecs - start <= (uint32_t) to)) {
+		if (all) {
 			snprintf(filename, sizeof filename,
 				 "wcap-frame-%d.png", i);
 			write_png(decoder, filename);
 			fprintf(stderr, "wrote %s\n", filename);
 		}
-		if (yuv4mpeg2)
-			output_yuv_frame(decoder, yuv4mpeg2);
+		if (yuv)
+			yuv_output_frame(yuv, decoder);
 		i++;
 		msecs += frame_time;
 		while (decoder->msecs < msecs && has_frame)
 			has_frame = wcap_decoder_get_frame(decoder);
 	}
 
+	if (yuv)
+		yuv_output_destroy(yuv);
+	elapsed = timestamp() - start_time;
+
 	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
 		decoder->width, decoder->height, i);
+	if (bench)
+		fprintf(stderr, "%d frames in %.2f s, %.1f frames/s\n",
+			i, elapsed, i / elapsed);
 
 	wcap_decoder_destroy(decoder);
 
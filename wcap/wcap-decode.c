@@ -90,23 +90,162 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
-	uint32_t i;
+	struct wcap_frame_header_v2 *header_v2;
+	uint32_t i, nrects, flags = 0;
 
 	if (decoder->p == decoder->end)
 		return 0;
 
-	header = decoder->p;
-	decoder->msecs = header->msecs;
+	if (decoder->version >= 2) {
+		header_v2 = decoder->p;
+		decoder->msecs = header_v2->msecs;
+		nrects = header_v2->nrects;
+		flags = header_v2->flags;
+		rects = (void *) (header_v2 + 1);
+	} else {
+		header = decoder->p;
+		decoder->msecs = header->msecs;
+		nrects = header->nrects;
+		rects = (void *) (header + 1);
+	}
 	decoder->count++;
 
-	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
+	/* Keyframes are encoded against a frame of all zeros, like the
+	 * first frame of the file */
+	if (flags & WCAP_FRAME_KEYFRAME)
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+
+	decoder->p = (uint32_t *) (rects + nrects);
+	for (i = 0; i < nrects; i++)
 		wcap_decoder_decode_rectangle(decoder, &rects[i]);
 
 	return 1;
 }
 
+static void
+wcap_decoder_rewind(struct wcap_decoder *decoder, void *p, uint32_t count)
+{
+	decoder->p = p;
+	decoder->count = count;
+	memset(decoder->frame, 0, decoder->width * decoder->height * 4);
+}
+
+/* Decodes the given frame, counting from 0.  With an index, decoding
+ * starts at the last keyframe before it unless the frames decoded so
+ * far already lead there.  Without one, seeking backwards replays the
+ * file from the start. */
+int
+wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame)
+{
+	const struct wcap_index_entry *entry;
+	uint64_t offset;
+	uint32_t key;
+
+	if (decoder->index) {
+		if (frame >= decoder->nframes)
+			return 0;
+
+		key = frame;
+		while (key > 0 &&
+		       !(decoder->index[key].flags & WCAP_FRAME_KEYFRAME))
+			key--;
+
+		if (decoder->count <= key || decoder->count > frame + 1) {
+			entry = &decoder->index[key];
+			offset = (uint64_t) entry->offset_hi << 32 |
+				entry->offset_lo;
+			wcap_decoder_rewind(decoder,
+					    (char *) decoder->map + offset, key);
+		}
+	} else if (decoder->count > frame + 1) {
+		wcap_decoder_rewind(decoder, decoder->first, 0);
+	}
+
+	while (decoder->count < frame + 1)
+		if (!wcap_decoder_get_frame(decoder))
+			return 0;
+
+	return 1;
+}
+
+/* Decodes the last frame at or before the given timestamp, or the first
+ * frame if the file starts after it. */
+int
+wcap_decoder_seek_msecs(struct wcap_decoder *decoder, uint32_t msecs)
+{
+	struct wcap_frame_header *next;
+	uint32_t lo, hi, mid;
+
+	if (decoder->index) {
+		lo = 0;
+		hi = decoder->nframes;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (decoder->index[mid].msecs <= msecs)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		return wcap_decoder_seek(decoder, lo);
+	}
+
+	if ((decoder->count == 0 || decoder->msecs > msecs) &&
+	    !wcap_decoder_seek(decoder, 0))
+		return 0;
+
+	/* Both frame header versions start with the timestamp */
+	while (decoder->p != decoder->end) {
+		next = decoder->p;
+		if (next->msecs > msecs)
+			break;
+		wcap_decoder_get_frame(decoder);
+	}
+
+	return 1;
+}
+
+/* Looks for the frame index at the end of a v2 file, which a recording
+ * that was cut short does not have. */
+static void
+wcap_decoder_read_index(struct wcap_decoder *decoder)
+{
+	const struct wcap_trailer *trailer;
+	const struct wcap_index_entry *index;
+	uint64_t offset, entry, prev;
+	uint32_t i;
+
+	if (decoder->size < sizeof (struct wcap_header) + sizeof *trailer)
+		return;
+
+	trailer = (void *) ((char *) decoder->map + decoder->size -
+			    sizeof *trailer);
+	if (trailer->magic != WCAP_INDEX_MAGIC || trailer->nframes == 0)
+		return;
+
+	offset = (uint64_t) trailer->index_hi << 32 | trailer->index_lo;
+	if (offset < sizeof (struct wcap_header) ||
+	    offset + (uint64_t) trailer->nframes * sizeof *index +
+	    sizeof *trailer != decoder->size)
+		return;
+
+	index = (void *) ((char *) decoder->map + offset);
+	prev = 0;
+	for (i = 0; i < trailer->nframes; i++) {
+		entry = (uint64_t) index[i].offset_hi << 32 |
+			index[i].offset_lo;
+		if (entry < sizeof (struct wcap_header) ||
+		    entry >= offset || entry < prev)
+			return;
+		prev = entry;
+	}
+
+	decoder->index = index;
+	decoder->nframes = trailer->nframes;
+	decoder->end = (char *) decoder->map + offset;
+}
+
 struct wcap_decoder *
 wcap_decoder_create(const char *filename)
 {
@@ -136,12 +275,28 @@ wcap_decoder_create(const char *filename)
 	}
 
 	header = decoder->map;
+	if (decoder->size < sizeof *header ||
+	    (header->magic != WCAP_HEADER_MAGIC &&
+	     header->magic != WCAP_HEADER_MAGIC_V2)) {
+		fprintf(stderr, "not a wcap file\n");
+		munmap(decoder->map, decoder->size);
+		close(decoder->fd);
+		free(decoder);
+		return NULL;
+	}
+
+	decoder->version = header->magic == WCAP_HEADER_MAGIC_V2 ? 2 : 1;
 	decoder->format = header->format;
 	decoder->count = 0;
 	decoder->width = header->width;
 	decoder->height = header->height;
-	decoder->p = header + 1;
+	decoder->first = header + 1;
+	decoder->p = decoder->first;
 	decoder->end = decoder->map + decoder->size;
+	decoder->index = NULL;
+	decoder->nframes = 0;
+	if (decoder->version >= 2)
+		wcap_decoder_read_index(decoder);
 
 	frame_size = header->width * header->height * 4;
 	decoder->frame = malloc(frame_size);
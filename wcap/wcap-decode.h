@@ -27,6 +27,10 @@
 #define _WCAP_DECODE_
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
+#define WCAP_INDEX_MAGIC	0x57494458
+
+#define WCAP_FRAME_KEYFRAME	(1 << 0)
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -44,6 +48,24 @@ struct wcap_frame_header {
 	uint32_t nrects;
 };
 
+struct wcap_frame_header_v2 {
+	uint32_t msecs;
+	uint32_t nrects;
+	uint32_t flags;
+};
+
+struct wcap_index_entry {
+	uint32_t offset_lo, offset_hi;
+	uint32_t msecs;
+	uint32_t flags;
+};
+
+struct wcap_trailer {
+	uint32_t index_lo, index_hi;
+	uint32_t nframes;
+	uint32_t magic;
+};
+
 struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
@@ -57,9 +79,17 @@ struct wcap_decoder {
 	uint32_t msecs;
 	uint32_t count;
 	int width, height;
+	int version;
+	void *first;
+
+	/* NULL for v1 files and v2 files that lack the trailing index */
+	const struct wcap_index_entry *index;
+	uint32_t nframes;
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame);
+int wcap_decoder_seek_msecs(struct wcap_decoder *decoder, uint32_t msecs);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 
@@ -0,0 +1,210 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WCAP_BLOCK 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define WCAP_BLOCK 4
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WCAP_NEON 1
+#define WCAP_BLOCK 4
+#else
+#define WCAP_BLOCK 1
+#endif
+
+#include "wcap-encode.h"
+
+struct wcap_run {
+	uint32_t *p;
+	uint32_t prev;
+	int run;
+};
+
+static uint32_t *
+output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+static uint32_t
+component_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+static inline void
+add_delta(struct wcap_run *r, uint32_t delta)
+{
+	if (r->run == 0 || delta == r->prev) {
+		r->run++;
+	} else {
+		r->p = output_run(r->p, r->prev, r->run);
+		r->run = 1;
+	}
+	r->prev = delta;
+}
+
+/* Deltas of a block of pixels against the previous frame, which gets
+ * the new pixels. Returns whether they all continue the current run,
+ * otherwise they are left in 'deltas'.
+ */
+static inline int
+block_deltas(struct wcap_run *r, const uint32_t *s, uint32_t *d,
+	     uint32_t *deltas)
+{
+#if defined(__AVX2__)
+	const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+	__m256i next, delta;
+
+	next = _mm256_loadu_si256((const __m256i *) s);
+	delta = _mm256_and_si256(_mm256_sub_epi8(next,
+			_mm256_loadu_si256((const __m256i *) d)), mask);
+	_mm256_storeu_si256((__m256i *) d, next);
+
+	if (r->run > 0 &&
+	    _mm256_movemask_epi8(_mm256_cmpeq_epi32(delta,
+			_mm256_set1_epi32(r->prev))) == -1)
+		return 1;
+
+	_mm256_storeu_si256((__m256i *) deltas, delta);
+	return 0;
+#elif defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	__m128i next, delta;
+
+	next = _mm_loadu_si128((const __m128i *) s);
+	delta = _mm_and_si128(_mm_sub_epi8(next,
+			_mm_loadu_si128((const __m128i *) d)), mask);
+	_mm_storeu_si128((__m128i *) d, next);
+
+	if (r->run > 0 &&
+	    _mm_movemask_epi8(_mm_cmpeq_epi32(delta,
+			_mm_set1_epi32(r->prev))) == 0xffff)
+		return 1;
+
+	_mm_storeu_si128((__m128i *) deltas, delta);
+	return 0;
+#elif defined(WCAP_NEON)
+	uint32x4_t next, delta, same;
+	uint32x2_t all;
+
+	next = vld1q_u32(s);
+	delta = vreinterpretq_u32_u8(vsubq_u8(vreinterpretq_u8_u32(next),
+				vreinterpretq_u8_u32(vld1q_u32(d))));
+	delta = vandq_u32(delta, vdupq_n_u32(0x00ffffff));
+	vst1q_u32(d, next);
+
+	if (r->run > 0) {
+		same = vceqq_u32(delta, vdupq_n_u32(r->prev));
+		all = vand_u32(vget_low_u32(same), vget_high_u32(same));
+		if (vget_lane_u32(all, 0) & vget_lane_u32(all, 1))
+			return 1;
+	}
+
+	vst1q_u32(deltas, delta);
+	return 0;
+#else
+	deltas[0] = component_delta(*s, *d);
+	*d = *s;
+	return 0;
+#endif
+}
+
+/** Encodes a rectangle of a frame as wcap runs
+ *
+ * \param out Where the runs go, room for a word per pixel. This can be
+ *            the source pixels if src_stride is positive.
+ * \param frame The previous frame, updated with the new pixels
+ * \param stride Pixels per row of the frame
+ * \param rect The rectangle in the frame
+ * \param src The new pixels of the bottom row of the rectangle
+ * \param src_stride Pixels from one source row to the one above
+ * \return The end of the runs in out
+ *
+ * The runs are the component wise differences to the previous frame,
+ * from the bottom row of the rectangle up, as wcap_decoder_get_frame()
+ * applies them. Blocks of pixels continuing a run, typically unchanged
+ * areas, are counted without looking at their pixels one by one.
+ */
+uint32_t *
+wcap_encode_rectangle(uint32_t *out, uint32_t *frame, int stride,
+		      const struct wcap_rectangle *rect,
+		      const uint32_t *src, int src_stride)
+{
+	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
+	struct wcap_run r = { out, 0, 0 };
+	uint32_t deltas[WCAP_BLOCK];
+	const uint32_t *s;
+	uint32_t *d;
+	int i, j, k;
+
+	for (j = 0; j < height; j++) {
+		s = src + (intptr_t) src_stride * j;
+		d = frame + (intptr_t) stride * (rect->y2 - j - 1) + rect->x1;
+
+		for (k = 0; k + WCAP_BLOCK <= width; k += WCAP_BLOCK) {
+			if (block_deltas(&r, s + k, d + k, deltas)) {
+				r.run += WCAP_BLOCK;
+				continue;
+			}
+
+			for (i = 0; i < WCAP_BLOCK; i++)
+				add_delta(&r, deltas[i]);
+		}
+
+		for (; k < width; k++) {
+			add_delta(&r, component_delta(s[k], d[k]));
+			d[k] = s[k];
+		}
+	}
+
+	return output_run(r.p, r.prev, r.run);
+}
@@ -0,0 +1,390 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define WCAP_YUV_BLOCK 8
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WCAP_YUV_NEON 1
+#define WCAP_YUV_BLOCK 8
+#endif
+
+#include "wcap-decode.h"
+#include "wcap-yuv.h"
+
+/* Full range BT.601 in 16.16 fixed point.  The luma weights add up to
+ * 1 << 16, so luma never needs clamping.  4:2:0 chroma sums the
+ * differences to luma over four pixels before scaling, which takes
+ * another 2 bits off.  4:4:4 chroma has always come out at 5/6 of the
+ * 4:2:0 saturation.
+ */
+#define Y_R	19595
+#define Y_G	38469
+#define Y_B	7472
+#define U_420	36962
+#define V_420	46727
+#define U_444	30802
+#define V_444	38939
+
+static inline void
+rgb(uint32_t format, uint32_t p, int *r, int *g, int *b)
+{
+	*g = (p >> 8) & 0xff;
+	if (format == WCAP_FORMAT_XBGR8888) {
+		*r = (p >> 0) & 0xff;
+		*b = (p >> 16) & 0xff;
+	} else {
+		*r = (p >> 16) & 0xff;
+		*b = (p >> 0) & 0xff;
+	}
+}
+
+static inline int
+luma(int r, int g, int b)
+{
+	return (Y_R * r + Y_G * g + Y_B * b) >> 16;
+}
+
+static inline uint8_t
+clamp_uv(int c)
+{
+	c += 128;
+
+	if (c < 0)
+		return 0;
+	else if (c > 255)
+		return 255;
+	else
+		return c;
+}
+
+#if defined(__SSE2__)
+/* Eight pixels from p as 16 bit channels */
+static inline void
+load_sse2(uint32_t format, const uint32_t *p,
+	  __m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	__m128i p0, p1, c0, c2;
+
+	p0 = _mm_loadu_si128((const __m128i *) p);
+	p1 = _mm_loadu_si128((const __m128i *) (p + 4));
+
+	c0 = _mm_packs_epi32(_mm_and_si128(p0, mask),
+			     _mm_and_si128(p1, mask));
+	*g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask),
+			     _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+	c2 = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask),
+			     _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+
+	if (format == WCAP_FORMAT_XBGR8888) {
+		*r = c0;
+		*b = c2;
+	} else {
+		*r = c2;
+		*b = c0;
+	}
+}
+
+/* pmaddwd takes signed 16 bit factors, so the green weight is split
+ * between the red and blue pairs */
+static inline __m128i
+luma_sse2(__m128i r, __m128i g, __m128i b)
+{
+	const __m128i rg = _mm_set1_epi32((Y_G - Y_G / 2) << 16 | Y_R);
+	const __m128i gb = _mm_set1_epi32(Y_B << 16 | Y_G / 2);
+	__m128i lo, hi;
+
+	lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), rg),
+			   _mm_madd_epi16(_mm_unpacklo_epi16(g, b), gb));
+	hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), rg),
+			   _mm_madd_epi16(_mm_unpackhi_epi16(g, b), gb));
+
+	return _mm_packs_epi32(_mm_srli_epi32(lo, 16),
+			       _mm_srli_epi32(hi, 16));
+}
+
+/* Scales the sums of horizontal pairs of d by k, in two halves that
+ * fit pmaddwd, and stores them as four chroma samples */
+static inline void
+chroma_420_sse2(uint8_t *out, __m128i d, int k)
+{
+	const __m128i bias = _mm_set1_epi32(128);
+	__m128i c;
+	uint32_t v;
+
+	c = _mm_add_epi32(_mm_madd_epi16(d, _mm_set1_epi16(k / 2)),
+			  _mm_madd_epi16(d, _mm_set1_epi16(k - k / 2)));
+	c = _mm_add_epi32(_mm_srai_epi32(c, 18), bias);
+	c = _mm_packs_epi32(c, c);
+	v = _mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+	memcpy(out, &v, sizeof v);
+}
+
+static inline void
+chroma_444_sse2(uint8_t *out, __m128i d, int k)
+{
+	const __m128i bias = _mm_set1_epi32(128);
+	const __m128i kk = _mm_set1_epi32((k - k / 2) << 16 | k / 2);
+	__m128i lo, hi;
+
+	lo = _mm_madd_epi16(_mm_unpacklo_epi16(d, d), kk);
+	hi = _mm_madd_epi16(_mm_unpackhi_epi16(d, d), kk);
+	lo = _mm_add_epi32(_mm_srai_epi32(lo, 16), bias);
+	hi = _mm_add_epi32(_mm_srai_epi32(hi, 16), bias);
+	lo = _mm_packs_epi32(lo, hi);
+	_mm_storel_epi64((__m128i *) out, _mm_packus_epi16(lo, lo));
+}
+#elif defined(WCAP_YUV_NEON)
+static inline void
+load_neon(uint32_t format, const uint32_t *p,
+	  int16x8_t *r, int16x8_t *g, int16x8_t *b)
+{
+	uint8x8x4_t c = vld4_u8((const uint8_t *) p);
+
+	*g = vreinterpretq_s16_u16(vmovl_u8(c.val[1]));
+	if (format == WCAP_FORMAT_XBGR8888) {
+		*r = vreinterpretq_s16_u16(vmovl_u8(c.val[0]));
+		*b = vreinterpretq_s16_u16(vmovl_u8(c.val[2]));
+	} else {
+		*r = vreinterpretq_s16_u16(vmovl_u8(c.val[2]));
+		*b = vreinterpretq_s16_u16(vmovl_u8(c.val[0]));
+	}
+}
+
+static inline int16x8_t
+luma_neon(int16x8_t r, int16x8_t g, int16x8_t b)
+{
+	uint16x8_t ur = vreinterpretq_u16_s16(r);
+	uint16x8_t ug = vreinterpretq_u16_s16(g);
+	uint16x8_t ub = vreinterpretq_u16_s16(b);
+	uint32x4_t lo, hi;
+
+	lo = vmull_n_u16(vget_low_u16(ur), Y_R);
+	lo = vmlal_n_u16(lo, vget_low_u16(ug), Y_G);
+	lo = vmlal_n_u16(lo, vget_low_u16(ub), Y_B);
+	hi = vmull_n_u16(vget_high_u16(ur), Y_R);
+	hi = vmlal_n_u16(hi, vget_high_u16(ug), Y_G);
+	hi = vmlal_n_u16(hi, vget_high_u16(ub), Y_B);
+
+	return vreinterpretq_s16_u16(vcombine_u16(vshrn_n_u32(lo, 16),
+						  vshrn_n_u32(hi, 16)));
+}
+
+static inline void
+chroma_420_neon(uint8_t *out, int16x8_t d, int k)
+{
+	int32x4_t c;
+	int16x4_t n;
+	uint32_t v;
+
+	c = vmulq_n_s32(vpaddlq_s16(d), k);
+	c = vaddq_s32(vshrq_n_s32(c, 18), vdupq_n_s32(128));
+	n = vqmovn_s32(c);
+	v = vget_lane_u32(vreinterpret_u32_u8(
+				vqmovun_s16(vcombine_s16(n, n))), 0);
+	memcpy(out, &v, sizeof v);
+}
+
+static inline void
+chroma_444_neon(uint8_t *out, int16x8_t d, int k)
+{
+	int32x4_t lo, hi;
+
+	lo = vmulq_n_s32(vmovl_s16(vget_low_s16(d)), k);
+	hi = vmulq_n_s32(vmovl_s16(vget_high_s16(d)), k);
+	lo = vaddq_s32(vshrq_n_s32(lo, 16), vdupq_n_s32(128));
+	hi = vaddq_s32(vshrq_n_s32(hi, 16), vdupq_n_s32(128));
+	vst1_u8(out, vqmovun_s16(vcombine_s16(vqmovn_s32(lo),
+					      vqmovn_s32(hi))));
+}
+#endif
+
+#if defined(WCAP_YUV_BLOCK)
+/* Eight pixels of two rows to 4:2:0 */
+static inline void
+yv12_block(uint32_t format, const uint32_t *p1, const uint32_t *p2,
+	   uint8_t *y1, uint8_t *y2, uint8_t *u, uint8_t *v)
+{
+#if defined(__SSE2__)
+	__m128i r1, g1, b1, l1, r2, g2, b2, l2;
+
+	load_sse2(format, p1, &r1, &g1, &b1);
+	load_sse2(format, p2, &r2, &g2, &b2);
+	l1 = luma_sse2(r1, g1, b1);
+	l2 = luma_sse2(r2, g2, b2);
+	_mm_storel_epi64((__m128i *) y1, _mm_packus_epi16(l1, l1));
+	_mm_storel_epi64((__m128i *) y2, _mm_packus_epi16(l2, l2));
+
+	chroma_420_sse2(u, _mm_add_epi16(_mm_sub_epi16(b1, l1),
+					 _mm_sub_epi16(b2, l2)), U_420);
+	chroma_420_sse2(v, _mm_add_epi16(_mm_sub_epi16(r1, l1),
+					 _mm_sub_epi16(r2, l2)), V_420);
+#elif defined(WCAP_YUV_NEON)
+	int16x8_t r1, g1, b1, l1, r2, g2, b2, l2;
+
+	load_neon(format, p1, &r1, &g1, &b1);
+	load_neon(format, p2, &r2, &g2, &b2);
+	l1 = luma_neon(r1, g1, b1);
+	l2 = luma_neon(r2, g2, b2);
+	vst1_u8(y1, vqmovun_s16(l1));
+	vst1_u8(y2, vqmovun_s16(l2));
+
+	chroma_420_neon(u, vaddq_s16(vsubq_s16(b1, l1),
+				     vsubq_s16(b2, l2)), U_420);
+	chroma_420_neon(v, vaddq_s16(vsubq_s16(r1, l1),
+				     vsubq_s16(r2, l2)), V_420);
+#endif
+}
+
+/* Eight pixels to 4:4:4 */
+static inline void
+yuv444_block(uint32_t format, const uint32_t *p,
+	     uint8_t *y, uint8_t *u, uint8_t *v)
+{
+#if defined(__SSE2__)
+	__m128i r, g, b, l;
+
+	load_sse2(format, p, &r, &g, &b);
+	l = luma_sse2(r, g, b);
+	_mm_storel_epi64((__m128i *) y, _mm_packus_epi16(l, l));
+	chroma_444_sse2(u, _mm_sub_epi16(b, l), U_444);
+	chroma_444_sse2(v, _mm_sub_epi16(r, l), V_444);
+#elif defined(WCAP_YUV_NEON)
+	int16x8_t r, g, b, l;
+
+	load_neon(format, p, &r, &g, &b);
+	l = luma_neon(r, g, b);
+	vst1_u8(y, vqmovun_s16(l));
+	chroma_444_neon(u, vsubq_s16(b, l), U_444);
+	chroma_444_neon(v, vsubq_s16(r, l), V_444);
+#endif
+}
+#endif
+
+void
+wcap_convert_to_yv12(uint32_t format, const uint32_t *frame,
+		     int width, int height, int y1, int y2, uint8_t *out)
+{
+	const uint32_t *p1, *p2;
+	uint8_t *l1, *l2, *u, *v;
+	int i, x, r, g, b, y, u_accum, v_accum, stride0, stride1;
+
+	stride0 = width;
+	stride1 = width / 2;
+	for (i = y1; i + 1 < y2; i += 2) {
+		l1 = out + stride0 * i;
+		l2 = l1 + stride0;
+		u = out + stride0 * height + stride1 * (i / 2);
+		v = u + stride1 * (height / 2);
+		p1 = frame + width * i;
+		p2 = p1 + width;
+
+		x = 0;
+#if defined(WCAP_YUV_BLOCK)
+		for (; x + WCAP_YUV_BLOCK <= width; x += WCAP_YUV_BLOCK)
+			yv12_block(format, p1 + x, p2 + x, l1 + x, l2 + x,
+				   u + x / 2, v + x / 2);
+#endif
+		for (; x + 1 < width; x += 2) {
+			u_accum = 0;
+			v_accum = 0;
+
+			rgb(format, p1[x], &r, &g, &b);
+			l1[x] = y = luma(r, g, b);
+			u_accum += b - y;
+			v_accum += r - y;
+			rgb(format, p1[x + 1], &r, &g, &b);
+			l1[x + 1] = y = luma(r, g, b);
+			u_accum += b - y;
+			v_accum += r - y;
+			rgb(format, p2[x], &r, &g, &b);
+			l2[x] = y = luma(r, g, b);
+			u_accum += b - y;
+			v_accum += r - y;
+			rgb(format, p2[x + 1], &r, &g, &b);
+			l2[x + 1] = y = luma(r, g, b);
+			u_accum += b - y;
+			v_accum += r - y;
+
+			u[x / 2] = clamp_uv((U_420 * u_accum) >> 18);
+			v[x / 2] = clamp_uv((V_420 * v_accum) >> 18);
+		}
+
+		/* An odd column has no chroma of its own */
+		if (x < width) {
+			rgb(format, p1[x], &r, &g, &b);
+			l1[x] = luma(r, g, b);
+			rgb(format, p2[x], &r, &g, &b);
+			l2[x] = luma(r, g, b);
+		}
+	}
+
+	/* Neither does an odd last row */
+	if (i < y2) {
+		l1 = out + stride0 * i;
+		p1 = frame + width * i;
+		for (x = 0; x < width; x++) {
+			rgb(format, p1[x], &r, &g, &b);
+			l1[x] = luma(r, g, b);
+		}
+	}
+}
+
+void
+wcap_convert_to_yuv444(uint32_t format, const uint32_t *frame,
+		       int width, int height, int y1, int y2, uint8_t *out)
+{
+	const uint32_t *p;
+	uint8_t *yp, *up, *vp;
+	int i, x, r, g, b, y, psize;
+
+	psize = width * height;
+	for (i = y1; i < y2; i++) {
+		yp = out + width * i;
+		up = yp + psize;
+		vp = yp + psize * 2;
+		p = frame + width * i;
+
+		x = 0;
+#if defined(WCAP_YUV_BLOCK)
+		for (; x + WCAP_YUV_BLOCK <= width; x += WCAP_YUV_BLOCK)
+			yuv444_block(format, p + x,
+				     yp + x, up + x, vp + x);
+#endif
+		for (; x < width; x++) {
+			rgb(format, p[x], &r, &g, &b);
+			yp[x] = y = luma(r, g, b);
+			up[x] = clamp_uv((U_444 * (b - y)) >> 16);
+			vp[x] = clamp_uv((V_444 * (r - y)) >> 16);
+		}
+	}
+}
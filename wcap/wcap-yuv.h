@@ -0,0 +1,44 @@
+/*
+ * Copyright © 2016 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _WCAP_YUV_
+#define _WCAP_YUV_
+
+#include <stdint.h>
+
+/* Convert rows y1 up to y2 of an XRGB8888 or XBGR8888 frame into out,
+ * which holds the planes of the whole frame.  For 4:2:0, the Y plane
+ * is followed by U and V planes of half the width and height, and y1
+ * has to be even.  For 4:4:4 all three planes are full size.
+ */
+void
+wcap_convert_to_yv12(uint32_t format, const uint32_t *frame,
+		     int width, int height, int y1, int y2, uint8_t *out);
+
+void
+wcap_convert_to_yuv444(uint32_t format, const uint32_t *frame,
+		       int width, int height, int y1, int y2, uint8_t *out);
+
+#endif